@@ -0,0 +1,615 @@
+/*
+ * Copyright (c) 2020 Mindaugas Rasiukevicius <rmind at noxt eu>
+ * All rights reserved.
+ *
+ * Use is subject to license terms, as specified in the LICENSE file.
+ */
+
+/*
+ * Ciphertext-only incremental backup (mirror) of the vault.
+ *
+ * The file objects are self-contained ciphertext, independent of their
+ * location, therefore they can be copied without the key.  The state of
+ * the previous backup is described by the checkpoint: the list of the
+ * objects with their file metadata and a fingerprint from the object
+ * header (the modification time, length and the AE tag or HMAC, which
+ * are authenticated).  An object is copied only if it changed:
+ *
+ * => If the size and modification time (as per stat(2)) are the same,
+ *    then the object has not been replaced (every write-back replaces
+ *    the object file, see fileobj_sync()).
+ * => Otherwise, the header fingerprint is compared; if it matches, then
+ *    only the file metadata changed (e.g. the vault was copied).
+ *
+ * The changed objects are copied by the parallel workers, cloning the
+ * extents where the file system supports it (see fs_copy_file()).  The
+ * deleted objects are recorded as tombstones in the RVAULT_TOMBSTONES_FILE
+ * log at the destination and, optionally, deleted from it.  The new
+ * checkpoint is written only once all changes are copied.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+
+#include "rvault.h"
+#include "storage.h"
+#include "sys.h"
+#include "utils.h"
+
+#define	CKPT_MAGIC		"rvault-checkpoint 1\n"
+#define	CKPT_NOTAG		"-"
+
+typedef struct {
+	char *			path;	// relative to the vault base
+	char			type;	// 'd' or 'f'
+	bool			seen;
+	bool			copy;
+	off_t			size;
+	struct timespec		mtime;
+	uint64_t		hmtime;	// header modification time
+	char *			tag;	// AE tag or HMAC (hex)
+} bkp_ent_t;
+
+typedef struct {
+	bkp_ent_t *		ents;
+	size_t			nents;
+	size_t			maxents;
+} bkp_list_t;
+
+typedef struct {
+	const char *		base_path;
+	const char *		dest;
+	bkp_list_t		prev;
+	bkp_list_t		cur;
+
+	atomic_size_t		next;
+	atomic_uint		ncopied;
+	atomic_uint_fast64_t	nbytes;
+	atomic_uint		nerrors;
+} backup_t;
+
+static int
+bkp_path(char *buf, const char *dir, const char *path)
+{
+	if ((size_t)snprintf(buf, PATH_MAX, "%s/%s", dir, path) >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	return 0;
+}
+
+static int
+bkp_entcmp(const void *a, const void *b)
+{
+	const bkp_ent_t *e1 = a, *e2 = b;
+	return strcmp(e1->path, e2->path);
+}
+
+static bkp_ent_t *
+bkp_list_add(bkp_list_t *list, const char *path)
+{
+	bkp_ent_t *ent;
+
+	if (list->nents == list->maxents) {
+		size_t maxents = list->maxents ? list->maxents * 2 : 256;
+		void *ents;
+
+		ents = realloc(list->ents, maxents * sizeof(bkp_ent_t));
+		if (ents == NULL) {
+			return NULL;
+		}
+		list->ents = ents;
+		list->maxents = maxents;
+	}
+	ent = &list->ents[list->nents];
+	memset(ent, 0, sizeof(bkp_ent_t));
+	if ((ent->path = strdup(path)) == NULL) {
+		return NULL;
+	}
+	list->nents++;
+	return ent;
+}
+
+static void
+bkp_list_free(bkp_list_t *list)
+{
+	for (size_t i = 0; i < list->nents; i++) {
+		free(list->ents[i].path);
+		free(list->ents[i].tag);
+	}
+	free(list->ents);
+}
+
+/*
+ * ckpt_load: load the checkpoint, if it exists.
+ */
+static int
+ckpt_load(const char *fpath, bkp_list_t *list)
+{
+	char *line = NULL;
+	size_t lsize = 0;
+	ssize_t len;
+	FILE *fp;
+
+	if ((fp = fopen(fpath, "r")) == NULL) {
+		return errno == ENOENT ? 0 : -1;
+	}
+	if ((len = getline(&line, &lsize, fp)) == -1 ||
+	    strcmp(line, CKPT_MAGIC) != 0) {
+		goto bad;
+	}
+	while ((len = getline(&line, &lsize, fp)) > 0) {
+		char type, tag[512], path[PATH_MAX];
+		intmax_t size, sec;
+		uint64_t hmtime;
+		bkp_ent_t *ent;
+		long nsec;
+
+		if (line[len - 1] == '\n') {
+			line[len - 1] = '\0';
+		}
+		if (sscanf(line, "%c %jd %jd.%ld %" SCNu64 " %511s %4095[^\n]",
+		    &type, &size, &sec, &nsec, &hmtime, tag, path) != 7 ||
+		    (type != 'd' && type != 'f')) {
+			goto bad;
+		}
+		if ((ent = bkp_list_add(list, path)) == NULL) {
+			goto err;
+		}
+		ent->type = type;
+		ent->size = size;
+		ent->mtime.tv_sec = sec;
+		ent->mtime.tv_nsec = nsec;
+		ent->hmtime = hmtime;
+		if (strcmp(tag, CKPT_NOTAG) != 0 &&
+		    (ent->tag = strdup(tag)) == NULL) {
+			goto err;
+		}
+	}
+	free(line);
+	fclose(fp);
+	qsort(list->ents, list->nents, sizeof(bkp_ent_t), bkp_entcmp);
+	return 0;
+bad:
+	app_log(LOG_ERR, "invalid checkpoint `%s'", fpath);
+	errno = EINVAL;
+err:
+	free(line);
+	fclose(fp);
+	return -1;
+}
+
+/*
+ * ckpt_write: write the new checkpoint (atomically replacing the old).
+ */
+static int
+ckpt_write(const char *fpath, const bkp_list_t *list)
+{
+	char *tpath;
+	FILE *fp;
+
+	if ((tpath = tmpfile_get_name(fpath)) == NULL) {
+		return -1;
+	}
+	if ((fp = fopen(tpath, "w")) == NULL) {
+		free(tpath);
+		return -1;
+	}
+	fputs(CKPT_MAGIC, fp);
+	for (size_t i = 0; i < list->nents; i++) {
+		const bkp_ent_t *ent = &list->ents[i];
+
+		fprintf(fp, "%c %jd %jd.%09ld %" PRIu64 " %s %s\n",
+		    ent->type, (intmax_t)ent->size,
+		    (intmax_t)ent->mtime.tv_sec, ent->mtime.tv_nsec,
+		    ent->hmtime, ent->tag ? ent->tag : CKPT_NOTAG, ent->path);
+	}
+	if (fflush(fp) != 0 || fs_sync(fileno(fp), NULL) == -1 ||
+	    fclose(fp) != 0) {
+		unlink(tpath);
+		free(tpath);
+		return -1;
+	}
+	if (rename(tpath, fpath) == -1) {
+		unlink(tpath);
+		free(tpath);
+		return -1;
+	}
+	free(tpath);
+	return fs_sync(-1, fpath);
+}
+
+/*
+ * bkp_read_fingerprint: get the modification time and the AE tag (or
+ * HMAC) from the header of the file object.
+ */
+static int
+bkp_read_fingerprint(int dirfd, const char *name, bkp_ent_t *ent)
+{
+	unsigned char buf[FILEOBJ_HDR_LEN + 256];
+	fileobj_hdr_t *hdr = (void *)buf;
+	size_t tlen;
+	int fd;
+
+	if ((fd = openat(dirfd, name, O_RDONLY)) == -1) {
+		return -1;
+	}
+	if (storage_read_hdr(fd, hdr) == -1) {
+		close(fd);
+		return -1;
+	}
+	tlen = FILEOBJ_AETAG_LEN(hdr);
+	if (tlen && pread(fd, FILEOBJ_HDR_TO_AETAG(hdr),
+	    tlen, FILEOBJ_HDR_LEN) != (ssize_t)tlen) {
+		close(fd);
+		errno = EIO;
+		return -1;
+	}
+	close(fd);
+
+	ent->hmtime = be64toh(hdr->mtime);
+	if (tlen && (ent->tag = hex_write_str(
+	    FILEOBJ_HDR_TO_AETAG(hdr), tlen)) == NULL) {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * bkp_changed_p: determine whether the object has changed since the
+ * previous backup.
+ */
+static bool
+bkp_changed_p(const bkp_ent_t *prev, const bkp_ent_t *ent)
+{
+	if (prev == NULL || prev->type != ent->type) {
+		return true;
+	}
+	if (prev->size != ent->size) {
+		return true;
+	}
+	if (prev->mtime.tv_sec == ent->mtime.tv_sec &&
+	    prev->mtime.tv_nsec == ent->mtime.tv_nsec) {
+		return false;
+	}
+	return prev->tag == NULL || ent->tag == NULL ||
+	    prev->hmtime != ent->hmtime || strcmp(prev->tag, ent->tag) != 0;
+}
+
+static bool
+bkp_object_p(const char *relpath, const char *name)
+{
+	if (strncmp(name, RVAULT_FOBJ_PREF, RVAULT_FOBJ_PREFLEN) == 0) {
+		return true;
+	}
+	if (relpath[0] != '\0') {
+		return false;
+	}
+
+	/* The vault files at the top level (e.g. not the PID file). */
+	return strcmp(name, RVAULT_META_FILE) == 0 ||
+	    strcmp(name, RVAULT_SDB_FILE) == 0 ||
+	    strcmp(name, RVAULT_INDEX_FILE) == 0;
+}
+
+/*
+ * bkp_scan: scan the directory, recording the entries and marking the
+ * changed objects to copy; create the directories at the destination.
+ */
+static int
+bkp_scan(backup_t *bk, const char *relpath)
+{
+	char vpath[PATH_MAX], path[PATH_MAX];
+	char **subdirs = NULL;
+	size_t nsubdirs = 0;
+	struct dirent *dp;
+	DIR *dirp;
+	int ret = -1;
+
+	if (bkp_path(vpath, bk->base_path, relpath) == -1 ||
+	    (dirp = opendir(vpath)) == NULL) {
+		app_elog(LOG_ERR, "opendir `%s' failed", vpath);
+		return -1;
+	}
+	while ((dp = readdir(dirp)) != NULL) {
+		const char *name = dp->d_name;
+		bkp_ent_t key, *ent, *prev;
+		struct stat st;
+
+		if (!bkp_object_p(relpath, name)) {
+			continue;
+		}
+		if ((size_t)snprintf(path, sizeof(path), "%s%s%s", relpath,
+		    relpath[0] ? "/" : "", name) >= sizeof(path)) {
+			continue;
+		}
+		if (fstatat(dirfd(dirp), name, &st,
+		    AT_SYMLINK_NOFOLLOW) == -1 ||
+		    (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode))) {
+			continue;
+		}
+		if ((ent = bkp_list_add(&bk->cur, path)) == NULL) {
+			goto out;
+		}
+		ent->type = S_ISDIR(st.st_mode) ? 'd' : 'f';
+		ent->size = S_ISDIR(st.st_mode) ? 0 : st.st_size;
+		ent->mtime = st.st_mtim;
+
+		key.path = path;
+		prev = bk->prev.nents ? bsearch(&key, bk->prev.ents,
+		    bk->prev.nents, sizeof(bkp_ent_t), bkp_entcmp) : NULL;
+		if (prev) {
+			prev->seen = true;
+		}
+		if (ent->type == 'd') {
+			char dpath[PATH_MAX];
+			void *p;
+
+			if (bkp_path(dpath, bk->dest, path) == -1 ||
+			    (mkdir(dpath, 0700) == -1 && errno != EEXIST)) {
+				app_elog(LOG_ERR, "mkdir `%s' failed", dpath);
+				goto out;
+			}
+			p = realloc(subdirs, (nsubdirs + 1) * sizeof(char *));
+			if (p == NULL) {
+				goto out;
+			}
+			subdirs = p;
+			if ((subdirs[nsubdirs] = strdup(path)) == NULL) {
+				goto out;
+			}
+			nsubdirs++;
+			continue;
+		}
+
+		/*
+		 * Unchanged file metadata: carry over the fingerprint.
+		 * Otherwise, read the header (the metadata file has none).
+		 */
+		if (prev && !bkp_changed_p(prev, ent)) {
+			ent->hmtime = prev->hmtime;
+			if (prev->tag &&
+			    (ent->tag = strdup(prev->tag)) == NULL) {
+				goto out;
+			}
+			continue;
+		}
+		if (strcmp(path, RVAULT_META_FILE) != 0 &&
+		    bkp_read_fingerprint(dirfd(dirp), name, ent) == -1) {
+			app_elog(LOG_WARNING, "could not read `%s'", path);
+		}
+		ent->copy = bkp_changed_p(prev, ent);
+	}
+
+	/*
+	 * Descend into the sub-directories.
+	 */
+	closedir(dirp);
+	dirp = NULL;
+	for (size_t i = 0; i < nsubdirs; i++) {
+		if (bkp_scan(bk, subdirs[i]) == -1) {
+			goto out;
+		}
+	}
+	ret = 0;
+out:
+	if (dirp) {
+		closedir(dirp);
+	}
+	for (size_t i = 0; i < nsubdirs; i++) {
+		free(subdirs[i]);
+	}
+	free(subdirs);
+	return ret;
+}
+
+static int
+bkp_copy_object(backup_t *bk, const bkp_ent_t *ent)
+{
+	char spath[PATH_MAX], dpath[PATH_MAX], *tpath;
+	struct stat st;
+	int sfd, dfd = -1;
+
+	if (bkp_path(spath, bk->base_path, ent->path) == -1 ||
+	    bkp_path(dpath, bk->dest, ent->path) == -1) {
+		return -1;
+	}
+	if ((sfd = open(spath, O_RDONLY)) == -1) {
+		return -1;
+	}
+	if ((tpath = tmpfile_get_name(dpath)) == NULL) {
+		close(sfd);
+		return -1;
+	}
+	if (fstat(sfd, &st) == -1 ||
+	    (dfd = open(tpath, O_CREAT | O_EXCL | O_WRONLY, 0600)) == -1) {
+		goto err;
+	}
+	if (fs_copy_file(sfd, dfd, st.st_size) == -1 ||
+	    fchmod(dfd, st.st_mode & ALLPERMS) == -1 ||
+	    fs_sync_rename(dfd, tpath, dpath) == -1) {
+		goto err;
+	}
+	fs_sync(-1, dpath);
+	atomic_fetch_add(&bk->nbytes, st.st_size);
+	close(dfd);
+	close(sfd);
+	free(tpath);
+	return 0;
+err:
+	if (dfd != -1) {
+		unlink(tpath);
+		close(dfd);
+	}
+	close(sfd);
+	free(tpath);
+	return -1;
+}
+
+static void *
+bkp_copy_worker(void *arg)
+{
+	backup_t *bk = arg;
+	size_t i;
+
+	while ((i = atomic_fetch_add(&bk->next, 1)) < bk->cur.nents) {
+		const bkp_ent_t *ent = &bk->cur.ents[i];
+
+		if (!ent->copy) {
+			continue;
+		}
+		if (bkp_copy_object(bk, ent) == -1) {
+			app_elog(LOG_ERR, "failed to copy `%s'", ent->path);
+			atomic_fetch_add(&bk->nerrors, 1);
+			continue;
+		}
+		atomic_fetch_add(&bk->ncopied, 1);
+	}
+	return NULL;
+}
+
+/*
+ * bkp_tombstones: record the deleted objects and, optionally, delete
+ * them at the destination.
+ */
+static int
+bkp_tombstones(backup_t *bk, unsigned flags, unsigned *ndeleted)
+{
+	const time_t now = time(NULL);
+	char fpath[PATH_MAX];
+	FILE *fp = NULL;
+
+	*ndeleted = 0;
+	if (bkp_path(fpath, bk->dest, RVAULT_TOMBSTONES_FILE) == -1) {
+		return -1;
+	}
+
+	/*
+	 * Note: reverse order of the sorted paths, so the entries of a
+	 * directory go before the directory itself, which is then empty.
+	 */
+	for (size_t i = bk->prev.nents; i-- > 0;) {
+		const bkp_ent_t *ent = &bk->prev.ents[i];
+		char dpath[PATH_MAX];
+
+		if (ent->seen) {
+			continue;
+		}
+		if (fp == NULL && (fp = fopen(fpath, "a")) == NULL) {
+			return -1;
+		}
+		fprintf(fp, "%jd %c %s\n", (intmax_t)now, ent->type, ent->path);
+		(*ndeleted)++;
+
+		if ((flags & RVAULT_BACKUP_DELETE) == 0) {
+			continue;
+		}
+		if (bkp_path(dpath, bk->dest, ent->path) == -1 ||
+		    ((ent->type == 'd' ? rmdir(dpath) : unlink(dpath)) == -1 &&
+		    errno != ENOENT)) {
+			app_elog(LOG_WARNING, "could not delete `%s'", dpath);
+		}
+	}
+	if (fp && (fflush(fp) != 0 || fs_sync(fileno(fp), NULL) == -1 ||
+	    fclose(fp) != 0)) {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * rvault_backup: copy the changed objects of the vault to the destination
+ * directory, since the given checkpoint, and write the new checkpoint.
+ *
+ * => The key is not needed: only the ciphertext is copied.
+ * => The checkpoint may not exist, in which case all objects are copied.
+ * => The number of workers may be zero to use the default.
+ */
+int
+rvault_backup(const char *base_path, const char *dest, const char *ckpt,
+    unsigned nworkers, unsigned flags, rvault_backup_stats_t *stats)
+{
+	pthread_t *threads = NULL;
+	unsigned n = 0, ndeleted = 0;
+	backup_t bk;
+	int ret = -1;
+
+	memset(&bk, 0, sizeof(bk));
+	bk.base_path = base_path;
+	bk.dest = dest;
+	atomic_init(&bk.next, 0);
+	atomic_init(&bk.ncopied, 0);
+	atomic_init(&bk.nbytes, 0);
+	atomic_init(&bk.nerrors, 0);
+
+	if (nworkers == 0) {
+		nworkers = rvault_walk_workers();
+	}
+	if (mkdir(dest, 0700) == -1 && errno != EEXIST) {
+		return -1;
+	}
+	if (ckpt_load(ckpt, &bk.prev) == -1) {
+		goto out;
+	}
+	if (bkp_scan(&bk, "") == -1) {
+		goto out;
+	}
+
+	/*
+	 * Copy the changed objects.  The first worker is the calling
+	 * thread.
+	 */
+	if ((threads = calloc(nworkers, sizeof(pthread_t))) == NULL) {
+		goto out;
+	}
+	for (n = 1; n < nworkers; n++) {
+		if (pthread_create(&threads[n], NULL, bkp_copy_worker, &bk)) {
+			break;
+		}
+	}
+	bkp_copy_worker(&bk);
+	for (unsigned i = 1; i < n; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	if (atomic_load(&bk.nerrors)) {
+		/* Keep the old checkpoint: the next backup will retry. */
+		errno = EIO;
+		goto out;
+	}
+
+	/*
+	 * Record the deletions and write the new checkpoint.
+	 */
+	if (bkp_tombstones(&bk, flags, &ndeleted) == -1) {
+		goto out;
+	}
+	if (ckpt_write(ckpt, &bk.cur) == -1) {
+		goto out;
+	}
+	ret = 0;
+out:
+	if (stats) {
+		stats->nobjects = bk.cur.nents;
+		stats->ncopied = atomic_load(&bk.ncopied);
+		stats->nbytes = atomic_load(&bk.nbytes);
+		stats->ndeleted = ndeleted;
+		stats->nerrors = atomic_load(&bk.nerrors);
+	}
+	bkp_list_free(&bk.prev);
+	bkp_list_free(&bk.cur);
+	free(threads);
+	return ret;
+}
@@ -102,6 +102,20 @@ sbuffer_free(sbuffer_t *sbuf)
 	sbuf->buf_size = 0;
 }
 
+/*
+ * sbuffer_release: free the buffer without erasing it.
+ *
+ * => The caller is responsible for erasing the data, e.g. only the
+ *    extents of a sparse buffer, so that the holes are not touched.
+ */
+void
+sbuffer_release(sbuffer_t *sbuf)
+{
+	safe_munmap(sbuf->buf, sbuf->buf_size, 0);
+	sbuf->buf = NULL;
+	sbuf->buf_size = 0;
+}
+
 /*
  * LZ4 buffer compression API.
  */
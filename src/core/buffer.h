@@ -23,6 +23,7 @@ void *	sbuffer_alloc(sbuffer_t *, size_t);
 void *	sbuffer_move(sbuffer_t *, size_t, unsigned);
 void	sbuffer_replace(sbuffer_t *, sbuffer_t *);
 void	sbuffer_free(sbuffer_t *);
+void	sbuffer_release(sbuffer_t *);
 
 /*
  * LZ4 buffer compression.
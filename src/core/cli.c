@@ -21,7 +21,10 @@
 #include <ctype.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <limits.h>
 #include <fcntl.h>
+#include <time.h>
+#include <errno.h>
 #include <pwd.h>
 #include <err.h>
 
@@ -54,12 +57,19 @@ usage(void)
 	    "  RVAULT_SERVER          Authentication server address\n"
 	    "\n"
 	    "Commands:\n"
+	    "  backup           Incremental backup of the encrypted data\n"
+	    "  cp               Copy the files without re-encrypting\n"
 	    "  create           Create and initialize a new vault\n"
+	    "  du               Show the space usage and compression ratio\n"
 	    "  export-key       Print the metadata and key for backup/recovery\n"
+	    "  find             Find the files by name using the index\n"
+	    "  grep             Search the files for a pattern\n"
+	    "  index            Create or rebuild the file name index\n"
 	    "  ls               List the vault contents\n"
 	    "  mount            Mount the encrypted vault as a file system\n"
 	    "  sdb              CLI to operate secrets/passwords\n"
 	    "  read             Read a file from the vault\n"
+	    "  replay           Replay a trace of the file system operations\n"
 	    "  write            Write a file to the vault\n"
 	    "\n"
 	    "Run '"APP_NAME" <COMMAND> -h' for more information on a command.\n"
@@ -85,9 +95,10 @@ usage_datapath(void)
 static int
 create_vault(const char *path, const char *server, int argc, char **argv)
 {
-	static const char *opts_s = "c:m:nh?";
+	static const char *opts_s = "c:e:m:nh?";
 	static struct option opts_l[] = {
 		{ "cipher",	required_argument,	0,	'c'	},
+		{ "key-epoch",	required_argument,	0,	'e'	},
 		{ "mac",	required_argument,	0,	'm'	},
 		{ "noauth",	no_argument,		0,	'n'	},
 		{ "help",	no_argument,		0,	'h'	},
@@ -95,7 +106,7 @@ create_vault(const char *path, const char *server, int argc, char **argv)
 	};
 	const char *uid, *cipher = NULL, *mac = NULL;
 	char *passphrase0, *passphrase;
-	unsigned flags = 0;
+	unsigned flags = 0, key_epoch = 0;
 	int ch, ret;
 	bool match;
 
@@ -104,6 +115,14 @@ create_vault(const char *path, const char *server, int argc, char **argv)
 		case 'c':
 			cipher = optarg;
 			break;
+		case 'e':
+			if (str_to_uint(optarg, 0, UINT8_MAX,
+			    &key_epoch) == -1) {
+				fprintf(stderr, "invalid key epoch `%s'\n",
+				    optarg);
+				goto usage;
+			}
+			break;
 		case 'm':
 			mac = optarg;
 			break;
@@ -137,7 +156,8 @@ create_vault(const char *path, const char *server, int argc, char **argv)
 		errx(EXIT_FAILURE, "passphrases do not match");
 	}
 
-	ret = rvault_init(path, server, passphrase, uid, cipher, mac, flags);
+	ret = rvault_init(path, server, passphrase, uid,
+	    cipher, mac, flags, key_epoch);
 	crypto_memzero(passphrase, strlen(passphrase));
 	if (ret == -1) {
 		fprintf(stderr, "vault creation failed -- exiting.\n");
@@ -145,12 +165,14 @@ create_vault(const char *path, const char *server, int argc, char **argv)
 	return ret;
 usage:
 	fprintf(stderr,
-	    "Usage:\t" APP_NAME " create [ -c cipher ] [ -m mac ] [ -n ] UID\n"
+	    "Usage:\t" APP_NAME " create [ -c cipher ] [ -e epoch ] "
+	    "[ -m mac ] [ -n ] UID\n"
 	    "\n"
 	    "Create a new vault with the given UID.\n"
 	    "\n"
 	    "Options:\n"
 	    "  -c|--cipher CIPHER  Cipher\n"
+	    "  -e|--key-epoch N    Key epoch (when replacing the key)\n"
 	    "  -m|--mac MAC        MAC algorithm\n"
 	    "  -n|--noauth         No authentication "
 	    "(WARNING: this is much less secure)"
@@ -189,34 +211,71 @@ open_vault(const char *datapath, const char *server)
 static int
 mount_vault(const char *datapath, const char *server, int argc, char **argv)
 {
-	static const char *opts_s = "c:dfr:s:h?";
+	static const char *opts_s = "C:c:Ddfk:m:p::Rr:s:t:wh?";
 	static struct option opts_l[] = {
+		{ "cache",	required_argument,	0,	'C'	},
 		{ "compress",	optional_argument,	0,	'c'	},
+		{ "direct-io",	no_argument,		0,	'D'	},
 		{ "debug",	no_argument,		0,	'd'	},
 		{ "foreground",	no_argument,		0,	'f'	},
+		{ "prev-key",	required_argument,	0,	'k'	},
+		{ "preload-mem",required_argument,	0,	'm'	},
+		{ "preload",	optional_argument,	0,	'p'	},
+		{ "read-only",	no_argument,		0,	'R'	},
 		{ "recover",	required_argument,	0,	'r'	},
 		{ "sync",	required_argument,	0,	's'	},
+		{ "trace",	required_argument,	0,	't'	},
+		{ "watch",	no_argument,		0,	'w'	},
 		{ "help",	no_argument,		0,	'h'	},
 		{ NULL,		0,			NULL,	0	}
 	};
 	rvault_t *vault;
-	const char *mountpoint, *recover = NULL;
-	bool fg = false, debug = false, weak_sync = false, comp = false;
+	const char *mountpoint, *recover = NULL, *preload = NULL;
+	const char *trace = NULL;
+	const char *prev_keys[RVAULT_MAX_PREV_KEYS];
+	bool weak_sync = false, comp = false, ro = false, dio = false;
+	unsigned nprev_keys = 0, flags = 0;
+	size_t preload_mem = 0;
 	int ch;
 
 	while ((ch = getopt_long(argc, argv, opts_s, opts_l, NULL)) != -1) {
 		switch (ch) {
+		case 'C':
+			if (strcmp(optarg, "kernel") == 0) {
+				flags |= RVAULTFS_KERNEL_CACHE;
+			} else if (strcmp(optarg, "none") != 0) {
+				goto usage;
+			}
+			break;
 		case 'c':
 			comp = optarg && (
 			    atoi(optarg) ||
 			    tolower((unsigned char)optarg[0]) == 'y'
 			);
 			break;
+		case 'D':
+			dio = true;
+			break;
 		case 'd':
-			debug = true;
+			flags |= RVAULTFS_DEBUG;
 			break;
 		case 'f':
-			fg = true;
+			flags |= RVAULTFS_FOREGROUND;
+			break;
+		case 'k':
+			if (nprev_keys == RVAULT_MAX_PREV_KEYS) {
+				errx(EXIT_FAILURE, "too many previous keys");
+			}
+			prev_keys[nprev_keys++] = optarg;
+			break;
+		case 'm':
+			preload_mem = (size_t)strtoul(optarg, NULL, 10) << 20;
+			break;
+		case 'p':
+			preload = optarg ? optarg : "/";
+			break;
+		case 'R':
+			ro = true;
 			break;
 		case 'r':
 			recover = optarg;
@@ -224,6 +283,12 @@ mount_vault(const char *datapath, const char *server, int argc, char **argv)
 		case 's':
 			weak_sync = strcasecmp(optarg, "weak") == 0;
 			break;
+		case 't':
+			trace = optarg;
+			break;
+		case 'w':
+			flags |= RVAULTFS_WATCH;
+			break;
 		case 'h':
 		case '?':
 		default:
@@ -244,25 +309,64 @@ mount_vault(const char *datapath, const char *server, int argc, char **argv)
 		fprintf(stderr, "failed to open the vault -- exiting.\n");
 		exit(EXIT_FAILURE);
 	}
+	for (unsigned i = 0; i < nprev_keys; i++) {
+		if (rvault_add_prev_key(vault, prev_keys[i]) == -1) {
+			fprintf(stderr, "invalid previous key -- exiting.\n");
+			rvault_close(vault);
+			exit(EXIT_FAILURE);
+		}
+	}
 	vault->weak_sync = weak_sync;
 	vault->compress = comp;
-	rvaultfs_run(vault, mountpoint, fg, debug);
+	vault->read_only = ro;
+	vault->direct_io = dio;
+	if (rvault_index_open(vault) == -1) {
+		fprintf(stderr, "WARNING: could not load the file name index; "
+		    "run '" APP_NAME " index' to rebuild it.\n");
+	}
+	if (preload &&
+	    rvault_preload_setup(vault, preload, preload_mem) == -1) {
+		fprintf(stderr, "WARNING: could not set up the preloading.\n");
+	}
+	if (trace && rvault_trace_open(vault, trace) == -1) {
+		fprintf(stderr, "failed to open the trace -- exiting.\n");
+		rvault_close(vault);
+		exit(EXIT_FAILURE);
+	}
+	rvaultfs_run(vault, mountpoint, flags);
 	rvault_close(vault);
 	return 0;
 usage:
 	fprintf(stderr,
-	    "Usage:\t" APP_NAME " mount [ -c 1|0 ] [ -d ] [ -f ] "
-	    "[ -r file ] [ -s mode ] PATH\n"
+	    "Usage:\t" APP_NAME " mount [ -C mode ] [ -c 1|0 ] [ -D ] [ -d ] "
+	    "[ -f ] [ -k file ] [ -m N ] [ -p[paths] ]\n"
+	    "\t    [ -R ] [ -r file ] [ -s mode ] [ -t file ] [ -w ] PATH\n"
 	    "\n"
 	    "Mount the vault at the given path.\n"
 	    "\n"
 	    "Options:\n"
+	    "  -C|--cache MODE    Caching of the decrypted data: none "
+	    "(default) or kernel.\n"
 	    "  -c|--compress 1|0  Enable or disable (default) compression.\n"
+	    "  -D|--direct-io     Bypass the page cache for the encrypted "
+	    "objects.\n"
 	    "  -d|--debug         Enable FUSE-level debug logging.\n"
 	    "  -f|--foreground    Run in the foreground (do not daemonize).\n"
+	    "  -k|--prev-key PATH Previous key (recovery file) to re-key "
+	    "the data from.\n"
+	    "  -m|--preload-mem N Memory budget (in MB) for the preloaded "
+	    "data (default: 0).\n"
+	    "  -p|--preload=PATHS Preload the given paths (comma-separated; "
+	    "default: /)\n"
+	    "                     in the background.\n"
+	    "  -R|--read-only     Mount read-only.\n"
 	    "  -r|--recover PATH  Mount the vault using the recovery file.\n"
 	    "  -s|--sync MODE     Sync mode on write operations: "
 	    "weak (faster) or full (safer).\n"
+	    "  -t|--trace PATH    Record the trace of the operations "
+	    "(see the replay command).\n"
+	    "  -w|--watch         Watch the vault directory for the external "
+	    "changes.\n"
 	    "\n"
 	);
 	return -1;
@@ -300,6 +404,97 @@ export_key(const char *datapath, const char *server,
 
 //////////////////////////////////////////////////////////////////////////////
 
+static int
+backup_cmd(const char *datapath, const char *server __unused,
+    int argc, char **argv)
+{
+	static const char *opts_s = "dj:s:h?";
+	static struct option opts_l[] = {
+		{ "delete",	no_argument,		0,	'd'	},
+		{ "jobs",	required_argument,	0,	'j'	},
+		{ "since",	required_argument,	0,	's'	},
+		{ "help",	no_argument,		0,	'h'	},
+		{ NULL,		0,			NULL,	0	}
+	};
+	const char *dest, *ckpt = NULL;
+	unsigned nworkers = 0, flags = 0;
+	rvault_backup_stats_t stats;
+	char *ckpt_path = NULL;
+	int ch, ret;
+
+	while ((ch = getopt_long(argc, argv, opts_s, opts_l, NULL)) != -1) {
+		switch (ch) {
+		case 'd':
+			flags |= RVAULT_BACKUP_DELETE;
+			break;
+		case 'j':
+			if (str_to_uint(optarg, 1, UINT_MAX,
+			    &nworkers) == -1) {
+				fprintf(stderr, "invalid number of jobs `%s'\n",
+				    optarg);
+				goto usage;
+			}
+			break;
+		case 's':
+			ckpt = optarg;
+			break;
+		case 'h':
+		case '?':
+		default:
+			goto usage;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc == 0) {
+		goto usage;
+	}
+	dest = argv[0];
+
+	if (ckpt == NULL) {
+		if (asprintf(&ckpt_path, "%s/%s", dest,
+		    RVAULT_CHECKPOINT_FILE) == -1) {
+			err(EXIT_FAILURE, "asprintf");
+		}
+		ckpt = ckpt_path;
+	}
+	ret = rvault_backup(datapath, dest, ckpt, nworkers, flags, &stats);
+	if (ret == -1) {
+		fprintf(stderr, "backup failed: %s\n", strerror(errno));
+	}
+	printf("%zu objects, %u copied (%" PRIu64 " bytes), %u deleted",
+	    stats.nobjects, stats.ncopied, stats.nbytes, stats.ndeleted);
+	if (stats.nerrors) {
+		printf(", %u failed", stats.nerrors);
+	}
+	putchar('\n');
+	free(ckpt_path);
+	return ret;
+usage:
+	fprintf(stderr,
+	    "Usage:\t" APP_NAME " backup [ -d ] [ -j N ] "
+	    "[ -s CHECKPOINT ] DEST\n"
+	    "\n"
+	    "Copy the vault objects changed since the checkpoint into the\n"
+	    "destination directory and write the new checkpoint.  Only the\n"
+	    "ciphertext is copied, therefore the passphrase is not needed.\n"
+	    "The deleted objects are recorded in " RVAULT_TOMBSTONES_FILE "\n"
+	    "at the destination.\n"
+	    "\n"
+	    "Options:\n"
+	    "  -d|--delete        Also delete the removed objects at the "
+	    "destination.\n"
+	    "  -j|--jobs N        Number of parallel workers "
+	    "(default: CPU count).\n"
+	    "  -s|--since PATH    Checkpoint file "
+	    "(default: DEST/" RVAULT_CHECKPOINT_FILE ").\n"
+	    "\n"
+	);
+	return -1;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
 #define	BUF_SIZE	(64 * 1024)
 
 typedef enum { FILE_READ, FILE_WRITE } file_op_t;
@@ -361,7 +556,12 @@ out:
 	return ret;
 }
 
-typedef enum { FILE_SHOWALL = 0x1 } flist_flag_t;
+typedef enum {
+	FILE_SHOWALL	= 0x01,
+	FILE_RECURSIVE	= 0x02,
+	FILE_LONG	= 0x04,
+	FILE_JSON	= 0x08,
+} flist_flag_t;
 
 static void
 file_list_iter(void *arg, const char *name, struct dirent *dp)
@@ -375,19 +575,129 @@ file_list_iter(void *arg, const char *name, struct dirent *dp)
 	(void)arg; (void)dp;
 }
 
+static void
+json_write_str(FILE *fp, const char *s)
+{
+	fputc('"', fp);
+	for (; *s; s++) {
+		const unsigned char c = *s;
+
+		if (c == '"' || c == '\\') {
+			fprintf(fp, "\\%c", c);
+		} else if (c < 0x20) {
+			fprintf(fp, "\\u%04x", c);
+		} else {
+			fputc(c, fp);
+		}
+	}
+	fputc('"', fp);
+}
+
+/*
+ * file_mode_str: ls(1) style mode string (strmode() is not portable).
+ */
+static void
+file_mode_str(mode_t m, char *buf)
+{
+	static const char rwx[] = "rwxrwxrwx";
+
+	buf[0] = S_ISDIR(m) ? 'd' : '-';
+	for (unsigned i = 0; i < 9; i++) {
+		buf[i + 1] = (m & (0400 >> i)) ? rwx[i] : '-';
+	}
+	buf[10] = '\0';
+}
+
+/*
+ * file_list_entry: print the entry; invoked by the (parallel) vault walk.
+ *
+ * => Each entry is printed with the stdout lock held, so the lines of
+ *    different workers do not interleave.
+ */
+static int
+file_list_entry(void *arg, const rvault_walk_ent_t *ent)
+{
+	const flist_flag_t flags = (flist_flag_t)(uintptr_t)arg;
+	const char *name = (flags & FILE_RECURSIVE) ? ent->path : ent->name;
+	const int pruned = (flags & FILE_RECURSIVE) ? 0 : RVAULT_WALK_PRUNE;
+	const struct stat *st = ent->st;
+	const bool isdir = S_ISDIR(st->st_mode);
+	intmax_t size = st->st_size;
+	char mode[11], mtime[32];
+	struct tm tm;
+
+	if ((flags & FILE_SHOWALL) == 0 && ent->name[0] == '.') {
+		return RVAULT_WALK_PRUNE;
+	}
+	if (!isdir && !S_ISREG(st->st_mode)) {
+		/* We support only directories and regular files. */
+		return 0;
+	}
+
+	/*
+	 * The plain size is in the file object header.  If it cannot be
+	 * read, the size is unknown (-1): printed as "?" or null.
+	 */
+	if ((flags & (FILE_LONG | FILE_JSON)) && !isdir && size > 0) {
+		int fd;
+
+		size = -1;
+		if ((fd = open(ent->vpath, O_RDONLY)) != -1) {
+			size = storage_read_length(ent->vault, fd);
+			close(fd);
+		}
+		if (size == -1) {
+			app_elog(LOG_WARNING, "could not read `%s'", ent->path);
+		}
+	}
+
+	flockfile(stdout);
+	if (flags & FILE_JSON) {
+		fputs("{\"path\":", stdout);
+		json_write_str(stdout, name);
+		printf(",\"type\":\"%s\",\"size\":", isdir ? "dir" : "file");
+		if (size == -1) {
+			fputs("null", stdout);
+		} else {
+			printf("%jd", size);
+		}
+		printf(",\"stored\":%jd,\"mode\":\"%04o\",\"mtime\":%jd}\n",
+		    (intmax_t)st->st_size, (unsigned)(st->st_mode & ALLPERMS),
+		    (intmax_t)st->st_mtime);
+	} else if (flags & FILE_LONG) {
+		file_mode_str(st->st_mode, mode);
+		localtime_r(&st->st_mtime, &tm);
+		strftime(mtime, sizeof(mtime), "%Y-%m-%d %H:%M", &tm);
+		if (size == -1) {
+			printf("%s %12s %s %s\n", mode, "?", mtime, name);
+		} else {
+			printf("%s %12jd %s %s\n", mode, size, mtime, name);
+		}
+	} else {
+		printf("%s\n", name);
+	}
+	funlockfile(stdout);
+	return pruned;
+}
+
 static int
 file_list_cmd(const char *datapath, const char *server, int argc, char **argv)
 {
-	static const char *opts_s = "ah?";
+	static const char *opts_s = "aj:lRh?";
 	static struct option opts_l[] = {
 		{ "all",	no_argument,		0,	'a'	},
+		{ "format",	required_argument,	0,	'F'	},
+		{ "jobs",	required_argument,	0,	'j'	},
+		{ "long",	no_argument,		0,	'l'	},
+		{ "recursive",	no_argument,		0,	'R'	},
 		{ "help",	no_argument,		0,	'h'	},
 		{ NULL,		0,			NULL,	0	}
 	};
+	unsigned nworkers = 0;
 	rvault_t *vault;
 	const char *path;
 	flist_flag_t flags;
-	int ch;
+	int ch, ret;
 
 	flags = 0;
 	while ((ch = getopt_long(argc, argv, opts_s, opts_l, NULL)) != -1) {
@@ -395,6 +705,27 @@ file_list_cmd(const char *datapath, const char *server, int argc, char **argv)
 		case 'a':
 			flags |= FILE_SHOWALL;
 			break;
+		case 'F':
+			if (strcmp(optarg, "json") == 0) {
+				flags |= FILE_JSON;
+			} else if (strcmp(optarg, "text") != 0) {
+				goto usage;
+			}
+			break;
+		case 'j':
+			if (str_to_uint(optarg, 1, UINT_MAX,
+			    &nworkers) == -1) {
+				fprintf(stderr, "invalid number of jobs `%s'\n",
+				    optarg);
+				goto usage;
+			}
+			break;
+		case 'l':
+			flags |= FILE_LONG;
+			break;
+		case 'R':
+			flags |= FILE_RECURSIVE;
+			break;
 		case 'h':
 		case '?':
 		default:
@@ -406,19 +737,41 @@ file_list_cmd(const char *datapath, const char *server, int argc, char **argv)
 
 	vault = open_vault(datapath, server);
 	path = argc ? argv[0] : "/";
-	rvault_iter_dir(vault, path, (void *)(uintptr_t)flags, file_list_iter);
+
+	if ((flags & ~FILE_SHOWALL) == 0) {
+		/* Just the names: simple iteration. */
+		ret = rvault_iter_dir(vault, path,
+		    (void *)(uintptr_t)flags, file_list_iter);
+	} else {
+		/* Only the recursive listing benefits from the workers. */
+		nworkers = (flags & FILE_RECURSIVE) ? nworkers : 1;
+		ret = rvault_walk(vault, path, nworkers,
+		    (void *)(uintptr_t)flags, file_list_entry);
+	}
+	if (ret == -1) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+	}
 	rvault_close(vault);
-	return 0;
+	return ret;
 usage:
 	fprintf(stderr,
-	    "Usage:\t" APP_NAME " ls [ -a ] [PATH]\n"
+	    "Usage:\t" APP_NAME " ls [ -a ] [ -l ] [ -R ] [ -j N ] "
+	    "[ --format=text|json ] [PATH]\n"
 	    "\n"
 	    "List the vault content.\n"
 	    "The path must represent the namespace in vault.\n"
 	    "\n"
 	    "Options:\n"
-	    "  -a|--all  Show all files and directories, "
+	    "  -a|--all          Show all files and directories, "
 	    "including the dot ones.\n"
+	    "  -l|--long         Show the mode, size and modification time.\n"
+	    "  -R|--recursive    List the sub-directories recursively, in\n"
+	    "                    parallel; the full paths are printed in no\n"
+	    "                    particular order.\n"
+	    "  -j|--jobs N       Number of parallel workers "
+	    "(default: CPU count).\n"
+	    "  --format=json     Print a JSON object per line, with the path,\n"
+	    "                    type, plain and stored size, mode and mtime.\n"
 	    "\n"
 	);
 	return -1;
@@ -450,7 +803,12 @@ file_write_cmd(const char *datapath, const char *server, int argc, char **argv)
 	if (argc > 1) {
 		const char *target = argv[1];
 		rvault_t *vault = open_vault(datapath, server);
-		int ret = do_file_io(vault, target, FILE_WRITE);
+		int ret;
+
+		if (rvault_index_open(vault) == -1) {
+			app_elog(LOG_WARNING, "could not load the index");
+		}
+		ret = do_file_io(vault, target, FILE_WRITE);
 		rvault_close(vault);
 		return ret;
 	}
@@ -464,6 +822,287 @@ file_write_cmd(const char *datapath, const char *server, int argc, char **argv)
 	return -1;
 }
 
+typedef struct {
+	const char *	dst;
+	size_t		srclen;
+	unsigned	nerrors;
+} copy_ctx_t;
+
+/*
+ * file_copy_entry: copy the entry of the source tree into the target.
+ */
+static int
+file_copy_entry(void *arg, const rvault_walk_ent_t *ent)
+{
+	copy_ctx_t *ctx = arg;
+	char path[PATH_MAX];
+	int ret = 0;
+
+	if ((size_t)snprintf(path, sizeof(path), "%s%s", ctx->dst,
+	    ent->path + ctx->srclen) >= sizeof(path)) {
+		errno = ENAMETOOLONG;
+		ret = -1;
+	} else if (S_ISDIR(ent->st->st_mode)) {
+		char *vpath = rvault_resolve_path(ent->vault, path, NULL);
+
+		if (vpath == NULL ||
+		    (mkdir(vpath, 0700) == -1 && errno != EEXIST)) {
+			ret = -1;
+		}
+		free(vpath);
+	} else if (S_ISREG(ent->st->st_mode)) {
+		ret = fileobj_clone(ent->vault, ent->path, path);
+	}
+	if (ret == -1) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		ctx->nerrors++;
+		return RVAULT_WALK_PRUNE;
+	}
+	(void)rvault_index_add(ent->vault, path,
+	    S_ISDIR(ent->st->st_mode));
+	return 0;
+}
+
+static int
+file_copy_cmd(const char *datapath, const char *server, int argc, char **argv)
+{
+	static const char *opts_s = "Rh?";
+	static struct option opts_l[] = {
+		{ "recursive",	no_argument,		0,	'R'	},
+		{ "help",	no_argument,		0,	'h'	},
+		{ NULL,		0,			NULL,	0	}
+	};
+	char dst[PATH_MAX], *vpath;
+	bool recursive = false;
+	const char *src, *name;
+	copy_ctx_t ctx;
+	struct stat st;
+	rvault_t *vault;
+	int ch, ret = -1;
+
+	while ((ch = getopt_long(argc, argv, opts_s, opts_l, NULL)) != -1) {
+		switch (ch) {
+		case 'R':
+			recursive = true;
+			break;
+		case 'h':
+		case '?':
+		default:
+			goto usage;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 2) {
+		goto usage;
+	}
+	src = argv[0];
+	name = strrchr(src, '/') ? strrchr(src, '/') + 1 : src;
+
+	vault = open_vault(datapath, server);
+	if (rvault_index_open(vault) == -1) {
+		app_elog(LOG_WARNING, "could not load the index");
+	}
+
+	/*
+	 * As cp(1): if the target is a directory, then copy into it.
+	 */
+	snprintf(dst, sizeof(dst), "%s", argv[1]);
+	if ((vpath = rvault_resolve_path(vault, dst, NULL)) != NULL &&
+	    stat(vpath, &st) == 0 && S_ISDIR(st.st_mode) && *name &&
+	    (size_t)snprintf(dst, sizeof(dst), "%s/%s",
+	    argv[1], name) >= sizeof(dst)) {
+		errno = ENAMETOOLONG;
+		goto err;
+	}
+	free(vpath);
+	vpath = NULL;
+
+	if ((vpath = rvault_resolve_path(vault, src, NULL)) == NULL ||
+	    stat(vpath, &st) == -1) {
+		goto err;
+	}
+	if (!S_ISDIR(st.st_mode)) {
+		if ((ret = fileobj_clone(vault, src, dst)) == -1) {
+			goto err;
+		}
+		goto out;
+	}
+	if (!recursive) {
+		errno = EISDIR;
+		goto err;
+	}
+
+	/*
+	 * Directory: create the target and walk the source.  Note: the
+	 * index is not thread-safe, therefore use a single worker.
+	 */
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.dst = dst;
+	ctx.srclen = strlen(src);
+	while (ctx.srclen && src[ctx.srclen - 1] == '/') {
+		ctx.srclen--;
+	}
+	if (strncmp(dst, src, ctx.srclen) == 0 &&
+	    (dst[ctx.srclen] == '/' || dst[ctx.srclen] == '\0')) {
+		errno = EINVAL;
+		goto err;
+	}
+	free(vpath);
+	if ((vpath = rvault_resolve_path(vault, dst, NULL)) == NULL ||
+	    (mkdir(vpath, 0700) == -1 && errno != EEXIST)) {
+		goto err;
+	}
+	(void)rvault_index_add(vault, dst, true);
+	if (rvault_walk(vault, src, 1, &ctx, file_copy_entry) == -1) {
+		goto err;
+	}
+	ret = ctx.nerrors ? -1 : 0;
+	goto out;
+err:
+	fprintf(stderr, "%s: %s\n", src, strerror(errno));
+	ret = -1;
+out:
+	free(vpath);
+	rvault_close(vault);
+	return ret;
+usage:
+	fprintf(stderr,
+	    "Usage:\t" APP_NAME " cp [ -R ] SRC DST\n"
+	    "\n"
+	    "Copy the file within the vault.  The encrypted data is cloned\n"
+	    "as is, without decrypting it, using a reflink where the file\n"
+	    "system supports it.\n"
+	    "The paths must represent the namespace in vault.\n"
+	    "\n"
+	    "Options:\n"
+	    "  -R|--recursive  Copy the directories recursively.\n"
+	    "\n"
+	);
+	return -1;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+typedef struct {
+	rvault_t *	vault;
+	unsigned	nmatches;
+	unsigned	nstale;
+} find_ctx_t;
+
+/*
+ * find_iter: print the matching entry, but only if it still exists (the
+ * index may be stale, e.g. if the vault was modified without it).
+ */
+static void
+find_iter(void *arg, const char *path, bool isdir)
+{
+	find_ctx_t *ctx = arg;
+	struct stat st;
+	char *vpath;
+
+	if ((vpath = rvault_resolve_path(ctx->vault, path, NULL)) == NULL) {
+		return;
+	}
+	if (lstat(vpath, &st) == -1 || S_ISDIR(st.st_mode) != isdir) {
+		ctx->nstale++;
+	} else {
+		printf("%s%s\n", path, isdir ? "/" : "");
+		ctx->nmatches++;
+	}
+	free(vpath);
+}
+
+static int
+file_find_cmd(const char *datapath, const char *server, int argc, char **argv)
+{
+	find_ctx_t ctx;
+	int ret;
+
+	if (argc < 2 || argv[1][0] == '-') {
+		fprintf(stderr,
+		    "Usage:\t" APP_NAME " find PATTERN\n"
+		    "\n"
+		    "Find the files and directories matching the pattern\n"
+		    "using the file name index, i.e. without decrypting the\n"
+		    "names of the whole vault.  The shell pattern is matched\n"
+		    "against the name or, if it starts with '/', the path.\n"
+		    "\n"
+		);
+		return -1;
+	}
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.vault = open_vault(datapath, server);
+
+	if ((ret = rvault_index_open(ctx.vault)) == -1) {
+		fprintf(stderr, "failed to load the index: %s\n",
+		    strerror(errno));
+	} else if (ctx.vault->index == NULL) {
+		fprintf(stderr, "there is no index; "
+		    "run '" APP_NAME " index' to create it.\n");
+		ret = -1;
+	} else {
+		ret = rvault_index_find(ctx.vault, argv[1], &ctx, find_iter);
+	}
+	if (ctx.nstale) {
+		fprintf(stderr, "WARNING: the index is stale; "
+		    "run '" APP_NAME " index' to rebuild it.\n");
+	}
+	rvault_close(ctx.vault);
+	return (ret == 0 && ctx.nmatches) ? 0 : -1;
+}
+
+static int
+file_index_cmd(const char *datapath, const char *server, int argc, char **argv)
+{
+	static const char *opts_s = "j:h?";
+	static struct option opts_l[] = {
+		{ "jobs",	required_argument,	0,	'j'	},
+		{ "help",	no_argument,		0,	'h'	},
+		{ NULL,		0,			NULL,	0	}
+	};
+	unsigned nworkers = 0;
+	rvault_t *vault;
+	int ch, ret;
+
+	while ((ch = getopt_long(argc, argv, opts_s, opts_l, NULL)) != -1) {
+		switch (ch) {
+		case 'j':
+			if (str_to_uint(optarg, 1, UINT_MAX,
+			    &nworkers) == -1) {
+				fprintf(stderr, "invalid number of jobs `%s'\n",
+				    optarg);
+				goto usage;
+			}
+			break;
+		case 'h':
+		case '?':
+		default:
+			goto usage;
+		}
+	}
+	vault = open_vault(datapath, server);
+	if ((ret = rvault_index_rebuild(vault, nworkers)) == -1) {
+		fprintf(stderr, "failed to build the index: %s\n",
+		    strerror(errno));
+	}
+	rvault_close(vault);
+	return ret;
+usage:
+	fprintf(stderr,
+	    "Usage:\t" APP_NAME " index [ -j N ]\n"
+	    "\n"
+	    "Create or rebuild the file name index used by the 'find'\n"
+	    "command.  Once created, the index is maintained by the 'mount'\n"
+	    "and 'write' commands.\n"
+	    "\n"
+	    "Options:\n"
+	    "  -j|--jobs N  Number of parallel workers (default: CPU count).\n"
+	    "\n"
+	);
+	return -1;
+}
+
 //////////////////////////////////////////////////////////////////////////////
 
 #ifndef SQLITE3_SERIALIZE
@@ -490,8 +1129,14 @@ process_command(const char *datapath, const char *server, int argc, char **argv)
 		cmd_func_t	func;
 		bool		setup_pid;
 	} commands[] = {
+		{ "backup",	backup_cmd,		false	},
+		{ "cp",		file_copy_cmd,		true	},
 		{ "create",	create_vault,		false	},
+		{ "du",		du_cmd,			false	},
 		{ "export-key",	export_key,		false	},
+		{ "find",	file_find_cmd,		false	},
+		{ "grep",	grep_cmd,		false	},
+		{ "index",	file_index_cmd,		true	},
 		{ "ls",		file_list_cmd,		false	},
 #ifdef SQLITE3_SERIALIZE
 		{ "sdb",	sdb_cli,		false	},
@@ -500,6 +1145,7 @@ process_command(const char *datapath, const char *server, int argc, char **argv)
 #endif
 		{ "mount",	mount_vault,		true	},
 		{ "read",	file_read_cmd,		false	},
+		{ "replay",	replay_cmd,		false	},
 		{ "write",	file_write_cmd,		true	},
 	};
 
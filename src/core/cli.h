@@ -11,5 +11,8 @@
 void		usage_srvurl(bool);
 rvault_t *	open_vault(const char *, const char *);
 int		sdb_cli(const char *, const char *, int, char **);
+int		du_cmd(const char *, const char *, int, char **);
+int		grep_cmd(const char *, const char *, int, char **);
+int		replay_cmd(const char *, const char *, int, char **);
 
 #endif
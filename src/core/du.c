@@ -0,0 +1,588 @@
+/*
+ * Copyright (c) 2020 Mindaugas Rasiukevicius <rmind at noxt eu>
+ * All rights reserved.
+ *
+ * Use is subject to license terms, as specified in the LICENSE file.
+ */
+
+/*
+ * Space and compression accounting ("du" command).
+ *
+ * The file object header has the plain and compressed data lengths, as
+ * well as the modification time, in the clear.  Therefore, only the
+ * headers are read (in parallel) and only the names are decrypted; the
+ * file data is never decrypted.  Each worker queues up to DU_IO_DEPTH
+ * header reads, which are submitted as a batch where the io_uring is
+ * available (see fs_io_pread()).
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+
+#include "rvault.h"
+#include "storage.h"
+#include "cli.h"
+#include "sys.h"
+#include "utils.h"
+
+/*
+ * Modification time histogram buckets: upper bounds of the age.
+ */
+static const struct {
+	const char *	label;
+	time_t		age;
+} du_mtime_buckets[] = {
+	{ "< 1 day",	24 * 3600		},
+	{ "< 1 week",	7 * 24 * 3600		},
+	{ "< 1 month",	30 * 24 * 3600		},
+	{ "< 1 year",	365 * 24 * 3600		},
+	{ ">= 1 year",	0			},
+};
+
+#define	DU_MTIME_NBUCKETS	__arraycount(du_mtime_buckets)
+
+#define	DU_IO_DEPTH		8
+
+typedef struct {
+	char *		path;
+	unsigned	depth;
+	uint64_t	plain_len;
+	uint64_t	stored_len;
+	uint64_t	nfiles;
+	uint64_t	ndirs;
+	uint64_t	nlz4;
+} du_dir_t;
+
+typedef struct du du_t;
+typedef struct du_worker du_worker_t;
+
+/*
+ * Header read in flight.
+ */
+typedef struct {
+	du_t *		du;
+	du_worker_t *	w;
+	size_t		dir;	// index of the parent record
+	char *		path;
+	int		fd;
+	unsigned char	buf[FILEOBJ_HDR_LEN];
+} du_hdr_t;
+
+struct du_worker {
+	du_dir_t *	dirs;
+	size_t		ndirs;
+	size_t		maxdirs;
+	size_t		cur;
+	uint64_t	nerrors;
+	uint64_t	mtime_hist[DU_MTIME_NBUCKETS];
+
+	fs_io_t *	io;
+	du_hdr_t	hdrs[DU_IO_DEPTH];
+};
+
+struct du {
+	time_t		now;
+	unsigned	nworkers;
+	du_worker_t *	workers;
+};
+
+static int
+du_dircmp(const void *a, const void *b)
+{
+	const du_dir_t *d1 = a, *d2 = b;
+	return str_pathcmp(d1->path, d2->path);
+}
+
+static du_dir_t *
+du_dir_add(du_worker_t *w, const char *path, size_t len, unsigned depth)
+{
+	du_dir_t *dir;
+
+	if (w->ndirs == w->maxdirs) {
+		size_t maxdirs = w->maxdirs ? w->maxdirs * 2 : 64;
+		void *dirs;
+
+		if ((dirs = realloc(w->dirs,
+		    maxdirs * sizeof(du_dir_t))) == NULL) {
+			return NULL;
+		}
+		w->dirs = dirs;
+		w->maxdirs = maxdirs;
+	}
+	dir = &w->dirs[w->ndirs];
+	memset(dir, 0, sizeof(du_dir_t));
+	if ((dir->path = strndup(path, len)) == NULL) {
+		return NULL;
+	}
+	dir->depth = depth;
+	w->ndirs++;
+	return dir;
+}
+
+/*
+ * du_get_parent: get the record of the parent directory.  The entries
+ * of a directory are delivered consecutively, so check the current one.
+ */
+static du_dir_t *
+du_get_parent(du_worker_t *w, const rvault_walk_ent_t *ent)
+{
+	const size_t len = (uintptr_t)ent->name - (uintptr_t)ent->path - 1;
+	du_dir_t *dir;
+
+	if (w->cur < w->ndirs) {
+		dir = &w->dirs[w->cur];
+		if (strlen(dir->path) == len &&
+		    strncmp(dir->path, ent->path, len) == 0) {
+			return dir;
+		}
+	}
+	if ((dir = du_dir_add(w, ent->path, len, ent->depth - 1)) != NULL) {
+		w->cur = w->ndirs - 1;
+	}
+	return dir;
+}
+
+static void
+du_account_mtime(du_t *du, du_worker_t *w, time_t mtime)
+{
+	const time_t age = du->now > mtime ? du->now - mtime : 0;
+	unsigned i;
+
+	for (i = 0; i < DU_MTIME_NBUCKETS - 1; i++) {
+		if (age < du_mtime_buckets[i].age) {
+			break;
+		}
+	}
+	w->mtime_hist[i]++;
+}
+
+/*
+ * du_hdr_done: account the file, once its header is read.
+ */
+static void
+du_hdr_done(void *arg, ssize_t nbytes)
+{
+	du_hdr_t *h = arg;
+	du_worker_t *w = h->w;
+	const fileobj_hdr_t *hdr = (const void *)h->buf;
+	du_dir_t *dir = &w->dirs[h->dir];
+
+	close(h->fd);
+	h->fd = -1;
+
+	if (nbytes != FILEOBJ_HDR_LEN) {
+		errno = (nbytes < 0) ? -nbytes : EIO;
+		app_elog(LOG_WARNING, "could not read `%s'", h->path);
+		w->nerrors++;
+	} else {
+		dir->plain_len += FILEOBJ_DATA_LEN(hdr);
+		dir->nlz4 += FILEOBJ_LZ4_P(hdr) ? 1 : 0;
+		du_account_mtime(h->du, w, (time_t)be64toh(hdr->mtime));
+	}
+	free(h->path);
+	h->path = NULL;
+}
+
+/*
+ * du_get_hdr: get a free header read slot, waiting for the reads in
+ * flight to complete, if necessary.
+ */
+static du_hdr_t *
+du_get_hdr(du_worker_t *w)
+{
+	if (w->io == NULL) {
+		if ((w->io = fs_io_create(DU_IO_DEPTH, du_hdr_done)) == NULL) {
+			return NULL;
+		}
+		for (unsigned i = 0; i < DU_IO_DEPTH; i++) {
+			w->hdrs[i].fd = -1;
+		}
+	}
+	for (;;) {
+		for (unsigned i = 0; i < DU_IO_DEPTH; i++) {
+			if (w->hdrs[i].fd == -1) {
+				return &w->hdrs[i];
+			}
+		}
+		if (fs_io_wait(w->io, false) == -1) {
+			return NULL;
+		}
+	}
+}
+
+/*
+ * du_io_finish: complete the header reads of the workers.
+ */
+static void
+du_io_finish(du_t *du)
+{
+	for (unsigned i = 0; i < du->nworkers; i++) {
+		du_worker_t *w = &du->workers[i];
+
+		if (w->io == NULL) {
+			continue;
+		}
+		if (fs_io_wait(w->io, true) == -1) {
+			app_elog(LOG_ERR, "%s: I/O failed", __func__);
+		}
+		fs_io_destroy(w->io);
+		w->io = NULL;
+	}
+}
+
+static int
+du_account_file(du_t *du, du_worker_t *w, du_dir_t *dir,
+    const rvault_walk_ent_t *ent)
+{
+	const struct stat *st = ent->st;
+	du_hdr_t *h;
+	int fd;
+
+	dir->nfiles++;
+	dir->stored_len += st->st_size;
+
+	if (st->st_size == 0) {
+		/* Created, but not yet written. */
+		du_account_mtime(du, w, st->st_mtime);
+		return 0;
+	}
+	if ((h = du_get_hdr(w)) == NULL) {
+		return -1;
+	}
+	if ((fd = open(ent->vpath, O_RDONLY)) == -1) {
+		return -1;
+	}
+#if defined(POSIX_FADV_RANDOM)
+	/* Only the header is needed: avoid the read-ahead of the data. */
+	(void)posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+#endif
+	if ((h->path = strdup(ent->path)) == NULL) {
+		close(fd);
+		return -1;
+	}
+	h->du = du;
+	h->w = w;
+	h->dir = dir - w->dirs;
+	h->fd = fd;
+
+	/* Note: the completion may be invoked right away. */
+	if (fs_io_pread(w->io, fd, h->buf, FILEOBJ_HDR_LEN, 0, h) == -1) {
+		free(h->path);
+		h->path = NULL;
+		h->fd = -1;
+		close(fd);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+du_walk_entry(void *arg, const rvault_walk_ent_t *ent)
+{
+	du_t *du = arg;
+	du_worker_t *w = &du->workers[ent->worker];
+	du_dir_t *dir;
+
+	if ((dir = du_get_parent(w, ent)) == NULL) {
+		return -1;
+	}
+	if (S_ISDIR(ent->st->st_mode)) {
+		/* Count first: adding a record may move the array. */
+		dir->ndirs++;
+
+		/* Make sure the empty directories have a record too. */
+		if (du_dir_add(w, ent->path, strlen(ent->path),
+		    ent->depth) == NULL) {
+			return -1;
+		}
+		return 0;
+	}
+	if (S_ISREG(ent->st->st_mode) &&
+	    du_account_file(du, w, dir, ent) == -1) {
+		app_elog(LOG_WARNING, "could not read `%s'", ent->path);
+		w->nerrors++;
+	}
+	return 0;
+}
+
+static void
+du_dir_merge(du_dir_t *dst, const du_dir_t *src)
+{
+	dst->plain_len += src->plain_len;
+	dst->stored_len += src->stored_len;
+	dst->nfiles += src->nfiles;
+	dst->ndirs += src->ndirs;
+	dst->nlz4 += src->nlz4;
+}
+
+/*
+ * du_collect: merge the records of the workers, sort them and compute
+ * the cumulative values, i.e. include the sub-directories.
+ */
+static du_dir_t *
+du_collect(du_t *du, size_t *ndirsp)
+{
+	size_t ndirs = 0, n = 0;
+	du_dir_t *dirs;
+
+	for (unsigned i = 0; i < du->nworkers; i++) {
+		ndirs += du->workers[i].ndirs;
+	}
+	if ((dirs = calloc(ndirs + 1, sizeof(du_dir_t))) == NULL) {
+		return NULL;
+	}
+	for (unsigned i = 0; i < du->nworkers; i++) {
+		du_worker_t *w = &du->workers[i];
+
+		if (w->ndirs) {
+			memcpy(&dirs[n], w->dirs, w->ndirs * sizeof(du_dir_t));
+			n += w->ndirs;
+			w->ndirs = 0;
+		}
+	}
+	qsort(dirs, ndirs, sizeof(du_dir_t), du_dircmp);
+
+	/*
+	 * A directory may have more than one record, since it is both
+	 * an entry and a directory processed by (possibly) another worker.
+	 */
+	n = 0;
+	for (size_t i = 0; i < ndirs; i++) {
+		if (n && strcmp(dirs[n - 1].path, dirs[i].path) == 0) {
+			du_dir_merge(&dirs[n - 1], &dirs[i]);
+			free(dirs[i].path);
+			continue;
+		}
+		dirs[n++] = dirs[i];
+	}
+	ndirs = n;
+
+	/*
+	 * The descendants sort after their parent, so iterate backwards
+	 * adding the (already cumulative) values to the parent.
+	 */
+	for (size_t i = ndirs; i-- > 1;) {
+		du_dir_t *dir = &dirs[i], *parent, key;
+		char *p;
+
+		if ((p = strrchr(dir->path, '/')) == NULL) {
+			continue;
+		}
+		*p = '\0';
+		key.path = dir->path;
+		parent = bsearch(&key, dirs, i, sizeof(du_dir_t), du_dircmp);
+		*p = '/';
+
+		if (parent) {
+			du_dir_merge(parent, dir);
+		}
+	}
+	*ndirsp = ndirs;
+	return dirs;
+}
+
+static const char *
+du_fmt_size(char *buf, size_t len, uint64_t size, bool bytes)
+{
+	static const char units[] = "BKMGTPE";
+	double val = size;
+	unsigned i = 0;
+
+	if (bytes) {
+		snprintf(buf, len, "%" PRIu64, size);
+		return buf;
+	}
+	while (val >= 1024 && i < sizeof(units) - 2) {
+		val /= 1024;
+		i++;
+	}
+	snprintf(buf, len, i ? "%.1f%c" : "%.0f%c", val, units[i]);
+	return buf;
+}
+
+static void
+du_print_dir(const du_dir_t *dir, bool bytes)
+{
+	char plain[32], stored[32], ratio[16];
+
+	if (dir->stored_len) {
+		snprintf(ratio, sizeof(ratio), "%.2f",
+		    (double)dir->plain_len / dir->stored_len);
+	} else {
+		snprintf(ratio, sizeof(ratio), "-");
+	}
+	printf("%10s %10s %6s %8" PRIu64 " %8" PRIu64 " %8" PRIu64 "  %s\n",
+	    du_fmt_size(plain, sizeof(plain), dir->plain_len, bytes),
+	    du_fmt_size(stored, sizeof(stored), dir->stored_len, bytes),
+	    ratio, dir->nfiles, dir->nlz4, dir->ndirs,
+	    *dir->path ? dir->path : "/");
+}
+
+static void
+du_print_hist(const du_t *du)
+{
+	uint64_t hist[DU_MTIME_NBUCKETS], total = 0;
+
+	memset(hist, 0, sizeof(hist));
+	for (unsigned i = 0; i < du->nworkers; i++) {
+		for (unsigned j = 0; j < DU_MTIME_NBUCKETS; j++) {
+			hist[j] += du->workers[i].mtime_hist[j];
+			total += du->workers[i].mtime_hist[j];
+		}
+	}
+	printf("\nModification time:\n");
+	for (unsigned j = 0; j < DU_MTIME_NBUCKETS; j++) {
+		unsigned pct = total ? (unsigned)(hist[j] * 100 / total) : 0;
+		printf("  %-10s %8" PRIu64 " %3u%%%s",
+		    du_mtime_buckets[j].label, hist[j], pct,
+		    pct / 2 ? " " : "");
+		for (unsigned k = 0; k < pct / 2; k++) {
+			putchar('#');
+		}
+		putchar('\n');
+	}
+}
+
+int
+du_cmd(const char *datapath, const char *server, int argc, char **argv)
+{
+	static const char *opts_s = "bd:j:sh?";
+	static struct option opts_l[] = {
+		{ "bytes",	no_argument,		0,	'b'	},
+		{ "max-depth",	required_argument,	0,	'd'	},
+		{ "jobs",	required_argument,	0,	'j'	},
+		{ "summarize",	no_argument,		0,	's'	},
+		{ "help",	no_argument,		0,	'h'	},
+		{ NULL,		0,			NULL,	0	}
+	};
+	unsigned nworkers = 0, max_depth = UINT_MAX;
+	bool bytes = false;
+	uint64_t nerrors = 0;
+	rvault_t *vault;
+	const char *path;
+	du_dir_t *dirs;
+	size_t ndirs;
+	du_t du;
+	int ch, ret = -1;
+
+	while ((ch = getopt_long(argc, argv, opts_s, opts_l, NULL)) != -1) {
+		switch (ch) {
+		case 'b':
+			bytes = true;
+			break;
+		case 'd':
+			if (str_to_uint(optarg, 0, UINT_MAX,
+			    &max_depth) == -1) {
+				fprintf(stderr, "invalid depth `%s'\n", optarg);
+				goto usage;
+			}
+			break;
+		case 'j':
+			if (str_to_uint(optarg, 1, UINT_MAX,
+			    &nworkers) == -1) {
+				fprintf(stderr, "invalid number of jobs `%s'\n",
+				    optarg);
+				goto usage;
+			}
+			break;
+		case 's':
+			max_depth = 0;
+			break;
+		case 'h':
+		case '?':
+		default:
+			goto usage;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	memset(&du, 0, sizeof(du));
+	du.now = time(NULL);
+	du.nworkers = nworkers ? nworkers : rvault_walk_workers();
+	du.nworkers = MIN(du.nworkers, RVAULT_WALK_MAX_WORKERS);
+	if ((du.workers = calloc(du.nworkers, sizeof(du_worker_t))) == NULL) {
+		app_elog(LOG_CRIT, APP_NAME": calloc() failed");
+		return -1;
+	}
+
+	vault = open_vault(datapath, server);
+	path = argc ? argv[0] : "/";
+	if (rvault_walk(vault, path, du.nworkers, &du, du_walk_entry) == -1) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		du_io_finish(&du);
+		goto out;
+	}
+	du_io_finish(&du);
+	if ((dirs = du_collect(&du, &ndirs)) == NULL) {
+		goto out;
+	}
+
+	printf("%10s %10s %6s %8s %8s %8s  %s\n",
+	    "PLAIN", "STORED", "RATIO", "FILES", "LZ4", "DIRS", "PATH");
+	if (ndirs == 0) {
+		/* Empty directory. */
+		du_print_dir(&(du_dir_t){ .path = __UNCONST(path) }, bytes);
+	}
+	for (size_t i = 0; i < ndirs; i++) {
+		if (dirs[i].depth <= max_depth) {
+			du_print_dir(&dirs[i], bytes);
+		}
+		free(dirs[i].path);
+	}
+	free(dirs);
+	du_print_hist(&du);
+
+	for (unsigned i = 0; i < du.nworkers; i++) {
+		nerrors += du.workers[i].nerrors;
+	}
+	if (nerrors) {
+		fprintf(stderr, "%" PRIu64 " file(s) could not be read\n",
+		    nerrors);
+		goto out;
+	}
+	ret = 0;
+out:
+	for (unsigned i = 0; i < du.nworkers; i++) {
+		du_worker_t *w = &du.workers[i];
+
+		for (size_t j = 0; j < w->ndirs; j++) {
+			free(w->dirs[j].path);
+		}
+		free(w->dirs);
+	}
+	free(du.workers);
+	rvault_close(vault);
+	return ret;
+usage:
+	fprintf(stderr,
+	    "Usage:\t" APP_NAME " du [ -b ] [ -d DEPTH ] [ -j N ] [ -s ] "
+	    "[PATH]\n"
+	    "\n"
+	    "Show the plain and stored (encrypted) size of the directories,\n"
+	    "the compression ratio, the number of files (total and\n"
+	    "compressed) and sub-directories, including the descendants.\n"
+	    "The path must represent the namespace in vault.\n"
+	    "Only the file headers are read; the data is not decrypted.\n"
+	    "\n"
+	    "Options:\n"
+	    "  -b|--bytes          Print the sizes in bytes\n"
+	    "  -d|--max-depth N    Show the directories only up to the depth\n"
+	    "  -j|--jobs N         Number of parallel workers "
+	    "(default: CPU count)\n"
+	    "  -s|--summarize      Show only the total\n"
+	    "\n"
+	);
+	return -1;
+}
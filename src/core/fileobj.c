@@ -30,6 +30,7 @@
 #include "storage.h"
 #include "crypto.h"
 #include "sys.h"
+#include "probes.h"
 #include "utils.h"
 
 /*
@@ -48,9 +49,23 @@ struct fileobj {
 	sbuffer_t	sbuf;
 	size_t		len;
 
+	/*
+	 * Data map: a bit per block which may have the data; the rest of
+	 * the blocks are holes, i.e. zeros which have not been touched.
+	 */
+	uint64_t *	dmap;
+	size_t		dmap_words;
+
 	/* Last sync time. */
 	time_t		last_stime;
 
+	/*
+	 * Keyed digest (HMAC) of the persisted data, if FOBJ_DIGEST.
+	 * Used to skip the write-back if the data did not change.
+	 */
+	unsigned char	digest[HMAC_MAX_BUFLEN];
+	size_t		digest_len;
+
 	/* Vault file-list entry. */
 	LIST_ENTRY(fileobj) entry;
 };
@@ -59,59 +74,376 @@ struct fileobj {
 #define	FOBJ_DIRTY		0x02	// data needs to be synced
 #define	FOBJ_NEED_FSYNC		0x04	// need a full fsync()
 #define	FOBJ_ALWAYS_FSYNC	0x08	// always sync / O_SYNC
+#define	FOBJ_REKEY		0x10	// encrypted with a previous key
+#define	FOBJ_DIGEST		0x20	// digest of the persisted data
 
 #define	FOBJ_MIN_SYNC_TIME	3	// in seconds
 
+#define	FOBJ_BLKSHIFT		16	// 64 KB blocks for the hole tracking
+#define	FOBJ_BLKSIZE		(UINT64_C(1) << FOBJ_BLKSHIFT)
+#define	FOBJ_NBLKS(len)		(((uint64_t)(len) + FOBJ_BLKSIZE - 1) >> \
+				FOBJ_BLKSHIFT)
+
 static int	fileobj_dataload(fileobj_t *);
 
+/*
+ * Data map (hole tracking) helpers.
+ */
+
+static inline bool
+fileobj_blk_data_p(const fileobj_t *fobj, uint64_t blk)
+{
+	const uint64_t i = blk >> 6;
+	return i < fobj->dmap_words &&
+	    (fobj->dmap[i] & (UINT64_C(1) << (blk & 63))) != 0;
+}
+
+static inline void
+fileobj_blk_clear(fileobj_t *fobj, uint64_t blk)
+{
+	ASSERT((blk >> 6) < fobj->dmap_words);
+	fobj->dmap[blk >> 6] &= ~(UINT64_C(1) << (blk & 63));
+}
+
+/*
+ * fileobj_dmap_set: mark the given range as having the data.
+ */
+static int
+fileobj_dmap_set(void *arg, uint64_t off, uint64_t len)
+{
+	fileobj_t *fobj = arg;
+	const uint64_t eblk = FOBJ_NBLKS(off + len);
+	const uint64_t nwords = (eblk + 63) >> 6;
+
+	ASSERT(len > 0);
+
+	if (nwords > fobj->dmap_words) {
+		const size_t nlen = nwords * sizeof(uint64_t);
+		const size_t olen = fobj->dmap_words * sizeof(uint64_t);
+		uint64_t *dmap;
+
+		if ((dmap = realloc(fobj->dmap, nlen)) == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		memset((uint8_t *)dmap + olen, 0, nlen - olen);
+		fobj->dmap = dmap;
+		fobj->dmap_words = nwords;
+	}
+	for (uint64_t blk = off >> FOBJ_BLKSHIFT; blk < eblk; blk++) {
+		fobj->dmap[blk >> 6] |= UINT64_C(1) << (blk & 63);
+	}
+	return 0;
+}
+
+/*
+ * fileobj_dmap_trunc: clear the blocks beyond the given length.
+ */
+static void
+fileobj_dmap_trunc(fileobj_t *fobj, size_t len)
+{
+	const uint64_t nblks = FOBJ_NBLKS(len);
+
+	for (uint64_t i = 0; i < fobj->dmap_words; i++) {
+		const uint64_t blk = i << 6;
+
+		if (blk >= nblks) {
+			fobj->dmap[i] = 0;
+		} else if (nblks - blk < 64) {
+			fobj->dmap[i] &= (UINT64_C(1) << (nblks - blk)) - 1;
+		}
+	}
+}
+
+/*
+ * fileobj_dense_p: return true if the data has no holes.
+ */
+static bool
+fileobj_dense_p(const fileobj_t *fobj)
+{
+	const uint64_t nblks = FOBJ_NBLKS(fobj->len);
+
+	for (uint64_t blk = 0; blk < nblks; blk += 64) {
+		const uint64_t n = MIN(nblks - blk, 64);
+		const uint64_t mask = (n == 64) ? UINT64_MAX :
+		    (UINT64_C(1) << n) - 1;
+
+		if ((blk >> 6) >= fobj->dmap_words ||
+		    (fobj->dmap[blk >> 6] & mask) != mask) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * fileobj_buf_free: erase the data and free the buffer.
+ *
+ * => Only the blocks with data are erased: the holes are not touched,
+ *    so they do not get backed by the memory pages.
+ */
+static void
+fileobj_buf_free(fileobj_t *fobj, sbuffer_t *sbuf)
+{
+	const uint64_t nblks = FOBJ_NBLKS(sbuf->buf_size);
+	uint8_t *buf = sbuf->buf;
+
+	if (buf == NULL) {
+		return;
+	}
+	for (uint64_t blk = 0; blk < nblks; blk++) {
+		const uint64_t off = blk << FOBJ_BLKSHIFT;
+
+		if (fileobj_blk_data_p(fobj, blk)) {
+			crypto_memzero(&buf[off],
+			    MIN(FOBJ_BLKSIZE, sbuf->buf_size - off));
+		}
+	}
+	sbuffer_release(sbuf);
+}
+
+/*
+ * fileobj_buf_resize: resize the in-memory buffer, copying only the
+ * blocks with data; the data beyond the new length is discarded.
+ */
+static int
+fileobj_buf_resize(fileobj_t *fobj, size_t nlen, unsigned flags)
+{
+	const size_t clen = MIN(fobj->len, nlen);
+	size_t bufsize = nlen;
+	uint8_t *nbuf, *buf;
+	sbuffer_t nsbuf;
+
+	if (nlen == 0) {
+		fileobj_buf_free(fobj, &fobj->sbuf);
+		fileobj_dmap_trunc(fobj, 0);
+		return 0;
+	}
+
+	/*
+	 * Grow exponentially, if requested.  Check for overflow, though.
+	 */
+	if ((flags & SBUF_GROWEXP) != 0 && nlen > fobj->sbuf.buf_size &&
+	    (nlen << 1) > nlen) {
+		bufsize <<= 1;
+	}
+	if ((nbuf = sbuffer_alloc(&nsbuf, bufsize)) == NULL) {
+		return -1;
+	}
+	buf = fobj->sbuf.buf;
+	for (uint64_t off = 0; off < clen; off += FOBJ_BLKSIZE) {
+		if (fileobj_blk_data_p(fobj, off >> FOBJ_BLKSHIFT)) {
+			memcpy(&nbuf[off], &buf[off],
+			    MIN(FOBJ_BLKSIZE, clen - off));
+		}
+	}
+	fileobj_buf_free(fobj, &fobj->sbuf);
+	fobj->sbuf = nsbuf;
+	fileobj_dmap_trunc(fobj, nlen);
+	return 0;
+}
+
+static bool
+fileobj_zero_p(const uint8_t *buf, size_t len)
+{
+	ASSERT(len > 0);
+	return buf[0] == 0 && memcmp(buf, buf + 1, len - 1) == 0;
+}
+
+/*
+ * fileobj_get_extents: get the data extents, dropping the blocks which
+ * are (no longer) holding any non-zero data.
+ *
+ * => Returns the extents, their count and the total length of the data.
+ */
+static int
+fileobj_get_extents(fileobj_t *fobj, storage_extent_t **extsp,
+    unsigned *np, size_t *dlenp)
+{
+	const uint64_t nblks = FOBJ_NBLKS(fobj->len);
+	const uint8_t *buf = fobj->sbuf.buf;
+	storage_extent_t *exts = NULL;
+	unsigned n = 0, max = 0;
+	size_t dlen = 0;
+
+	for (uint64_t blk = 0; blk < nblks; blk++) {
+		const uint64_t off = blk << FOBJ_BLKSHIFT;
+		const uint64_t len = MIN(FOBJ_BLKSIZE, fobj->len - off);
+
+		if (!fileobj_blk_data_p(fobj, blk)) {
+			continue;
+		}
+		if (fileobj_zero_p(&buf[off], len)) {
+			fileobj_blk_clear(fobj, blk);
+			continue;
+		}
+		dlen += len;
+
+		/* Extend the previous extent or add a new one. */
+		if (n && exts[n - 1].off + exts[n - 1].len == off) {
+			exts[n - 1].len += len;
+			continue;
+		}
+		if (n == max) {
+			storage_extent_t *nexts;
+
+			max = max ? (max << 1) : 16;
+			nexts = realloc(exts, max * sizeof(storage_extent_t));
+			if (nexts == NULL) {
+				free(exts);
+				errno = ENOMEM;
+				return -1;
+			}
+			exts = nexts;
+		}
+		exts[n].off = off;
+		exts[n].len = len;
+		n++;
+	}
+	*extsp = exts;
+	*np = n;
+	*dlenp = dlen;
+	return 0;
+}
+
+/*
+ * fileobj_write_data: write the data to the given file; sparse, if the
+ * data has any holes.
+ */
+static ssize_t
+fileobj_write_data(fileobj_t *fobj, int fd)
+{
+	storage_extent_t *exts;
+	ssize_t nbytes;
+	size_t dlen;
+	unsigned n;
+
+	ASSERT(fobj->len > 0);
+
+	if (fileobj_get_extents(fobj, &exts, &n, &dlen) == -1) {
+		return -1;
+	}
+	if (dlen == fobj->len) {
+		nbytes = storage_write_data(fobj->vault, fd,
+		    fobj->sbuf.buf, fobj->len);
+	} else {
+		nbytes = storage_write_sparse(fobj->vault, fd,
+		    fobj->sbuf.buf, fobj->len, exts, n);
+	}
+	free(exts);
+	return nbytes;
+}
+
 fileobj_t *
 fileobj_open(rvault_t *vault, const char *path, int flags, mode_t mode)
+{
+	return fileobj_vopen(vault, path, NULL, flags, mode);
+}
+
+/*
+ * fileobj_vopen: open the file object, given the vault path if it is
+ * already resolved (e.g. cached by the caller); otherwise, resolve the
+ * plain path.
+ */
+fileobj_t *
+fileobj_vopen(rvault_t *vault, const char *path, const char *vpath,
+    int flags, mode_t mode)
 {
 	fileobj_t *fobj;
 
-	if ((fobj = calloc(1, sizeof(fileobj_t))) == NULL) {
+	if (vault->read_only && ((flags & O_ACCMODE) != O_RDONLY ||
+	    (flags & (O_CREAT | O_TRUNC)) != 0)) {
+		errno = EROFS;
 		return NULL;
 	}
-	fobj->vpath = rvault_resolve_path(vault, path, &fobj->pathlen);
-	if (!fobj->vpath) {
-		free(fobj);
+	if ((fobj = calloc(1, sizeof(fileobj_t))) == NULL) {
 		return NULL;
 	}
-	fobj->vault = vault;
-	LIST_INSERT_HEAD(&vault->file_list, fobj, entry);
-	vault->file_count++;
-
 	if ((flags & (O_SYNC|O_DSYNC)) != 0 || !vault->weak_sync) {
 		fobj->flags |= FOBJ_ALWAYS_FSYNC;
 	}
+	fobj->vault = vault;
 
 	/*
-	 * Open the data file.
+	 * Resolve the path and open the data file.  Note: the re-keying
+	 * sweeper may be renaming the objects, therefore hold the lock.
 	 */
+	pthread_mutex_lock(&vault->lock);
+	if (vpath) {
+		fobj->vpath = strdup(vpath);
+		fobj->pathlen = strlen(vpath);
+	} else {
+		fobj->vpath = rvault_resolve_path(vault, path, &fobj->pathlen);
+	}
+	if (!fobj->vpath) {
+		pthread_mutex_unlock(&vault->lock);
+		free(fobj);
+		return NULL;
+	}
+	LIST_INSERT_HEAD(&vault->file_list, fobj, entry);
+	vault->file_count++;
 	fobj->fd = open(fobj->vpath, flags, mode);
+	pthread_mutex_unlock(&vault->lock);
+
 	if (fobj->fd == -1) {
 		fileobj_close(fobj);
 		return NULL;
 	}
+	if ((flags & O_CREAT) != 0) {
+		(void)rvault_index_add(vault, path, false);
+	}
 	app_log(LOG_DEBUG, "%s: vnode %p, data length %zu, vpath [%s]",
 	    __func__, fobj, fobj->len, fobj->vpath);
+	RVAULT_PROBE3(fileobj_open, fobj, fobj->vpath, flags);
 	return fobj;
 }
 
+/*
+ * fileobj_move: move the file object to another handle of the vault
+ * (e.g. from the handle of a background worker).
+ *
+ * => The file object must not be in use through the current handle.
+ */
+void
+fileobj_move(fileobj_t *fobj, rvault_t *vault)
+{
+	rvault_t *ovault = fobj->vault;
+
+	if (ovault == vault) {
+		return;
+	}
+	pthread_mutex_lock(&ovault->lock);
+	LIST_REMOVE(fobj, entry);
+	ASSERT(ovault->file_count > 0);
+	ovault->file_count--;
+	pthread_mutex_unlock(&ovault->lock);
+
+	pthread_mutex_lock(&vault->lock);
+	LIST_INSERT_HEAD(&vault->file_list, fobj, entry);
+	vault->file_count++;
+	pthread_mutex_unlock(&vault->lock);
+	fobj->vault = vault;
+}
+
 static int
 fileobj_dataload(fileobj_t *fobj)
 {
+	rvault_t *vault = fobj->vault;
 	ssize_t flen, nbytes;
 
 	if (fobj->flags & FOBJ_INMEM) {
 		return 0;
 	}
+	RVAULT_PROBE1(fileobj_dataload_start, fobj);
+
 	if ((flen = fs_file_size(fobj->fd)) == -1) {
 		app_elog(LOG_DEBUG, "%s: fs_file_size() failed", __func__);
+		RVAULT_PROBE3(fileobj_dataload_done, fobj, -1, -1);
 		return -1;
 	}
 	if (flen == 0) {
 		fobj->flags |= FOBJ_INMEM;
+		RVAULT_PROBE3(fileobj_dataload_done, fobj, 0, 0);
 		return 0;
 	}
 
@@ -119,31 +451,128 @@ fileobj_dataload(fileobj_t *fobj)
 	 * Initial load of the data into the memory.
 	 * Note: may return an empty buffer (if zero size)
 	 */
-	nbytes = storage_read_data(fobj->vault, fobj->fd, flen, &fobj->sbuf);
+	fileobj_dmap_trunc(fobj, 0);
+	nbytes = storage_read_extents(vault, fobj->fd, flen, &fobj->sbuf,
+	    fileobj_dmap_set, fobj);
 	if (nbytes == -1) {
-		app_elog(LOG_ERR, "%s: storage_read_data() failed", __func__);
+		app_elog(LOG_ERR, "%s: storage_read_extents() failed",
+		    __func__);
+		RVAULT_PROBE3(fileobj_dataload_done, fobj, flen, -1);
 		return -1;
 	}
 	ASSERT(fobj->len == 0 || fobj->sbuf.buf);
 	fobj->len = nbytes;
 	fobj->flags |= FOBJ_INMEM;
+
+	/*
+	 * If the vault is being re-keyed and the object was encrypted
+	 * with a previous key, then re-encrypt it on the next sync
+	 * (unless the vault is read-only).
+	 */
+	if (vault->prev_key_count && !vault->read_only) {
+		unsigned char buf[FILEOBJ_HDR_LEN];
+		fileobj_hdr_t *hdr = (void *)buf;
+
+		if (storage_read_hdr(fobj->fd, hdr) == 0 &&
+		    FILEOBJ_KEY_EPOCH(hdr) != vault->key_epoch) {
+			fobj->flags |= FOBJ_REKEY;
+		}
+	}
+	RVAULT_PROBE3(fileobj_dataload_done, fobj, flen, nbytes);
 	return 0;
 }
 
 /*
- * fileobj_sync: sync the data to the backing store.
+ * fileobj_digest: compute the keyed digest of the in-memory data.
  */
-int
-fileobj_sync(fileobj_t *fobj, int stype)
+static ssize_t
+fileobj_digest(fileobj_t *fobj, unsigned char digest[static HMAC_MAX_BUFLEN])
+{
+	ASSERT(fobj->len > 0);
+	return crypto_hmac(fobj->vault->crypto,
+	    fobj->sbuf.buf, fobj->len, digest);
+}
+
+/*
+ * fileobj_digest_clean: take the digest of the clean data, before it is
+ * modified or discarded; returns true if the digest of the persisted data
+ * is valid (see fileobj_unchanged_p()).
+ */
+static bool
+fileobj_digest_clean(fileobj_t *fobj)
+{
+	ssize_t dlen;
+
+	if ((fobj->flags & FOBJ_DIGEST) != 0) {
+		return true;
+	}
+	if ((fobj->flags & FOBJ_DIRTY) != 0 || fobj->len == 0 ||
+	    !fileobj_dense_p(fobj)) {
+		return false;
+	}
+	if ((dlen = fileobj_digest(fobj, fobj->digest)) == -1) {
+		return false;
+	}
+	fobj->digest_len = fobj->len;
+	fobj->flags |= FOBJ_DIGEST;
+	return true;
+}
+
+/*
+ * fileobj_unchanged_p: check whether the data is the same as persisted,
+ * i.e. the write-back can be skipped.  Otherwise, keep the new digest,
+ * but it becomes valid only once the data is persisted.
+ *
+ * => The digest of the persisted data is taken before it is modified
+ *    in place (see fileobj_pwrite()) or truncated (see fileobj_setsize());
+ *    a different length means that the data changed, therefore no need
+ *    to compute it in such case.
+ */
+static bool
+fileobj_unchanged_p(fileobj_t *fobj, bool *digested)
+{
+	unsigned char digest[HMAC_MAX_BUFLEN];
+	ssize_t dlen;
+
+	if ((fobj->flags & FOBJ_DIGEST) == 0 || fobj->len != fobj->digest_len) {
+		fobj->flags &= ~FOBJ_DIGEST;
+		return false;
+	}
+	if ((dlen = fileobj_digest(fobj, digest)) == -1) {
+		fobj->flags &= ~FOBJ_DIGEST;
+		return false;
+	}
+	if ((size_t)dlen <= sizeof(fobj->digest) &&
+	    memcmp(fobj->digest, digest, dlen) == 0) {
+		return true;
+	}
+
+	memcpy(fobj->digest, digest, dlen);
+	fobj->digest_len = fobj->len;
+	fobj->flags &= ~FOBJ_DIGEST;
+	*digested = true;
+	return false;
+}
+
+/*
+ * fileobj_writeback: sync the data to the backing store; sets the
+ * outcome of the sync and the number of bytes written (for the probes).
+ */
+static int
+fileobj_writeback(fileobj_t *fobj, int stype, const char **outcome,
+    ssize_t *nbytesp)
 {
 	rvault_t *vault = fobj->vault;
+	bool digested = false;
+	ssize_t nbytes;
 	char *fpath;
 	int fd, e;
 
 	/*
 	 * Check if there is anything to sync.
 	 */
-	if ((fobj->flags & FOBJ_DIRTY) == 0) {
+	if ((fobj->flags & (FOBJ_DIRTY | FOBJ_REKEY)) == 0) {
+		*outcome = "clean";
 		goto out;
 	}
 
@@ -154,6 +583,23 @@ fileobj_sync(fileobj_t *fobj, int stype)
 		if (ftruncate(fobj->fd, 0) == -1) {
 			return -1;
 		}
+		fobj->flags &= ~FOBJ_DIGEST;
+		*outcome = "truncate";
+		goto out;
+	}
+
+	/*
+	 * Skip the write-back if the data is the same as persisted
+	 * (e.g. the file was rewritten with the identical content).
+	 */
+	if ((fobj->flags & FOBJ_REKEY) != 0) {
+		/* Re-encrypting anyway. */
+		fobj->flags &= ~FOBJ_DIGEST;
+	} else if (fileobj_unchanged_p(fobj, &digested)) {
+		fobj->flags &= ~FOBJ_DIRTY;
+		atomic_fetch_add(&vault->stats.nsyncs_skipped, 1);
+		app_log(LOG_DEBUG, "%s: vnode %p unchanged", __func__, fobj);
+		*outcome = "unchanged";
 		goto out;
 	}
 
@@ -174,28 +620,36 @@ fileobj_sync(fileobj_t *fobj, int stype)
 	 *
 	 * Note: must sync the directory too.
 	 */
-	if (storage_write_data(vault, fd, fobj->sbuf.buf, fobj->len) == -1) {
-		app_elog(LOG_DEBUG, "%s: storage_write_data() failed", __func__);
+	if ((nbytes = fileobj_write_data(fobj, fd)) == -1) {
+		app_elog(LOG_DEBUG, "%s: fileobj_write_data() failed", __func__);
 		errno = EIO;
 		goto err;
 	}
+	pthread_mutex_lock(&vault->lock);
 	if (rename(fpath, fobj->vpath) == -1) {
+		pthread_mutex_unlock(&vault->lock);
 		app_elog(LOG_ERR, "%s: rename() failed", __func__);
 		goto err;
 	}
+	pthread_mutex_unlock(&vault->lock);
 	free(fpath);
 
 	/*
 	 * Update the file descriptor; mark the object as no longer dirty.
 	 */
-	fobj->flags &= ~FOBJ_DIRTY;
+	fobj->flags &= ~(FOBJ_DIRTY | FOBJ_REKEY);
+	fobj->flags |= digested ? FOBJ_DIGEST : 0;
 	close(fobj->fd);
 	fobj->fd = fd;
+	atomic_fetch_add(&vault->stats.nsyncs, 1);
+	*outcome = "writeback";
+	*nbytesp = nbytes;
 
 	app_log(LOG_DEBUG, "%s: vnode %p write-back complete", __func__, fobj);
 out:
 	if (stype == FOBJ_FULLSYNC && (fobj->flags & FOBJ_NEED_FSYNC) != 0) {
 		fs_sync(fobj->fd, fobj->vpath);
+		atomic_fetch_add(&vault->stats.nfsyncs, 1);
 		fobj->flags &= ~FOBJ_NEED_FSYNC;
 		app_log(LOG_DEBUG, "%s: vnode %p full-sync", __func__, fobj);
 	}
@@ -207,29 +661,333 @@ err:
 		free(fpath);
 	}
 	close(fd);
+
+	/*
+	 * Re-keying alone is opportunistic: the sweeper will retry.
+	 */
+	if ((fobj->flags & (FOBJ_DIRTY | FOBJ_REKEY)) == FOBJ_REKEY) {
+		fobj->flags &= ~FOBJ_REKEY;
+		return 0;
+	}
 	errno = e;
 	return -1;
 }
 
+/*
+ * fileobj_sync: sync the data to the backing store.
+ */
+int
+fileobj_sync(fileobj_t *fobj, int stype)
+{
+	const char *outcome = "error";
+	ssize_t nbytes = 0;
+	int ret;
+
+	RVAULT_PROBE2(fileobj_sync_start, fobj, stype);
+	ret = fileobj_writeback(fobj, stype, &outcome, &nbytes);
+	RVAULT_PROBE3(fileobj_sync_done, fobj, outcome, nbytes);
+	return ret;
+}
+
+/*
+ * fileobj_inuse_p: check whether the given vault path, or any path
+ * under it, is currently open.
+ *
+ * => The caller must hold the vault lock.
+ */
+bool
+fileobj_inuse_p(rvault_t *vault, const char *vpath)
+{
+	const size_t len = strlen(vpath);
+	fileobj_t *fobj;
+
+	LIST_FOREACH(fobj, &vault->file_list, entry) {
+		if (strncmp(fobj->vpath, vpath, len) == 0 &&
+		    (fobj->vpath[len] == '\0' || fobj->vpath[len] == '/')) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * fileobj_reload: discard the in-memory data and reopen the object, as
+ * it was replaced on disk.
+ *
+ * => The caller must hold the vault lock.
+ */
+static int
+fileobj_reload(fileobj_t *fobj)
+{
+	int fd;
+
+	if ((fd = open(fobj->vpath, O_RDWR)) == -1) {
+		return -1;
+	}
+	close(fobj->fd);
+	fobj->fd = fd;
+
+	fileobj_buf_free(fobj, &fobj->sbuf);
+	fileobj_dmap_trunc(fobj, 0);
+	fobj->len = 0;
+	fobj->flags &= ~(FOBJ_INMEM | FOBJ_DIRTY | FOBJ_REKEY | FOBJ_DIGEST);
+	return 0;
+}
+
+/*
+ * fileobj_clone: copy the file by cloning its encrypted object.
+ *
+ * => The object header is the only associated data, i.e. the object is
+ *    not bound to its path, therefore the ciphertext is reused as is,
+ *    without decrypting or re-encrypting the data.
+ * => The data is cloned (reflink) if the backing file system supports
+ *    it, otherwise copied in the kernel (see fs_copy_file()).
+ * => The source is synced first, if open and dirty; the target, if
+ *    open, is reloaded.
+ */
+int
+fileobj_clone(rvault_t *vault, const char *src, const char *dst)
+{
+	char *svpath = NULL, *dvpath = NULL, *tpath = NULL;
+	int sfd = -1, dfd = -1, ret = -1;
+	fileobj_t *fobj;
+	struct stat st;
+	size_t dlen;
+
+	if (vault->read_only) {
+		errno = EROFS;
+		return -1;
+	}
+	pthread_mutex_lock(&vault->lock);
+	svpath = rvault_resolve_path(vault, src, NULL);
+	dvpath = rvault_resolve_path(vault, dst, &dlen);
+	if (svpath == NULL || dvpath == NULL) {
+		pthread_mutex_unlock(&vault->lock);
+		goto out;
+	}
+
+	/*
+	 * Write back the source, so the object is up to date.
+	 */
+again:
+	LIST_FOREACH(fobj, &vault->file_list, entry) {
+		if ((fobj->flags & FOBJ_DIRTY) == 0 ||
+		    strcmp(fobj->vpath, svpath) != 0) {
+			continue;
+		}
+		pthread_mutex_unlock(&vault->lock);
+		if (fileobj_sync(fobj, FOBJ_WRITEBACK) == -1) {
+			goto out;
+		}
+		pthread_mutex_lock(&vault->lock);
+		goto again;
+	}
+	pthread_mutex_unlock(&vault->lock);
+
+	/*
+	 * Copy the object into a temporary file and atomically replace
+	 * the target.
+	 */
+	if ((sfd = open(svpath, O_RDONLY)) == -1 || fstat(sfd, &st) == -1) {
+		goto out;
+	}
+	if (!S_ISREG(st.st_mode)) {
+		errno = S_ISDIR(st.st_mode) ? EISDIR : EINVAL;
+		goto out;
+	}
+	if ((tpath = tmpfile_get_name(dvpath)) == NULL) {
+		goto out;
+	}
+	if ((dfd = open(tpath, O_CREAT | O_EXCL | O_RDWR,
+	    st.st_mode & ALLPERMS)) == -1) {
+		goto out;
+	}
+	if (fs_copy_file(sfd, dfd, st.st_size) == -1) {
+		app_elog(LOG_ERR, "%s: copy to `%s' failed", __func__, tpath);
+		unlink(tpath);
+		goto out;
+	}
+	if (!vault->weak_sync) {
+		fs_sync(dfd, NULL);
+	}
+
+	pthread_mutex_lock(&vault->lock);
+	if (rename(tpath, dvpath) == -1) {
+		pthread_mutex_unlock(&vault->lock);
+		unlink(tpath);
+		goto out;
+	}
+	LIST_FOREACH(fobj, &vault->file_list, entry) {
+		if (strcmp(fobj->vpath, dvpath) == 0 &&
+		    fileobj_reload(fobj) == -1) {
+			app_elog(LOG_ERR, "%s: reload failed", __func__);
+		}
+	}
+	pthread_mutex_unlock(&vault->lock);
+
+	if (!vault->weak_sync) {
+		fs_sync(-1, dvpath);
+	}
+	(void)rvault_index_add(vault, dst, false);
+	ret = 0;
+out:
+	if (dfd != -1) {
+		close(dfd);
+	}
+	if (sfd != -1) {
+		close(sfd);
+	}
+	if (dvpath) {
+		crypto_memzero(dvpath, dlen);
+		free(dvpath);
+	}
+	free(svpath);
+	free(tpath);
+	return ret;
+}
+
+/*
+ * fileobj_truncate: truncate the file at the given path.
+ *
+ * => If the file is open, then its file object is used rather than
+ *    loading the data into a separate one.
+ * => Truncating to zero replaces the object with an empty file, i.e.
+ *    the data is never decrypted; the open file objects are reloaded.
+ */
+int
+fileobj_truncate(rvault_t *vault, const char *path, size_t len)
+{
+	fileobj_t *fobj;
+	char *vpath;
+	size_t vlen;
+	int fd, ret;
+
+	if (vault->read_only) {
+		errno = EROFS;
+		return -1;
+	}
+	pthread_mutex_lock(&vault->lock);
+	if ((vpath = rvault_resolve_path(vault, path, &vlen)) == NULL) {
+		pthread_mutex_unlock(&vault->lock);
+		return -1;
+	}
+	if (len == 0) {
+		ret = -1;
+		if ((fd = open(vpath, O_WRONLY | O_TRUNC)) == -1) {
+			pthread_mutex_unlock(&vault->lock);
+			goto out;
+		}
+		LIST_FOREACH(fobj, &vault->file_list, entry) {
+			if (strcmp(fobj->vpath, vpath) == 0 &&
+			    fileobj_reload(fobj) == -1) {
+				app_elog(LOG_ERR, "%s: reload failed",
+				    __func__);
+			}
+		}
+		pthread_mutex_unlock(&vault->lock);
+		if (!vault->weak_sync) {
+			fs_sync(fd, vpath);
+		}
+		close(fd);
+		ret = 0;
+		goto out;
+	}
+	LIST_FOREACH(fobj, &vault->file_list, entry) {
+		if (strcmp(fobj->vpath, vpath) == 0) {
+			break;
+		}
+	}
+	pthread_mutex_unlock(&vault->lock);
+
+	if (fobj) {
+		ret = fileobj_setsize(fobj, len);
+		goto out;
+	}
+	if ((fobj = fileobj_open(vault, path, O_WRONLY, FOBJ_OMASK)) == NULL) {
+		ret = -1;
+		goto out;
+	}
+	if ((ret = fileobj_setsize(fobj, len)) == -1) {
+		const int e = errno;
+		fileobj_close(fobj);
+		errno = e;
+		goto out;
+	}
+	fileobj_close(fobj);
+out:
+	crypto_memzero(vpath, vlen);
+	free(vpath);
+	return ret;
+}
+
 int
 fileobj_stat(rvault_t *vault, const char *path, struct stat *st)
 {
-	int fd, ret = -1;
 	char *vpath;
+	int ret;
 
 	if ((vpath = rvault_resolve_path(vault, path, NULL)) == NULL) {
 		return -1;
 	}
-	if ((fd = open(vpath, O_RDONLY)) == -1) {
-		app_log(LOG_DEBUG, "%s: open `%s' failed", __func__, vpath);
-		free(vpath);
+	ret = fileobj_vstat(vault, vpath, st);
+	free(vpath);
+	return ret;
+}
+
+/*
+ * fileobj_vstat: get the file attributes given the vault path; the size
+ * of a regular file is the length of its (plain) data.
+ */
+int
+fileobj_vstat(rvault_t *vault, const char *vpath, struct stat *st)
+{
+	return fileobj_statat(vault, AT_FDCWD, vpath, st);
+}
+
+/*
+ * fileobj_fstat: get the file attributes of the open file object.
+ *
+ * => If the data is in memory, then its length is the size, as it might
+ *    not be written back yet (e.g. a deferred truncation); otherwise, the
+ *    length is read from the header, i.e. the data is not loaded.
+ */
+int
+fileobj_fstat(fileobj_t *fobj, struct stat *st)
+{
+	ssize_t size;
+
+	if (fstat(fobj->fd, st) == -1) {
 		return -1;
 	}
-	free(vpath);
+	if ((fobj->flags & FOBJ_INMEM) != 0) {
+		st->st_size = fobj->len;
+		return 0;
+	}
+	if (st->st_size > 0) {
+		if ((size = storage_read_length(fobj->vault, fobj->fd)) == -1) {
+			return -1;
+		}
+		st->st_size = size;
+	}
+	return 0;
+}
 
-	if (fstat(fd, st) == -1) {
-		app_log(LOG_DEBUG, "%s: fstat `%s' failed", __func__, vpath);
-		goto err;
+/*
+ * fileobj_statat: get the file attributes of the file object relative
+ * to the directory descriptor (e.g. of a directory being listed).
+ *
+ * => The header is read only for the non-empty regular files.
+ */
+int
+fileobj_statat(rvault_t *vault, int dirfd, const char *vpath,
+    struct stat *st)
+{
+	ssize_t size;
+	int fd;
+
+	if (fstatat(dirfd, vpath, st, AT_SYMLINK_NOFOLLOW) == -1) {
+		app_log(LOG_DEBUG, "%s: fstatat `%s' failed", __func__, vpath);
+		return -1;
 	}
 
 	/*
@@ -237,26 +995,28 @@ fileobj_stat(rvault_t *vault, const char *path, struct stat *st)
 	 */
 	if (((st->st_mode & S_IFMT) & ~(S_IFDIR | S_IFREG)) != 0) {
 		errno = ENOENT;
-		goto err;
+		return -1;
 	}
 
 	/*
 	 * Regular and non-empty files are encrypted.
 	 */
 	if ((st->st_mode & S_IFMT) == S_IFREG && st->st_size > 0) {
-		ssize_t size;
-
-		if ((size = storage_read_length(vault, fd)) == -1) {
-			goto err;
+		if ((fd = openat(dirfd, vpath, O_RDONLY)) == -1) {
+			app_log(LOG_DEBUG, "%s: open `%s' failed",
+			    __func__, vpath);
+			return -1;
+		}
+		size = storage_read_length(vault, fd);
+		close(fd);
+		if (size == -1) {
+			return -1;
 		}
 		st->st_size = size;
 	}
-	app_log(LOG_DEBUG, "%s: path `%s', size %zu",
-	    __func__, path, st->st_size);
-	ret = 0;
-err:
-	close(fd);
-	return ret;
+	app_log(LOG_DEBUG, "%s: vpath `%s', size %zu",
+	    __func__, vpath, st->st_size);
+	return 0;
 }
 
 void
@@ -266,6 +1026,7 @@ fileobj_close(fileobj_t *fobj)
 	unsigned retry = 3;
 
 	app_log(LOG_DEBUG, "%s: vnode %p", __func__, fobj);
+	RVAULT_PROBE1(fileobj_close, fobj);
 
 	/* Sync any data before closing. */
 	while (fileobj_sync(fobj, FOBJ_FULLSYNC) == -1 && retry--) {
@@ -273,9 +1034,11 @@ fileobj_close(fileobj_t *fobj)
 	}
 
 	/* Remove itself from the file list. */
+	pthread_mutex_lock(&vault->lock);
 	LIST_REMOVE(fobj, entry);
 	ASSERT(vault->file_count > 0);
 	vault->file_count--;
+	pthread_mutex_unlock(&vault->lock);
 
 	if (fobj->vpath) {
 		ASSERT(fobj->pathlen > 0);
@@ -285,8 +1048,9 @@ fileobj_close(fileobj_t *fobj)
 	if (fobj->len) {
 		ASSERT(fobj->sbuf.buf != NULL);
 		ASSERT(fobj->sbuf.buf_size >= fobj->len);
-		sbuffer_free(&fobj->sbuf);
 	}
+	fileobj_buf_free(fobj, &fobj->sbuf);
+	free(fobj->dmap);
 	if (fobj->fd > 0) {
 		close(fobj->fd);
 	}
@@ -295,6 +1059,25 @@ fileobj_close(fileobj_t *fobj)
 
 ssize_t
 fileobj_pread(fileobj_t *fobj, void *buf, size_t len, off_t offset)
+{
+	const void *data;
+	ssize_t nbytes;
+
+	if ((nbytes = fileobj_pread_buf(fobj, &data, len, offset)) > 0) {
+		memcpy(buf, data, nbytes);
+	}
+	return nbytes;
+}
+
+/*
+ * fileobj_pread_buf: get the data, without copying it, i.e. a pointer
+ * to the in-memory buffer of the file object.
+ *
+ * => The pointer is valid until the next operation on the file object.
+ */
+ssize_t
+fileobj_pread_buf(fileobj_t *fobj, const void **bufp, size_t len,
+    off_t offset)
 {
 	size_t nbytes;
 	uint8_t *fbuf;
@@ -313,17 +1096,54 @@ fileobj_pread(fileobj_t *fobj, void *buf, size_t len, off_t offset)
 
 	fbuf = fobj->sbuf.buf;
 	nbytes = MIN(fobj->len - offset, len);
-	memcpy(buf, &fbuf[offset], nbytes);
+	*bufp = &fbuf[offset];
 
 	app_log(LOG_DEBUG, "%s: vnode %p, read [%jd:%zu] -> %zd",
 	    __func__, fobj, (intmax_t)offset, len, nbytes);
 	return (size_t)nbytes;
 }
 
+/*
+ * fileobj_load: load (decrypt) the data into the memory, ahead of the
+ * first access.
+ */
+int
+fileobj_load(fileobj_t *fobj)
+{
+	if (fileobj_dataload(fobj) == -1) {
+		errno = EIO;
+		return -1;
+	}
+	return 0;
+}
+
+static ssize_t
+fileobj_copy_mem(void *arg, void *buf, size_t len)
+{
+	memcpy(buf, arg, len);
+	return len;
+}
+
 ssize_t
 fileobj_pwrite(fileobj_t *fobj, const void *buf, size_t len, off_t offset)
 {
+	return fileobj_pwrite_copy(fobj, fileobj_copy_mem,
+	    (void *)(uintptr_t)buf, len, offset);
+}
+
+/*
+ * fileobj_pwrite_copy: write the data, which is copied into the buffer
+ * of the file object by the given function (e.g. directly from a pipe).
+ *
+ * => If the data is copied partially, then only that part is written.
+ */
+ssize_t
+fileobj_pwrite_copy(fileobj_t *fobj, fileobj_copy_t copyfn, void *arg,
+    size_t len, off_t offset)
+{
+	const size_t olen = fobj->len;
 	uint64_t endoff;
+	ssize_t nbytes;
 	uint8_t *fbuf;
 
 	endoff = offset + len - 1;
@@ -340,6 +1160,14 @@ fileobj_pwrite(fileobj_t *fobj, const void *buf, size_t len, off_t offset)
 		return -1;
 	}
 
+	/*
+	 * If the clean data is modified in place, then take the digest
+	 * of it first, to detect the rewrites with the same content.
+	 */
+	if (endoff < fobj->len) {
+		(void)fileobj_digest_clean(fobj);
+	}
+
 	/*
 	 * Expand the memory buffer.
 	 */
@@ -352,7 +1180,7 @@ fileobj_pwrite(fileobj_t *fobj, const void *buf, size_t len, off_t offset)
 		 * exponentially.
 		 */
 		if (endoff >= fobj->sbuf.buf_size &&
-		    sbuffer_move(&fobj->sbuf, nlen, SBUF_GROWEXP) == NULL) {
+		    fileobj_buf_resize(fobj, nlen, SBUF_GROWEXP) == -1) {
 			errno = ENOMEM;
 			return -1;
 		}
@@ -366,7 +1194,27 @@ fileobj_pwrite(fileobj_t *fobj, const void *buf, size_t len, off_t offset)
 	/*
 	 * Write the data to the buffer.
 	 */
-	memcpy(&fbuf[offset], buf, len);
+	if (fileobj_dmap_set(fobj, offset, len) == -1) {
+		return -1;
+	}
+	if ((nbytes = copyfn(arg, &fbuf[offset], len)) != (ssize_t)len) {
+		const size_t clen = nbytes > 0 ? nbytes : 0;
+
+		/*
+		 * Short copy: trim the expansion, keeping the data past
+		 * the length zeroed.
+		 */
+		if (offset + clen < fobj->len && fobj->len > olen) {
+			const size_t nlen = MAX(olen, offset + clen);
+
+			memset(&fbuf[nlen], 0, fobj->len - nlen);
+			fobj->len = nlen;
+		}
+		if (nbytes <= 0) {
+			return -1;
+		}
+		len = nbytes;
+	}
 	fobj->flags |= (FOBJ_DIRTY | FOBJ_NEED_FSYNC);
 
 	app_log(LOG_DEBUG, "%s: vnode %p, write [%jd:%zu]",
@@ -405,24 +1253,46 @@ fileobj_getsize(fileobj_t *fobj)
 int
 fileobj_setsize(fileobj_t *fobj, size_t len)
 {
-	if (fileobj_dataload(fobj) == -1) {
+	bool deferred = false;
+
+	if (len == 0) {
+		/*
+		 * Discard the data.  If it is clean, then take its digest
+		 * first, so that rewriting the same content (e.g. O_TRUNC
+		 * followed by the writes) skips the write-back.  In such
+		 * case, the truncation is persisted on the next sync, as
+		 * the writes are.
+		 */
+		if ((fobj->flags & (FOBJ_DIRTY | FOBJ_DIGEST)) == 0 &&
+		    fileobj_dataload(fobj) == 0) {
+			deferred = fileobj_digest_clean(fobj);
+		} else {
+			deferred = (fobj->flags & FOBJ_DIGEST) != 0;
+		}
+		fileobj_buf_free(fobj, &fobj->sbuf);
+		fileobj_dmap_trunc(fobj, 0);
+		fobj->flags |= FOBJ_INMEM;
+	} else if (fileobj_dataload(fobj) == -1) {
 		app_elog(LOG_DEBUG, "%s: fileobj_dataload() failed", __func__);
 		errno = EIO;
 		return -1;
 	}
 
 	/*
-	 * Note: if new length is zero, then sbuffer_move() will free the
-	 * old buffer and will return NULL.
+	 * Note: the extended range is a hole, i.e. it is not touched.
+	 * The buffer might have been pre-allocated (see fileobj_allocate()),
+	 * in which case the memory beyond the data length is zeroed.
 	 */
-	if (len && sbuffer_move(&fobj->sbuf, len, 0) == NULL) {
-		app_elog(LOG_DEBUG, "%s: sbuffer_move() failed", __func__);
+	if ((len <= fobj->len || len > fobj->sbuf.buf_size) &&
+	    fileobj_buf_resize(fobj, len, 0) == -1) {
+		app_elog(LOG_DEBUG, "%s: fileobj_buf_resize() failed",
+		    __func__);
 		return -1;
 	}
 	fobj->len = len;
 	fobj->flags |= (FOBJ_DIRTY | FOBJ_NEED_FSYNC);
 
-	if (fileobj_sync(fobj, FOBJ_WRITEBACK) == -1) {
+	if (!deferred && fileobj_sync(fobj, FOBJ_WRITEBACK) == -1) {
 		app_elog(LOG_DEBUG, "%s: fileobj_sync() failed", __func__);
 		return -1;
 	}
@@ -430,3 +1300,80 @@ fileobj_setsize(fileobj_t *fobj, size_t len)
 	app_log(LOG_DEBUG, "%s: vnode %p, size %zu", __func__, fobj, fobj->len);
 	return 0;
 }
+
+/*
+ * fileobj_allocate: pre-allocate the buffer for the given range, so
+ * that the subsequent writes within it neither re-allocate nor copy;
+ * see fallocate(2).
+ *
+ * => The file is extended, unless FOBJ_ALLOC_KEEP_SIZE is set; the
+ *    extended range is a hole, therefore it is neither stored nor
+ *    encrypted until written.
+ */
+int
+fileobj_allocate(fileobj_t *fobj, off_t offset, size_t len, unsigned flags)
+{
+	const uint64_t endoff = offset + len;
+
+	if (offset < 0 || len == 0 || endoff < (uint64_t)offset) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (endoff > SIZE_MAX) {
+		errno = EFBIG;
+		return -1;
+	}
+	if (fileobj_dataload(fobj) == -1) {
+		errno = EIO;
+		return -1;
+	}
+	if (endoff > fobj->sbuf.buf_size &&
+	    fileobj_buf_resize(fobj, endoff, 0) == -1) {
+		errno = ENOMEM;
+		return -1;
+	}
+	app_log(LOG_DEBUG, "%s: vnode %p, allocated [%zu]",
+	    __func__, fobj, fobj->sbuf.buf_size);
+
+	if ((flags & FOBJ_ALLOC_KEEP_SIZE) != 0 || endoff <= fobj->len) {
+		return 0;
+	}
+	return fileobj_setsize(fobj, endoff);
+}
+
+/*
+ * fileobj_seek_data: find the data, or a hole if 'hole' is true, at or
+ * after the given offset; see SEEK_DATA and SEEK_HOLE in lseek(2).
+ *
+ * => The holes are tracked at the block granularity; there is always
+ *    an implicit hole at the end of the file.
+ * => Returns -1 and sets ENXIO if there is no data beyond the offset.
+ */
+off_t
+fileobj_seek_data(fileobj_t *fobj, off_t offset, bool hole)
+{
+	uint64_t nblks, blk;
+
+	if (fileobj_dataload(fobj) == -1) {
+		errno = EIO;
+		return -1;
+	}
+	if (offset < 0 || (uint64_t)offset >= fobj->len) {
+		errno = ENXIO;
+		return -1;
+	}
+	nblks = FOBJ_NBLKS(fobj->len);
+	for (blk = offset >> FOBJ_BLKSHIFT; blk < nblks; blk++) {
+		if (fileobj_blk_data_p(fobj, blk) != hole) {
+			break;
+		}
+	}
+	if (blk == nblks) {
+		if (!hole) {
+			errno = ENXIO;
+			return -1;
+		}
+		return fobj->len;
+	}
+	return MAX(offset, (off_t)(blk << FOBJ_BLKSHIFT));
+}
@@ -15,14 +15,33 @@ enum { FOBJ_WRITEBACK, FOBJ_FULLSYNC };
 
 #define	FOBJ_OMASK	0644	// default file mask
 
+#define	FOBJ_ALLOC_KEEP_SIZE	0x01	// do not change the file size
+
+typedef ssize_t (*fileobj_copy_t)(void *, void *, size_t);
+
 fileobj_t *	fileobj_open(rvault_t *, const char *, int, mode_t);
+fileobj_t *	fileobj_vopen(rvault_t *, const char *, const char *,
+		    int, mode_t);
 void		fileobj_close(fileobj_t *);
+void		fileobj_move(fileobj_t *, rvault_t *);
+int		fileobj_load(fileobj_t *);
 ssize_t		fileobj_pread(fileobj_t *, void *, size_t, off_t);
+ssize_t		fileobj_pread_buf(fileobj_t *, const void **, size_t, off_t);
 ssize_t		fileobj_pwrite(fileobj_t *, const void *, size_t, off_t);
+ssize_t		fileobj_pwrite_copy(fileobj_t *, fileobj_copy_t, void *,
+		    size_t, off_t);
 int		fileobj_sync(fileobj_t *, int);
 size_t		fileobj_getsize(fileobj_t *);
 int		fileobj_setsize(fileobj_t *, size_t);
+int		fileobj_allocate(fileobj_t *, off_t, size_t, unsigned);
+int		fileobj_truncate(rvault_t *, const char *, size_t);
+off_t		fileobj_seek_data(fileobj_t *, off_t, bool);
+int		fileobj_clone(rvault_t *, const char *, const char *);
 
 int		fileobj_stat(rvault_t *, const char *, struct stat *);
+int		fileobj_vstat(rvault_t *, const char *, struct stat *);
+int		fileobj_fstat(fileobj_t *, struct stat *);
+int		fileobj_statat(rvault_t *, int, const char *, struct stat *);
+bool		fileobj_inuse_p(rvault_t *, const char *);
 
 #endif
@@ -0,0 +1,292 @@
+/*
+ * Copyright (c) 2020 Mindaugas Rasiukevicius <rmind at noxt eu>
+ * All rights reserved.
+ *
+ * Use is subject to license terms, as specified in the LICENSE file.
+ */
+
+/*
+ * Content search ("grep" command).
+ *
+ * The files are decrypted and searched by the parallel workers of the
+ * vault walk (see walk.c), rather than through the single-threaded FUSE
+ * loop.  A literal pattern is searched with memmem(3), which is
+ * vectorized by the C library; a regular expression is optional.
+ *
+ * => The plaintext buffer is erased and released right after matching
+ *    (only the data extents, see storage_extents_free()); only the
+ *    matching lines or paths are output.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <regex.h>
+#include <errno.h>
+
+#include "rvault.h"
+#include "storage.h"
+#include "cli.h"
+#include "utils.h"
+
+typedef struct {
+	const char *	pattern;
+	size_t		len;
+	bool		use_regex;
+	bool		icase;
+	bool		list_only;
+	regex_t		regex;
+
+	atomic_uint	nmatches;
+	atomic_uint	nerrors;
+} grep_t;
+
+/*
+ * memcasemem: case-insensitive memmem(3).
+ */
+static const void *
+memcasemem(const void *buf, size_t len, const char *pat, size_t plen)
+{
+	const unsigned char *p = buf, *end = p + len;
+	const int c0 = tolower((unsigned char)pat[0]);
+
+	while ((size_t)(end - p) >= plen) {
+		if (tolower(*p) == c0 && strncasecmp((const char *)p + 1,
+		    pat + 1, plen - 1) == 0) {
+			return p;
+		}
+		p++;
+	}
+	return NULL;
+}
+
+/*
+ * grep_match: find the first match in the buffer.
+ *
+ * => Returns the match offset or -1 if there is none.
+ */
+static ssize_t
+grep_match(grep_t *gp, const char *buf, size_t len)
+{
+	const char *p;
+
+	if (gp->use_regex) {
+		regmatch_t m;
+
+		/* Note: REG_STARTEND lets the regex operate on the buffer. */
+		m.rm_so = 0;
+		m.rm_eo = len;
+		if (regexec(&gp->regex, buf, 1, &m, REG_STARTEND) != 0) {
+			return -1;
+		}
+		return m.rm_so;
+	}
+	if (len < gp->len) {
+		return -1;
+	}
+	p = gp->icase ?
+	    memcasemem(buf, len, gp->pattern, gp->len) :
+	    memmem(buf, len, gp->pattern, gp->len);
+	return p ? (ssize_t)(p - buf) : -1;
+}
+
+/*
+ * grep_buf: search the buffer, printing the path and the matching lines.
+ *
+ * => Returns the number of matching lines.
+ */
+static unsigned
+grep_buf(grep_t *gp, const char *path, const char *buf, size_t len)
+{
+	const char *p = buf, *end = buf + len;
+	unsigned nmatches = 0;
+	ssize_t off;
+
+	if (gp->list_only || memchr(buf, '\0', len)) {
+		/* Only the path is needed (or the data is binary). */
+		if (grep_match(gp, buf, len) == -1) {
+			return 0;
+		}
+		if (gp->list_only) {
+			printf("%s\n", path);
+		} else {
+			printf("Binary file %s matches\n", path);
+		}
+		return 1;
+	}
+
+	/*
+	 * Search the whole remaining buffer rather than line by line;
+	 * on a match, print the line and continue after it.
+	 */
+	flockfile(stdout);
+	while (p < end && (off = grep_match(gp, p, end - p)) != -1) {
+		const char *m = p + off, *lstart, *lend;
+
+		lstart = m;
+		while (lstart > p && lstart[-1] != '\n') {
+			lstart--;
+		}
+		if ((lend = memchr(m, '\n', end - m)) == NULL) {
+			lend = end;
+		}
+		printf("%s:%.*s\n", path, (int)(lend - lstart), lstart);
+		nmatches++;
+		p = lend + 1;
+	}
+	funlockfile(stdout);
+	return nmatches;
+}
+
+static int
+grep_walk_entry(void *arg, const rvault_walk_ent_t *ent)
+{
+	grep_t *gp = arg;
+	const struct stat *st = ent->st;
+	storage_extents_t se = { NULL, 0, 0 };
+	sbuffer_t sbuf;
+	ssize_t nbytes;
+	int fd;
+
+	if (!S_ISREG(st->st_mode) || st->st_size == 0) {
+		return 0;
+	}
+	if ((fd = open(ent->vpath, O_RDONLY)) == -1) {
+		goto err;
+	}
+	memset(&sbuf, 0, sizeof(sbuffer_t));
+	nbytes = storage_read_extents(ent->vault, fd, st->st_size, &sbuf,
+	    storage_extents_add, &se);
+	close(fd);
+	if (nbytes == -1) {
+		storage_extents_free(&se, &sbuf);
+		goto err;
+	}
+	if (nbytes && grep_buf(gp, ent->path, sbuf.buf, nbytes)) {
+		atomic_fetch_add(&gp->nmatches, 1);
+	}
+	storage_extents_free(&se, &sbuf);
+	return 0;
+err:
+	app_elog(LOG_WARNING, "could not read `%s'", ent->path);
+	atomic_fetch_add(&gp->nerrors, 1);
+	return 0;
+}
+
+int
+grep_cmd(const char *datapath, const char *server, int argc, char **argv)
+{
+	static const char *opts_s = "Eij:lh?";
+	static struct option opts_l[] = {
+		{ "extended-regexp",	no_argument,		0,	'E' },
+		{ "ignore-case",	no_argument,		0,	'i' },
+		{ "jobs",		required_argument,	0,	'j' },
+		{ "files-with-matches",	no_argument,		0,	'l' },
+		{ "help",		no_argument,		0,	'h' },
+		{ NULL,			0,			NULL,	0   }
+	};
+	unsigned nworkers = 0;
+	rvault_t *vault;
+	const char *path;
+	grep_t gp;
+	int ch, ret;
+
+	memset(&gp, 0, sizeof(gp));
+	while ((ch = getopt_long(argc, argv, opts_s, opts_l, NULL)) != -1) {
+		switch (ch) {
+		case 'E':
+			gp.use_regex = true;
+			break;
+		case 'i':
+			gp.icase = true;
+			break;
+		case 'j':
+			if (str_to_uint(optarg, 1, UINT_MAX,
+			    &nworkers) == -1) {
+				fprintf(stderr, "invalid number of jobs `%s'\n",
+				    optarg);
+				goto usage;
+			}
+			break;
+		case 'l':
+			gp.list_only = true;
+			break;
+		case 'h':
+		case '?':
+		default:
+			goto usage;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc < 1 || (gp.len = strlen(argv[0])) == 0) {
+		goto usage;
+	}
+	gp.pattern = argv[0];
+	path = argc > 1 ? argv[1] : "/";
+
+	if (gp.use_regex) {
+		const int flags = REG_EXTENDED | REG_NEWLINE |
+		    (gp.icase ? REG_ICASE : 0);
+		char errbuf[256];
+
+		if ((ret = regcomp(&gp.regex, gp.pattern, flags)) != 0) {
+			regerror(ret, &gp.regex, errbuf, sizeof(errbuf));
+			fprintf(stderr, "invalid pattern: %s\n", errbuf);
+			return -1;
+		}
+	}
+	atomic_init(&gp.nmatches, 0);
+	atomic_init(&gp.nerrors, 0);
+
+	vault = open_vault(datapath, server);
+	if ((ret = rvault_walk(vault, path, nworkers,
+	    &gp, grep_walk_entry)) == -1) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+	}
+	rvault_close(vault);
+
+	if (gp.use_regex) {
+		regfree(&gp.regex);
+	}
+	if (atomic_load(&gp.nerrors)) {
+		fprintf(stderr, "%u file(s) could not be read\n",
+		    atomic_load(&gp.nerrors));
+	}
+
+	/* As grep(1), fail if there are no matches. */
+	return (ret == 0 && atomic_load(&gp.nmatches)) ? 0 : -1;
+usage:
+	fprintf(stderr,
+	    "Usage:\t" APP_NAME " grep [ -E ] [ -i ] [ -l ] [ -j N ] "
+	    "PATTERN [PATH]\n"
+	    "\n"
+	    "Search the files in the vault for the pattern, printing the\n"
+	    "matching lines prefixed with the path.  The files are decrypted\n"
+	    "and searched in parallel.\n"
+	    "The path must represent the namespace in vault.\n"
+	    "\n"
+	    "Options:\n"
+	    "  -E|--extended-regexp     The pattern is an extended regular "
+	    "expression\n"
+	    "  -i|--ignore-case         Ignore the case\n"
+	    "  -l|--files-with-matches  Print only the paths of the matching "
+	    "files\n"
+	    "  -j|--jobs N              Number of parallel workers "
+	    "(default: CPU count)\n"
+	    "\n"
+	);
+	return -1;
+}
@@ -0,0 +1,589 @@
+/*
+ * Copyright (c) 2020 Mindaugas Rasiukevicius <rmind at noxt eu>
+ * All rights reserved.
+ *
+ * Use is subject to license terms, as specified in the LICENSE file.
+ */
+
+/*
+ * Encrypted file name index.
+ *
+ * Locating a file by name otherwise requires decrypting every directory
+ * entry in the vault.  The index is a sorted list of the plain paths,
+ * kept in memory and stored as an encrypted object (RVAULT_INDEX_FILE).
+ * It is optional: it is maintained only if it was created (rebuilt).
+ *
+ * => The vault paths are not stored: the name encryption is deterministic,
+ *    so they are resolved from the plain paths (this also keeps the index
+ *    valid while the names are being re-keyed).
+ * => A directory sorts right before its descendants (see str_pathcmp()),
+ *    therefore a sub-tree is a contiguous range.
+ * => The changes are only made in memory, i.e. the operations do not
+ *    write the index; it is written back, if changed, on sync (e.g. on
+ *    fsync(2) in the mount) and on close.  It may become stale after a
+ *    crash; the lookups are verified by the caller and the index can be
+ *    rebuilt at any time.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <errno.h>
+
+#include "rvault.h"
+#include "storage.h"
+#include "sys.h"
+#include "utils.h"
+
+#define	INDEX_MAGIC		"rvault-index 1\n"
+#define	INDEX_MAGIC_LEN		(sizeof(INDEX_MAGIC) - 1)
+
+typedef struct {
+	char *			path;
+	bool			isdir;
+} index_ent_t;
+
+struct rvault_index {
+	index_ent_t *		ents;
+	size_t			nents;
+	size_t			maxents;
+	bool			dirty;
+
+	/* Used only while rebuilding. */
+	pthread_mutex_t		lock;
+};
+
+static int
+index_entcmp(const void *a, const void *b)
+{
+	const index_ent_t *e1 = a, *e2 = b;
+	return str_pathcmp(e1->path, e2->path);
+}
+
+static void
+index_free(rvault_index_t *idx)
+{
+	for (size_t i = 0; i < idx->nents; i++) {
+		free(idx->ents[i].path);
+	}
+	free(idx->ents);
+	pthread_mutex_destroy(&idx->lock);
+	free(idx);
+}
+
+static rvault_index_t *
+index_alloc(void)
+{
+	rvault_index_t *idx;
+
+	if ((idx = calloc(1, sizeof(rvault_index_t))) == NULL) {
+		return NULL;
+	}
+	pthread_mutex_init(&idx->lock, NULL);
+	return idx;
+}
+
+/*
+ * index_lookup: find the position of the first entry which is not less
+ * than the given path (i.e. the lower bound).
+ */
+static size_t
+index_lookup(const rvault_index_t *idx, const char *path)
+{
+	size_t lo = 0, hi = idx->nents;
+
+	while (lo < hi) {
+		const size_t mid = lo + (hi - lo) / 2;
+
+		if (str_pathcmp(idx->ents[mid].path, path) < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/*
+ * index_subtree_end: get the end of the range of the entry at the given
+ * position and its descendants.
+ */
+static size_t
+index_subtree_end(const rvault_index_t *idx, size_t i)
+{
+	const char *path = idx->ents[i].path;
+	const size_t len = strlen(path);
+
+	while (++i < idx->nents) {
+		const char *p = idx->ents[i].path;
+
+		if (strncmp(p, path, len) != 0 || p[len] != '/') {
+			break;
+		}
+	}
+	return i;
+}
+
+static void
+index_remove_range(rvault_index_t *idx, size_t start, size_t end)
+{
+	for (size_t i = start; i < end; i++) {
+		free(idx->ents[i].path);
+	}
+	memmove(&idx->ents[start], &idx->ents[end],
+	    (idx->nents - end) * sizeof(index_ent_t));
+	idx->nents -= end - start;
+}
+
+static int
+index_append(rvault_index_t *idx, const char *path, bool isdir)
+{
+	index_ent_t *ent;
+
+	if (idx->nents == idx->maxents) {
+		size_t maxents = idx->maxents ? idx->maxents * 2 : 256;
+		void *ents;
+
+		ents = realloc(idx->ents, maxents * sizeof(index_ent_t));
+		if (ents == NULL) {
+			return -1;
+		}
+		idx->ents = ents;
+		idx->maxents = maxents;
+	}
+	ent = &idx->ents[idx->nents];
+	if ((ent->path = strdup(path)) == NULL) {
+		return -1;
+	}
+	ent->isdir = isdir;
+	idx->nents++;
+	return 0;
+}
+
+/*
+ * index_normalize: normalize the path into the form used by the index,
+ * i.e. an absolute path without "." and ".." and duplicate slashes.
+ */
+static int
+index_normalize(const char *path, char *buf, size_t len)
+{
+	size_t n = 0;
+
+	for (const char *pc = path, *p; *pc; pc = *p ? p + 1 : p) {
+		size_t pclen;
+
+		if ((p = strchr(pc, '/')) == NULL) {
+			p = pc + strlen(pc);
+		}
+		pclen = p - pc;
+
+		if (pclen == 0 || (pclen == 1 && pc[0] == '.')) {
+			continue;
+		}
+		if (pclen == 2 && pc[0] == '.' && pc[1] == '.') {
+			while (n && buf[--n] != '/')
+				;
+			continue;
+		}
+		if (n + 1 + pclen >= len) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		buf[n++] = '/';
+		memcpy(&buf[n], pc, pclen);
+		n += pclen;
+	}
+	buf[n] = '\0';
+	return n ? 0 : -1; // the root itself is not indexed
+}
+
+/*
+ * rvault_index_sync: write the index, if changed.
+ *
+ * => Called on close and by the mount on fsync(2); the add, remove and
+ *    rename operations never write it.
+ */
+int
+rvault_index_sync(rvault_t *vault)
+{
+	rvault_index_t *idx = vault->index;
+	char *fpath = NULL, *tpath = NULL, *buf = NULL;
+	size_t len = 0;
+	FILE *fp = NULL;
+	int fd = -1, ret = -1;
+
+	if (idx == NULL || !idx->dirty) {
+		return 0;
+	}
+
+	/*
+	 * Serialize: the type and the path, NUL-terminated.
+	 */
+	if ((fp = open_memstream(&buf, &len)) == NULL) {
+		return -1;
+	}
+	fputs(INDEX_MAGIC, fp);
+	for (size_t i = 0; i < idx->nents; i++) {
+		const index_ent_t *ent = &idx->ents[i];
+		fprintf(fp, "%c%s%c", ent->isdir ? 'd' : 'f', ent->path, '\0');
+	}
+	if (fclose(fp) != 0) {
+		goto out;
+	}
+
+	/*
+	 * Encrypt and write into a temporary file; atomically replace.
+	 */
+	if (asprintf(&fpath, "%s/%s", vault->base_path,
+	    RVAULT_INDEX_FILE) == -1) {
+		fpath = NULL;
+		goto out;
+	}
+	if ((tpath = tmpfile_get_name(fpath)) == NULL) {
+		goto out;
+	}
+	if ((fd = open(tpath, O_CREAT | O_EXCL | O_RDWR, 0600)) == -1) {
+		goto out;
+	}
+	if (storage_write_data(vault, fd, buf, len) == -1 ||
+	    rename(tpath, fpath) == -1) {
+		unlink(tpath);
+		goto out;
+	}
+	idx->dirty = false;
+	ret = 0;
+out:
+	if (ret == -1) {
+		app_elog(LOG_ERR, "%s: failed to write the index", __func__);
+	}
+	if (fd != -1) {
+		close(fd);
+	}
+	if (buf) {
+		crypto_memzero(buf, len);
+		free(buf);
+	}
+	free(tpath);
+	free(fpath);
+	return ret;
+}
+
+/*
+ * rvault_index_open: load the index, if it exists.
+ *
+ * => Returns 0 if there is no index, i.e. it is not maintained.
+ */
+int
+rvault_index_open(rvault_t *vault)
+{
+	unsigned char hbuf[FILEOBJ_HDR_LEN];
+	fileobj_hdr_t *hdr = (void *)hbuf;
+	storage_extents_t se = { NULL, 0, 0 };
+	rvault_index_t *idx = NULL;
+	sbuffer_t sbuf;
+	ssize_t flen, len;
+	const char *p, *end;
+	char *fpath;
+	int fd;
+
+	if (asprintf(&fpath, "%s/%s", vault->base_path,
+	    RVAULT_INDEX_FILE) == -1) {
+		return -1;
+	}
+	fd = open(fpath, O_RDONLY);
+	free(fpath);
+	if (fd == -1) {
+		return errno == ENOENT ? 0 : -1;
+	}
+	memset(&sbuf, 0, sizeof(sbuffer_t));
+	if ((flen = fs_file_size(fd)) <= 0 ||
+	    (len = storage_read_extents(vault, fd, flen, &sbuf,
+	    storage_extents_add, &se)) == -1 ||
+	    storage_read_hdr(fd, hdr) == -1) {
+		goto err;
+	}
+	close(fd);
+	fd = -1;
+
+	if ((size_t)len < INDEX_MAGIC_LEN ||
+	    memcmp(sbuf.buf, INDEX_MAGIC, INDEX_MAGIC_LEN) != 0) {
+		app_log(LOG_ERR, "%s: invalid index", __func__);
+		errno = EINVAL;
+		goto err;
+	}
+	if ((idx = index_alloc()) == NULL) {
+		goto err;
+	}
+	p = (const char *)sbuf.buf + INDEX_MAGIC_LEN;
+	end = (const char *)sbuf.buf + len;
+	while (p < end) {
+		const char *e;
+
+		if ((e = memchr(p, '\0', end - p)) == NULL || e - p < 2 ||
+		    (*p != 'd' && *p != 'f')) {
+			app_log(LOG_ERR, "%s: corrupted index", __func__);
+			errno = EINVAL;
+			goto err;
+		}
+		if (index_append(idx, p + 1, *p == 'd') == -1) {
+			goto err;
+		}
+		p = e + 1;
+	}
+	storage_extents_free(&se, &sbuf);
+
+	qsort(idx->ents, idx->nents, sizeof(index_ent_t), index_entcmp);
+
+	/* Encrypted with a previous key: re-encrypt on the next sync. */
+	idx->dirty = FILEOBJ_KEY_EPOCH(hdr) != vault->key_epoch;
+	vault->index = idx;
+	return 0;
+err:
+	if (idx) {
+		index_free(idx);
+	}
+	storage_extents_free(&se, &sbuf);
+	if (fd != -1) {
+		close(fd);
+	}
+	return -1;
+}
+
+/*
+ * rvault_index_close: write back and destroy the index.
+ */
+void
+rvault_index_close(rvault_t *vault)
+{
+	rvault_index_t *idx = vault->index;
+
+	if (idx == NULL) {
+		return;
+	}
+	(void)rvault_index_sync(vault);
+	index_free(idx);
+	vault->index = NULL;
+}
+
+/*
+ * rvault_index_add: add the file or directory to the index.
+ */
+int
+rvault_index_add(rvault_t *vault, const char *path, bool isdir)
+{
+	rvault_index_t *idx = vault->index;
+	char npath[PATH_MAX];
+	index_ent_t *ent;
+	size_t i;
+
+	if (idx == NULL || index_normalize(path, npath, sizeof(npath)) == -1) {
+		return 0;
+	}
+	i = index_lookup(idx, npath);
+	if (i < idx->nents && strcmp(idx->ents[i].path, npath) == 0) {
+		idx->ents[i].isdir = isdir;
+		return 0;
+	}
+
+	/* Append and move into the position. */
+	if (index_append(idx, npath, isdir) == -1) {
+		return -1;
+	}
+	ent = &idx->ents[idx->nents - 1];
+	if (i != idx->nents - 1) {
+		const index_ent_t tmp = *ent;
+
+		memmove(&idx->ents[i + 1], &idx->ents[i],
+		    (idx->nents - 1 - i) * sizeof(index_ent_t));
+		idx->ents[i] = tmp;
+	}
+	idx->dirty = true;
+	return 0;
+}
+
+/*
+ * rvault_index_remove: remove the entry and its descendants, if any.
+ */
+int
+rvault_index_remove(rvault_t *vault, const char *path)
+{
+	rvault_index_t *idx = vault->index;
+	char npath[PATH_MAX];
+	size_t i;
+
+	if (idx == NULL || index_normalize(path, npath, sizeof(npath)) == -1) {
+		return 0;
+	}
+	i = index_lookup(idx, npath);
+	if (i < idx->nents && strcmp(idx->ents[i].path, npath) == 0) {
+		index_remove_range(idx, i, index_subtree_end(idx, i));
+		idx->dirty = true;
+	}
+	return 0;
+}
+
+/*
+ * rvault_index_rename: rename the entry, including its descendants.
+ */
+int
+rvault_index_rename(rvault_t *vault, const char *from, const char *to)
+{
+	rvault_index_t *idx = vault->index;
+	char nfrom[PATH_MAX], nto[PATH_MAX];
+	size_t i, end, flen, tlen, n;
+	index_ent_t *ents;
+
+	if (idx == NULL ||
+	    index_normalize(from, nfrom, sizeof(nfrom)) == -1 ||
+	    index_normalize(to, nto, sizeof(nto)) == -1 ||
+	    strcmp(nfrom, nto) == 0) {
+		return 0;
+	}
+
+	/* The target gets replaced. */
+	(void)rvault_index_remove(vault, nto);
+
+	i = index_lookup(idx, nfrom);
+	if (i == idx->nents || strcmp(idx->ents[i].path, nfrom) != 0) {
+		return 0;
+	}
+	end = index_subtree_end(idx, i);
+	flen = strlen(nfrom);
+	tlen = strlen(nto);
+	n = end - i;
+
+	/*
+	 * Replacing the prefix keeps the order within the sub-tree, so
+	 * the renamed entries are moved into the new position as a range.
+	 */
+	if ((ents = malloc(n * sizeof(index_ent_t))) == NULL) {
+		return -1;
+	}
+	for (size_t j = 0; j < n; j++) {
+		const index_ent_t *ent = &idx->ents[i + j];
+		const char *suffix = ent->path + flen;
+
+		if (asprintf(&ents[j].path, "%.*s%s",
+		    (int)tlen, nto, suffix) == -1) {
+			while (j--) {
+				free(ents[j].path);
+			}
+			free(ents);
+			return -1;
+		}
+		ents[j].isdir = ent->isdir;
+	}
+	index_remove_range(idx, i, end);
+
+	i = index_lookup(idx, nto);
+	memmove(&idx->ents[i + n], &idx->ents[i],
+	    (idx->nents - i) * sizeof(index_ent_t));
+	memcpy(&idx->ents[i], ents, n * sizeof(index_ent_t));
+	idx->nents += n;
+	free(ents);
+
+	idx->dirty = true;
+	return 0;
+}
+
+/*
+ * rvault_index_find: find the entries matching the glob pattern.
+ *
+ * => An absolute pattern is matched against the full path (the wildcards
+ *    also match '/'); otherwise, the pattern is matched against the name.
+ * => The literal prefix of an absolute pattern narrows the search: the
+ *    paths with a common prefix form a range in the sorted index.
+ */
+int
+rvault_index_find(rvault_t *vault, const char *pattern,
+    void *arg, index_iter_t iterfunc)
+{
+	rvault_index_t *idx = vault->index;
+	const bool fullpath = pattern[0] == '/';
+	size_t i = 0, plen = 0;
+	char prefix[PATH_MAX];
+
+	if (idx == NULL) {
+		errno = ENOENT;
+		return -1;
+	}
+	if (fullpath) {
+		plen = strcspn(pattern, "*?[\\");
+		if (plen >= sizeof(prefix)) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		memcpy(prefix, pattern, plen);
+		prefix[plen] = '\0';
+		i = index_lookup(idx, prefix);
+	}
+	for (; i < idx->nents; i++) {
+		const index_ent_t *ent = &idx->ents[i];
+		const char *name;
+
+		if (fullpath) {
+			/* The entries with the prefix are contiguous. */
+			if (strncmp(ent->path, prefix, plen) != 0) {
+				break;
+			}
+			name = ent->path;
+		} else {
+			name = strrchr(ent->path, '/') + 1;
+		}
+		if (fnmatch(pattern, name, 0) == 0) {
+			iterfunc(arg, ent->path, ent->isdir);
+		}
+	}
+	return 0;
+}
+
+static int
+index_rebuild_entry(void *arg, const rvault_walk_ent_t *ent)
+{
+	rvault_index_t *idx = arg;
+	const bool isdir = S_ISDIR(ent->st->st_mode);
+	int ret;
+
+	if (!isdir && !S_ISREG(ent->st->st_mode)) {
+		return 0;
+	}
+	pthread_mutex_lock(&idx->lock);
+	ret = index_append(idx, ent->path, isdir);
+	pthread_mutex_unlock(&idx->lock);
+	return ret;
+}
+
+/*
+ * rvault_index_rebuild: (re)create the index by walking the vault.
+ */
+int
+rvault_index_rebuild(rvault_t *vault, unsigned nworkers)
+{
+	rvault_index_t *idx;
+
+	if ((idx = index_alloc()) == NULL) {
+		return -1;
+	}
+	if (rvault_walk(vault, "/", nworkers, idx,
+	    index_rebuild_entry) == -1) {
+		index_free(idx);
+		return -1;
+	}
+	qsort(idx->ents, idx->nents, sizeof(index_ent_t), index_entcmp);
+	idx->dirty = true;
+
+	if (vault->index) {
+		index_free(vault->index);
+	}
+	vault->index = idx;
+	return rvault_index_sync(vault);
+}
@@ -0,0 +1,567 @@
+/*
+ * Copyright (c) 2020 Mindaugas Rasiukevicius <rmind at noxt eu>
+ * All rights reserved.
+ *
+ * Use is subject to license terms, as specified in the LICENSE file.
+ */
+
+/*
+ * Mount-time cache warming (preload).
+ *
+ * The selected sub-trees are walked in the background (see walk.c): the
+ * names are decrypted and the attributes are read, optionally together
+ * with the data of the file objects, within the memory budget.  The
+ * results are kept in a table, keyed by the plain path, from which the
+ * file system takes them on the first access: the lookup gets the
+ * encrypted name and the attributes, while the open gets the file object
+ * with its data already decrypted.
+ *
+ * => An entry is used only if the file object was not changed since it
+ *    was preloaded (i.e. it is still the same file, of the same size and
+ *    modification time); otherwise, it is discarded.
+ *
+ * => The preloader runs at the lowest priority and backs off while there
+ *    are foreground requests (see rvault_preload_touch()).
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <errno.h>
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+#include "rvault.h"
+#include "fileobj.h"
+#include "utils.h"
+
+#define	PRELOAD_NICE		19	// lowest priority
+#define	PRELOAD_PAUSE_US	(1000)
+#define	PRELOAD_HASH_MINSIZE	1024
+
+typedef struct preload_ent {
+	char *			path;
+	char *			vpath;
+	struct stat		st;	// plain attributes
+	off_t			fsize;	// size of the file object
+	fileobj_t *		fobj;	// data (optional)
+	size_t			len;
+	struct preload_ent *	next;
+} preload_ent_t;
+
+struct rvault_preload {
+	/*
+	 * The paths to preload (comma-separated) and the memory budget
+	 * for the data.  The private handle of the preloader holds the
+	 * preloaded file objects.
+	 */
+	char *			paths;
+	size_t			budget;
+	rvault_t *		pvault;
+
+	pthread_t		thread;
+	bool			running;
+	atomic_bool		stop;
+
+	/* Foreground activity and its last observation by each worker. */
+	atomic_uint_fast64_t	fg_seq;
+	uint64_t *		fg_seen;
+	unsigned		nworkers;
+
+	/* Table of the preloaded entries and the data in use. */
+	pthread_mutex_t		lock;
+	preload_ent_t **	htable;
+	unsigned		hsize;
+	unsigned		nentries;
+	size_t			used;
+
+	/* Statistics. */
+	unsigned		nnames;
+	unsigned		nobjs;
+	unsigned		nhits;
+};
+
+static unsigned
+preload_hash(const char *path)
+{
+	uint32_t h = 2166136261U;	// FNV-1a
+
+	while (*path) {
+		h ^= (unsigned char)*path++;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+static void
+preload_ent_free(preload_ent_t *ent)
+{
+	free(ent->path);
+	free(ent->vpath);
+	free(ent);
+}
+
+/*
+ * preload_hash_grow: double the hash table size (best effort).
+ *
+ * => The caller must hold the lock.
+ */
+static void
+preload_hash_grow(struct rvault_preload *pl)
+{
+	const unsigned nsize = pl->hsize << 1;
+	preload_ent_t **ntable;
+
+	if ((ntable = calloc(nsize, sizeof(preload_ent_t *))) == NULL) {
+		return;
+	}
+	for (unsigned i = 0; i < pl->hsize; i++) {
+		preload_ent_t *ent;
+
+		while ((ent = pl->htable[i]) != NULL) {
+			const unsigned b =
+			    preload_hash(ent->path) & (nsize - 1);
+
+			pl->htable[i] = ent->next;
+			ent->next = ntable[b];
+			ntable[b] = ent;
+		}
+	}
+	free(pl->htable);
+	pl->htable = ntable;
+	pl->hsize = nsize;
+}
+
+/*
+ * preload_remove: find the entry and remove it from the table.
+ *
+ * => The caller must hold the lock.
+ */
+static preload_ent_t *
+preload_remove(struct rvault_preload *pl, const char *path)
+{
+	const unsigned b = preload_hash(path) & (pl->hsize - 1);
+	preload_ent_t **entp = &pl->htable[b], *ent;
+
+	while ((ent = *entp) != NULL) {
+		if (strcmp(ent->path, path) == 0) {
+			*entp = ent->next;
+			pl->nentries--;
+			pl->used -= ent->len;
+			return ent;
+		}
+		entp = &ent->next;
+	}
+	return NULL;
+}
+
+/*
+ * preload_insert: add the entry to the table, replacing the existing
+ * one (which is returned), if any.
+ *
+ * => The caller must hold the lock.
+ */
+static preload_ent_t *
+preload_insert(struct rvault_preload *pl, preload_ent_t *ent)
+{
+	preload_ent_t *oent = preload_remove(pl, ent->path);
+	const unsigned b = preload_hash(ent->path) & (pl->hsize - 1);
+
+	ent->next = pl->htable[b];
+	pl->htable[b] = ent;
+	pl->used += ent->len;
+	if (++pl->nentries > pl->hsize * 2) {
+		preload_hash_grow(pl);
+	}
+	return oent;
+}
+
+/*
+ * preload_valid_p: check whether the file object is still the same as
+ * when it was preloaded.
+ */
+static bool
+preload_valid_p(const preload_ent_t *ent)
+{
+	struct stat st;
+
+	if (lstat(ent->vpath, &st) == -1) {
+		return false;
+	}
+	return st.st_ino == ent->st.st_ino && st.st_size == ent->fsize &&
+	    st.st_mtim.tv_sec == ent->st.st_mtim.tv_sec &&
+	    st.st_mtim.tv_nsec == ent->st.st_mtim.tv_nsec;
+}
+
+/*
+ * preload_yield: back off while there are foreground requests, i.e.
+ * until no new requests arrive during the pause.
+ */
+static void
+preload_yield(struct rvault_preload *pl, unsigned worker)
+{
+	uint64_t seq = atomic_load(&pl->fg_seq);
+
+	while (seq != pl->fg_seen[worker] && !atomic_load(&pl->stop)) {
+		pl->fg_seen[worker] = seq;
+		usleep(PRELOAD_PAUSE_US);
+		seq = atomic_load(&pl->fg_seq);
+	}
+}
+
+/*
+ * preload_data: open the file object and load its data, if it fits in
+ * the memory budget.  The file object is moved to the private handle.
+ */
+static fileobj_t *
+preload_data(struct rvault_preload *pl, const rvault_walk_ent_t *went,
+    size_t len)
+{
+	const int flags = pl->pvault->read_only ? O_RDONLY : O_RDWR;
+	fileobj_t *fobj;
+
+	/*
+	 * Reserve the memory; on success, the entry takes it over.
+	 */
+	pthread_mutex_lock(&pl->lock);
+	if (pl->used + len > pl->budget) {
+		pthread_mutex_unlock(&pl->lock);
+		return NULL;
+	}
+	pl->used += len;
+	pthread_mutex_unlock(&pl->lock);
+
+	fobj = fileobj_vopen(went->vault, went->path, went->vpath, flags, 0);
+	if (fobj && fileobj_load(fobj) == -1) {
+		fileobj_close(fobj);
+		fobj = NULL;
+	}
+	if (fobj == NULL) {
+		pthread_mutex_lock(&pl->lock);
+		pl->used -= len;
+		pthread_mutex_unlock(&pl->lock);
+		return NULL;
+	}
+	fileobj_move(fobj, pl->pvault);
+	return fobj;
+}
+
+static int
+preload_walk_entry(void *arg, const rvault_walk_ent_t *went)
+{
+	struct rvault_preload *pl = arg;
+	preload_ent_t *ent, *oent;
+
+	if (atomic_load(&pl->stop)) {
+		errno = EINTR;
+		return -1;
+	}
+	preload_yield(pl, went->worker);
+
+	if ((ent = calloc(1, sizeof(preload_ent_t))) == NULL) {
+		return -1;
+	}
+	ent->path = strdup(went->path);
+	ent->vpath = strdup(went->vpath);
+	if (ent->path == NULL || ent->vpath == NULL) {
+		preload_ent_free(ent);
+		return -1;
+	}
+
+	/* Get the attributes; the data size is in the object header. */
+	ent->fsize = went->st->st_size;
+	if (fileobj_vstat(went->vault, went->vpath, &ent->st) == -1 ||
+	    ent->st.st_ino != went->st->st_ino) {
+		preload_ent_free(ent);
+		return 0;
+	}
+	if (S_ISREG(ent->st.st_mode) && ent->st.st_size > 0 && pl->budget &&
+	    (ent->fobj = preload_data(pl, went, ent->st.st_size)) != NULL) {
+		ent->len = ent->st.st_size;
+	}
+
+	pthread_mutex_lock(&pl->lock);
+	pl->used -= ent->len;	// reserved by preload_data()
+	oent = preload_insert(pl, ent);
+	pl->nnames++;
+	pl->nobjs += ent->fobj != NULL;
+	pthread_mutex_unlock(&pl->lock);
+
+	if (oent) {
+		if (oent->fobj) {
+			fileobj_close(oent->fobj);
+		}
+		preload_ent_free(oent);
+	}
+	return 0;
+}
+
+static void *
+preload_thread(void *arg)
+{
+	struct rvault_preload *pl = arg;
+	char *paths, *path, *sp = NULL;
+
+#if defined(__linux__)
+	/*
+	 * On Linux, the nice value is per-thread; the walk workers
+	 * inherit it.
+	 */
+	(void)setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid),
+	    PRELOAD_NICE);
+#endif
+	if ((paths = strdup(pl->paths)) == NULL) {
+		return NULL;
+	}
+	path = strtok_r(paths, ",", &sp);
+	while (path && !atomic_load(&pl->stop)) {
+		if (rvault_walk(pl->pvault, path, pl->nworkers,
+		    pl, preload_walk_entry) == -1 && errno != EINTR) {
+			app_elog(LOG_WARNING, "%s: could not preload `%s'",
+			    __func__, path);
+		}
+		path = strtok_r(NULL, ",", &sp);
+	}
+	free(paths);
+
+	app_log(LOG_INFO, "%s: preloaded %u names and %u objects%s", __func__,
+	    pl->nnames, pl->nobjs, atomic_load(&pl->stop) ? " (stopped)" : "");
+	return NULL;
+}
+
+/*
+ * rvault_preload_setup: configure the preloading of the given paths
+ * (comma-separated) and, if the memory budget is non-zero, the data.
+ *
+ * => The preloader is started by rvault_preload_start(), since the
+ *    threads do not survive fork (i.e. daemonizing).
+ */
+int
+rvault_preload_setup(rvault_t *vault, const char *paths, size_t budget)
+{
+	struct rvault_preload *pl;
+
+	if (vault->preload) {
+		errno = EEXIST;
+		return -1;
+	}
+	if ((pl = calloc(1, sizeof(struct rvault_preload))) == NULL) {
+		return -1;
+	}
+	if ((pl->paths = strdup(paths)) == NULL) {
+		free(pl);
+		return -1;
+	}
+	pl->budget = budget;
+	pl->hsize = PRELOAD_HASH_MINSIZE;
+	if ((pl->htable = calloc(pl->hsize, sizeof(preload_ent_t *))) == NULL) {
+		free(pl->paths);
+		free(pl);
+		return -1;
+	}
+	pthread_mutex_init(&pl->lock, NULL);
+	atomic_init(&pl->stop, false);
+	atomic_init(&pl->fg_seq, 0);
+	vault->preload = pl;
+	return 0;
+}
+
+/*
+ * rvault_preload_start: start the background preloader, if configured.
+ *
+ * => A half of the CPUs is used, leaving the rest to the foreground.
+ */
+int
+rvault_preload_start(rvault_t *vault)
+{
+	struct rvault_preload *pl = vault->preload;
+	int ret;
+
+	if (pl == NULL || pl->running) {
+		return 0;
+	}
+	pl->nworkers = MAX(rvault_walk_workers() / 2, 1);
+	if ((pl->fg_seen = calloc(pl->nworkers, sizeof(uint64_t))) == NULL) {
+		return -1;
+	}
+	if ((pl->pvault = rvault_dup(vault)) == NULL) {
+		return -1;
+	}
+	ret = pthread_create(&pl->thread, NULL, preload_thread, pl);
+	if (ret != 0) {
+		errno = ret;
+		app_elog(LOG_ERR, "%s: pthread_create() failed", __func__);
+		rvault_close(pl->pvault);
+		pl->pvault = NULL;
+		return -1;
+	}
+	pl->running = true;
+	return 0;
+}
+
+/*
+ * rvault_preload_stop: stop the preloader, if running, and destroy all
+ * the preloaded entries.
+ */
+void
+rvault_preload_stop(rvault_t *vault)
+{
+	struct rvault_preload *pl = vault->preload;
+
+	if (pl == NULL) {
+		return;
+	}
+	if (pl->running) {
+		atomic_store(&pl->stop, true);
+		pthread_join(pl->thread, NULL);
+	}
+	for (unsigned i = 0; i < pl->hsize; i++) {
+		preload_ent_t *ent;
+
+		while ((ent = pl->htable[i]) != NULL) {
+			pl->htable[i] = ent->next;
+			if (ent->fobj) {
+				fileobj_close(ent->fobj);
+			}
+			preload_ent_free(ent);
+		}
+	}
+	if (pl->pvault) {
+		rvault_close(pl->pvault);
+	}
+	pthread_mutex_destroy(&pl->lock);
+	vault->preload = NULL;
+	free(pl->htable);
+	free(pl->fg_seen);
+	free(pl->paths);
+	free(pl);
+}
+
+/*
+ * rvault_preload_touch: indicate a foreground request.
+ */
+void
+rvault_preload_touch(rvault_t *vault)
+{
+	struct rvault_preload *pl = vault->preload;
+
+	if (pl) {
+		atomic_fetch_add_explicit(&pl->fg_seq, 1,
+		    memory_order_relaxed);
+	}
+}
+
+/*
+ * rvault_preload_lookup: get the attributes and, optionally, the
+ * encrypted name of the preloaded path.
+ *
+ * => The entry is kept only if it has the data (for the open).
+ * => Returns 0 on success and -1 if there is no (valid) entry.
+ */
+int
+rvault_preload_lookup(rvault_t *vault, const char *path, char **vnamep,
+    struct stat *st)
+{
+	struct rvault_preload *pl = vault->preload;
+	preload_ent_t *ent;
+	char *vname = NULL;
+	int ret = -1;
+
+	if (pl == NULL) {
+		return -1;
+	}
+	pthread_mutex_lock(&pl->lock);
+	if ((ent = preload_remove(pl, path)) == NULL) {
+		pthread_mutex_unlock(&pl->lock);
+		atomic_fetch_add(&vault->stats.preload_misses, 1);
+		return -1;
+	}
+	if (preload_valid_p(ent) && (vnamep == NULL ||
+	    (vname = strdup(strrchr(ent->vpath, '/') + 1)) != NULL)) {
+		memcpy(st, &ent->st, sizeof(struct stat));
+		if (vnamep) {
+			*vnamep = vname;
+		}
+		pl->nhits++;
+		ret = 0;
+	}
+	if (ret == 0 && ent->fobj) {
+		(void)preload_insert(pl, ent);
+		ent = NULL;
+	}
+	pthread_mutex_unlock(&pl->lock);
+
+	if (ent) {
+		if (ent->fobj) {
+			fileobj_move(ent->fobj, vault);
+			fileobj_close(ent->fobj);
+		}
+		preload_ent_free(ent);
+	}
+	atomic_fetch_add(ret == 0 ? &vault->stats.preload_hits :
+	    &vault->stats.preload_misses, 1);
+	return ret;
+}
+
+/*
+ * rvault_preload_open: take the preloaded file object of the path, if
+ * it can serve the open with the given flags.
+ *
+ * => The file object is moved to the given vault handle.
+ * => Returns NULL if there is no (valid) file object.
+ */
+fileobj_t *
+rvault_preload_open(rvault_t *vault, const char *path, int flags)
+{
+	struct rvault_preload *pl = vault->preload;
+	fileobj_t *fobj = NULL;
+	preload_ent_t *ent;
+
+	if (pl == NULL) {
+		return NULL;
+	}
+	pthread_mutex_lock(&pl->lock);
+	if ((ent = preload_remove(pl, path)) == NULL) {
+		pthread_mutex_unlock(&pl->lock);
+		atomic_fetch_add(&vault->stats.preload_misses, 1);
+		return NULL;
+	}
+	pthread_mutex_unlock(&pl->lock);
+
+	/*
+	 * Note: the file object is closed in the vault of the caller,
+	 * since the crypto objects of the private handle are in use.
+	 */
+	if (ent->fobj) {
+		fileobj_move(ent->fobj, vault);
+		fobj = ent->fobj;
+	}
+	if (fobj && ((flags & (O_TRUNC | O_SYNC | O_DSYNC)) != 0 ||
+	    !preload_valid_p(ent))) {
+		fileobj_close(fobj);
+		fobj = NULL;
+	}
+	if (fobj) {
+		pthread_mutex_lock(&pl->lock);
+		pl->nhits++;
+		pthread_mutex_unlock(&pl->lock);
+	}
+	preload_ent_free(ent);
+	atomic_fetch_add(fobj ? &vault->stats.preload_hits :
+	    &vault->stats.preload_misses, 1);
+	return fobj;
+}
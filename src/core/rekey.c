@@ -0,0 +1,389 @@
+/*
+ * Copyright (c) 2020 Mindaugas Rasiukevicius <rmind at noxt eu>
+ * All rights reserved.
+ *
+ * Use is subject to license terms, as specified in the LICENSE file.
+ */
+
+/*
+ * Online re-keying.
+ *
+ * Every file object records the key epoch it was encrypted with.  When
+ * the vault is opened with the previous keys, the objects encrypted with
+ * them are re-encrypted with the current key lazily: the file object
+ * layer does it on the next sync of an object in use, while the sweeper
+ * walks the vault in the background and converts the cold objects.  The
+ * file and directory names are re-encrypted (renamed) by the sweeper, as
+ * well as the secrets database and the index, so that the vault remains
+ * fully accessible once the previous key is retired.
+ *
+ * The sweeper operates on its own vault handle (see rvault_dup()) and
+ * replaces the objects only while holding the vault lock, if they are
+ * neither open nor were modified in the meantime.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <errno.h>
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+#include "rvault.h"
+#include "fileobj.h"
+#include "storage.h"
+#include "sys.h"
+#include "utils.h"
+
+#define	REKEY_NICE		19	// lowest priority
+#define	REKEY_PAUSE_US		(10 * 1000)
+
+struct rvault_rekey {
+	/* The vault in use and the private handle of the sweeper. */
+	rvault_t *		vault;
+	rvault_t *		svault;
+
+	pthread_t		thread;
+	atomic_bool		stop;
+	bool			background;
+
+	/* Statistics. */
+	unsigned		nobjs;
+	unsigned		nnames;
+};
+
+static bool
+same_file_p(int fd, const char *path)
+{
+	struct stat st0, st1;
+
+	if (fstat(fd, &st0) == -1 || lstat(path, &st1) == -1) {
+		return false;
+	}
+	return st0.st_dev == st1.st_dev && st0.st_ino == st1.st_ino &&
+	    st0.st_size == st1.st_size &&
+	    st0.st_mtim.tv_sec == st1.st_mtim.tv_sec &&
+	    st0.st_mtim.tv_nsec == st1.st_mtim.tv_nsec;
+}
+
+/*
+ * rekey_object: re-encrypt the file object with the current key.
+ *
+ * => The sparse objects are kept sparse: only their extents are erased,
+ *    so the holes in the buffer are not touched.
+ */
+static int
+rekey_object(struct rvault_rekey *rk, const char *path)
+{
+	rvault_t *vault = rk->vault, *svault = rk->svault;
+	unsigned char buf[FILEOBJ_HDR_LEN];
+	fileobj_hdr_t *hdr = (void *)buf;
+	storage_extents_t se = { NULL, 0, 0 };
+	char *tpath = NULL;
+	sbuffer_t sbuf;
+	ssize_t flen, nbytes;
+	struct stat st;
+	int fd, tfd = -1, ret = -1;
+
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		return -1;
+	}
+	if (fstat(fd, &st) == -1 || storage_read_hdr(fd, hdr) == -1) {
+		goto out;
+	}
+	if (FILEOBJ_KEY_EPOCH(hdr) == svault->key_epoch) {
+		/* Nothing to do. */
+		ret = 0;
+		goto out;
+	}
+	if (!rvault_get_crypto(svault, FILEOBJ_KEY_EPOCH(hdr))) {
+		app_log(LOG_WARNING, "%s: no key for epoch %u at `%s'",
+		    __func__, FILEOBJ_KEY_EPOCH(hdr), path);
+		goto out;
+	}
+
+	/*
+	 * Decrypt with the previous key; encrypt with the current one.
+	 */
+	memset(&sbuf, 0, sizeof(sbuffer_t));
+	flen = st.st_size;
+	nbytes = storage_read_extents(svault, fd, flen, &sbuf,
+	    storage_extents_add, &se);
+	if (nbytes <= 0) {
+		storage_extents_free(&se, &sbuf);
+		goto out;
+	}
+	if ((tpath = tmpfile_get_name(path)) != NULL &&
+	    (tfd = open(tpath, O_CREAT | O_EXCL | O_RDWR, FOBJ_OMASK)) != -1) {
+		(void)fchmod(tfd, st.st_mode & ALLPERMS);
+		nbytes = FILEOBJ_SPARSE_P(hdr) ?
+		    storage_write_sparse(svault, tfd, sbuf.buf, nbytes,
+		    se.exts, se.n) :
+		    storage_write_data(svault, tfd, sbuf.buf, nbytes);
+	} else {
+		nbytes = -1;
+	}
+	storage_extents_free(&se, &sbuf);
+	if (nbytes == -1) {
+		goto out;
+	}
+
+	/*
+	 * Replace the object, unless it is open or has been changed.
+	 */
+	pthread_mutex_lock(&vault->lock);
+	if (!fileobj_inuse_p(vault, path) && same_file_p(fd, path) &&
+	    rename(tpath, path) == 0) {
+		free(tpath);
+		tpath = NULL;
+		rk->nobjs++;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&vault->lock);
+out:
+	if (tpath) {
+		unlink(tpath);
+		free(tpath);
+	}
+	if (tfd != -1) {
+		close(tfd);
+	}
+	close(fd);
+	return ret;
+}
+
+/*
+ * rekey_name: re-encrypt the name of the file object with the current
+ * key, i.e. rename it.
+ */
+static int
+rekey_name(struct rvault_rekey *rk, const char *dpath, const char *vname)
+{
+	rvault_t *vault = rk->vault, *svault = rk->svault;
+	char *name, *nvname, opath[PATH_MAX], npath[PATH_MAX];
+	struct stat st;
+	size_t len;
+	int ret = -1;
+
+	if ((name = rvault_resolve_vname(svault, vname, &len)) == NULL) {
+		return -1;
+	}
+	nvname = rvault_encrypt_vname(svault, name, len);
+	crypto_memzero(name, len);
+	free(name);
+	if (nvname == NULL) {
+		return -1;
+	}
+	if (strcmp(vname, nvname) == 0) {
+		/* Already encrypted with the current key. */
+		free(nvname);
+		return 0;
+	}
+	if ((size_t)snprintf(opath, sizeof(opath), "%s/%s",
+	    dpath, vname) >= sizeof(opath) ||
+	    (size_t)snprintf(npath, sizeof(npath), "%s/%s",
+	    dpath, nvname) >= sizeof(npath)) {
+		free(nvname);
+		return -1;
+	}
+	free(nvname);
+
+	pthread_mutex_lock(&vault->lock);
+	if (!fileobj_inuse_p(vault, opath) &&
+	    lstat(npath, &st) == -1 && errno == ENOENT &&
+	    rename(opath, npath) == 0) {
+		rk->nnames++;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&vault->lock);
+	return ret;
+}
+
+static void
+rekey_walk(struct rvault_rekey *rk, const char *dpath)
+{
+	struct dirent *dp;
+	DIR *dirp;
+
+	if ((dirp = opendir(dpath)) == NULL) {
+		app_elog(LOG_WARNING, "%s: opendir `%s' failed",
+		    __func__, dpath);
+		return;
+	}
+	while ((dp = readdir(dirp)) != NULL && !atomic_load(&rk->stop)) {
+		const char *vname = dp->d_name;
+		char path[PATH_MAX];
+		struct stat st;
+
+		if (strncmp(vname, RVAULT_FOBJ_PREF, RVAULT_FOBJ_PREFLEN)) {
+			continue;
+		}
+		if ((size_t)snprintf(path, sizeof(path), "%s/%s",
+		    dpath, vname) >= sizeof(path)) {
+			continue;
+		}
+		if (lstat(path, &st) == -1) {
+			continue;
+		}
+		if (S_ISDIR(st.st_mode)) {
+			rekey_walk(rk, path);
+		} else if (S_ISREG(st.st_mode) && st.st_size > 0) {
+			if (rekey_object(rk, path) == -1) {
+				app_log(LOG_DEBUG, "%s: could not re-key `%s'",
+				    __func__, path);
+			}
+		}
+		if (rekey_name(rk, dpath, vname) == -1) {
+			app_log(LOG_DEBUG, "%s: could not rename `%s'",
+			    __func__, path);
+		}
+		if (rk->background) {
+			usleep(REKEY_PAUSE_US);
+		}
+	}
+	closedir(dirp);
+}
+
+/*
+ * rekey_meta: re-encrypt the vault-level objects, i.e. the secrets
+ * database and the index.
+ *
+ * => The index loaded by the vault is re-encrypted on its next sync
+ *    instead (see rvault_index_open()).
+ */
+static void
+rekey_meta(struct rvault_rekey *rk)
+{
+	static const char *meta_files[] = {
+		RVAULT_SDB_FILE, RVAULT_INDEX_FILE,
+	};
+	const char *base_path = rk->svault->base_path;
+
+	for (unsigned i = 0; i < __arraycount(meta_files); i++) {
+		char path[PATH_MAX];
+		struct stat st;
+
+		if (atomic_load(&rk->stop)) {
+			break;
+		}
+		if (strcmp(meta_files[i], RVAULT_INDEX_FILE) == 0 &&
+		    rk->vault->index) {
+			continue;
+		}
+		if ((size_t)snprintf(path, sizeof(path), "%s/%s",
+		    base_path, meta_files[i]) >= sizeof(path)) {
+			continue;
+		}
+		if (lstat(path, &st) == -1 || !S_ISREG(st.st_mode) ||
+		    st.st_size == 0) {
+			continue;
+		}
+		if (rekey_object(rk, path) == -1) {
+			app_log(LOG_WARNING, "%s: could not re-key `%s'",
+			    __func__, path);
+		}
+	}
+}
+
+static void *
+rekey_thread(void *arg)
+{
+	struct rvault_rekey *rk = arg;
+
+#if defined(__linux__)
+	/* On Linux, the nice value is per-thread. */
+	(void)setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), REKEY_NICE);
+#endif
+	rekey_walk(rk, rk->svault->base_path);
+	rekey_meta(rk);
+	app_log(LOG_INFO, "%s: re-keyed %u objects and %u names%s", __func__,
+	    rk->nobjs, rk->nnames, atomic_load(&rk->stop) ? " (stopped)" : "");
+	return NULL;
+}
+
+/*
+ * rvault_rekey_sweep: re-encrypt all objects in the vault with the
+ * current key, synchronously.
+ */
+int
+rvault_rekey_sweep(rvault_t *vault)
+{
+	struct rvault_rekey rk;
+
+	memset(&rk, 0, sizeof(rk));
+	rk.vault = vault;
+	rk.svault = vault;
+	atomic_init(&rk.stop, false);
+	rekey_walk(&rk, vault->base_path);
+	rekey_meta(&rk);
+	app_log(LOG_INFO, "%s: re-keyed %u objects and %u names",
+	    __func__, rk.nobjs, rk.nnames);
+	return 0;
+}
+
+/*
+ * rvault_rekey_start: start the background sweeper, if there are any
+ * previous keys.
+ */
+int
+rvault_rekey_start(rvault_t *vault)
+{
+	struct rvault_rekey *rk;
+	int ret;
+
+	if (vault->prev_key_count == 0 || vault->rekey || vault->read_only) {
+		return 0;
+	}
+	if ((rk = calloc(1, sizeof(struct rvault_rekey))) == NULL) {
+		return -1;
+	}
+	rk->vault = vault;
+	rk->background = true;
+	atomic_init(&rk->stop, false);
+
+	if ((rk->svault = rvault_dup(vault)) == NULL) {
+		free(rk);
+		return -1;
+	}
+	if ((ret = pthread_create(&rk->thread, NULL, rekey_thread, rk)) != 0) {
+		errno = ret;
+		app_elog(LOG_ERR, "%s: pthread_create() failed", __func__);
+		rvault_close(rk->svault);
+		free(rk);
+		return -1;
+	}
+	vault->rekey = rk;
+	return 0;
+}
+
+/*
+ * rvault_rekey_stop: stop the background sweeper and wait for it.
+ */
+void
+rvault_rekey_stop(rvault_t *vault)
+{
+	struct rvault_rekey *rk = vault->rekey;
+
+	if (rk == NULL) {
+		return;
+	}
+	atomic_store(&rk->stop, true);
+	pthread_join(rk->thread, NULL);
+	rvault_close(rk->svault);
+	vault->rekey = NULL;
+	free(rk);
+}
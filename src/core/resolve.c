@@ -19,6 +19,7 @@
  * The prefix is followed by an AE tag and the encrypted file name.
  */
 
+#include <sys/stat.h>
 #include <stdlib.h>
 #include <inttypes.h>
 #include <string.h>
@@ -27,6 +28,7 @@
 
 #include "rvault.h"
 #include "storage.h"
+#include "probes.h"
 #include "utils.h"
 
 /*
@@ -71,38 +73,94 @@ err:
 }
 
 static int
-get_path_component(rvault_t *vault, const char *pc, size_t len, FILE *fp)
+get_path_component(crypto_t *crypto, const char *pc, size_t len, FILE *fp)
 {
 	unsigned char buf[PATH_MAX + 1];
 	const void *tag;
 	size_t tag_len;
 	ssize_t ret;
 
-	if (!vault->crypto) {
+	if (!crypto) {
 		/* For testing purposes. */
 		return fprintf(fp, "%.*s", (int)len, pc);
 	}
 	if (fputs(RVAULT_FOBJ_PREF, fp) == EOF) {
 		return -1;
 	}
-	if (crypto_get_buflen(vault->crypto, len) > sizeof(buf)) {
+	if (crypto_get_buflen(crypto, len) > sizeof(buf)) {
 		errno = ENAMETOOLONG;
 		return -1;
 	}
-	ret = crypto_encrypt(vault->crypto, pc, len, buf, sizeof(buf));
+	ret = crypto_encrypt(crypto, pc, len, buf, sizeof(buf));
 	if (ret == -1 || hex_write(fp, buf, ret) == -1) {
 		return -1;
 	}
 	if (fputc(':', fp) == EOF) {
 		return -1;
 	}
-	tag = crypto_get_aetag(vault->crypto, &tag_len);
+	tag = crypto_get_aetag(crypto, &tag_len);
 	if (hex_write(fp, tag, tag_len) == -1) {
 		return -1;
 	}
 	return 0;
 }
 
+/*
+ * put_path_component: encrypt and append the path component.
+ *
+ * => If there are previous keys (i.e. the vault is being re-keyed), the
+ *    component might still be encrypted with one of them.  Prefer the
+ *    current key, but use the previous one if such file object exists.
+ * => The previous keys are tried only if the lookup fails with ENOENT.
+ *    If the component does not exist with any key, then neither do its
+ *    descendants: *missing is set and the lookups are skipped for them.
+ */
+static int
+put_path_component(rvault_t *vault, const char *pc, size_t len,
+    FILE *fp, char **bufp, bool *missing)
+{
+	const char *base_path = vault->base_path ? vault->base_path : "";
+	long off;
+
+	if (vault->prev_key_count == 0 || *missing) {
+		return get_path_component(vault->crypto, pc, len, fp);
+	}
+	if (fflush(fp) != 0 || (off = ftell(fp)) == -1) {
+		return -1;
+	}
+	for (unsigned i = 0; i <= vault->prev_key_count; i++) {
+		crypto_t *crypto = i ?
+		    vault->prev_keys[i - 1].crypto : vault->crypto;
+		char vpath[PATH_MAX];
+		struct stat st;
+		long noff;
+		int error;
+
+		if (get_path_component(crypto, pc, len, fp) == -1 ||
+		    fflush(fp) != 0 || (noff = ftell(fp)) == -1) {
+			return -1;
+		}
+		if (snprintf(vpath, sizeof(vpath), "%s/%.*s", base_path,
+		    (int)noff - 1, *bufp + 1) >= (int)sizeof(vpath)) {
+			error = ENAMETOOLONG;
+		} else if (lstat(vpath, &st) == 0) {
+			return 0;
+		} else {
+			error = errno;
+		}
+		if (fseek(fp, off, SEEK_SET) == -1) {
+			return -1;
+		}
+		if (error != ENOENT) {
+			break;
+		}
+	}
+
+	/* Does not exist: use the current key. */
+	*missing = true;
+	return get_path_component(vault->crypto, pc, len, fp);
+}
+
 /*
  * Wrapper for strchrnul() since many systems don't have it.
  */
@@ -128,11 +186,13 @@ rvault_resolve_path(rvault_t *vault, const char *path, size_t *rlen)
 	char *fpath = NULL, *buf = NULL;
 	const char *pc, *p;
 	size_t len = 0, pclen;
+	bool missing = false;
 	FILE *fp = NULL;
 
 	if ((fp = open_memstream(&buf, &len)) == NULL) {
 		return NULL;
 	}
+	RVAULT_PROBE1(resolve_path_start, path);
 
 	/*
 	 * Normalize: handle "." and "..", as well as trailing "/".
@@ -160,12 +220,14 @@ rvault_resolve_path(rvault_t *vault, const char *path, size_t *rlen)
 				}
 				fseek(fp, off, SEEK_SET);
 			}
+			missing = false;
 			continue;
 		}
 		if (fputs("/", fp) == EOF) {
 			goto err;
 		}
-		if (get_path_component(vault, pc, pclen, fp) == -1) {
+		if (put_path_component(vault, pc, pclen, fp, &buf,
+		    &missing) == -1) {
 			goto err;
 		}
 	}
@@ -194,17 +256,72 @@ err:
 	} else {
 		app_log(LOG_DEBUG, "%s: `%s' -> `%s'", __func__, path, fpath);
 	}
+	RVAULT_PROBE2(resolve_path_done, path, fpath);
 	return fpath;
 }
 
+/*
+ * rvault_encrypt_vname: encrypt a single name (path component) into
+ * the vault name form using the current key.
+ *
+ * => Allocates memory and returns the name; the caller must free it.
+ */
+char *
+rvault_encrypt_vname(rvault_t *vault, const char *name, size_t len)
+{
+	char *vname = NULL;
+	size_t vlen = 0;
+	FILE *fp;
+
+	if ((fp = open_memstream(&vname, &vlen)) == NULL) {
+		return NULL;
+	}
+	if (get_path_component(vault->crypto, name, len, fp) == -1) {
+		fclose(fp);
+		free(vname);
+		return NULL;
+	}
+	fclose(fp);
+	return vname;
+}
+
+static ssize_t
+decrypt_vname(crypto_t *crypto, const void *buf, size_t len,
+    const void *tag, size_t tlen, char **namep)
+{
+	ssize_t nbytes;
+	size_t blen;
+	char *name;
+
+	if (crypto_set_aetag(crypto, tag, tlen) == -1) {
+		app_log(LOG_ERR, "%s: invalid AE tag", __func__);
+		return -1;
+	}
+	blen = crypto_get_buflen(crypto, len);
+	if ((name = malloc(blen + 1)) == NULL) {
+		return -1;
+	}
+	nbytes = crypto_decrypt(crypto, buf, len, name, blen);
+	if (nbytes == -1) {
+		free(name);
+		errno = EINVAL;
+		return -1;
+	}
+	name[nbytes] = '\0';
+	*namep = name;
+	return nbytes;
+}
+
 /*
  * rvault_resolve_vname: resolve vault name to the decrypted form.
+ *
+ * => If the vault is being re-keyed, the previous keys are tried too.
  */
 char *
 rvault_resolve_vname(rvault_t *vault, const char *vname, size_t *rlen)
 {
 	void *buf = NULL, *tag = NULL;
-	size_t blen, len, tlen;
+	size_t len, tlen;
 	char *name = NULL;
 	ssize_t nbytes;
 
@@ -218,23 +335,15 @@ rvault_resolve_vname(rvault_t *vault, const char *vname, size_t *rlen)
 		app_log(LOG_ERR, "%s: corrupted file name", __func__);
 		goto err;
 	}
-	if (crypto_set_aetag(vault->crypto, tag, tlen) == -1) {
-		app_log(LOG_ERR, "%s: invalid AE tag", __func__);
-		goto err;
-	}
-
-	blen = crypto_get_buflen(vault->crypto, len);
-	if ((name = malloc(blen + 1)) == NULL) {
-		goto err;
+	nbytes = decrypt_vname(vault->crypto, buf, len, tag, tlen, &name);
+	for (unsigned i = 0; nbytes == -1 && i < vault->prev_key_count; i++) {
+		crypto_t *crypto = vault->prev_keys[i].crypto;
+		nbytes = decrypt_vname(crypto, buf, len, tag, tlen, &name);
 	}
-	nbytes = crypto_decrypt(vault->crypto, buf, len, name, blen);
 	if (nbytes == -1) {
-		free(name);
 		name = NULL;
-		errno = EINVAL;
 		goto err;
 	}
-	name[nbytes] = '\0';
 	if (rlen) {
 		*rlen = nbytes;
 	}
@@ -224,7 +224,7 @@ rvault_hmac_verify(crypto_t *crypto, const rvault_hdr_t *hdr)
 int
 rvault_init(const char *path, const char *server, const char *pwd,
     const char *uid_str, const char *cipher_str, const char *mac_str,
-    unsigned flags)
+    unsigned flags, unsigned key_epoch)
 {
 	crypto_cipher_t cipher;
 	crypto_hmac_t hmac_id;
@@ -310,11 +310,18 @@ rvault_init(const char *path, const char *server, const char *pwd,
 	ASSERT(iv_len <= UINT8_MAX);
 	ASSERT(hmac_len <= UINT8_MAX);
 
+	if (key_epoch > UINT8_MAX) {
+		app_log(LOG_CRIT, APP_NAME": key epoch must be in 0..%u range",
+		    UINT8_MAX);
+		goto err;
+	}
+
 	hdr->ver = RVAULT_ABI_VER;
 	hdr->flags = flags;
 	hdr->cipher0 = cipher;
 	hdr->cipher1 = CIPHER_NONE;
 	hdr->hmac_id = hmac_id;
+	hdr->key_epoch = key_epoch;
 
 	hdr->kp_len = kp_len;
 	hdr->iv0_len = iv_len;
@@ -403,7 +410,7 @@ rvault_open_hdr(rvault_hdr_t *hdr, const char *server, const size_t file_len)
 	size_t iv_len;
 
 	/* Verify the ABI version. */
-	if (hdr->ver != RVAULT_ABI_VER) {
+	if (!RVAULT_ABI_VALID_P(hdr->ver)) {
 		app_log(LOG_CRIT, APP_NAME": incompatible vault version %u\n"
 		    "Hint: vault might have been created using a %s "
 		    "application version", hdr->ver,
@@ -419,7 +426,8 @@ rvault_open_hdr(rvault_hdr_t *hdr, const char *server, const size_t file_len)
 	 * Ensure that the HMAC algorithm is set.  This must be done
 	 * even if using the AE cipher.
 	 */
-	if (RVAULT_FILE_LEN(hdr) != file_len || hdr->hmac_id == HMAC_NONE) {
+	if (RVAULT_FILE_LEN(hdr) != file_len || hdr->hmac_id == HMAC_NONE ||
+	    !RVAULT_ABI_EPOCH_VALID_P(hdr->ver, hdr->key_epoch)) {
 		app_log(LOG_CRIT, "rvault: metadata file corrupted");
 		return NULL;
 	}
@@ -432,9 +440,12 @@ rvault_open_hdr(rvault_hdr_t *hdr, const char *server, const size_t file_len)
 	if ((vault = calloc(1, sizeof(rvault_t))) == NULL) {
 		return NULL;
 	}
+	vault->abi_ver = hdr->ver;
 	vault->cipher = hdr->cipher0;
 	vault->hmac_id = hdr->hmac_id;
+	vault->key_epoch = hdr->key_epoch;
 	vault->server_url = server;
+	pthread_mutex_init(&vault->lock, NULL);
 	LIST_INIT(&vault->file_list);
 
 	static_assert(sizeof(vault->uid) == sizeof(hdr->uid), "UUID length");
@@ -599,6 +610,164 @@ err:
 	return vault;
 }
 
+/*
+ * rvault_dup: create a new vault handle with the copies of the keys.
+ *
+ * => The handle has its own crypto objects and file list, therefore it
+ *    can be used by another thread (e.g. a background worker).
+ */
+rvault_t *
+rvault_dup(const rvault_t *vault)
+{
+	rvault_t *nvault;
+
+	if ((nvault = calloc(1, sizeof(rvault_t))) == NULL) {
+		return NULL;
+	}
+	nvault->server_url = vault->server_url;
+	nvault->weak_sync = vault->weak_sync;
+	nvault->compress = vault->compress;
+	nvault->read_only = vault->read_only;
+	nvault->direct_io = vault->direct_io;
+	nvault->abi_ver = vault->abi_ver;
+	nvault->cipher = vault->cipher;
+	nvault->hmac_id = vault->hmac_id;
+	nvault->key_epoch = vault->key_epoch;
+	memcpy(nvault->uid, vault->uid, sizeof(vault->uid));
+	pthread_mutex_init(&nvault->lock, NULL);
+	LIST_INIT(&nvault->file_list);
+
+	if (vault->base_path &&
+	    (nvault->base_path = strdup(vault->base_path)) == NULL) {
+		goto err;
+	}
+	if (vault->crypto &&
+	    (nvault->crypto = crypto_clone(vault->crypto)) == NULL) {
+		goto err;
+	}
+	for (unsigned i = 0; i < vault->prev_key_count; i++) {
+		const rvault_key_t *key = &vault->prev_keys[i];
+		rvault_key_t *nkey = &nvault->prev_keys[i];
+
+		if ((nkey->crypto = crypto_clone(key->crypto)) == NULL) {
+			goto err;
+		}
+		nkey->epoch = key->epoch;
+		nvault->prev_key_count++;
+	}
+	return nvault;
+err:
+	rvault_close(nvault);
+	return NULL;
+}
+
+/*
+ * rvault_add_prev_key: add a previous key, given its recovery file.
+ *
+ * => The objects encrypted with it get re-encrypted with the current key.
+ * => The recovery file metadata is verified using the key.
+ */
+int
+rvault_add_prev_key(rvault_t *vault, const char *recovery)
+{
+	rsection_t *sections;
+	crypto_t *crypto = NULL;
+	rvault_hdr_t *hdr;
+	size_t hdrlen;
+	int ret = -1;
+	FILE *fp;
+
+	if (vault->prev_key_count == RVAULT_MAX_PREV_KEYS) {
+		app_log(LOG_CRIT, APP_NAME": too many previous keys");
+		return -1;
+	}
+	if ((fp = fopen(recovery, "r")) == NULL) {
+		app_elog(LOG_CRIT, APP_NAME": could not open `%s'", recovery);
+		return -1;
+	}
+	sections = rvault_recovery_import(fp);
+	fclose(fp);
+	if (!sections) {
+		return -1;
+	}
+	hdr = sections[RECOVERY_METADATA].buf;
+	hdrlen = sections[RECOVERY_METADATA].nbytes;
+
+	/*
+	 * Verify the metadata: it must be using the same algorithms
+	 * and must have a different key epoch.
+	 */
+	if (hdrlen < RVAULT_HDR_LEN || !RVAULT_ABI_VALID_P(hdr->ver) ||
+	    !RVAULT_ABI_EPOCH_VALID_P(hdr->ver, hdr->key_epoch) ||
+	    RVAULT_FILE_LEN(hdr) != hdrlen) {
+		app_log(LOG_CRIT, APP_NAME": invalid metadata in `%s'",
+		    recovery);
+		goto out;
+	}
+	if (hdr->cipher0 != vault->cipher || hdr->hmac_id != vault->hmac_id) {
+		app_log(LOG_CRIT, APP_NAME": the previous key in `%s' must "
+		    "use the same cipher and MAC", recovery);
+		goto out;
+	}
+	if (rvault_get_crypto(vault, hdr->key_epoch) != NULL) {
+		app_log(LOG_CRIT, APP_NAME": key epoch %u is already in use",
+		    hdr->key_epoch);
+		goto out;
+	}
+
+	/*
+	 * Create the crypto object and verify the HMAC.
+	 */
+	if ((crypto = crypto_create(hdr->cipher0, hdr->hmac_id)) == NULL) {
+		goto out;
+	}
+	if (crypto_set_iv(crypto, RVAULT_HDR_TO_IV0(hdr), hdr->iv0_len) == -1 ||
+	    crypto_set_key(crypto, sections[RECOVERY_EKEY].buf,
+	    sections[RECOVERY_EKEY].nbytes) == -1 ||
+	    crypto_set_authkey(crypto, sections[RECOVERY_AKEY].buf,
+	    sections[RECOVERY_AKEY].nbytes) == -1) {
+		app_log(LOG_CRIT, APP_NAME": invalid key in `%s'", recovery);
+		goto out;
+	}
+	if (rvault_hmac_verify(crypto, hdr) != 0) {
+		app_log(LOG_CRIT, APP_NAME": verification of `%s' failed",
+		    recovery);
+		goto out;
+	}
+
+	vault->prev_keys[vault->prev_key_count].epoch = hdr->key_epoch;
+	vault->prev_keys[vault->prev_key_count].crypto = crypto;
+	vault->prev_key_count++;
+	crypto = NULL;
+
+	app_log(LOG_INFO, "%s: added key epoch %u (current %u)",
+	    __func__, hdr->key_epoch, vault->key_epoch);
+	ret = 0;
+out:
+	if (crypto) {
+		crypto_destroy(crypto);
+	}
+	rvault_recovery_release(sections);
+	return ret;
+}
+
+/*
+ * rvault_get_crypto: get the crypto object for the given key epoch.
+ */
+crypto_t *
+rvault_get_crypto(rvault_t *vault, unsigned epoch)
+{
+	if (epoch == vault->key_epoch) {
+		return vault->crypto;
+	}
+	for (unsigned i = 0; i < vault->prev_key_count; i++) {
+		if (vault->prev_keys[i].epoch == epoch) {
+			return vault->prev_keys[i].crypto;
+		}
+	}
+	return NULL;
+}
+
 static void
 rvault_close_files(rvault_t *vault)
 {
@@ -617,7 +786,17 @@ rvault_close_files(rvault_t *vault)
 void
 rvault_close(rvault_t *vault)
 {
+	if (vault->rekey) {
+		rvault_rekey_stop(vault);
+	}
+	if (vault->preload) {
+		rvault_preload_stop(vault);
+	}
+	if (vault->trace) {
+		rvault_trace_close(vault);
+	}
 	rvault_close_files(vault);
+	rvault_index_close(vault);
 
 	if (vault->base_path) {
 		free(vault->base_path);
@@ -625,6 +804,10 @@ rvault_close(rvault_t *vault)
 	if (vault->crypto) {
 		crypto_destroy(vault->crypto);
 	}
+	for (unsigned i = 0; i < vault->prev_key_count; i++) {
+		crypto_destroy(vault->prev_keys[i].crypto);
+	}
+	pthread_mutex_destroy(&vault->lock);
 	free(vault);
 }
 
@@ -635,19 +818,30 @@ int
 rvault_iter_dir(rvault_t *vault, const char *path,
     void *arg, dir_iter_t iterfunc)
 {
-	struct dirent *dp;
 	char *vpath;
-	DIR *dirp;
+	int ret;
 
 	if ((vpath = rvault_resolve_path(vault, path, NULL)) == NULL) {
 		return -1;
 	}
-	dirp = opendir(vpath);
-	if (dirp == NULL) {
-		free(vpath);
+	ret = rvault_iter_vdir(vault, vpath, arg, iterfunc);
+	free(vpath);
+	return ret;
+}
+
+/*
+ * rvault_iter_vdir: iterate the directory, given its vault path.
+ */
+int
+rvault_iter_vdir(rvault_t *vault, const char *vpath,
+    void *arg, dir_iter_t iterfunc)
+{
+	struct dirent *dp;
+	DIR *dirp;
+
+	if ((dirp = opendir(vpath)) == NULL) {
 		return -1;
 	}
-	free(vpath);
 
 	while ((dp = readdir(dirp)) != NULL) {
 		const char *vname = dp->d_name;
@@ -680,3 +874,113 @@ rvault_iter_dir(rvault_t *vault, const char *path,
 	closedir(dirp);
 	return 0;
 }
+
+/*
+ * rvault_opendir: take a snapshot of the directory entries, given the
+ * vault path of the directory.
+ *
+ * => Only the encrypted names are read; the names are decrypted lazily,
+ *    as the entries are retrieved (see rvault_readdir()).
+ * => The directory descriptor is kept open, e.g. for fstatat().
+ */
+rvault_dir_t *
+rvault_opendir(rvault_t *vault, const char *vpath)
+{
+	rvault_dir_t *dir;
+	struct dirent *dp;
+	unsigned nitems = 0;
+	DIR *dirp;
+	int fd;
+
+	if ((dir = calloc(1, sizeof(rvault_dir_t))) == NULL) {
+		return NULL;
+	}
+	dir->vault = vault;
+	if ((dir->fd = open(vpath, O_RDONLY | O_DIRECTORY)) == -1) {
+		free(dir);
+		return NULL;
+	}
+	if ((fd = dup(dir->fd)) == -1 || (dirp = fdopendir(fd)) == NULL) {
+		if (fd != -1) {
+			close(fd);
+		}
+		rvault_closedir(dir);
+		return NULL;
+	}
+	while ((dp = readdir(dirp)) != NULL) {
+		const char *vname = dp->d_name;
+		rvault_dirent_t *ent;
+
+		/* See rvault_iter_vdir() on the special cases. */
+		if (strcmp(vname, ".") && strcmp(vname, "..") &&
+		    strncmp(vname, RVAULT_FOBJ_PREF, RVAULT_FOBJ_PREFLEN)) {
+			continue;
+		}
+		if (dir->count == nitems) {
+			const unsigned n = nitems ? nitems * 2 : 64;
+			void *entries;
+
+			entries = realloc(dir->entries, n * sizeof(*ent));
+			if (entries == NULL) {
+				goto err;
+			}
+			dir->entries = entries;
+			nitems = n;
+		}
+		ent = &dir->entries[dir->count];
+		memset(ent, 0, sizeof(rvault_dirent_t));
+		if ((ent->vname = strdup(vname)) == NULL) {
+			goto err;
+		}
+		ent->type = DTTOIF(dp->d_type);
+		dir->count++;
+	}
+	closedir(dirp);
+	return dir;
+err:
+	closedir(dirp);
+	rvault_closedir(dir);
+	return NULL;
+}
+
+/*
+ * rvault_readdir: get the directory entry at the given index or, if
+ * its name cannot be decrypted, the next one; update the index.
+ *
+ * => Returns NULL if there are no more entries.
+ */
+const rvault_dirent_t *
+rvault_readdir(rvault_dir_t *dir, unsigned *idx)
+{
+	for (unsigned i = *idx; i < dir->count; i++) {
+		rvault_dirent_t *ent = &dir->entries[i];
+		const char *vname = ent->vname;
+
+		if (ent->name == NULL && !ent->invalid) {
+			ent->name = (strcmp(vname, ".") == 0 ||
+			    strcmp(vname, "..") == 0) ? strdup(vname) :
+			    rvault_resolve_vname(dir->vault, vname, NULL);
+			ent->invalid = ent->name == NULL;
+		}
+		if (ent->name) {
+			*idx = i;
+			return ent;
+		}
+	}
+	*idx = dir->count;
+	return NULL;
+}
+
+void
+rvault_closedir(rvault_dir_t *dir)
+{
+	for (unsigned i = 0; i < dir->count; i++) {
+		free(dir->entries[i].name);
+		free(dir->entries[i].vname);
+	}
+	if (dir->fd != -1) {
+		close(dir->fd);
+	}
+	free(dir->entries);
+	free(dir);
+}
@@ -8,39 +8,238 @@
 #ifndef	_RVAULT_H_
 #define	_RVAULT_H_
 
+#include <sys/types.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
 #include <sys/queue.h>
 #include "crypto.h"
 
 #define	APP_NAME		"rvault"
 #define	APP_PROJ_VER		"0.3"
 
+/*
+ * Maximum number of previous keys retained for the online re-keying.
+ */
+#define	RVAULT_MAX_PREV_KEYS	4
+
+typedef struct {
+	unsigned		epoch;
+	crypto_t *		crypto;
+} rvault_key_t;
+
+/*
+ * Statistics: counters and latency histograms.
+ *
+ * => Bucket i counts the latencies below 2^i microseconds (and at least
+ *    2^(i-1), except the first one); the last bucket has no upper bound.
+ */
+#define	RVAULT_HIST_NBUCKETS	24
+
+typedef struct {
+	atomic_uint_fast64_t	count;
+	atomic_uint_fast64_t	total_us;
+	atomic_uint_fast64_t	buckets[RVAULT_HIST_NBUCKETS];
+} rvault_hist_t;
+
+typedef enum {
+	RVAULT_OP_LOOKUP = 0,
+	RVAULT_OP_FORGET,
+	RVAULT_OP_GETATTR,
+	RVAULT_OP_SETATTR,
+	RVAULT_OP_MKDIR,
+	RVAULT_OP_UNLINK,
+	RVAULT_OP_RMDIR,
+	RVAULT_OP_RENAME,
+	RVAULT_OP_CREATE,
+	RVAULT_OP_OPEN,
+	RVAULT_OP_READ,
+	RVAULT_OP_WRITE,
+	RVAULT_OP_FLUSH,
+	RVAULT_OP_FSYNC,
+	RVAULT_OP_RELEASE,
+	RVAULT_OP_OPENDIR,
+	RVAULT_OP_READDIR,
+	RVAULT_OP_READDIRPLUS,
+	RVAULT_OP_RELEASEDIR,
+	RVAULT_OP_STATFS,
+	RVAULT_OP_FALLOCATE,
+	RVAULT_OP_COPY_FILE_RANGE,
+	RVAULT_OP_LSEEK,
+	RVAULT_OP_GETXATTR,
+	RVAULT_OP_LISTXATTR,
+	RVAULT_OP_SETXATTR,
+	RVAULT_OP_REMOVEXATTR,
+	RVAULT_OP_COUNT
+} rvault_op_t;
+
+#define	RVAULT_STATS_NCIPHERS	(CHACHA20_POLY1305 + 1)
+
+typedef struct {
+	atomic_uint_fast64_t	nsyncs;		// data write-backs
+	atomic_uint_fast64_t	nsyncs_skipped;	// skipped: data unchanged
+	atomic_uint_fast64_t	nfsyncs;	// fsync(2) of the data
+
+	/* File system operations. */
+	rvault_hist_t		ops[RVAULT_OP_COUNT];
+
+	/* Storage: the object reads and writes (the plain data bytes). */
+	rvault_hist_t		storage_read;
+	rvault_hist_t		storage_write;
+	atomic_uint_fast64_t	read_bytes;
+	atomic_uint_fast64_t	write_bytes;
+
+	/* Encrypted and decrypted bytes, by the cipher. */
+	atomic_uint_fast64_t	enc_bytes[RVAULT_STATS_NCIPHERS];
+	atomic_uint_fast64_t	dec_bytes[RVAULT_STATS_NCIPHERS];
+
+	/* Compression: the input and the compressed bytes. */
+	atomic_uint_fast64_t	comp_in;
+	atomic_uint_fast64_t	comp_out;
+
+	/* Preload cache lookups. */
+	atomic_uint_fast64_t	preload_hits;
+	atomic_uint_fast64_t	preload_misses;
+} rvault_stats_t;
+
+/*
+ * RVAULT_HIST_SCOPE: record the time spent in the rest of the scope
+ * (i.e. until it is left, by any means) into the histogram.
+ *
+ * RVAULT_OP_SCOPE: likewise, but for the file system operation; also
+ * fires the fuse_op_start and fuse_op_done probes (see probes.h) and,
+ * if tracing, records the operation into the trace (see trace.c).  The
+ * arguments of the operation are set with RVAULT_OP_TRACE() and the
+ * second path, if any, with RVAULT_OP_TRACE2().
+ */
+typedef struct rvault_trace rvault_trace_t;
+typedef struct rvault_trace_rec rvault_trace_rec_t;
+
+typedef struct {
+	rvault_hist_t *		hist;
+	uint64_t		start;
+	int			op;
+	rvault_trace_rec_t *	trec;
+} rvault_hist_scope_t;
+
+#define	RVAULT_HIST_SCOPE(h)	RVAULT_SCOPE((h), -1, NULL)
+#define	RVAULT_OP_SCOPE(v, op)	RVAULT_SCOPE(&(v)->stats.ops[(op)], (op), \
+    (v)->trace ? rvault_trace_begin((v)->trace) : NULL)
+
+#define	RVAULT_SCOPE(h, op, trec)					\
+    rvault_hist_scope_t __hist_scope					\
+    __attribute__((__cleanup__(rvault_hist_scope_end))) =		\
+    { (h), rvault_hist_scope_start(op), (op), (trec) }
+
+#define	RVAULT_OP_TRACE(path, arg, off, len)				\
+    do {								\
+	if (__hist_scope.trec) {					\
+		rvault_trace_args(__hist_scope.trec,			\
+		    (path), (arg), (off), (len));			\
+	}								\
+    } while (0)
+
+#define	RVAULT_OP_TRACE2(path2)						\
+    do {								\
+	if (__hist_scope.trec) {					\
+		rvault_trace_path2(__hist_scope.trec, (path2));		\
+	}								\
+    } while (0)
+
 struct fileobj;
+struct rvault_rekey;
+struct rvault_preload;
+typedef struct rvault_index rvault_index_t;
 
 typedef struct {
 	char *			base_path;
 	const char *		server_url;
 	bool			weak_sync;
 	bool			compress;
+	bool			read_only;
+	bool			direct_io;
 
+	unsigned		abi_ver;
 	crypto_cipher_t		cipher;
 	crypto_hmac_t		hmac_id;
 	crypto_t *		crypto;
+	unsigned		key_epoch;
 	uint8_t			uid[16];
 
+	/*
+	 * Previous keys, if the data is being re-keyed, and the
+	 * background sweeper converting the objects.
+	 */
+	rvault_key_t		prev_keys[RVAULT_MAX_PREV_KEYS];
+	unsigned		prev_key_count;
+	struct rvault_rekey *	rekey;
+
+	/* Mount-time cache warming (optional). */
+	struct rvault_preload *	preload;
+
+	/* Trace of the file system operations (optional). */
+	rvault_trace_t *	trace;
+
+	/*
+	 * Lock protecting the file list and the replacement of the
+	 * file objects on disk.
+	 */
+	pthread_mutex_t		lock;
 	LIST_HEAD(, fileobj)	file_list;
 	unsigned		file_count;
+
+	/* File name index (optional). */
+	rvault_index_t *	index;
+
+	rvault_stats_t		stats;
 } rvault_t;
 
 void *		open_metadata_mmap(const char *, char **, size_t *);
 
 int		rvault_init(const char *, const char *, const char *,
-		    const char *, const char *, const char *, unsigned);
+		    const char *, const char *, const char *, unsigned,
+		    unsigned);
 rvault_t *	rvault_open(const char *, const char *, const char *);
 rvault_t *	rvault_open_ekey(const char *, const char *);
+rvault_t *	rvault_dup(const rvault_t *);
 void		rvault_close(rvault_t *);
 
+int		rvault_add_prev_key(rvault_t *, const char *);
+crypto_t *	rvault_get_crypto(rvault_t *, unsigned);
+
+int		rvault_rekey_sweep(rvault_t *);
+int		rvault_rekey_start(rvault_t *);
+void		rvault_rekey_stop(rvault_t *);
+
+uint64_t	rvault_stats_now(void);
+const char *	rvault_op_name(unsigned);
+void		rvault_hist_put(rvault_hist_t *, uint64_t);
+uint64_t	rvault_hist_add(rvault_hist_t *, uint64_t);
+uint64_t	rvault_hist_quantile(const rvault_hist_t *, uint64_t, unsigned);
+uint64_t	rvault_hist_scope_start(int);
+void		rvault_hist_scope_end(rvault_hist_scope_t *);
+char *		rvault_stats_render(rvault_t *, unsigned);
+void		rvault_stats_log(rvault_t *);
+int		rvault_stats_start(rvault_t *);
+void		rvault_stats_stop(void);
+
+#define	RVAULT_STATS_JSON	0
+#define	RVAULT_STATS_PROM	1
+
+/*
+ * Trace of the file system operations (see trace.c).
+ */
+int		rvault_trace_open(rvault_t *, const char *);
+void		rvault_trace_close(rvault_t *);
+rvault_trace_rec_t *rvault_trace_begin(rvault_trace_t *);
+void		rvault_trace_args(rvault_trace_rec_t *, const char *,
+		    int64_t, int64_t, uint64_t);
+void		rvault_trace_path2(rvault_trace_rec_t *, const char *);
+void		rvault_trace_end(rvault_trace_rec_t *, int, uint64_t,
+		    uint64_t);
+
 int		rvault_push_key(rvault_t *);
 int		rvault_pull_key(rvault_t *);
 int		rvault_unhex_aedata(const char *, void **, size_t *,
@@ -50,7 +249,96 @@ struct dirent;
 typedef void (*dir_iter_t)(void *, const char *, struct dirent *);
 
 int		rvault_iter_dir(rvault_t *, const char *, void *, dir_iter_t);
+int		rvault_iter_vdir(rvault_t *, const char *, void *, dir_iter_t);
+/*
+ * Directory snapshot, with the names decrypted lazily.
+ */
+typedef struct {
+	char *			vname;		// encrypted name
+	char *			name;		// plain name, once decrypted
+	bool			invalid;	// the name cannot be decrypted
+	mode_t			type;		// file type (S_IFMT), if known
+} rvault_dirent_t;
+
+typedef struct {
+	rvault_t *		vault;
+	int			fd;
+	unsigned		count;
+	rvault_dirent_t *	entries;
+} rvault_dir_t;
+
+rvault_dir_t *	rvault_opendir(rvault_t *, const char *);
+const rvault_dirent_t *rvault_readdir(rvault_dir_t *, unsigned *);
+void		rvault_closedir(rvault_dir_t *);
+
 char *		rvault_resolve_path(rvault_t *, const char *, size_t *);
 char *		rvault_resolve_vname(rvault_t *, const char *, size_t *);
+char *		rvault_encrypt_vname(rvault_t *, const char *, size_t);
+
+/*
+ * Parallel traversal of the vault (see walk.c).
+ */
+struct stat;
+
+typedef struct {
+	rvault_t *		vault;	// vault handle of the worker
+	unsigned		worker;	// worker index
+	unsigned		depth;	// depth relative to the start
+	const char *		path;	// plain path
+	const char *		name;	// plain name
+	const char *		vpath;	// path to the file object
+	const struct stat *	st;
+} rvault_walk_ent_t;
+
+#define	RVAULT_WALK_PRUNE	1
+#define	RVAULT_WALK_MAX_WORKERS	64
+
+typedef int (*walk_func_t)(void *, const rvault_walk_ent_t *);
+
+unsigned	rvault_walk_workers(void);
+int		rvault_walk(rvault_t *, const char *, unsigned, void *,
+		    walk_func_t);
+
+/*
+ * Mount-time cache warming (see preload.c).
+ */
+int		rvault_preload_setup(rvault_t *, const char *, size_t);
+int		rvault_preload_start(rvault_t *);
+void		rvault_preload_stop(rvault_t *);
+void		rvault_preload_touch(rvault_t *);
+int		rvault_preload_lookup(rvault_t *, const char *, char **,
+		    struct stat *);
+struct fileobj *rvault_preload_open(rvault_t *, const char *, int);
+
+/*
+ * File name index (see index.c).
+ */
+typedef void (*index_iter_t)(void *, const char *, bool);
+
+int		rvault_index_open(rvault_t *);
+void		rvault_index_close(rvault_t *);
+int		rvault_index_sync(rvault_t *);
+int		rvault_index_rebuild(rvault_t *, unsigned);
+int		rvault_index_add(rvault_t *, const char *, bool);
+int		rvault_index_remove(rvault_t *, const char *);
+int		rvault_index_rename(rvault_t *, const char *, const char *);
+int		rvault_index_find(rvault_t *, const char *, void *,
+		    index_iter_t);
+
+/*
+ * Ciphertext-only backup (see backup.c).
+ */
+#define	RVAULT_BACKUP_DELETE	0x01	// delete the removed objects
+
+typedef struct {
+	size_t			nobjects;
+	unsigned		ncopied;
+	uint64_t		nbytes;
+	unsigned		ndeleted;
+	unsigned		nerrors;
+} rvault_backup_stats_t;
+
+int		rvault_backup(const char *, const char *, const char *,
+		    unsigned, unsigned, rvault_backup_stats_t *);
 
 #endif
@@ -65,6 +65,7 @@ sdb_init(sqlite3 *db)
 static sdb_t *
 sdb_open(rvault_t *vault)
 {
+	storage_extents_t se = { NULL, 0, 0 };
 	sdb_t *sdb = NULL;
 	sqlite3 *db = NULL;
 	ssize_t len = 0, flen;
@@ -88,7 +89,8 @@ sdb_open(rvault_t *vault)
 	if ((flen = fs_file_size(fd)) == -1) {
 		goto out;
 	}
-	if (flen && (len = storage_read_data(vault, fd, flen, &sbuf)) == -1) {
+	if (flen && (len = storage_read_extents(vault, fd, flen, &sbuf,
+	    storage_extents_add, &se)) == -1) {
 		goto out;
 	}
 
@@ -108,7 +110,7 @@ sdb_open(rvault_t *vault)
 			goto out;
 		}
 		memcpy(db_buf, sbuf.buf, len);
-		sbuffer_free(&sbuf);
+		storage_extents_free(&se, &sbuf);
 
 		/*
 		 * Note: if sqlite3_deserialize() fails, it will free the
@@ -132,9 +134,7 @@ sdb_open(rvault_t *vault)
 	sdb->fd = fd;
 	return sdb;
 out:
-	if (sbuf.buf) {
-		sbuffer_free(&sbuf);
-	}
+	storage_extents_free(&se, &sbuf);
 	if (db) {
 		sqlite3_close(db);
 	}
@@ -0,0 +1,513 @@
+/*
+ * Copyright (c) 2020 Mindaugas Rasiukevicius <rmind at noxt eu>
+ * All rights reserved.
+ *
+ * Use is subject to license terms, as specified in the LICENSE file.
+ */
+
+/*
+ * Statistics: counters and latency histograms.
+ *
+ * The counters are embedded in the vault (see rvault_stats_t) and are
+ * updated with the relaxed atomic operations, i.e. without any locks;
+ * the readers take an approximate snapshot.  The latencies are recorded
+ * into the histograms with the power-of-two buckets of microseconds.
+ *
+ * The statistics can be rendered as JSON or in the Prometheus text
+ * exposition format, and logged on SIGUSR1 (see rvault_stats_start()).
+ *
+ * => The background workers (re-keying, preloading) operate on their
+ *    own vault handles, therefore their I/O is not accounted here.
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+
+#include "rvault.h"
+#include "probes.h"
+#include "utils.h"
+
+static const char *	op_names[RVAULT_OP_COUNT] = {
+	[RVAULT_OP_LOOKUP]		= "lookup",
+	[RVAULT_OP_FORGET]		= "forget",
+	[RVAULT_OP_GETATTR]		= "getattr",
+	[RVAULT_OP_SETATTR]		= "setattr",
+	[RVAULT_OP_MKDIR]		= "mkdir",
+	[RVAULT_OP_UNLINK]		= "unlink",
+	[RVAULT_OP_RMDIR]		= "rmdir",
+	[RVAULT_OP_RENAME]		= "rename",
+	[RVAULT_OP_CREATE]		= "create",
+	[RVAULT_OP_OPEN]		= "open",
+	[RVAULT_OP_READ]		= "read",
+	[RVAULT_OP_WRITE]		= "write",
+	[RVAULT_OP_FLUSH]		= "flush",
+	[RVAULT_OP_FSYNC]		= "fsync",
+	[RVAULT_OP_RELEASE]		= "release",
+	[RVAULT_OP_OPENDIR]		= "opendir",
+	[RVAULT_OP_READDIR]		= "readdir",
+	[RVAULT_OP_READDIRPLUS]		= "readdirplus",
+	[RVAULT_OP_RELEASEDIR]		= "releasedir",
+	[RVAULT_OP_STATFS]		= "statfs",
+	[RVAULT_OP_FALLOCATE]		= "fallocate",
+	[RVAULT_OP_COPY_FILE_RANGE]	= "copy_file_range",
+	[RVAULT_OP_LSEEK]		= "lseek",
+	[RVAULT_OP_GETXATTR]		= "getxattr",
+	[RVAULT_OP_LISTXATTR]		= "listxattr",
+	[RVAULT_OP_SETXATTR]		= "setxattr",
+	[RVAULT_OP_REMOVEXATTR]		= "removexattr",
+};
+
+#define	STAT_LOAD(v)	atomic_load_explicit(&(v), memory_order_relaxed)
+
+/*
+ * rvault_stats_now: get the monotonic time in microseconds.
+ */
+uint64_t
+rvault_stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * rvault_op_name: get the name of the file system operation.
+ */
+const char *
+rvault_op_name(unsigned op)
+{
+	ASSERT(op < RVAULT_OP_COUNT);
+	return op_names[op];
+}
+
+/*
+ * rvault_hist_put: record the latency (in microseconds).
+ */
+void
+rvault_hist_put(rvault_hist_t *hist, uint64_t us)
+{
+	unsigned i = us ? flsl((long)us) : 0;
+
+	i = MIN(i, RVAULT_HIST_NBUCKETS - 1);
+	atomic_fetch_add_explicit(&hist->buckets[i], 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&hist->total_us, us, memory_order_relaxed);
+	atomic_fetch_add_explicit(&hist->count, 1, memory_order_relaxed);
+}
+
+/*
+ * rvault_hist_add: record the time elapsed since the given start time;
+ * returns the elapsed time in microseconds.
+ */
+uint64_t
+rvault_hist_add(rvault_hist_t *hist, uint64_t start)
+{
+	const uint64_t us = rvault_stats_now() - start;
+
+	rvault_hist_put(hist, us);
+	return us;
+}
+
+uint64_t
+rvault_hist_scope_start(int op)
+{
+	if (op >= 0) {
+		RVAULT_PROBE1(fuse_op_start, op_names[op]);
+	}
+	return rvault_stats_now();
+}
+
+void
+rvault_hist_scope_end(rvault_hist_scope_t *scope)
+{
+	const uint64_t us = rvault_hist_add(scope->hist, scope->start);
+
+	if (scope->op >= 0) {
+		RVAULT_PROBE2(fuse_op_done, op_names[scope->op], us);
+	}
+	if (scope->trec) {
+		rvault_trace_end(scope->trec, scope->op, scope->start, us);
+	}
+}
+
+/*
+ * rvault_hist_quantile: get the upper bound of the bucket with the
+ * quantile, in microseconds; zero if it falls into the last (unbounded)
+ * bucket.  The count is of the snapshot taken by the caller.
+ */
+uint64_t
+rvault_hist_quantile(const rvault_hist_t *hist, uint64_t count, unsigned pct)
+{
+	const uint64_t target = (count * pct + 99) / 100;
+	uint64_t n = 0;
+
+	for (unsigned i = 0; i < RVAULT_HIST_NBUCKETS - 1; i++) {
+		if ((n += STAT_LOAD(hist->buckets[i])) >= target) {
+			return UINT64_C(1) << i;
+		}
+	}
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////
+
+/*
+ * JSON.
+ */
+
+static void
+json_hist(FILE *fp, const char *name, const rvault_hist_t *hist)
+{
+	fprintf(fp, "\"%s\": {\"count\": %ju, \"total_us\": %ju, "
+	    "\"buckets\": [", name, (uintmax_t)STAT_LOAD(hist->count),
+	    (uintmax_t)STAT_LOAD(hist->total_us));
+	for (unsigned i = 0; i < RVAULT_HIST_NBUCKETS; i++) {
+		fprintf(fp, "%s%ju", i ? ", " : "",
+		    (uintmax_t)STAT_LOAD(hist->buckets[i]));
+	}
+	fprintf(fp, "]}");
+}
+
+static void
+stats_render_json(FILE *fp, rvault_stats_t *stats)
+{
+	const char *sep = "";
+
+	fprintf(fp, "{\n  \"syncs\": {\"writebacks\": %ju, "
+	    "\"skipped\": %ju, \"fsyncs\": %ju},\n",
+	    (uintmax_t)STAT_LOAD(stats->nsyncs),
+	    (uintmax_t)STAT_LOAD(stats->nsyncs_skipped),
+	    (uintmax_t)STAT_LOAD(stats->nfsyncs));
+
+	fprintf(fp, "  \"ops\": {");
+	for (unsigned i = 0; i < RVAULT_OP_COUNT; i++) {
+		if (STAT_LOAD(stats->ops[i].count) == 0) {
+			continue;
+		}
+		fprintf(fp, "%s\n    ", sep);
+		json_hist(fp, op_names[i], &stats->ops[i]);
+		sep = ",";
+	}
+	fprintf(fp, "\n  },\n");
+
+	fprintf(fp, "  \"storage\": {\n    ");
+	json_hist(fp, "read", &stats->storage_read);
+	fprintf(fp, ",\n    ");
+	json_hist(fp, "write", &stats->storage_write);
+	fprintf(fp, ",\n    \"read_bytes\": %ju, "
+	    "\"write_bytes\": %ju\n  },\n",
+	    (uintmax_t)STAT_LOAD(stats->read_bytes),
+	    (uintmax_t)STAT_LOAD(stats->write_bytes));
+
+	sep = "";
+	fprintf(fp, "  \"crypto\": {");
+	for (unsigned i = 0; i < RVAULT_STATS_NCIPHERS; i++) {
+		const char *cipher = crypto_cipher_name(i);
+
+		if (cipher == NULL) {
+			continue;
+		}
+		fprintf(fp, "%s\n    \"%s\": {\"encrypted_bytes\": %ju, "
+		    "\"decrypted_bytes\": %ju}", sep, cipher,
+		    (uintmax_t)STAT_LOAD(stats->enc_bytes[i]),
+		    (uintmax_t)STAT_LOAD(stats->dec_bytes[i]));
+		sep = ",";
+	}
+	fprintf(fp, "\n  },\n");
+
+	fprintf(fp, "  \"compression\": {\"in_bytes\": %ju, "
+	    "\"out_bytes\": %ju},\n",
+	    (uintmax_t)STAT_LOAD(stats->comp_in),
+	    (uintmax_t)STAT_LOAD(stats->comp_out));
+	fprintf(fp, "  \"preload\": {\"hits\": %ju, \"misses\": %ju}\n}\n",
+	    (uintmax_t)STAT_LOAD(stats->preload_hits),
+	    (uintmax_t)STAT_LOAD(stats->preload_misses));
+}
+
+/*
+ * Prometheus text exposition format.
+ */
+
+static void
+prom_hist(FILE *fp, const char *metric, const char *labels,
+    const rvault_hist_t *hist)
+{
+	uint64_t n = 0;
+
+	for (unsigned i = 0; i < RVAULT_HIST_NBUCKETS - 1; i++) {
+		n += STAT_LOAD(hist->buckets[i]);
+		fprintf(fp, "%s_bucket{%s,le=\"%g\"} %ju\n", metric, labels,
+		    (double)(UINT64_C(1) << i) / 1e6, (uintmax_t)n);
+	}
+	fprintf(fp, "%s_bucket{%s,le=\"+Inf\"} %ju\n", metric, labels,
+	    (uintmax_t)STAT_LOAD(hist->count));
+	fprintf(fp, "%s_sum{%s} %g\n", metric, labels,
+	    (double)STAT_LOAD(hist->total_us) / 1e6);
+	fprintf(fp, "%s_count{%s} %ju\n", metric, labels,
+	    (uintmax_t)STAT_LOAD(hist->count));
+}
+
+static void
+stats_render_prom(FILE *fp, rvault_stats_t *stats)
+{
+	char labels[64];
+
+	fprintf(fp, "# TYPE rvault_syncs_total counter\n");
+	fprintf(fp, "rvault_syncs_total{type=\"writeback\"} %ju\n",
+	    (uintmax_t)STAT_LOAD(stats->nsyncs));
+	fprintf(fp, "rvault_syncs_total{type=\"skipped\"} %ju\n",
+	    (uintmax_t)STAT_LOAD(stats->nsyncs_skipped));
+	fprintf(fp, "rvault_syncs_total{type=\"fsync\"} %ju\n",
+	    (uintmax_t)STAT_LOAD(stats->nfsyncs));
+
+	fprintf(fp, "# TYPE rvault_op_duration_seconds histogram\n");
+	for (unsigned i = 0; i < RVAULT_OP_COUNT; i++) {
+		if (STAT_LOAD(stats->ops[i].count) == 0) {
+			continue;
+		}
+		snprintf(labels, sizeof(labels), "op=\"%s\"", op_names[i]);
+		prom_hist(fp, "rvault_op_duration_seconds", labels,
+		    &stats->ops[i]);
+	}
+
+	fprintf(fp, "# TYPE rvault_storage_duration_seconds histogram\n");
+	prom_hist(fp, "rvault_storage_duration_seconds", "op=\"read\"",
+	    &stats->storage_read);
+	prom_hist(fp, "rvault_storage_duration_seconds", "op=\"write\"",
+	    &stats->storage_write);
+	fprintf(fp, "# TYPE rvault_storage_bytes_total counter\n");
+	fprintf(fp, "rvault_storage_bytes_total{op=\"read\"} %ju\n",
+	    (uintmax_t)STAT_LOAD(stats->read_bytes));
+	fprintf(fp, "rvault_storage_bytes_total{op=\"write\"} %ju\n",
+	    (uintmax_t)STAT_LOAD(stats->write_bytes));
+
+	fprintf(fp, "# TYPE rvault_crypto_bytes_total counter\n");
+	for (unsigned i = 0; i < RVAULT_STATS_NCIPHERS; i++) {
+		const char *cipher = crypto_cipher_name(i);
+
+		if (cipher == NULL) {
+			continue;
+		}
+		fprintf(fp, "rvault_crypto_bytes_total{cipher=\"%s\","
+		    "op=\"encrypt\"} %ju\n", cipher,
+		    (uintmax_t)STAT_LOAD(stats->enc_bytes[i]));
+		fprintf(fp, "rvault_crypto_bytes_total{cipher=\"%s\","
+		    "op=\"decrypt\"} %ju\n", cipher,
+		    (uintmax_t)STAT_LOAD(stats->dec_bytes[i]));
+	}
+
+	fprintf(fp, "# TYPE rvault_compression_bytes_total counter\n");
+	fprintf(fp, "rvault_compression_bytes_total{type=\"in\"} %ju\n",
+	    (uintmax_t)STAT_LOAD(stats->comp_in));
+	fprintf(fp, "rvault_compression_bytes_total{type=\"out\"} %ju\n",
+	    (uintmax_t)STAT_LOAD(stats->comp_out));
+
+	fprintf(fp, "# TYPE rvault_preload_lookups_total counter\n");
+	fprintf(fp, "rvault_preload_lookups_total{result=\"hit\"} %ju\n",
+	    (uintmax_t)STAT_LOAD(stats->preload_hits));
+	fprintf(fp, "rvault_preload_lookups_total{result=\"miss\"} %ju\n",
+	    (uintmax_t)STAT_LOAD(stats->preload_misses));
+}
+
+/*
+ * rvault_stats_render: render the statistics in the given format.
+ *
+ * => Returns a NUL-terminated string, which the caller must free.
+ */
+char *
+rvault_stats_render(rvault_t *vault, unsigned fmt)
+{
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *fp;
+
+	if ((fp = open_memstream(&buf, &len)) == NULL) {
+		return NULL;
+	}
+	switch (fmt) {
+	case RVAULT_STATS_JSON:
+		stats_render_json(fp, &vault->stats);
+		break;
+	case RVAULT_STATS_PROM:
+		stats_render_prom(fp, &vault->stats);
+		break;
+	default:
+		ASSERT(false);
+		break;
+	}
+	if (fclose(fp) != 0) {
+		free(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+static void
+log_hist(const char *name, const rvault_hist_t *hist)
+{
+	const uint64_t count = STAT_LOAD(hist->count);
+
+	if (count == 0) {
+		return;
+	}
+	app_log(LOG_INFO, "%s: %ju calls, avg %ju us, "
+	    "p50 < %ju us, p99 < %ju us", name, (uintmax_t)count,
+	    (uintmax_t)(STAT_LOAD(hist->total_us) / count),
+	    (uintmax_t)rvault_hist_quantile(hist, count, 50),
+	    (uintmax_t)rvault_hist_quantile(hist, count, 99));
+}
+
+/*
+ * rvault_stats_log: log the summary of the statistics.
+ *
+ * => The percentiles are the upper bounds of the histogram buckets
+ *    (zero if the bucket has no bound).
+ */
+void
+rvault_stats_log(rvault_t *vault)
+{
+	rvault_stats_t *stats = &vault->stats;
+	char name[64];
+
+	for (unsigned i = 0; i < RVAULT_OP_COUNT; i++) {
+		snprintf(name, sizeof(name), "op %s", op_names[i]);
+		log_hist(name, &stats->ops[i]);
+	}
+	log_hist("storage read", &stats->storage_read);
+	log_hist("storage write", &stats->storage_write);
+
+	for (unsigned i = 0; i < RVAULT_STATS_NCIPHERS; i++) {
+		const char *cipher = crypto_cipher_name(i);
+
+		if (cipher && (STAT_LOAD(stats->enc_bytes[i]) ||
+		    STAT_LOAD(stats->dec_bytes[i]))) {
+			app_log(LOG_INFO, "%s: encrypted %ju bytes, "
+			    "decrypted %ju bytes", cipher,
+			    (uintmax_t)STAT_LOAD(stats->enc_bytes[i]),
+			    (uintmax_t)STAT_LOAD(stats->dec_bytes[i]));
+		}
+	}
+	if (STAT_LOAD(stats->comp_in)) {
+		app_log(LOG_INFO, "compression: %ju -> %ju bytes (%.1f%%)",
+		    (uintmax_t)STAT_LOAD(stats->comp_in),
+		    (uintmax_t)STAT_LOAD(stats->comp_out),
+		    100.0 * STAT_LOAD(stats->comp_out) /
+		    STAT_LOAD(stats->comp_in));
+	}
+	if (STAT_LOAD(stats->preload_hits) ||
+	    STAT_LOAD(stats->preload_misses)) {
+		app_log(LOG_INFO, "preload: %ju hits, %ju misses",
+		    (uintmax_t)STAT_LOAD(stats->preload_hits),
+		    (uintmax_t)STAT_LOAD(stats->preload_misses));
+	}
+	app_log(LOG_INFO, "write-backs: %ju, skipped (unchanged): %ju, "
+	    "fsyncs: %ju", (uintmax_t)STAT_LOAD(stats->nsyncs),
+	    (uintmax_t)STAT_LOAD(stats->nsyncs_skipped),
+	    (uintmax_t)STAT_LOAD(stats->nfsyncs));
+}
+
+///////////////////////////////////////////////////////////////////////////
+
+/*
+ * Logging on SIGUSR1.
+ *
+ * The signal handler only writes a byte into a pipe (self-pipe), while
+ * a thread reads it and does the logging.  The thread exits once the
+ * write end of the pipe is closed.
+ */
+
+static int		stats_pipe[2] = { -1, -1 };
+static pthread_t	stats_thread;
+
+static void
+stats_sighandler(int sig __unused)
+{
+	const int e = errno;
+
+	(void)write(stats_pipe[1], "", 1);
+	errno = e;
+}
+
+static void *
+stats_logger(void *arg)
+{
+	rvault_t *vault = arg;
+	char c;
+
+	for (;;) {
+		ssize_t ret = read(stats_pipe[0], &c, 1);
+
+		if (ret == -1 && errno == EINTR) {
+			continue;
+		}
+		if (ret <= 0) {
+			break;
+		}
+		rvault_stats_log(vault);
+	}
+	return NULL;
+}
+
+/*
+ * rvault_stats_start: log the statistics of the vault on SIGUSR1.
+ *
+ * => Must be called after daemonizing, since the thread would not
+ *    survive the fork (e.g. from the file system initialization).
+ */
+int
+rvault_stats_start(rvault_t *vault)
+{
+	struct sigaction sa;
+
+	if (pipe(stats_pipe) == -1) {
+		return -1;
+	}
+	(void)fcntl(stats_pipe[1], F_SETFL, O_NONBLOCK);
+	if ((errno = pthread_create(&stats_thread, NULL,
+	    stats_logger, vault)) != 0) {
+		goto err;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stats_sighandler;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGUSR1, &sa, NULL) == -1) {
+		const int e = errno;
+
+		rvault_stats_stop();
+		errno = e;
+		return -1;
+	}
+	return 0;
+err:
+	close(stats_pipe[0]);
+	close(stats_pipe[1]);
+	stats_pipe[0] = stats_pipe[1] = -1;
+	return -1;
+}
+
+void
+rvault_stats_stop(void)
+{
+	if (stats_pipe[1] == -1) {
+		return;
+	}
+	signal(SIGUSR1, SIG_IGN);
+	close(stats_pipe[1]);
+	stats_pipe[1] = -1;
+	pthread_join(stats_thread, NULL);
+	close(stats_pipe[0]);
+	stats_pipe[0] = -1;
+}
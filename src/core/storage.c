@@ -16,6 +16,11 @@
  * The storage mechanism concerns: 1) providing sufficient low-level
  * primitives for the file object (fileobj_t) interface)  2) the ABI
  * of the file metadata  3) authenticated encryption at a file level.
+ *
+ * The ciphertext is never re-read without decrypting it again, so there
+ * is no point in keeping it in the page cache.  In the direct I/O mode
+ * (vault->direct_io), the objects are written bypassing the page cache
+ * (see storage_write_direct()) and their pages are dropped after reads.
  */
 
 #include <sys/mman.h>
@@ -36,19 +41,28 @@
 #include "fileobj.h"
 #include "crypto.h"
 #include "sys.h"
+#include "probes.h"
 #include "utils.h"
 
+/*
+ * Alignment of the buffers and the I/O lengths for O_DIRECT: the page
+ * size covers the logical block size of the common devices.
+ */
+#define	STORAGE_DIO_ALIGN	4096
+
 /*
  * storage_new_obj: compute the lengths, allocate the memory buffer as
  * well as populate the file header.
  */
 static fileobj_hdr_t *
-storage_new_obj(const rvault_t *vault, size_t len, size_t cdata_len)
+storage_new_obj(const rvault_t *vault, unsigned flags,
+    size_t len, size_t cdata_len)
 {
 	crypto_t *crypto = vault->crypto;
 	const size_t etarget = cdata_len ? cdata_len : len;
 	size_t max_len, meta_len, aetag_len;
 	fileobj_hdr_t *hdr;
+	void *buf;
 
 	/*
 	 * AEAD or HMAC-based generic composition using the EtM scheme.
@@ -63,7 +77,16 @@ storage_new_obj(const rvault_t *vault, size_t len, size_t cdata_len)
 	 */
 	meta_len = FILEOBJ_GETMETA_LEN(aetag_len);
 	max_len = meta_len + crypto_get_buflen(crypto, etarget);
-	if ((hdr = malloc(max_len)) == NULL) {
+	if (vault->direct_io) {
+		/* Aligned and with the space for the padding. */
+		max_len = roundup2(max_len, STORAGE_DIO_ALIGN);
+		if (posix_memalign(&buf, STORAGE_DIO_ALIGN, max_len) != 0) {
+			buf = NULL;
+		}
+	} else {
+		buf = malloc(max_len);
+	}
+	if ((hdr = buf) == NULL) {
 		app_log(LOG_ERR, "buffer allocation failed");
 		return NULL;
 	}
@@ -72,13 +95,14 @@ storage_new_obj(const rvault_t *vault, size_t len, size_t cdata_len)
 	/*
 	 * Setup the header and set it as the AAD.
 	 */
-	hdr->ver = RVAULT_ABI_VER;
-	hdr->flags = vault->compress ? FILEOBJ_FLAG_LZ4 : 0;
+	hdr->ver = vault->abi_ver;
+	hdr->flags = flags;
 	hdr->aetag_len = aetag_len;
 	hdr->data_len = htobe64(len);
 	hdr->cdata_len = htobe64(cdata_len);
 	hdr->edata_pad = 0; // to be set
 	hdr->mtime = htobe64(time(NULL));
+	hdr->key_epoch = htobe32(vault->key_epoch);
 	return hdr;
 }
 
@@ -107,11 +131,15 @@ storage_encrypt(rvault_t *vault, fileobj_hdr_t *hdr,
 		app_log(LOG_ERR, "crypto_set_aad() failed");
 		return -1;
 	}
+	RVAULT_PROBE1(storage_encrypt_start, len);
 	nbytes = crypto_encrypt(crypto, buf, len, enc_buf, enc_len);
+	RVAULT_PROBE2(storage_encrypt_done, len, nbytes);
 	if (nbytes == -1) {
 		app_log(LOG_ERR, "encryption failed");
 		return -1;
 	}
+	atomic_fetch_add(&vault->stats.enc_bytes[crypto_get_cipher(crypto)],
+	    len);
 
 	/*
 	 * Obtain the AE tag and copy it over.
@@ -128,42 +156,85 @@ storage_encrypt(rvault_t *vault, fileobj_hdr_t *hdr,
 }
 
 /*
- * storage_write_data: encrypt the given buffer and write to the file.
+ * storage_drop_cache: drop the (clean) pages of the object file.
+ */
+static void
+storage_drop_cache(int fd)
+{
+#if defined(POSIX_FADV_DONTNEED)
+	(void)posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#else
+	(void)fd;
+#endif
+}
+
+/*
+ * storage_write_direct: write the object bypassing the page cache, i.e.
+ * using O_DIRECT, with the length padded to the alignment and the file
+ * then truncated back to the object length.  If O_DIRECT is not supported
+ * (e.g. by the file system), then write normally and drop the pages.
  *
- * => Constructs metadata and stores together with encrypted data.
- * => On success: returns the total number of bytes written to the file.
- * => On error: return -1 and sets 'errno'.
+ * => The buffer must be aligned and have the space for the padding
+ *    (see storage_new_obj()).
+ * => The file must be empty, with the offset at zero.
  */
-ssize_t
-storage_write_data(rvault_t *vault, int fd, const void *buf, size_t len)
+static int
+storage_write_direct(int fd, void *buf, size_t len)
 {
-	fileobj_hdr_t *hdr;
-	size_t data_len = len, cdata_len = 0;
-	sbuffer_t sbuf;
-	ssize_t nbytes;
+#if defined(O_DIRECT)
+	const size_t dlen = roundup2(len, STORAGE_DIO_ALIGN);
+	int flags;
 
-	ASSERT(len > 0);
-	memset(&sbuf, 0, sizeof(sbuffer_t));
+	ASSERT(((uintptr_t)buf & (STORAGE_DIO_ALIGN - 1)) == 0);
 
-	/*
-	 * Compress the data.
-	 */
-	if (vault->compress) {
-		if ((nbytes = lz4_compress_buf(buf, len, &sbuf)) == -1) {
-			app_log(LOG_ERR, "compression failed");
+	if ((flags = fcntl(fd, F_GETFL)) != -1 &&
+	    fcntl(fd, F_SETFL, flags | O_DIRECT) == 0) {
+		ssize_t nbytes;
+
+		memset((uint8_t *)buf + len, 0, dlen - len);
+		nbytes = fs_write(fd, buf, dlen);
+		(void)fcntl(fd, F_SETFL, flags);
+
+		if (nbytes == (ssize_t)dlen) {
+			if (ftruncate(fd, len) == -1) {
+				return -1;
+			}
+			fs_sync(fd, NULL);
+			return 0;
+		}
+		if (lseek(fd, 0, SEEK_SET) == -1 || ftruncate(fd, 0) == -1) {
 			return -1;
 		}
-		cdata_len = nbytes;
-		buf = sbuf.buf;
-		len = nbytes;
 	}
+#endif
+	if (fs_write_sync(fd, buf, len) != (ssize_t)len) {
+		return -1;
+	}
+
+	/* The pages are clean after the sync. */
+	storage_drop_cache(fd);
+	return 0;
+}
+
+/*
+ * storage_write_obj: construct the file object with the given encryption
+ * target, encrypt and write it to the file.
+ */
+static ssize_t
+storage_write_obj(rvault_t *vault, int fd, unsigned flags, size_t data_len,
+    const void *buf, size_t len)
+{
+	const size_t cdata_len = (flags != 0) ? len : 0;
+	fileobj_hdr_t *hdr;
+	ssize_t nbytes;
+	RVAULT_HIST_SCOPE(&vault->stats.storage_write);
 
 	/*
 	 * Construct file object and encrypt.
 	 */
-	if ((hdr = storage_new_obj(vault, data_len, cdata_len)) == NULL) {
-		nbytes = -1;
-		goto err;
+	hdr = storage_new_obj(vault, flags, data_len, cdata_len);
+	if (hdr == NULL) {
+		return -1;
 	}
 	if ((nbytes = storage_encrypt(vault, hdr, buf, len)) == -1) {
 		goto err;
@@ -177,19 +248,124 @@ storage_write_data(rvault_t *vault, int fd, const void *buf, size_t len)
 		nbytes = -1;
 		goto err;
 	}
-	if (fs_write(fd, hdr, nbytes) != nbytes) {
+	if (vault->direct_io) {
+		if (storage_write_direct(fd, hdr, nbytes) == -1) {
+			nbytes = -1;
+			goto err;
+		}
+	} else if (fs_write_sync(fd, hdr, nbytes) != nbytes) {
 		nbytes = -1;
 		goto err;
 	}
-	fs_sync(fd, NULL);
+	atomic_fetch_add(&vault->stats.nfsyncs, 1);
+	atomic_fetch_add(&vault->stats.write_bytes, data_len);
 err:
-	if (vault->compress) {
-		sbuffer_free(&sbuf);
-	}
 	free(hdr);
 	return nbytes;
 }
 
+/*
+ * storage_write_data: encrypt the given buffer and write to the file.
+ *
+ * => Constructs metadata and stores together with encrypted data.
+ * => On success: returns the total number of bytes written to the file.
+ * => On error: return -1 and sets 'errno'.
+ */
+ssize_t
+storage_write_data(rvault_t *vault, int fd, const void *buf, size_t len)
+{
+	sbuffer_t sbuf;
+	ssize_t nbytes;
+
+	ASSERT(len > 0);
+
+	if (!vault->compress) {
+		return storage_write_obj(vault, fd, 0, len, buf, len);
+	}
+
+	/*
+	 * Compress the data.
+	 */
+	memset(&sbuf, 0, sizeof(sbuffer_t));
+	if ((nbytes = lz4_compress_buf(buf, len, &sbuf)) == -1) {
+		app_log(LOG_ERR, "compression failed");
+		return -1;
+	}
+	atomic_fetch_add(&vault->stats.comp_in, len);
+	atomic_fetch_add(&vault->stats.comp_out, nbytes);
+	nbytes = storage_write_obj(vault, fd, FILEOBJ_FLAG_LZ4, len,
+	    sbuf.buf, nbytes);
+	sbuffer_free(&sbuf);
+	return nbytes;
+}
+
+/*
+ * storage_write_sparse: store the given extents of the buffer as a
+ * sparse object; the rest of the buffer (of the given length) is zeros.
+ *
+ * => The extents must be in ascending order and must not overlap.
+ * => If the vault predates the sparse objects, the whole buffer is
+ *    stored as a regular object.
+ * => On success: returns the total number of bytes written to the file.
+ * => On error: return -1 and sets 'errno'.
+ */
+ssize_t
+storage_write_sparse(rvault_t *vault, int fd, const void *buf, size_t len,
+    const storage_extent_t *exts, unsigned n)
+{
+	size_t plen = STORAGE_SPARSE_HDRLEN(n);
+	uint64_t *map, off = 0;
+	sbuffer_t sbuf;
+	ssize_t nbytes;
+	uint8_t *pbuf;
+
+	ASSERT(len > 0);
+
+	if (!RVAULT_ABI_SPARSE_P(vault)) {
+		return storage_write_data(vault, fd, buf, len);
+	}
+
+	/*
+	 * Build the sparse image: the extent map and the data.
+	 */
+	for (unsigned i = 0; i < n; i++) {
+		ASSERT(exts[i].len > 0 && exts[i].off >= off);
+		ASSERT(exts[i].off + exts[i].len <= len);
+		off = exts[i].off + exts[i].len;
+		plen += exts[i].len;
+	}
+	if ((pbuf = sbuffer_alloc(&sbuf, plen)) == NULL) {
+		app_log(LOG_ERR, "buffer allocation failed");
+		return -1;
+	}
+	map = (void *)pbuf;
+	map[0] = htobe64(n);
+	off = STORAGE_SPARSE_HDRLEN(n);
+	for (unsigned i = 0; i < n; i++) {
+		map[1 + (i * 2)] = htobe64(exts[i].off);
+		map[2 + (i * 2)] = htobe64(exts[i].len);
+		memcpy(&pbuf[off], (const uint8_t *)buf + exts[i].off,
+		    exts[i].len);
+		off += exts[i].len;
+	}
+	ASSERT(off == plen);
+
+	nbytes = storage_write_obj(vault, fd, FILEOBJ_FLAG_SPARSE, len,
+	    pbuf, plen);
+	sbuffer_free(&sbuf);
+	return nbytes;
+}
+
+/*
+ * storage_hdr_valid_p: check the object version and the key epoch.
+ */
+static bool
+storage_hdr_valid_p(const fileobj_hdr_t *hdr)
+{
+	return RVAULT_ABI_VALID_P(hdr->ver) &&
+	    RVAULT_ABI_EPOCH_VALID_P(hdr->ver, FILEOBJ_KEY_EPOCH(hdr));
+}
+
 /*
  * storage_map_obj: memory-map the data file.
  *
@@ -211,7 +387,8 @@ storage_map_obj(rvault_t *vault, int fd, size_t file_len)
 		return NULL;
 	}
 	aetag_len = crypto_get_aetaglen(vault->crypto);
-	if (FILEOBJ_FILE_LEN(hdr) != (uint64_t)file_len ||
+	if (!storage_hdr_valid_p(hdr) ||
+	    FILEOBJ_FILE_LEN(hdr) != (uint64_t)file_len ||
 	    FILEOBJ_AETAG_LEN(hdr) != (uint64_t)aetag_len) {
 		app_log(LOG_ERR, "data file corrupted");
 		errno = EIO;
@@ -234,14 +411,26 @@ storage_decrypt(rvault_t *vault, const fileobj_hdr_t *hdr, sbuffer_t *sbuf)
 	const void *enc_buf, *ae_tag;
 	ssize_t nbytes = -1;
 	sbuffer_t tmpsbuf;
+	crypto_t *crypto;
+	unsigned epoch;
 	void *buf = NULL;
 
+	/*
+	 * Select the key the object was encrypted with.
+	 */
+	epoch = FILEOBJ_KEY_EPOCH(hdr);
+	if ((crypto = rvault_get_crypto(vault, epoch)) == NULL) {
+		app_log(LOG_ERR, "no key for the key epoch %u", epoch);
+		errno = EACCES;
+		return -1;
+	}
+
 	/*
 	 * Obtain and set the AE tag.
 	 */
 	ae_tag = FILEOBJ_HDR_TO_AETAG(hdr);
 	ae_tag_len = FILEOBJ_AETAG_LEN(hdr);
-	if (crypto_set_aetag(vault->crypto, ae_tag, ae_tag_len) == -1) {
+	if (crypto_set_aetag(crypto, ae_tag, ae_tag_len) == -1) {
 		app_log(LOG_ERR, "failed to obtain the AE tag");
 		goto out;
 	}
@@ -256,7 +445,7 @@ storage_decrypt(rvault_t *vault, const fileobj_hdr_t *hdr, sbuffer_t *sbuf)
 	memcpy(ae_hdr, hdr, FILEOBJ_HDR_LEN);
 	ae_hdr->edata_pad = 0;
 
-	if (crypto_set_aad(vault->crypto, ae_hdr, FILEOBJ_HDR_LEN) == -1) {
+	if (crypto_set_aad(crypto, ae_hdr, FILEOBJ_HDR_LEN) == -1) {
 		app_log(LOG_ERR, "crypto_set_aad() failed");
 		goto out;
 	}
@@ -266,19 +455,23 @@ storage_decrypt(rvault_t *vault, const fileobj_hdr_t *hdr, sbuffer_t *sbuf)
 	 * verification will be performed by the crypto_decrypt() primitive.
 	 */
 	edata_len = FILEOBJ_EDATA_LEN(hdr);
-	buflen = crypto_get_buflen(vault->crypto, edata_len);
+	buflen = crypto_get_buflen(crypto, edata_len);
 	if ((buf = sbuffer_alloc(&tmpsbuf, buflen)) == NULL) {
 		app_log(LOG_ERR, "buffer allocation failed");
 		goto out;
 	}
 	enc_buf = FILEOBJ_HDR_TO_DATA(hdr);
-	nbytes = crypto_decrypt(vault->crypto, enc_buf, edata_len, buf, buflen);
+	RVAULT_PROBE1(storage_decrypt_start, edata_len);
+	nbytes = crypto_decrypt(crypto, enc_buf, edata_len, buf, buflen);
+	RVAULT_PROBE2(storage_decrypt_done, edata_len, nbytes);
 	if (nbytes == -1 || FILEOBJ_ETARGET_LEN(hdr) != (size_t)nbytes) {
 		app_log(LOG_ERR, "decryption failed");
 		sbuffer_free(&tmpsbuf);
 		nbytes = -1;
 		goto out;
 	}
+	atomic_fetch_add(&vault->stats.dec_bytes[crypto_get_cipher(crypto)],
+	    edata_len);
 	sbuffer_replace(&tmpsbuf, sbuf);
 out:
 	free(ae_hdr);
@@ -306,22 +499,105 @@ storage_decompress(const fileobj_hdr_t *hdr, sbuffer_t *sbuf)
 }
 
 /*
- * storage_read_data: decrypt the data in the file and return a buffer.
+ * storage_unpack: expand the sparse image into the buffer of the full
+ * data length, reporting the extents to the given iterator.
+ *
+ * => Only the extents are written, therefore the holes are not touched.
+ */
+static ssize_t
+storage_unpack(const fileobj_hdr_t *hdr, sbuffer_t *sbuf,
+    storage_extent_iter_t iter, void *arg)
+{
+	const size_t data_len = FILEOBJ_DATA_LEN(hdr);
+	const size_t plen = FILEOBJ_CDATA_LEN(hdr);
+	const uint8_t *pbuf = sbuf->buf;
+	const uint64_t *map = sbuf->buf;
+	uint64_t n, off, doff = 0;
+	sbuffer_t tmpsbuf;
+	uint8_t *buf;
+
+	/*
+	 * Validate the extent map.
+	 */
+	if (plen < STORAGE_SPARSE_HDRLEN(0) || data_len == 0) {
+		goto bad;
+	}
+	n = be64toh(map[0]);
+	if (n > (plen - STORAGE_SPARSE_HDRLEN(0)) / sizeof(storage_extent_t)) {
+		goto bad;
+	}
+	off = STORAGE_SPARSE_HDRLEN(n);
+	for (uint64_t i = 0; i < n; i++) {
+		const uint64_t eoff = be64toh(map[1 + (i * 2)]);
+		const uint64_t elen = be64toh(map[2 + (i * 2)]);
+
+		if (elen == 0 || eoff < doff || eoff > data_len ||
+		    elen > data_len - eoff || elen > plen - off) {
+			goto bad;
+		}
+		doff = eoff + elen;
+		off += elen;
+	}
+	if (off != plen) {
+		goto bad;
+	}
+	for (uint64_t i = 0; iter && i < n; i++) {
+		if (iter(arg, be64toh(map[1 + (i * 2)]),
+		    be64toh(map[2 + (i * 2)])) == -1) {
+			return -1;
+		}
+	}
+
+	/*
+	 * Expand the data.  Note: the buffer memory is zero-filled.
+	 */
+	if ((buf = sbuffer_alloc(&tmpsbuf, data_len)) == NULL) {
+		app_log(LOG_ERR, "buffer allocation failed");
+		return -1;
+	}
+	off = STORAGE_SPARSE_HDRLEN(n);
+	for (uint64_t i = 0; i < n; i++) {
+		const uint64_t eoff = be64toh(map[1 + (i * 2)]);
+		const uint64_t elen = be64toh(map[2 + (i * 2)]);
+
+		memcpy(&buf[eoff], &pbuf[off], elen);
+		off += elen;
+	}
+	sbuffer_replace(&tmpsbuf, sbuf);
+	return data_len;
+bad:
+	app_log(LOG_ERR, "sparse data corrupted");
+	errno = EIO;
+	return -1;
+}
+
+/*
+ * storage_read_extents: decrypt the data in the file and return a buffer,
+ * reporting the ranges with data (if the object is sparse, the extents;
+ * otherwise, the whole buffer) to the given iterator, if any.
  *
  * => AE verification is performed for metadata and data.
  * => On success: returns decrypted data length and fills 'sbuf'.
  * => On error: returns -1 and sets 'errno'.
  */
 ssize_t
-storage_read_data(rvault_t *vault, int fd, size_t file_len, sbuffer_t *sbuf)
+storage_read_extents(rvault_t *vault, int fd, size_t file_len,
+    sbuffer_t *sbuf, storage_extent_iter_t iter, void *arg)
 {
 	fileobj_hdr_t *hdr;
 	ssize_t nbytes = -1;
 	sbuffer_t tmpsbuf;
+	RVAULT_HIST_SCOPE(&vault->stats.storage_read);
 
 	if ((hdr = storage_map_obj(vault, fd, file_len)) == NULL) {
 		return -1;
 	}
+	if ((hdr->flags & ~FILEOBJ_FLAGS_MASK) != 0) {
+		app_log(LOG_ERR, "unsupported file object flags 0x%x; "
+		    "created using a newer application version?", hdr->flags);
+		errno = ENOTSUP;
+		goto out;
+	}
 	if (FILEOBJ_EDATA_LEN(hdr) == 0) {
 		/*
 		 * Note: it is currently an error to have no encrypted data.
@@ -342,22 +618,113 @@ storage_read_data(rvault_t *vault, int fd, size_t file_len, sbuffer_t *sbuf)
 			goto out;
 		}
 	}
+	if (FILEOBJ_SPARSE_P(hdr)) {
+		nbytes = storage_unpack(hdr, &tmpsbuf, iter, arg);
+		if (nbytes == -1) {
+			sbuffer_free(&tmpsbuf);
+			goto out;
+		}
+	} else if (iter && iter(arg, 0, nbytes) == -1) {
+		sbuffer_free(&tmpsbuf);
+		nbytes = -1;
+		goto out;
+	}
 	ASSERT(FILEOBJ_DATA_LEN(hdr) == (size_t)nbytes);
 	sbuffer_replace(&tmpsbuf, sbuf);
+	atomic_fetch_add(&vault->stats.read_bytes, nbytes);
 out:
 	safe_munmap(hdr, file_len, 0);
+	if (vault->direct_io) {
+		storage_drop_cache(fd);
+	}
 	return nbytes;
 }
 
+/*
+ * storage_read_data: decrypt the data in the file and return a buffer.
+ *
+ * => AE verification is performed for metadata and data.
+ * => On success: returns decrypted data length and fills 'sbuf'.
+ * => On error: returns -1 and sets 'errno'.
+ */
+ssize_t
+storage_read_data(rvault_t *vault, int fd, size_t file_len, sbuffer_t *sbuf)
+{
+	return storage_read_extents(vault, fd, file_len, sbuf, NULL, NULL);
+}
+
+/*
+ * storage_extents_add: the extent iterator (see storage_read_extents())
+ * collecting the extents into storage_extents_t.
+ */
+int
+storage_extents_add(void *arg, uint64_t off, uint64_t len)
+{
+	storage_extents_t *se = arg;
+
+	if (se->n == se->max) {
+		const unsigned max = se->max ? (se->max << 1) : 16;
+		storage_extent_t *exts;
+
+		exts = realloc(se->exts, max * sizeof(storage_extent_t));
+		if (exts == NULL) {
+			return -1;
+		}
+		se->exts = exts;
+		se->max = max;
+	}
+	se->exts[se->n].off = off;
+	se->exts[se->n].len = len;
+	se->n++;
+	return 0;
+}
+
+/*
+ * storage_extents_free: erase the extents of the data and free the
+ * buffer, as well as the extents.
+ *
+ * => The holes of a sparse object are not touched, so that they do
+ *    not get backed by the memory pages.
+ */
+void
+storage_extents_free(storage_extents_t *se, sbuffer_t *sbuf)
+{
+	if (sbuf->buf) {
+		for (unsigned i = 0; i < se->n; i++) {
+			crypto_memzero((uint8_t *)sbuf->buf + se->exts[i].off,
+			    se->exts[i].len);
+		}
+		sbuffer_release(sbuf);
+	}
+	free(se->exts);
+	memset(se, 0, sizeof(storage_extents_t));
+}
+
+/*
+ * storage_read_hdr: read the header of the file object.
+ *
+ * => Only the header is read; the AE tag and data are not verified.
+ * => The file offset is not changed.
+ */
+int
+storage_read_hdr(int fd, fileobj_hdr_t *hdr)
+{
+	if (pread(fd, hdr, FILEOBJ_HDR_LEN, 0) != FILEOBJ_HDR_LEN ||
+	    !storage_hdr_valid_p(hdr)) {
+		app_log(LOG_ERR, "data file corrupted");
+		errno = EIO;
+		return -1;
+	}
+	return 0;
+}
+
 ssize_t
 storage_read_length(rvault_t *vault __unused, int fd)
 {
 	unsigned char buf[FILEOBJ_HDR_LEN];
 	fileobj_hdr_t *hdr = (void *)buf;
 
-	if (fs_read(fd, hdr, FILEOBJ_HDR_LEN) != FILEOBJ_HDR_LEN) {
-		app_log(LOG_ERR, "data file corrupted");
-		errno = EIO;
+	if (storage_read_hdr(fd, hdr) == -1) {
 		return -1;
 	}
 	return FILEOBJ_DATA_LEN(hdr);
@@ -15,9 +15,25 @@
  * rvault storage ABI.
  */
 
-#define	RVAULT_ABI_VER		3
+/*
+ * Vault ABI version.  Version 4 introduced the key epochs and the sparse
+ * file objects; the version 3 vaults are still supported, but no sparse
+ * objects are created in them, so that they remain accessible to the
+ * older versions.  In the version 3 headers, the key epoch field is the
+ * reserved byte or padding, therefore it must be zero.
+ */
+#define	RVAULT_ABI_VER		4
+#define	RVAULT_ABI_VER_MIN	3
+#define	RVAULT_ABI_SPARSE_P(v)	((v)->abi_ver >= 4)
+
+#define	RVAULT_ABI_VALID_P(ver)	\
+    ((ver) >= RVAULT_ABI_VER_MIN && (ver) <= RVAULT_ABI_VER)
+#define	RVAULT_ABI_EPOCH_VALID_P(ver, epoch)	((ver) >= 4 || (epoch) == 0)
 #define	RVAULT_META_FILE	"rvault.metadata"
 #define	RVAULT_SDB_FILE		"rvault.sdb"
+#define	RVAULT_INDEX_FILE	"rvault.index"
+#define	RVAULT_CHECKPOINT_FILE	"rvault.checkpoint"
+#define	RVAULT_TOMBSTONES_FILE	"rvault.tombstones"
 
 #define	RVAULT_FOBJ_PREF	"RV:"
 #define	RVAULT_FOBJ_PREFLEN	(sizeof(RVAULT_FOBJ_PREF) - 1)
@@ -59,7 +75,7 @@ typedef struct {
 	uint8_t		cipher0;
 	uint8_t		cipher1;
 	uint8_t		hmac_id;
-	uint8_t		reserved;
+	uint8_t		key_epoch;
 
 	uint8_t		iv0_len;
 	uint8_t		iv1_len;
@@ -103,6 +119,10 @@ typedef struct {
 
 #define	FILEOBJ_FLAG_CHUNK	(1U << 0)	// file chunking (not yet used)
 #define	FILEOBJ_FLAG_LZ4	(1U << 1)	// use LZ4 compression
+#define	FILEOBJ_FLAG_SPARSE	(1U << 2)	// sparse object (see below)
+
+/* The flags an object may have; anything else is not supported. */
+#define	FILEOBJ_FLAGS_MASK	(FILEOBJ_FLAG_LZ4 | FILEOBJ_FLAG_SPARSE)
 
 typedef struct {
 	uint8_t		ver;
@@ -112,10 +132,18 @@ typedef struct {
 	uint64_t	data_len;
 	uint64_t	cdata_len;
 	uint64_t	mtime;
+	uint32_t	key_epoch;
 } __attribute__((packed)) fileobj_hdr_t;
 
+/*
+ * Note: the key epoch occupies what used to be the header padding,
+ * therefore the objects created before it was introduced (version 3)
+ * have epoch 0.  See RVAULT_ABI_EPOCH_VALID_P().
+ */
 #define	FILEOBJ_HDR_LEN		STORAGE_ALIGN(sizeof(fileobj_hdr_t))
 #define	FILEOBJ_LZ4_P(h)	(((h)->flags & FILEOBJ_FLAG_LZ4) != 0)
+#define	FILEOBJ_SPARSE_P(h)	(((h)->flags & FILEOBJ_FLAG_SPARSE) != 0)
+#define	FILEOBJ_KEY_EPOCH(h)	(be32toh((h)->key_epoch))
 
 #define	FILEOBJ_AETAG_LEN(h)	((h)->aetag_len)
 #define	FILEOBJ_DATA_LEN(h)	(be64toh((h)->data_len))
@@ -126,19 +154,68 @@ typedef struct {
 #define	FILEOBJ_HDR_TO_DATA(h)	\
     STORAGE_PTROFF((h), FILEOBJ_GETMETA_LEN(FILEOBJ_AETAG_LEN(h)))
 
+/*
+ * The length of the encryption target: the compressed or the sparse
+ * image length is stored as 'cdata_len', if either is used.
+ */
 #define	FILEOBJ_ETARGET_LEN(h)	\
-    (FILEOBJ_LZ4_P(h) ? FILEOBJ_CDATA_LEN(h) : FILEOBJ_DATA_LEN(h))
+    ((FILEOBJ_LZ4_P(h) || FILEOBJ_SPARSE_P(h)) ? \
+    FILEOBJ_CDATA_LEN(h) : FILEOBJ_DATA_LEN(h))
 #define	FILEOBJ_EDATA_LEN(h)	(FILEOBJ_ETARGET_LEN(h) + (h)->edata_pad)
 
 #define	FILEOBJ_FILE_LEN(h)	\
     (FILEOBJ_GETMETA_LEN(FILEOBJ_AETAG_LEN(h)) + FILEOBJ_EDATA_LEN(h))
 
+/*
+ * Sparse file object.  The encryption target is the extent map followed
+ * by the data of the extents; the holes, i.e. the ranges not covered by
+ * the extents, are zeros and are neither stored nor encrypted.
+ *
+ *	+-----------------------+
+ *	| number of extents	|
+ *	+-----------------------+
+ *	| extent: offset, len	| x N
+ *	+-----------------------+
+ *	| extent data		| x N
+ *	+-----------------------+
+ *
+ * The extents are in ascending order and do not overlap.  Sparse objects
+ * are not compressed.  All values are big-endian.
+ */
+
+typedef struct {
+	uint64_t	off;
+	uint64_t	len;
+} storage_extent_t;
+
+#define	STORAGE_SPARSE_HDRLEN(n)	\
+    (sizeof(uint64_t) + (n) * sizeof(storage_extent_t))
+
+typedef int (*storage_extent_iter_t)(void *, uint64_t, uint64_t);
+
+/*
+ * Extents of the data read (see storage_extents_add()), so that only
+ * they need to be erased rather than the whole buffer.
+ */
+typedef struct {
+	storage_extent_t *	exts;
+	unsigned		n;
+	unsigned		max;
+} storage_extents_t;
+
 /*
  * Storage API.
  */
 
 ssize_t	storage_write_data(rvault_t *, int, const void *, size_t);
+ssize_t	storage_write_sparse(rvault_t *, int, const void *, size_t,
+	    const storage_extent_t *, unsigned);
 ssize_t	storage_read_data(rvault_t *, int, size_t, sbuffer_t *);
+ssize_t	storage_read_extents(rvault_t *, int, size_t, sbuffer_t *,
+	    storage_extent_iter_t, void *);
 ssize_t	storage_read_length(rvault_t *, int);
+int	storage_extents_add(void *, uint64_t, uint64_t);
+void	storage_extents_free(storage_extents_t *, sbuffer_t *);
+int	storage_read_hdr(int, fileobj_hdr_t *);
 
 #endif
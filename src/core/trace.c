@@ -0,0 +1,959 @@
+/*
+ * Copyright (c) 2020 Mindaugas Rasiukevicius <rmind at noxt eu>
+ * All rights reserved.
+ *
+ * Use is subject to license terms, as specified in the LICENSE file.
+ */
+
+/*
+ * Trace of the file system operations and its replay ("replay" command).
+ *
+ * The mounted file system may record each operation into a text file,
+ * one per line:
+ *
+ *	time duration op path arg offset length [path2]
+ *
+ * where the time is the start of the operation (relative to the start
+ * of the trace) and the duration are in microseconds; the argument is
+ * operation-specific: the open flags, the lseek whence, the fallocate
+ * mode, whether setattr changes the size (given as the length) or the
+ * destination offset of copy_file_range.  The second path is of the
+ * rename target or of the copy_file_range destination.  Unused fields
+ * are zero; a missing path is "-".
+ *
+ * The trace does not contain any names or data: each path component is
+ * replaced by the truncated HMAC of the name, keyed with a random key
+ * which is discarded once the trace is closed.  Therefore, the same
+ * names map to the same identifiers within the trace and the structure
+ * of the tree is preserved, but the names cannot be recovered.
+ *
+ * The replay creates the tree in the given directory (e.g. the mount
+ * point of a scratch vault), populates the files with random data of
+ * the sizes implied by the reads, then performs the operations in the
+ * recorded order with the equivalent system calls and reports the
+ * latencies alongside the recorded ones.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#if defined(__linux__)
+#include <sys/xattr.h>
+#endif
+
+#include "rvault.h"
+#include "cli.h"
+#include "sys.h"
+#include "utils.h"
+
+#define	TRACE_VERSION		1
+#define	TRACE_ID_LEN		6	// bytes of HMAC per path component
+
+struct rvault_trace {
+	pthread_mutex_t		lock;
+	FILE *			fp;
+	crypto_t *		crypto;
+	uint64_t		start;
+};
+
+struct rvault_trace_rec {
+	rvault_trace_t *	trace;
+	char *			path;
+	char *			path2;
+	int64_t			arg;
+	int64_t			off;
+	uint64_t		len;
+};
+
+/*
+ * rvault_trace_open: start recording the operations into the file.
+ */
+int
+rvault_trace_open(rvault_t *vault, const char *fpath)
+{
+	unsigned char key[HMAC_MAX_BUFLEN];
+	rvault_trace_t *trace;
+	ssize_t klen;
+	int fd;
+
+	if ((trace = calloc(1, sizeof(rvault_trace_t))) == NULL) {
+		return -1;
+	}
+	trace->crypto = crypto_create(vault->cipher, CRYPTO_HMAC_PRIMARY);
+	if (trace->crypto == NULL) {
+		goto err;
+	}
+	klen = crypto_get_authkeylen(trace->crypto);
+	if (klen <= 0 || (size_t)klen > sizeof(key)) {
+		goto err;
+	}
+	if (crypto_getrandbytes(key, klen) != klen ||
+	    crypto_set_authkey(trace->crypto, key, klen) == -1) {
+		crypto_memzero(key, sizeof(key));
+		goto err;
+	}
+	crypto_memzero(key, sizeof(key));
+
+	fd = open(fpath, O_CREAT | O_TRUNC | O_WRONLY, 0600);
+	if (fd == -1 || (trace->fp = fdopen(fd, "w")) == NULL) {
+		app_elog(LOG_ERR, "%s: could not open `%s'", __func__, fpath);
+		if (fd != -1) {
+			close(fd);
+		}
+		goto err;
+	}
+	fprintf(trace->fp, "# " APP_NAME " trace %d\n"
+	    "# time duration op path arg offset length [path2]\n",
+	    TRACE_VERSION);
+
+	pthread_mutex_init(&trace->lock, NULL);
+	trace->start = rvault_stats_now();
+	vault->trace = trace;
+	return 0;
+err:
+	if (trace->crypto) {
+		crypto_destroy(trace->crypto);
+	}
+	free(trace);
+	return -1;
+}
+
+/*
+ * rvault_trace_close: flush the trace and destroy the key.
+ */
+void
+rvault_trace_close(rvault_t *vault)
+{
+	rvault_trace_t *trace = vault->trace;
+
+	if (fclose(trace->fp) != 0) {
+		app_elog(LOG_ERR, "%s: could not write the trace", __func__);
+	}
+	crypto_destroy(trace->crypto);
+	pthread_mutex_destroy(&trace->lock);
+	free(trace);
+	vault->trace = NULL;
+}
+
+/*
+ * trace_pathid: get the identifier of the path, i.e. the path with
+ * each component replaced by its truncated HMAC (in hex).
+ *
+ * => The caller must hold the trace lock.
+ */
+static char *
+trace_pathid(rvault_trace_t *trace, const char *path)
+{
+	unsigned char digest[HMAC_MAX_BUFLEN];
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *fp;
+
+	if ((fp = open_memstream(&buf, &len)) == NULL) {
+		return NULL;
+	}
+	while (*path != '\0') {
+		const size_t pclen = strcspn(path, "/");
+
+		if (pclen) {
+			if (crypto_hmac(trace->crypto, path, pclen,
+			    digest) < TRACE_ID_LEN) {
+				break;
+			}
+			fputc('/', fp);
+			hex_write(fp, digest, TRACE_ID_LEN);
+		}
+		path += pclen;
+		path += (*path == '/');
+	}
+	if (fflush(fp) == 0 && len == 0) {
+		fputc('/', fp);
+	}
+	if (fclose(fp) != 0 || *path != '\0') {
+		free(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+/*
+ * rvault_trace_begin: create a record for the operation being started.
+ */
+rvault_trace_rec_t *
+rvault_trace_begin(rvault_trace_t *trace)
+{
+	rvault_trace_rec_t *trec;
+
+	if ((trec = calloc(1, sizeof(rvault_trace_rec_t))) != NULL) {
+		trec->trace = trace;
+	}
+	return trec;
+}
+
+/*
+ * rvault_trace_args: set the arguments of the operation.
+ */
+void
+rvault_trace_args(rvault_trace_rec_t *trec, const char *path,
+    int64_t arg, int64_t off, uint64_t len)
+{
+	rvault_trace_t *trace = trec->trace;
+
+	if (path && !trec->path) {
+		pthread_mutex_lock(&trace->lock);
+		trec->path = trace_pathid(trace, path);
+		pthread_mutex_unlock(&trace->lock);
+	}
+	trec->arg = arg;
+	trec->off = off;
+	trec->len = len;
+}
+
+/*
+ * rvault_trace_path2: set the second path of the operation.
+ */
+void
+rvault_trace_path2(rvault_trace_rec_t *trec, const char *path)
+{
+	rvault_trace_t *trace = trec->trace;
+
+	if (path && !trec->path2) {
+		pthread_mutex_lock(&trace->lock);
+		trec->path2 = trace_pathid(trace, path);
+		pthread_mutex_unlock(&trace->lock);
+	}
+}
+
+/*
+ * rvault_trace_end: write the record of the completed operation.
+ */
+void
+rvault_trace_end(rvault_trace_rec_t *trec, int op, uint64_t start,
+    uint64_t us)
+{
+	rvault_trace_t *trace = trec->trace;
+
+	pthread_mutex_lock(&trace->lock);
+	fprintf(trace->fp, "%" PRIu64 " %" PRIu64 " %s %s %" PRId64
+	    " %" PRId64 " %" PRIu64 "%s%s\n", start - trace->start, us,
+	    rvault_op_name(op), trec->path ? trec->path : "-",
+	    trec->arg, trec->off, trec->len,
+	    trec->path2 ? " " : "", trec->path2 ? trec->path2 : "");
+	pthread_mutex_unlock(&trace->lock);
+
+	free(trec->path);
+	free(trec->path2);
+	free(trec);
+}
+
+///////////////////////////////////////////////////////////////////////////
+
+/*
+ * Replay.
+ */
+
+#define	REPLAY_NOOBJ		UINT_MAX
+#define	REPLAY_PATHLEN		4096
+#define	REPLAY_MIN_BUFSIZE	(64 * 1024)
+
+typedef struct {
+	const char *	path;		// path relative to the directory
+	bool		dir;
+	bool		created;	// created by the trace
+	bool		precreate;	// must exist before the replay
+	uint64_t	size;
+	int *		fds;
+	unsigned	nfds;
+	DIR *		dirp;
+} replay_obj_t;
+
+typedef struct {
+	unsigned	op;
+	unsigned	obj;
+	unsigned	obj2;
+	char *		path;
+	char *		path2;
+	int64_t		arg;
+	int64_t		off;
+	uint64_t	len;
+	uint64_t	us;
+} replay_rec_t;
+
+typedef struct {
+	replay_rec_t *	recs;
+	size_t		nrecs;
+	replay_obj_t *	objs;
+	unsigned	nobjs;
+	void *		buf;
+	size_t		bufsize;
+
+	rvault_hist_t	recorded[RVAULT_OP_COUNT];
+	rvault_hist_t	replayed[RVAULT_OP_COUNT];
+	uint64_t	nerrors[RVAULT_OP_COUNT];
+	uint64_t	nskipped[RVAULT_OP_COUNT];
+} replay_t;
+
+static int
+replay_op_id(const char *name)
+{
+	for (unsigned i = 0; i < RVAULT_OP_COUNT; i++) {
+		if (strcmp(rvault_op_name(i), name) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static int
+replay_parse(replay_rec_t *rec, const char *line)
+{
+	char op[32], path[REPLAY_PATHLEN], path2[REPLAY_PATHLEN];
+	uint64_t start;
+	int n, op_id;
+
+	n = sscanf(line, "%" SCNu64 " %" SCNu64 " %31s %4095s %" SCNd64
+	    " %" SCNd64 " %" SCNu64 " %4095s", &start, &rec->us, op, path,
+	    &rec->arg, &rec->off, &rec->len, path2);
+	if (n < 7 || (op_id = replay_op_id(op)) == -1) {
+		return -1;
+	}
+	rec->op = op_id;
+	rec->path = strcmp(path, "-") ? strdup(path) : NULL;
+	rec->path2 = (n == 8) ? strdup(path2) : NULL;
+	return 0;
+}
+
+static int
+replay_load(replay_t *rp, const char *fpath)
+{
+	size_t nalloc = 0, lsize = 0;
+	char *line = NULL;
+	unsigned lineno = 0;
+	ssize_t len;
+	FILE *fp;
+
+	if ((fp = fopen(fpath, "r")) == NULL) {
+		fprintf(stderr, "%s: %s\n", fpath, strerror(errno));
+		return -1;
+	}
+	while ((len = getline(&line, &lsize, fp)) > 0) {
+		replay_rec_t *rec;
+
+		lineno++;
+		if (line[0] == '#' || line[0] == '\n') {
+			continue;
+		}
+		if (rp->nrecs == nalloc) {
+			const size_t n = nalloc ? nalloc * 2 : 1024;
+			void *recs;
+
+			if ((recs = realloc(rp->recs,
+			    n * sizeof(replay_rec_t))) == NULL) {
+				goto err;
+			}
+			rp->recs = recs;
+			nalloc = n;
+		}
+		rec = &rp->recs[rp->nrecs];
+		memset(rec, 0, sizeof(replay_rec_t));
+		if (replay_parse(rec, line) == -1) {
+			fprintf(stderr, "%s:%u: invalid record\n",
+			    fpath, lineno);
+			goto err;
+		}
+		rp->nrecs++;
+	}
+	free(line);
+	fclose(fp);
+	return 0;
+err:
+	free(line);
+	fclose(fp);
+	return -1;
+}
+
+static int
+replay_pathcmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static int
+replay_objcmp(const void *key, const void *obj)
+{
+	return strcmp(key, ((const replay_obj_t *)obj)->path);
+}
+
+static unsigned
+replay_obj_idx(replay_t *rp, const char *path)
+{
+	const replay_obj_t *obj;
+
+	if (!path) {
+		return REPLAY_NOOBJ;
+	}
+	obj = bsearch(path, rp->objs, rp->nobjs, sizeof(replay_obj_t),
+	    replay_objcmp);
+	ASSERT(obj != NULL);
+	return obj - rp->objs;
+}
+
+/*
+ * replay_relpath: get the path relative to the directory; the paths
+ * in the trace are absolute.
+ */
+static const char *
+replay_relpath(const char *path)
+{
+	return path[1] ? &path[1] : ".";
+}
+
+/*
+ * replay_index: build the table of the objects, i.e. the unique paths,
+ * and determine which ones must exist before the replay and as what.
+ */
+static int
+replay_index(replay_t *rp)
+{
+	const char **paths;
+	size_t n = 0;
+
+	if ((paths = calloc(rp->nrecs * 2 + 1, sizeof(char *))) == NULL) {
+		return -1;
+	}
+	for (size_t i = 0; i < rp->nrecs; i++) {
+		if (rp->recs[i].path) {
+			paths[n++] = rp->recs[i].path;
+		}
+		if (rp->recs[i].path2) {
+			paths[n++] = rp->recs[i].path2;
+		}
+	}
+	qsort(paths, n, sizeof(char *), replay_pathcmp);
+
+	if ((rp->objs = calloc(n + 1, sizeof(replay_obj_t))) == NULL) {
+		free(paths);
+		return -1;
+	}
+	for (size_t i = 0; i < n; i++) {
+		if (rp->nobjs && strcmp(rp->objs[rp->nobjs - 1].path,
+		    paths[i]) == 0) {
+			continue;
+		}
+		rp->objs[rp->nobjs++].path = paths[i];
+	}
+	free(paths);
+
+	/*
+	 * Directories: the paths with the components under them.  Note:
+	 * the identifiers are in hex, therefore the children come right
+	 * after the parent in the sorted order.
+	 */
+	for (unsigned i = 0; i < rp->nobjs; i++) {
+		replay_obj_t *obj = &rp->objs[i];
+		const size_t len = strlen(obj->path);
+
+		if (len == 1) {
+			/* The root. */
+			obj->dir = true;
+			obj->created = true;
+			continue;
+		}
+		if (i + 1 < rp->nobjs &&
+		    strncmp(rp->objs[i + 1].path, obj->path, len) == 0 &&
+		    rp->objs[i + 1].path[len] == '/') {
+			obj->dir = true;
+		}
+	}
+
+	/*
+	 * An object must exist before the replay if it is used before
+	 * it is created by the trace (the lookups do not count, as they
+	 * precede the creation) or if it is never created.
+	 */
+	for (size_t i = 0; i < rp->nrecs; i++) {
+		replay_rec_t *rec = &rp->recs[i];
+		replay_obj_t *obj;
+
+		rec->obj = replay_obj_idx(rp, rec->path);
+		rec->obj2 = replay_obj_idx(rp, rec->path2);
+		rp->bufsize = MAX(rp->bufsize, rec->len);
+
+		if (rec->obj2 != REPLAY_NOOBJ &&
+		    rec->op == RVAULT_OP_RENAME) {
+			rp->objs[rec->obj2].created = true;
+		}
+		if (rec->obj == REPLAY_NOOBJ) {
+			continue;
+		}
+		obj = &rp->objs[rec->obj];
+
+		switch (rec->op) {
+		case RVAULT_OP_OPENDIR:
+		case RVAULT_OP_READDIR:
+		case RVAULT_OP_READDIRPLUS:
+		case RVAULT_OP_RELEASEDIR:
+		case RVAULT_OP_MKDIR:
+		case RVAULT_OP_RMDIR:
+			obj->dir = true;
+			break;
+		case RVAULT_OP_READ:
+		case RVAULT_OP_COPY_FILE_RANGE:
+			obj->size = MAX(obj->size, rec->off + rec->len);
+			break;
+		}
+
+		if (obj->created) {
+			continue;
+		}
+		switch (rec->op) {
+		case RVAULT_OP_CREATE:
+		case RVAULT_OP_MKDIR:
+			obj->created = true;
+			break;
+		case RVAULT_OP_LOOKUP:
+		case RVAULT_OP_GETATTR:
+		case RVAULT_OP_FORGET:
+			break;
+		default:
+			obj->precreate = true;
+			obj->created = true;
+		}
+	}
+	for (unsigned i = 0; i < rp->nobjs; i++) {
+		replay_obj_t *obj = &rp->objs[i];
+
+		obj->precreate |= !obj->created;
+		obj->path = replay_relpath(obj->path);
+	}
+	rp->bufsize = MAX(rp->bufsize, REPLAY_MIN_BUFSIZE);
+	return 0;
+}
+
+static void
+replay_mkparents(const char *path)
+{
+	char buf[REPLAY_PATHLEN], *p = buf;
+
+	snprintf(buf, sizeof(buf), "%s", path);
+	while ((p = strchr(p, '/')) != NULL) {
+		*p = '\0';
+		(void)mkdir(buf, 0700);
+		*p++ = '/';
+	}
+}
+
+/*
+ * replay_setup: create the objects which must exist before the replay;
+ * the files are filled with the random data.
+ */
+static int
+replay_create(replay_t *rp, const replay_obj_t *obj)
+{
+	uint64_t off = 0;
+	int fd;
+
+	replay_mkparents(obj->path);
+	if (obj->dir) {
+		return (mkdir(obj->path, 0700) == -1 && errno != EEXIST) ?
+		    -1 : 0;
+	}
+	if ((fd = open(obj->path, O_CREAT | O_TRUNC | O_WRONLY, 0600)) == -1) {
+		return -1;
+	}
+	while (off < obj->size) {
+		const size_t len = MIN(obj->size - off, rp->bufsize);
+
+		if (fs_write(fd, rp->buf, len) != (ssize_t)len) {
+			close(fd);
+			return -1;
+		}
+		off += len;
+	}
+	return close(fd);
+}
+
+static int
+replay_setup(replay_t *rp)
+{
+	for (unsigned i = 0; i < rp->nobjs; i++) {
+		const replay_obj_t *obj = &rp->objs[i];
+
+		if (obj->precreate && replay_create(rp, obj) == -1) {
+			fprintf(stderr, "could not create `%s': %s\n",
+			    obj->path, strerror(errno));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int
+replay_push_fd(replay_obj_t *obj, int fd)
+{
+	int *fds;
+
+	if (fd == -1) {
+		return -1;
+	}
+	if ((fds = realloc(obj->fds, (obj->nfds + 1) * sizeof(int))) == NULL) {
+		close(fd);
+		return -1;
+	}
+	fds[obj->nfds++] = fd;
+	obj->fds = fds;
+	return 0;
+}
+
+/*
+ * replay_fd: get the descriptor of the last open; if the file was not
+ * opened by the trace (e.g. the trace started later), then open it.
+ */
+static int
+replay_fd(replay_obj_t *obj)
+{
+	if (obj == NULL) {
+		errno = EBADF;
+		return -1;
+	}
+	if (obj->nfds == 0 &&
+	    replay_push_fd(obj, open(obj->path, O_RDWR)) == -1) {
+		return -1;
+	}
+	return obj->fds[obj->nfds - 1];
+}
+
+static int
+replay_release(replay_obj_t *obj)
+{
+	if (obj == NULL || obj->nfds == 0) {
+		errno = EBADF;
+		return -1;
+	}
+	return close(obj->fds[--obj->nfds]);
+}
+
+static int
+replay_readdir(replay_obj_t *obj)
+{
+	if (obj->dirp == NULL && (obj->dirp = opendir(obj->path)) == NULL) {
+		return -1;
+	}
+	while (readdir(obj->dirp) != NULL) {
+		continue;
+	}
+	return 0;
+}
+
+static int
+replay_rename(replay_obj_t *src, replay_obj_t *dst)
+{
+	int *fds = dst->fds;
+	unsigned nfds = dst->nfds;
+
+	if (src == NULL || dst == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (rename(src->path, dst->path) == -1) {
+		return -1;
+	}
+
+	/* The open files move along. */
+	dst->fds = src->fds;
+	dst->nfds = src->nfds;
+	src->fds = fds;
+	src->nfds = nfds;
+	return 0;
+}
+
+/*
+ * replay_op: perform the operation with the equivalent system call;
+ * returns 1 if the operation cannot be replayed.
+ */
+static int
+replay_op(replay_t *rp, const replay_rec_t *rec)
+{
+	const int oflags = O_ACCMODE | O_APPEND | O_TRUNC | O_EXCL;
+	replay_obj_t *obj = NULL, *obj2 = NULL;
+	const char *path = ".";
+	struct statvfs svfs;
+	struct stat st;
+	int fd;
+
+	if (rec->obj != REPLAY_NOOBJ) {
+		obj = &rp->objs[rec->obj];
+		path = obj->path;
+	}
+	if (rec->obj2 != REPLAY_NOOBJ) {
+		obj2 = &rp->objs[rec->obj2];
+	}
+
+	switch (rec->op) {
+	case RVAULT_OP_FORGET:
+		return 1;
+	case RVAULT_OP_LOOKUP:
+	case RVAULT_OP_GETATTR:
+		return lstat(path, &st);
+	case RVAULT_OP_SETATTR:
+		if (rec->arg) {
+			return truncate(path, rec->len);
+		}
+		return utimensat(AT_FDCWD, path, NULL, 0);
+	case RVAULT_OP_MKDIR:
+		return mkdir(path, 0700);
+	case RVAULT_OP_UNLINK:
+		return unlink(path);
+	case RVAULT_OP_RMDIR:
+		return rmdir(path);
+	case RVAULT_OP_RENAME:
+		return replay_rename(obj, obj2);
+	case RVAULT_OP_CREATE:
+	case RVAULT_OP_OPEN:
+		if (obj == NULL) {
+			errno = EINVAL;
+			return -1;
+		}
+		return replay_push_fd(obj, open(path, (rec->arg & oflags) |
+		    (rec->op == RVAULT_OP_CREATE ? O_CREAT : 0), 0600));
+	case RVAULT_OP_READ:
+		if ((fd = replay_fd(obj)) == -1) {
+			return -1;
+		}
+		return pread(fd, rp->buf, rec->len, rec->off) == -1 ? -1 : 0;
+	case RVAULT_OP_WRITE:
+		if ((fd = replay_fd(obj)) == -1) {
+			return -1;
+		}
+		return pwrite(fd, rp->buf, rec->len, rec->off) == -1 ? -1 : 0;
+	case RVAULT_OP_FLUSH:
+		/* Closing a duplicate descriptor triggers the flush. */
+		if ((fd = replay_fd(obj)) == -1 || (fd = dup(fd)) == -1) {
+			return -1;
+		}
+		return close(fd);
+	case RVAULT_OP_FSYNC:
+		if ((fd = replay_fd(obj)) == -1) {
+			return -1;
+		}
+		return fsync(fd);
+	case RVAULT_OP_RELEASE:
+		return replay_release(obj);
+	case RVAULT_OP_OPENDIR:
+		if (obj == NULL) {
+			errno = EINVAL;
+			return -1;
+		}
+		if (obj->dirp) {
+			closedir(obj->dirp);
+		}
+		return (obj->dirp = opendir(path)) ? 0 : -1;
+	case RVAULT_OP_READDIR:
+	case RVAULT_OP_READDIRPLUS:
+		if (obj == NULL) {
+			errno = EINVAL;
+			return -1;
+		}
+		return replay_readdir(obj);
+	case RVAULT_OP_RELEASEDIR:
+		if (obj == NULL || obj->dirp == NULL) {
+			errno = EBADF;
+			return -1;
+		}
+		closedir(obj->dirp);
+		obj->dirp = NULL;
+		return 0;
+	case RVAULT_OP_STATFS:
+		return statvfs(path, &svfs);
+	case RVAULT_OP_LSEEK:
+		if ((fd = replay_fd(obj)) == -1) {
+			return -1;
+		}
+		return lseek(fd, rec->off, rec->arg) == -1 ? -1 : 0;
+#if defined(__linux__)
+	case RVAULT_OP_FALLOCATE:
+		if ((fd = replay_fd(obj)) == -1) {
+			return -1;
+		}
+		return fallocate(fd, rec->arg, rec->off, rec->len);
+	case RVAULT_OP_COPY_FILE_RANGE: {
+		loff_t off_in = rec->off, off_out = rec->arg;
+		int fd_out;
+
+		if ((fd = replay_fd(obj)) == -1 ||
+		    (fd_out = replay_fd(obj2)) == -1) {
+			return -1;
+		}
+		return copy_file_range(fd, &off_in, fd_out, &off_out,
+		    rec->len, 0) == -1 ? -1 : 0;
+	}
+	/*
+	 * The attribute names are not traced: use a fixed one.
+	 */
+	case RVAULT_OP_GETXATTR:
+		return lgetxattr(path, "user.replay", rp->buf,
+		    rec->len) == -1 ? -1 : 0;
+	case RVAULT_OP_LISTXATTR:
+		return llistxattr(path, rp->buf, rec->len) == -1 ? -1 : 0;
+	case RVAULT_OP_SETXATTR:
+		return lsetxattr(path, "user.replay", rp->buf, rec->len, 0);
+	case RVAULT_OP_REMOVEXATTR:
+		return lremovexattr(path, "user.replay");
+#endif
+	}
+	return 1;
+}
+
+static void
+replay_run(replay_t *rp)
+{
+	for (size_t i = 0; i < rp->nrecs; i++) {
+		const replay_rec_t *rec = &rp->recs[i];
+		const uint64_t start = rvault_stats_now();
+		int ret;
+
+		ret = replay_op(rp, rec);
+		if (ret == 1) {
+			rp->nskipped[rec->op]++;
+			continue;
+		}
+		rvault_hist_add(&rp->replayed[rec->op], start);
+		rvault_hist_put(&rp->recorded[rec->op], rec->us);
+		rp->nerrors[rec->op] += (ret == -1);
+	}
+}
+
+static void
+replay_report(replay_t *rp, uint64_t elapsed)
+{
+	printf("%-16s %9s   %-26s   %-26s %7s\n", "", "",
+	    "recorded (us)", "replayed (us)", "");
+	printf("%-16s %9s   %8s %8s %8s   %8s %8s %8s %7s\n", "OP", "COUNT",
+	    "AVG", "P50", "P99", "AVG", "P50", "P99", "ERRORS");
+
+	for (unsigned i = 0; i < RVAULT_OP_COUNT; i++) {
+		const rvault_hist_t *rec = &rp->recorded[i];
+		const rvault_hist_t *rep = &rp->replayed[i];
+		const uint64_t count = rep->count;
+
+		if (count == 0) {
+			if (rp->nskipped[i]) {
+				printf("%-16s %9" PRIu64 "   (not replayed)\n",
+				    rvault_op_name(i), rp->nskipped[i]);
+			}
+			continue;
+		}
+		printf("%-16s %9" PRIu64 "   %8" PRIu64 " %8" PRIu64
+		    " %8" PRIu64 "   %8" PRIu64 " %8" PRIu64 " %8" PRIu64
+		    " %7" PRIu64 "\n", rvault_op_name(i), count,
+		    (uint64_t)rec->total_us / count,
+		    rvault_hist_quantile(rec, count, 50),
+		    rvault_hist_quantile(rec, count, 99),
+		    (uint64_t)rep->total_us / count,
+		    rvault_hist_quantile(rep, count, 50),
+		    rvault_hist_quantile(rep, count, 99),
+		    rp->nerrors[i]);
+	}
+	printf("\n%zu operations in %.3f s\n", rp->nrecs,
+	    (double)elapsed / 1000000);
+}
+
+static void
+replay_destroy(replay_t *rp)
+{
+	for (unsigned i = 0; i < rp->nobjs; i++) {
+		replay_obj_t *obj = &rp->objs[i];
+
+		while (obj->nfds) {
+			close(obj->fds[--obj->nfds]);
+		}
+		if (obj->dirp) {
+			closedir(obj->dirp);
+		}
+		free(obj->fds);
+	}
+	for (size_t i = 0; i < rp->nrecs; i++) {
+		free(rp->recs[i].path);
+		free(rp->recs[i].path2);
+	}
+	free(rp->objs);
+	free(rp->recs);
+	free(rp->buf);
+}
+
+int
+replay_cmd(const char *datapath __unused, const char *server __unused,
+    int argc, char **argv)
+{
+	static const char *opts_s = "h?";
+	static struct option opts_l[] = {
+		{ "help",	no_argument,		0,	'h'	},
+		{ NULL,		0,			NULL,	0	}
+	};
+	replay_t rp;
+	uint64_t start;
+	int ch, ret = -1;
+
+	while ((ch = getopt_long(argc, argv, opts_s, opts_l, NULL)) != -1) {
+		switch (ch) {
+		case 'h':
+		case '?':
+		default:
+			goto usage;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 2) {
+		goto usage;
+	}
+
+	memset(&rp, 0, sizeof(replay_t));
+	if (replay_load(&rp, argv[0]) == -1 || replay_index(&rp) == -1) {
+		goto out;
+	}
+	if ((rp.buf = malloc(rp.bufsize)) == NULL ||
+	    crypto_getrandbytes(rp.buf, rp.bufsize) == -1) {
+		goto out;
+	}
+	if (chdir(argv[1]) == -1) {
+		fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+		goto out;
+	}
+	if (replay_setup(&rp) == -1) {
+		goto out;
+	}
+	start = rvault_stats_now();
+	replay_run(&rp);
+	replay_report(&rp, rvault_stats_now() - start);
+	ret = 0;
+out:
+	replay_destroy(&rp);
+	return ret;
+usage:
+	fprintf(stderr,
+	    "Usage:\t" APP_NAME " replay [ -h ] TRACE DIR\n"
+	    "\n"
+	    "Replay the trace of the file system operations (recorded by\n"
+	    "the mount command with the -t option) in the given directory,\n"
+	    "e.g. the mount point of a scratch vault, and report the "
+	    "latencies.\n"
+	    "\n"
+	    "Options:\n"
+	    "  -h|--help          Show this help text.\n"
+	    "\n"
+	);
+	return -1;
+}
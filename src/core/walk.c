@@ -0,0 +1,347 @@
+/*
+ * Copyright (c) 2020 Mindaugas Rasiukevicius <rmind at noxt eu>
+ * All rights reserved.
+ *
+ * Use is subject to license terms, as specified in the LICENSE file.
+ */
+
+/*
+ * Parallel traversal of the vault.
+ *
+ * The directories are put on a shared queue and processed by a pool of
+ * worker threads.  Each worker has its own vault handle (see rvault_dup())
+ * since the crypto objects are not thread-safe.  Only the names are
+ * decrypted; it is up to the callback whether to touch the data.
+ *
+ * => A directory is always processed by a single worker, therefore the
+ *    entries of a directory are delivered consecutively.
+ * => The callback is invoked concurrently by different workers; it may
+ *    use the worker index to keep the state without locking.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/queue.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <errno.h>
+
+#include "rvault.h"
+#include "storage.h"
+#include "utils.h"
+
+typedef struct walk_dir {
+	char *			path;
+	char *			vpath;
+	unsigned		depth;
+	STAILQ_ENTRY(walk_dir)	entry;
+} walk_dir_t;
+
+typedef struct walk walk_t;
+
+typedef struct {
+	walk_t *		walk;
+	rvault_t *		vault;
+	unsigned		index;
+	pthread_t		thread;
+} walk_worker_t;
+
+struct walk {
+	pthread_mutex_t		lock;
+	pthread_cond_t		cv;
+	STAILQ_HEAD(, walk_dir)	queue;
+	unsigned		active;
+	bool			stop;
+	int			error;
+
+	walk_func_t		func;
+	void *			arg;
+	walk_worker_t		workers[];
+};
+
+static walk_dir_t *
+walk_dir_alloc(const char *path, const char *vpath, unsigned depth)
+{
+	walk_dir_t *dir;
+
+	if ((dir = calloc(1, sizeof(walk_dir_t))) == NULL) {
+		return NULL;
+	}
+	dir->path = strdup(path);
+	dir->vpath = strdup(vpath);
+	dir->depth = depth;
+	if (dir->path == NULL || dir->vpath == NULL) {
+		free(dir->path);
+		free(dir->vpath);
+		free(dir);
+		return NULL;
+	}
+	return dir;
+}
+
+static void
+walk_dir_free(walk_dir_t *dir)
+{
+	free(dir->path);
+	free(dir->vpath);
+	free(dir);
+}
+
+static void
+walk_abort(walk_t *walk, int error)
+{
+	pthread_mutex_lock(&walk->lock);
+	if (!walk->error) {
+		walk->error = error;
+	}
+	walk->stop = true;
+	pthread_cond_broadcast(&walk->cv);
+	pthread_mutex_unlock(&walk->lock);
+}
+
+/*
+ * walk_process_dir: read the directory, invoke the callback on each
+ * entry and queue the sub-directories.
+ */
+static void
+walk_process_dir(walk_worker_t *wrk, const walk_dir_t *dir)
+{
+	walk_t *walk = wrk->walk;
+	struct dirent *dp;
+	DIR *dirp;
+
+	if ((dirp = opendir(dir->vpath)) == NULL) {
+		app_elog(LOG_WARNING, "%s: opendir `%s' failed",
+		    __func__, dir->vpath);
+		return;
+	}
+	while ((dp = readdir(dirp)) != NULL) {
+		const char *vname = dp->d_name;
+		char path[PATH_MAX], vpath[PATH_MAX];
+		rvault_walk_ent_t ent;
+		struct stat st;
+		size_t len;
+		char *name;
+		int ret;
+
+		if (strncmp(vname, RVAULT_FOBJ_PREF, RVAULT_FOBJ_PREFLEN)) {
+			continue;
+		}
+		if ((size_t)snprintf(vpath, sizeof(vpath), "%s/%s",
+		    dir->vpath, vname) >= sizeof(vpath)) {
+			continue;
+		}
+		if (fstatat(dirfd(dirp), vname, &st,
+		    AT_SYMLINK_NOFOLLOW) == -1) {
+			continue;
+		}
+		if ((name = rvault_resolve_vname(wrk->vault,
+		    vname, &len)) == NULL) {
+			continue;
+		}
+		ret = snprintf(path, sizeof(path), "%s/%s", dir->path, name);
+		if ((size_t)ret >= sizeof(path)) {
+			free(name);
+			continue;
+		}
+
+		ent.vault = wrk->vault;
+		ent.worker = wrk->index;
+		ent.path = path;
+		ent.name = path + strlen(dir->path) + 1;
+		ent.vpath = vpath;
+		ent.st = &st;
+		ent.depth = dir->depth + 1;
+		ret = walk->func(walk->arg, &ent);
+		crypto_memzero(name, len);
+		free(name);
+
+		if (ret == -1) {
+			walk_abort(walk, errno ? errno : EINTR);
+			break;
+		}
+		if (S_ISDIR(st.st_mode) && ret != RVAULT_WALK_PRUNE) {
+			walk_dir_t *subdir;
+
+			if ((subdir = walk_dir_alloc(path,
+			    vpath, ent.depth)) == NULL) {
+				walk_abort(walk, ENOMEM);
+				break;
+			}
+			pthread_mutex_lock(&walk->lock);
+			STAILQ_INSERT_TAIL(&walk->queue, subdir, entry);
+			pthread_cond_signal(&walk->cv);
+			pthread_mutex_unlock(&walk->lock);
+		}
+	}
+	closedir(dirp);
+}
+
+static void *
+walk_worker(void *arg)
+{
+	walk_worker_t *wrk = arg;
+	walk_t *walk = wrk->walk;
+
+	pthread_mutex_lock(&walk->lock);
+	for (;;) {
+		walk_dir_t *dir;
+
+		while (!walk->stop && STAILQ_EMPTY(&walk->queue) &&
+		    walk->active) {
+			pthread_cond_wait(&walk->cv, &walk->lock);
+		}
+		if (walk->stop || STAILQ_EMPTY(&walk->queue)) {
+			/* Aborted or no more work: wake up the others. */
+			walk->stop = true;
+			pthread_cond_broadcast(&walk->cv);
+			break;
+		}
+		dir = STAILQ_FIRST(&walk->queue);
+		STAILQ_REMOVE_HEAD(&walk->queue, entry);
+		walk->active++;
+		pthread_mutex_unlock(&walk->lock);
+
+		walk_process_dir(wrk, dir);
+		walk_dir_free(dir);
+
+		pthread_mutex_lock(&walk->lock);
+		walk->active--;
+	}
+	pthread_mutex_unlock(&walk->lock);
+	return NULL;
+}
+
+/*
+ * rvault_walk_workers: get the default number of workers.
+ */
+unsigned
+rvault_walk_workers(void)
+{
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	return ncpu > 0 ? MIN((unsigned)ncpu, RVAULT_WALK_MAX_WORKERS) : 1;
+}
+
+/*
+ * rvault_walk: traverse the vault tree starting at the given path,
+ * invoking the callback on every file and directory (but not the
+ * starting directory itself).
+ *
+ * => The callback may return RVAULT_WALK_PRUNE to not descend into the
+ *    directory or -1 to abort the walk.
+ * => The number of workers may be zero to use the default.
+ * => Returns 0 on success and -1 on failure (with errno set).
+ */
+int
+rvault_walk(rvault_t *vault, const char *path, unsigned nworkers,
+    void *arg, walk_func_t func)
+{
+	walk_dir_t *dir;
+	char *vpath, *rpath;
+	struct stat st;
+	size_t len;
+	walk_t *walk;
+	unsigned n;
+	int error;
+
+	if (nworkers == 0) {
+		nworkers = rvault_walk_workers();
+	}
+	nworkers = MIN(nworkers, RVAULT_WALK_MAX_WORKERS);
+
+	/*
+	 * Resolve the starting directory.  The plain paths are built
+	 * without the trailing slash, i.e. the root is an empty string.
+	 */
+	if ((vpath = rvault_resolve_path(vault, path, NULL)) == NULL) {
+		return -1;
+	}
+	errno = 0;
+	if (stat(vpath, &st) == -1 || !S_ISDIR(st.st_mode)) {
+		errno = errno ? errno : ENOTDIR;
+		free(vpath);
+		return -1;
+	}
+	if ((rpath = strdup(path)) == NULL) {
+		free(vpath);
+		return -1;
+	}
+	len = strlen(rpath);
+	while (len && rpath[len - 1] == '/') {
+		rpath[--len] = '\0';
+	}
+	dir = walk_dir_alloc(rpath, vpath, 0);
+	free(rpath);
+	free(vpath);
+	if (dir == NULL) {
+		return -1;
+	}
+
+	len = offsetof(walk_t, workers[nworkers]);
+	if ((walk = calloc(1, len)) == NULL) {
+		walk_dir_free(dir);
+		return -1;
+	}
+	pthread_mutex_init(&walk->lock, NULL);
+	pthread_cond_init(&walk->cv, NULL);
+	STAILQ_INIT(&walk->queue);
+	STAILQ_INSERT_TAIL(&walk->queue, dir, entry);
+	walk->func = func;
+	walk->arg = arg;
+
+	/*
+	 * The first worker is the calling thread, using the given vault.
+	 */
+	for (n = 0; n < nworkers; n++) {
+		walk_worker_t *wrk = &walk->workers[n];
+
+		wrk->walk = walk;
+		wrk->index = n;
+		if (n == 0) {
+			wrk->vault = vault;
+			continue;
+		}
+		if ((wrk->vault = rvault_dup(vault)) == NULL) {
+			break;
+		}
+		if ((error = pthread_create(&wrk->thread, NULL,
+		    walk_worker, wrk)) != 0) {
+			errno = error;
+			app_elog(LOG_ERR, "%s: pthread_create() failed",
+			    __func__);
+			rvault_close(wrk->vault);
+			break;
+		}
+	}
+	walk_worker(&walk->workers[0]);
+
+	for (unsigned i = 1; i < n; i++) {
+		walk_worker_t *wrk = &walk->workers[i];
+
+		pthread_join(wrk->thread, NULL);
+		rvault_close(wrk->vault);
+	}
+	while ((dir = STAILQ_FIRST(&walk->queue)) != NULL) {
+		STAILQ_REMOVE_HEAD(&walk->queue, entry);
+		walk_dir_free(dir);
+	}
+	pthread_cond_destroy(&walk->cv);
+	pthread_mutex_destroy(&walk->lock);
+	error = walk->error;
+	free(walk);
+
+	if (error) {
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
@@ -115,6 +115,20 @@ crypto_cipher_id(const char *cipher)
 	return CIPHER_NONE;
 }
 
+/*
+ * crypto_cipher_name: get the name of the cipher type.
+ */
+const char *
+crypto_cipher_name(crypto_cipher_t c)
+{
+	for (unsigned i = 0; cipher_str2id[i].name != NULL; i++) {
+		if (cipher_str2id[i].id == c) {
+			return cipher_str2id[i].name;
+		}
+	}
+	return NULL;
+}
+
 /*
  * crypto_hmac_id: get the HMAC type from the name.
  */
@@ -222,6 +236,41 @@ err:
 	return NULL;
 }
 
+/*
+ * crypto_clone: construct a new crypto object with the same cipher,
+ * IV and keys.  The AE tag and AAD state are not copied.
+ *
+ * => Crypto objects are not thread-safe; clones can be used by other
+ *    threads to operate independently.
+ */
+crypto_t *
+crypto_clone(const crypto_t *crypto)
+{
+	crypto_t *ncrypto;
+
+	ncrypto = crypto_create(crypto->cipher, crypto->hmac_id);
+	if (ncrypto == NULL) {
+		return NULL;
+	}
+	ASSERT(ncrypto->key_len == crypto->key_len);
+	ASSERT(ncrypto->iv_len == crypto->iv_len);
+
+	if (crypto->iv_set) {
+		memcpy(ncrypto->iv, crypto->iv, crypto->iv_len);
+		ncrypto->iv_set = true;
+	}
+	if (crypto->enc_key_set) {
+		memcpy(ncrypto->key, crypto->key, crypto->key_len);
+		ncrypto->enc_key_set = true;
+	}
+	if (crypto->auth_key_set) {
+		memcpy(ncrypto->auth_key, crypto->auth_key,
+		    crypto->auth_key_len);
+		ncrypto->auth_key_set = true;
+	}
+	return ncrypto;
+}
+
 /*
  * crypto_gen_iv: allocate and set the Initialization Vector (IV).
  */
@@ -362,6 +411,12 @@ crypto_cipher_ae_p(const crypto_t *crypto)
 	return crypto->ae_cipher;
 }
 
+crypto_cipher_t
+crypto_get_cipher(const crypto_t *crypto)
+{
+	return crypto->cipher;
+}
+
 /*
  * crypto_set_aad: set the additional authenticated data (AAD).
  *
@@ -60,11 +60,14 @@ int		kdf_passphrase_genkey(const char *, const void *, size_t,
 
 const char **	crypto_cipher_list(unsigned *);
 crypto_cipher_t	crypto_cipher_id(const char *);
+const char *	crypto_cipher_name(crypto_cipher_t);
 crypto_hmac_t	crypto_hmac_id(const char *);
 
 crypto_t *	crypto_create(crypto_cipher_t, crypto_hmac_t);
+crypto_t *	crypto_clone(const crypto_t *);
 void		crypto_destroy(crypto_t *);
 bool		crypto_cipher_ae_p(const crypto_t *);
+crypto_cipher_t	crypto_get_cipher(const crypto_t *);
 
 void *		crypto_gen_iv(crypto_t *, size_t *);
 int		crypto_set_iv(crypto_t *, const void *, size_t);
@@ -13,10 +13,14 @@
 #include <sys/xattr.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <limits.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <dirent.h>
+#include <time.h>
+#include <pthread.h>
 #include <errno.h>
 #include <err.h>
 
@@ -30,15 +34,37 @@
 
 #define	FUSE_MINIMUM_VERSION	26
 
+typedef struct {
+	rvault_t *	vault;
+	unsigned	flags;
+} rvaultfs_ctx_t;
+
+static rvaultfs_ctx_t *
+get_fs_ctx(void)
+{
+	struct fuse_context *fctx = fuse_get_context();
+	rvaultfs_ctx_t *ctx = fctx->private_data;
+	ASSERT(ctx != NULL && ctx->vault != NULL);
+
+	/* Every operation is a foreground request for the preloader. */
+	rvault_preload_touch(ctx->vault);
+	return ctx;
+}
+
 static rvault_t *
 get_vault_ctx(void)
 {
-	struct fuse_context *fctx = fuse_get_context();
-	rvault_t *vault = fctx->private_data;
-	ASSERT(vault != NULL);
-	return vault;
+	return get_fs_ctx()->vault;
 }
 
+/*
+ * OP_STATS: record the latency of the operation (see RVAULT_OP_SCOPE).
+ * OP_TRACE: set the arguments of the operation, if tracing.
+ */
+#define	OP_STATS(op)	RVAULT_OP_SCOPE(get_vault_ctx(), RVAULT_OP_ ## op)
+#define	OP_TRACE(path, arg, off, len)	RVAULT_OP_TRACE(path, arg, off, len)
+#define	OP_TRACE2(path)			RVAULT_OP_TRACE2(path)
+
 static ssize_t
 get_vault_path(const char *path, char *buf, size_t len)
 {
@@ -59,23 +85,142 @@ get_vault_path(const char *path, char *buf, size_t len)
 	return ret;
 }
 
+/*
+ * vault_path_lock: hold the vault lock across the resolution of a path
+ * and the operation on the resolved path.
+ *
+ * => While re-keying, the sweeper renames the objects to their names
+ *    under the current key holding the lock (see fileobj_vopen()).
+ */
+static void
+vault_path_lock(rvault_t *vault)
+{
+	if (vault->prev_key_count) {
+		pthread_mutex_lock(&vault->lock);
+	}
+}
+
+static void
+vault_path_unlock(rvault_t *vault)
+{
+	if (vault->prev_key_count) {
+		pthread_mutex_unlock(&vault->lock);
+	}
+}
+
+/*
+ * Control directory: the statistics files, rendered on open.  The paths
+ * are not backed by the vault, therefore the operations on them, other
+ * than reading, fail (e.g. with ENOENT).
+ */
+
+#define	CTL_DIR_PATH	"/" RVAULTFS_CTL_DIR
+
+static int
+ctl_file(const char *path)
+{
+	if (strcmp(path, CTL_DIR_PATH "/" RVAULTFS_CTL_STATS) == 0) {
+		return RVAULT_STATS_JSON;
+	}
+	if (strcmp(path, CTL_DIR_PATH "/" RVAULTFS_CTL_STATS_PROM) == 0) {
+		return RVAULT_STATS_PROM;
+	}
+	return -1;
+}
+
+static bool
+ctl_p(const char *path)
+{
+	return path &&
+	    (strcmp(path, CTL_DIR_PATH) == 0 || ctl_file(path) != -1);
+}
+
+static void
+ctl_stat(const char *path, struct stat *st)
+{
+	const bool dir = strcmp(path, CTL_DIR_PATH) == 0;
+
+	memset(st, 0, sizeof(struct stat));
+	st->st_mode = dir ? (S_IFDIR | 0111) : (S_IFREG | 0444);
+	st->st_nlink = dir ? 2 : 1;
+	st->st_uid = getuid();
+	st->st_gid = getgid();
+	st->st_mtime = st->st_ctime = st->st_atime = time(NULL);
+}
+
+static int
+ctl_open(const char *path, struct fuse_file_info *fi)
+{
+	char *buf;
+
+	if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+		return -EACCES;
+	}
+	if ((buf = rvault_stats_render(get_vault_ctx(),
+	    ctl_file(path))) == NULL) {
+		return -errno;
+	}
+	fi->fh = (uintptr_t)buf;
+	fi->direct_io = true;
+	return 0;
+}
+
+static int
+ctl_read(char *buf, size_t len, off_t offset, struct fuse_file_info *fi)
+{
+	const char *data = (const char *)(uintptr_t)fi->fh;
+	const size_t dlen = strlen(data);
+
+	if ((size_t)offset >= dlen) {
+		return 0;
+	}
+	len = MIN(len, dlen - (size_t)offset);
+	memcpy(buf, data + offset, len);
+	return len;
+}
+
 static void *
 rvaultfs_init(struct fuse_conn_info *conn __unused)
 {
+	rvaultfs_ctx_t *ctx = get_fs_ctx();
+	rvault_t *vault = ctx->vault;
+
+	if (app_log_start() == -1) {
+		app_elog(LOG_ERR, "failed to start the logger");
+	}
+
+	/*
+	 * Start the re-keying sweeper, if needed.  Note: it has to be
+	 * started after daemonizing, as the threads do not survive fork.
+	 */
+	if (rvault_rekey_start(vault) == -1) {
+		app_log(LOG_ERR, "failed to start the re-keying sweeper");
+	}
+	if (rvault_preload_start(vault) == -1) {
+		app_log(LOG_ERR, "failed to start the preloader");
+	}
+	if (rvault_stats_start(vault) == -1) {
+		app_elog(LOG_ERR, "failed to set up the statistics logging");
+	}
+
 	/* Must return the context. */
-	return get_vault_ctx();
+	return ctx;
 }
 
 static int
 rvaultfs_statfs(const char *path, struct statvfs *stbuf)
 {
+	rvault_t *vault = get_vault_ctx();
 	char vpath[PATH_MAX];
 	int ret;
+	OP_STATS(STATFS);
 
-	if (get_vault_path(path, vpath, sizeof(vpath)) == -1) {
-		return -errno;
+	OP_TRACE(path, 0, 0, 0);
+	vault_path_lock(vault);
+	if ((ret = get_vault_path(path, vpath, sizeof(vpath))) != -1) {
+		ret = statvfs(vpath, stbuf);
 	}
-	ret = statvfs(vpath, stbuf);
+	vault_path_unlock(vault);
 	return (ret == -1) ? -errno : ret;
 }
 
@@ -83,52 +228,110 @@ static int
 rvaultfs_getattr(const char *path, struct stat *st)
 {
 	rvault_t *vault = get_vault_ctx();
-	const int ret = fileobj_stat(vault, path, st);
+	int ret;
+	OP_STATS(GETATTR);
+
+	OP_TRACE(path, 0, 0, 0);
+	if (ctl_p(path)) {
+		ctl_stat(path, st);
+		return 0;
+	}
+	if (rvault_preload_lookup(vault, path, NULL, st) == 0) {
+		return 0;
+	}
+	vault_path_lock(vault);
+	ret = fileobj_stat(vault, path, st);
+	vault_path_unlock(vault);
 	app_log(LOG_DEBUG, "%s: path `%s', retval %d", __func__, path, ret);
 	return (ret == -1) ? -errno : ret;
 }
 
+/*
+ * rvaultfs_fgetattr: get the attributes of the open file; its size might
+ * differ from the persisted one (see fileobj_fstat()).
+ */
+static int
+rvaultfs_fgetattr(const char *path, struct stat *st,
+    struct fuse_file_info *fi)
+{
+	fileobj_t *fobj = (void *)(uintptr_t)fi->fh;
+	int ret;
+	OP_STATS(GETATTR);
+
+	OP_TRACE(path, 0, 0, 0);
+	if (ctl_p(path)) {
+		ctl_stat(path, st);
+		return 0;
+	}
+	ret = fileobj_fstat(fobj, st);
+	return (ret == -1) ? -errno : ret;
+}
+
 static int
 rvaultfs_truncate(const char *path, off_t size)
 {
 	rvault_t *vault = get_vault_ctx();
-	fileobj_t *fobj;
+	OP_STATS(SETATTR);
 
+	OP_TRACE(path, 1, 0, size);
 	app_log(LOG_DEBUG, "%s: path `%s', size %jd",
 	    __func__, path, (intmax_t)size);
 
+	if (vault->read_only) {
+		return -EROFS;
+	}
 	if (size < 0) {
 		return -EINVAL;
 	}
-	if ((fobj = fileobj_open(vault, path, O_WRONLY, FOBJ_OMASK)) == NULL) {
+	if (fileobj_truncate(vault, path, (size_t)size) == -1) {
 		return -errno;
 	}
+	return 0;
+}
+
+static int
+rvaultfs_ftruncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+	fileobj_t *fobj = (void *)(uintptr_t)fi->fh;
+	OP_STATS(SETATTR);
+
+	OP_TRACE(path, 1, 0, size);
+	app_log(LOG_DEBUG, "%s: path `%s', vnode %p, size %jd",
+	    __func__, path, fobj, (intmax_t)size);
+	ASSERT(fobj != NULL);
+
+	if (size < 0) {
+		return -EINVAL;
+	}
 	if (fileobj_setsize(fobj, (size_t)size) == -1) {
-		const int ret = -errno;
-		fileobj_close(fobj);
-		return ret;
+		return -errno;
 	}
-	fileobj_close(fobj);
 	return 0;
 }
 
 static int
 rvaultfs_open_raw(const char *path, struct fuse_file_info *fi, mode_t mode)
 {
-	rvault_t *vault = get_vault_ctx();
-	fileobj_t *fobj;
+	rvaultfs_ctx_t *ctx = get_fs_ctx();
+	fileobj_t *fobj = NULL;
 
-	if ((fobj = fileobj_open(vault, path, fi->flags, mode)) == NULL) {
+	if ((fi->flags & O_CREAT) == 0) {
+		fobj = rvault_preload_open(ctx->vault, path, fi->flags);
+	}
+	if (fobj == NULL &&
+	    (fobj = fileobj_open(ctx->vault, path, fi->flags, mode)) == NULL) {
 		return -errno;
 	}
 
 	/*
-	 * Use direct I/O i.e. bypass the page cache for extra security.
-	 * This causes abnormal behaviour on Darwin, though; we use the
-	 * '-noubc' parameter there instead.
+	 * Use direct I/O i.e. bypass the page cache for extra security,
+	 * unless the kernel cache is enabled (the cached pages are then
+	 * invalidated by FUSE on open if the file has changed, as per the
+	 * 'auto_cache' option).  Direct I/O causes abnormal behaviour on
+	 * Darwin, though; we use the '-noubc' parameter there instead.
 	 */
 #if !defined(__APPLE__)
-	fi->direct_io = true;
+	fi->direct_io = (ctx->flags & RVAULTFS_KERNEL_CACHE) == 0;
 #endif
 
 	/* Associate the file object with the FUSE file handle. */
@@ -142,24 +345,38 @@ rvaultfs_open_raw(const char *path, struct fuse_file_info *fi, mode_t mode)
 static int
 rvaultfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
+	OP_STATS(CREATE);
+
+	OP_TRACE(path, fi->flags, 0, 0);
 	return rvaultfs_open_raw(path, fi, mode);
 }
 
 static int
 rvaultfs_open(const char *path, struct fuse_file_info *fi)
 {
+	OP_STATS(OPEN);
+
+	OP_TRACE(path, fi->flags, 0, 0);
+	if (ctl_file(path) != -1) {
+		return ctl_open(path, fi);
+	}
 	return rvaultfs_open_raw(path, fi, FOBJ_OMASK);
 }
 
 static int
-rvaultfs_read(const char *path __unused, char *buf, size_t len,
+rvaultfs_read(const char *path, char *buf, size_t len,
     off_t offset, struct fuse_file_info *fi)
 {
 	fileobj_t *fobj = (void *)(uintptr_t)fi->fh;
 	ssize_t ret;
+	OP_STATS(READ);
 
+	OP_TRACE(path, 0, offset, len);
 	app_log(LOG_DEBUG, "%s: path `%s', vnode %p, len %zu, offset %jd",
 	    __func__, path, fobj, len, (intmax_t)offset);
+	if (ctl_file(path) != -1) {
+		return ctl_read(buf, len, offset, fi);
+	}
 	ASSERT(fobj != NULL);
 
 	if (len == 0) {
@@ -177,7 +394,9 @@ rvaultfs_write(const char *path __unused, const char *buf, size_t len,
 {
 	fileobj_t *fobj = (void *)(uintptr_t)fi->fh;
 	ssize_t ret;
+	OP_STATS(WRITE);
 
+	OP_TRACE(path, 0, offset, len);
 	app_log(LOG_DEBUG, "%s: path `%s', vnode %p, len %zu, offset %jd",
 	    __func__, path, fobj, len, (intmax_t)offset);
 	ASSERT(fobj != NULL);
@@ -191,176 +410,399 @@ rvaultfs_write(const char *path __unused, const char *buf, size_t len,
 	return ret;
 }
 
+#if FUSE_VERSION >= 29
+static ssize_t
+rvaultfs_copy_buf(void *arg, void *buf, size_t len)
+{
+	struct fuse_bufvec *src = arg;
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(len);
+	ssize_t ret;
+
+	dst.buf[0].mem = buf;
+	if ((ret = fuse_buf_copy(&dst, src, 0)) < 0) {
+		errno = -ret;
+		return -1;
+	}
+	return ret;
+}
+
+/*
+ * rvaultfs_write_buf: copy the data directly into the file buffer (the
+ * source may be a pipe, if the data is spliced).
+ *
+ * => There is no read counterpart: FUSE frees the buffers returned by
+ *    the read_buf operation, so it cannot point to the file buffer.
+ */
 static int
-rvaultfs_flush(const char *path __unused, struct fuse_file_info *fi)
+rvaultfs_write_buf(const char *path __unused, struct fuse_bufvec *bufv,
+    off_t offset, struct fuse_file_info *fi)
 {
 	fileobj_t *fobj = (void *)(uintptr_t)fi->fh;
+	const size_t len = fuse_buf_size(bufv);
+	ssize_t ret;
+	OP_STATS(WRITE);
+
+	OP_TRACE(path, 0, offset, len);
+	app_log(LOG_DEBUG, "%s: path `%s', vnode %p, len %zu, offset %jd",
+	    __func__, path, fobj, len, (intmax_t)offset);
+	ASSERT(fobj != NULL);
+
+	if (len == 0) {
+		return 0;
+	}
+	ret = fileobj_pwrite_copy(fobj, rvaultfs_copy_buf, bufv, len, offset);
+	return (ret == -1) ? -errno : ret;
+}
+#endif
 
+static int
+rvaultfs_flush(const char *path, struct fuse_file_info *fi)
+{
+	fileobj_t *fobj = (void *)(uintptr_t)fi->fh;
+	OP_STATS(FLUSH);
+
+	OP_TRACE(path, 0, 0, 0);
 	app_log(LOG_DEBUG, "%s: path `%s', vnode %p", __func__, path, fobj);
+	if (ctl_file(path) != -1) {
+		return 0;
+	}
 	ASSERT(fobj != NULL);
 	return fileobj_sync(fobj, FOBJ_FULLSYNC) == -1 ? -errno : 0;
 }
 
+/*
+ * rvaultfs_fsync: sync the file; also write back the index, if changed
+ * (the operations change it only in memory, see rvault_index_sync()).
+ */
 static int
-rvaultfs_fsync(const char *path __unused, int isdatasync __unused,
+rvaultfs_fsync(const char *path, int isdatasync __unused,
     struct fuse_file_info *fi)
 {
 	fileobj_t *fobj = (void *)(uintptr_t)fi->fh;
+	OP_STATS(FSYNC);
 
+	OP_TRACE(path, 0, 0, 0);
 	app_log(LOG_DEBUG, "%s: path `%s', vnode %p", __func__, path, fobj);
+	if (ctl_file(path) != -1) {
+		return 0;
+	}
 	ASSERT(fobj != NULL);
+	(void)rvault_index_sync(get_vault_ctx());
 	return fileobj_sync(fobj, FOBJ_FULLSYNC) == -1 ? -errno : 0;
 }
 
 static int
-rvaultfs_release(const char *path __unused, struct fuse_file_info *fi)
+rvaultfs_release(const char *path, struct fuse_file_info *fi)
 {
 	fileobj_t *fobj = (void *)(uintptr_t)fi->fh;
+	OP_STATS(RELEASE);
 
+	OP_TRACE(path, 0, 0, 0);
 	app_log(LOG_DEBUG, "%s: path `%s', vnode %p", __func__, path, fobj);
+	if (ctl_file(path) != -1) {
+		free((void *)(uintptr_t)fi->fh);
+		return 0;
+	}
 	ASSERT(fobj != NULL);
 	fileobj_close(fobj);
 	return 0;
 }
 
+#if FUSE_VERSION >= 29
+/*
+ * rvaultfs_fallocate: pre-allocate the file buffer (see fileobj_allocate());
+ * only the plain allocation, optionally keeping the size, is supported.
+ */
+static int
+rvaultfs_fallocate(const char *path, int mode, off_t off, off_t len,
+    struct fuse_file_info *fi)
+{
+	fileobj_t *fobj = (void *)(uintptr_t)fi->fh;
+	unsigned flags = 0;
+	OP_STATS(FALLOCATE);
+
+	OP_TRACE(path, mode, off, len);
+	app_log(LOG_DEBUG, "%s: path `%s', vnode %p, mode %d, "
+	    "offset %jd, len %jd", __func__, path, fobj, mode,
+	    (intmax_t)off, (intmax_t)len);
+	ASSERT(fobj != NULL);
+
+#if defined(FALLOC_FL_KEEP_SIZE)
+	if ((mode & FALLOC_FL_KEEP_SIZE) != 0) {
+		flags |= FOBJ_ALLOC_KEEP_SIZE;
+		mode &= ~FALLOC_FL_KEEP_SIZE;
+	}
+#endif
+	if (mode != 0) {
+		return -EOPNOTSUPP;
+	}
+	if (len <= 0) {
+		return -EINVAL;
+	}
+	if (fileobj_allocate(fobj, off, len, flags) == -1) {
+		return -errno;
+	}
+	return 0;
+}
+#endif
+
 static int
 rvaultfs_unlink(const char *path)
 {
+	rvault_t *vault = get_vault_ctx();
 	char vpath[PATH_MAX];
 	int ret;
+	OP_STATS(UNLINK);
 
-	if (get_vault_path(path, vpath, sizeof(vpath)) == -1) {
+	OP_TRACE(path, 0, 0, 0);
+	if (vault->read_only) {
+		return -EROFS;
+	}
+	vault_path_lock(vault);
+	if ((ret = get_vault_path(path, vpath, sizeof(vpath))) != -1) {
+		ret = unlink(vpath);
+	}
+	vault_path_unlock(vault);
+	if (ret == -1) {
 		return -errno;
 	}
-	ret = unlink(vpath);
-	return (ret == -1) ? -errno : ret;
+	rvault_index_remove(vault, path);
+	return 0;
 }
 
 static int
 rvaultfs_rename(const char *from, const char *to)
 {
+	rvault_t *vault = get_vault_ctx();
 	char vpath_from[PATH_MAX], vpath_to[PATH_MAX];
 	int ret;
+	OP_STATS(RENAME);
 
+	OP_TRACE(from, 0, 0, 0);
+	OP_TRACE2(to);
 	app_log(LOG_DEBUG, "%s: from `%s' to `%s'", __func__, from, to);
 
-	if (get_vault_path(from, vpath_from, sizeof(vpath_from)) == -1) {
-		return -errno;
+	if (vault->read_only) {
+		return -EROFS;
+	}
+	vault_path_lock(vault);
+	if (get_vault_path(from, vpath_from, sizeof(vpath_from)) == -1 ||
+	    get_vault_path(to, vpath_to, sizeof(vpath_to)) == -1) {
+		ret = -1;
+	} else {
+		ret = rename(vpath_from, vpath_to);
 	}
-	if (get_vault_path(to, vpath_to, sizeof(vpath_to)) == -1) {
+	vault_path_unlock(vault);
+	if (ret == -1) {
 		return -errno;
 	}
-	ret = rename(vpath_from, vpath_to);
-	return (ret == -1) ? -errno : ret;
+	rvault_index_rename(vault, from, to);
+	return 0;
 }
 
 static int
 rvaultfs_mkdir(const char *path, mode_t mode)
 {
+	rvault_t *vault = get_vault_ctx();
 	char vpath[PATH_MAX];
 	int ret;
+	OP_STATS(MKDIR);
 
-	if (get_vault_path(path, vpath, sizeof(vpath)) == -1) {
+	OP_TRACE(path, 0, 0, 0);
+	if (vault->read_only) {
+		return -EROFS;
+	}
+	vault_path_lock(vault);
+	if ((ret = get_vault_path(path, vpath, sizeof(vpath))) != -1) {
+		ret = mkdir(vpath, mode);
+	}
+	vault_path_unlock(vault);
+	if (ret == -1) {
 		return -errno;
 	}
-	ret = mkdir(vpath, mode);
-	return (ret == -1) ? -errno : ret;
+	rvault_index_add(vault, path, true);
+	return 0;
 }
 
 static int
 rvaultfs_rmdir(const char *path)
 {
+	rvault_t *vault = get_vault_ctx();
 	char vpath[PATH_MAX];
 	int ret;
+	OP_STATS(RMDIR);
 
-	if (get_vault_path(path, vpath, sizeof(vpath)) == -1) {
+	OP_TRACE(path, 0, 0, 0);
+	if (vault->read_only) {
+		return -EROFS;
+	}
+	vault_path_lock(vault);
+	if ((ret = get_vault_path(path, vpath, sizeof(vpath))) != -1) {
+		ret = rmdir(vpath);
+	}
+	vault_path_unlock(vault);
+	if (ret == -1) {
 		return -errno;
 	}
-	ret = rmdir(vpath);
-	return (ret == -1) ? -errno : ret;
+	rvault_index_remove(vault, path);
+	return 0;
 }
 
-struct rvaultfs_readdir_iter_ctx {
-	fuse_fill_dir_t	filler;
-	void *		buf;
-};
+/*
+ * Directory operations: a snapshot of the entries is taken on opendir
+ * and their names are decrypted as the entries are returned, i.e. in the
+ * batches of the readdir buffer size, keeping the position as an offset.
+ *
+ * => The high-level API has no readdirplus: the attributes would be
+ *    discarded, therefore only the file type is filled.
+ */
 
-static void
-rvaultfs_readdir_iter(void *arg0, const char *name, struct dirent *dp __unused)
+static int
+rvaultfs_opendir(const char *path, struct fuse_file_info *fi)
 {
-	struct rvaultfs_readdir_iter_ctx *arg = arg0;
-	arg->filler(arg->buf, name, NULL, 0);
+	rvault_t *vault = get_vault_ctx();
+	char vpath[PATH_MAX];
+	rvault_dir_t *dir;
+	OP_STATS(OPENDIR);
+
+	OP_TRACE(path, 0, 0, 0);
+	if (ctl_p(path)) {
+		/* Note: the control directory is not listed. */
+		return -EACCES;
+	}
+	vault_path_lock(vault);
+	if (get_vault_path(path, vpath, sizeof(vpath)) == -1) {
+		dir = NULL;
+	} else {
+		dir = rvault_opendir(vault, vpath);
+	}
+	vault_path_unlock(vault);
+	if (dir == NULL) {
+		return -errno;
+	}
+	fi->fh = (uintptr_t)dir;
+	return 0;
 }
 
 static int
 rvaultfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-    off_t offset __unused, struct fuse_file_info *fi __unused)
+    off_t offset, struct fuse_file_info *fi)
 {
-	struct rvaultfs_readdir_iter_ctx arg = { .filler = filler, .buf = buf };
-	rvault_t *vault = get_vault_ctx();
+	rvault_dir_t *dir = (void *)(uintptr_t)fi->fh;
+	const rvault_dirent_t *ent;
+	OP_STATS(READDIR);
 
-	app_log(LOG_DEBUG, "%s: path `%s'", __func__, path);
+	OP_TRACE(path, 0, offset, 0);
+	app_log(LOG_DEBUG, "%s: path `%s', offset %jd",
+	    __func__, path, (intmax_t)offset);
 
-	if (rvault_iter_dir(vault, path, &arg, rvaultfs_readdir_iter) == -1) {
-		return -errno;
+	for (unsigned i = (unsigned)offset;
+	    (ent = rvault_readdir(dir, &i)) != NULL; i++) {
+		struct stat st;
+
+		memset(&st, 0, sizeof(st));
+		st.st_mode = ent->type;
+
+		/* Note: the offset is of the next entry. */
+		if (filler(buf, ent->name, &st, i + 1)) {
+			break;
+		}
 	}
 	return 0;
 }
 
+static int
+rvaultfs_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	OP_STATS(RELEASEDIR);
+
+	OP_TRACE(path, 0, 0, 0);
+	rvault_closedir((void *)(uintptr_t)fi->fh);
+	return 0;
+}
+
 static int
 rvaultfs_chmod(const char *path, mode_t mode)
 {
+	rvault_t *vault = get_vault_ctx();
 	char vpath[PATH_MAX];
 	int ret;
+	OP_STATS(SETATTR);
 
-	if (get_vault_path(path, vpath, sizeof(vpath)) == -1) {
-		return -errno;
+	OP_TRACE(path, 0, 0, 0);
+	if (vault->read_only) {
+		return -EROFS;
 	}
-	ret = chmod(vpath, mode);
+	vault_path_lock(vault);
+	if ((ret = get_vault_path(path, vpath, sizeof(vpath))) != -1) {
+		ret = chmod(vpath, mode);
+	}
+	vault_path_unlock(vault);
 	return (ret == -1) ? -errno : ret;
 }
 
 static int
 rvaultfs_chown(const char *path, uid_t uid, gid_t gid)
 {
+	rvault_t *vault = get_vault_ctx();
 	char vpath[PATH_MAX];
 	int ret;
+	OP_STATS(SETATTR);
 
-	if (get_vault_path(path, vpath, sizeof(vpath)) == -1) {
-		return -errno;
+	OP_TRACE(path, 0, 0, 0);
+	if (vault->read_only) {
+		return -EROFS;
+	}
+	vault_path_lock(vault);
+	if ((ret = get_vault_path(path, vpath, sizeof(vpath))) != -1) {
+		ret = chown(vpath, uid, gid);
 	}
-	ret = chown(vpath, uid, gid);
+	vault_path_unlock(vault);
 	return (ret == -1) ? -errno : ret;
 }
 
 static int
 rvaultfs_utimens(const char *path, const struct timespec ts[2])
 {
+	rvault_t *vault = get_vault_ctx();
 	char vpath[PATH_MAX];
 	int ret;
+	OP_STATS(SETATTR);
 
-	if (get_vault_path(path, vpath, sizeof(vpath)) == -1) {
-		return -errno;
+	OP_TRACE(path, 0, 0, 0);
+	if (vault->read_only) {
+		return -EROFS;
+	}
+	vault_path_lock(vault);
+	if ((ret = get_vault_path(path, vpath, sizeof(vpath))) != -1) {
+		ret = utimensat(-1, vpath, ts, AT_SYMLINK_NOFOLLOW);
 	}
-	ret = utimensat(-1, path, ts, AT_SYMLINK_NOFOLLOW);
+	vault_path_unlock(vault);
 	return (ret == -1) ? -errno : ret;
 }
 
 static int
 rvaultfs_listxattr(const char *path, char *list, size_t size)
 {
+	rvault_t *vault = get_vault_ctx();
 	char vpath[PATH_MAX];
 	ssize_t ret;
+	OP_STATS(LISTXATTR);
 
-	if (get_vault_path(path, vpath, sizeof(vpath)) == -1) {
-		return -errno;
+	OP_TRACE(path, 0, 0, size);
+	if (ctl_p(path)) {
+		return -ENOTSUP;
 	}
+	vault_path_lock(vault);
+	if ((ret = get_vault_path(path, vpath, sizeof(vpath))) != -1) {
 #ifdef __APPLE__
-	ret = listxattr(vpath, list, size, XATTR_NOFOLLOW);
+		ret = listxattr(vpath, list, size, XATTR_NOFOLLOW);
 #else
-	ret = listxattr(vpath, list, size);
+		ret = listxattr(vpath, list, size);
 #endif
-	return ret == -1 ? -errno : ret;
+	}
+	vault_path_unlock(vault);
+	return (ret == -1) ? -errno : ret;
 }
 
 #ifdef __APPLE__
@@ -369,13 +811,20 @@ static int
 rvaultfs_getxattr(const char *path, const char *name, char *value,
     size_t size, uint32_t pos)
 {
+	rvault_t *vault = get_vault_ctx();
 	char vpath[PATH_MAX];
 	ssize_t ret;
+	OP_STATS(GETXATTR);
 
-	if (get_vault_path(path, vpath, sizeof(vpath)) == -1) {
-		return -errno;
+	OP_TRACE(path, 0, 0, size);
+	if (ctl_p(path)) {
+		return -ENOTSUP;
 	}
-	ret = getxattr(vpath, name, value, size, pos, XATTR_NOFOLLOW);
+	vault_path_lock(vault);
+	if ((ret = get_vault_path(path, vpath, sizeof(vpath))) != -1) {
+		ret = getxattr(vpath, name, value, size, pos, XATTR_NOFOLLOW);
+	}
+	vault_path_unlock(vault);
 	return (ret == -1) ? -errno : ret;
 }
 
@@ -383,13 +832,23 @@ static int
 rvaultfs_setxattr(const char *path, const char *name, const char *val,
     size_t size, int ops __unused, uint32_t pos)
 {
+	rvault_t *vault = get_vault_ctx();
 	char vpath[PATH_MAX];
 	int ret;
+	OP_STATS(SETXATTR);
 
-	if (get_vault_path(path, vpath, sizeof(vpath)) == -1) {
-		return -errno;
+	OP_TRACE(path, 0, 0, size);
+	if (ctl_p(path)) {
+		return -ENOTSUP;
+	}
+	if (vault->read_only) {
+		return -EROFS;
 	}
-	ret = setxattr(vpath, name, val, size, pos, XATTR_NOFOLLOW);
+	vault_path_lock(vault);
+	if ((ret = get_vault_path(path, vpath, sizeof(vpath))) != -1) {
+		ret = setxattr(vpath, name, val, size, pos, XATTR_NOFOLLOW);
+	}
+	vault_path_unlock(vault);
 	return (ret == -1) ? -errno : ret;
 }
 
@@ -399,13 +858,20 @@ static int
 rvaultfs_getxattr(const char *path, const char *name, char *val,
     size_t size)
 {
+	rvault_t *vault = get_vault_ctx();
 	char vpath[PATH_MAX];
 	ssize_t ret;
+	OP_STATS(GETXATTR);
 
-	if (get_vault_path(path, vpath, sizeof(vpath)) == -1) {
-		return -errno;
+	OP_TRACE(path, 0, 0, size);
+	if (ctl_p(path)) {
+		return -ENOTSUP;
 	}
-	ret = getxattr(vpath, name, val, size);
+	vault_path_lock(vault);
+	if ((ret = get_vault_path(path, vpath, sizeof(vpath))) != -1) {
+		ret = getxattr(vpath, name, val, size);
+	}
+	vault_path_unlock(vault);
 	return (ret == -1) ? -errno : ret;
 }
 
@@ -413,13 +879,23 @@ static int
 rvaultfs_setxattr(const char *path, const char *name, const char *val,
     size_t size, int flags)
 {
+	rvault_t *vault = get_vault_ctx();
 	char vpath[PATH_MAX];
 	int ret;
+	OP_STATS(SETXATTR);
 
-	if (get_vault_path(path, vpath, sizeof(vpath)) == -1) {
-		return -errno;
+	OP_TRACE(path, 0, 0, size);
+	if (ctl_p(path)) {
+		return -ENOTSUP;
 	}
-	ret = lsetxattr(vpath, name, val, size, flags);
+	if (vault->read_only) {
+		return -EROFS;
+	}
+	vault_path_lock(vault);
+	if ((ret = get_vault_path(path, vpath, sizeof(vpath))) != -1) {
+		ret = lsetxattr(vpath, name, val, size, flags);
+	}
+	vault_path_unlock(vault);
 	return (ret == -1) ? -errno : ret;
 }
 
@@ -428,17 +904,27 @@ rvaultfs_setxattr(const char *path, const char *name, const char *val,
 static int
 rvaultfs_removexattr(const char *path, const char *name)
 {
+	rvault_t *vault = get_vault_ctx();
 	char vpath[PATH_MAX];
 	int ret;
+	OP_STATS(REMOVEXATTR);
 
-	if (get_vault_path(path, vpath, sizeof(vpath)) == -1) {
-		return -errno;
+	OP_TRACE(path, 0, 0, 0);
+	if (ctl_p(path)) {
+		return -ENOTSUP;
+	}
+	if (vault->read_only) {
+		return -EROFS;
 	}
+	vault_path_lock(vault);
+	if ((ret = get_vault_path(path, vpath, sizeof(vpath))) != -1) {
 #ifdef __APPLE__
-	ret = removexattr(vpath, name, XATTR_NOFOLLOW);
+		ret = removexattr(vpath, name, XATTR_NOFOLLOW);
 #else
-	ret = removexattr(vpath, name);
+		ret = removexattr(vpath, name);
 #endif
+	}
+	vault_path_unlock(vault);
 	return (ret == -1) ? -errno : ret;
 }
 
@@ -446,12 +932,19 @@ static const struct fuse_operations rvaultfs_ops = {
 	.init		= rvaultfs_init,
 	.statfs		= rvaultfs_statfs,
 	.getattr	= rvaultfs_getattr,
+	.fgetattr	= rvaultfs_fgetattr,
+	.opendir	= rvaultfs_opendir,
 	.readdir	= rvaultfs_readdir,
+	.releasedir	= rvaultfs_releasedir,
 	.truncate	= rvaultfs_truncate,
+	.ftruncate	= rvaultfs_ftruncate,
 	.create		= rvaultfs_create,
 	.open		= rvaultfs_open,
 	.read		= rvaultfs_read,
 	.write		= rvaultfs_write,
+#if FUSE_VERSION >= 29
+	.write_buf	= rvaultfs_write_buf,
+#endif
 	.flush		= rvaultfs_flush,
 	.fsync		= rvaultfs_fsync,
 	.release	= rvaultfs_release,
@@ -462,6 +955,9 @@ static const struct fuse_operations rvaultfs_ops = {
 	.chmod		= rvaultfs_chmod,
 	.chown		= rvaultfs_chown,
 	.utimens	= rvaultfs_utimens,
+#if FUSE_VERSION >= 29
+	.fallocate	= rvaultfs_fallocate,
+#endif
 
 	.listxattr	= rvaultfs_listxattr,
 	.getxattr	= rvaultfs_getxattr,
@@ -470,9 +966,11 @@ static const struct fuse_operations rvaultfs_ops = {
 };
 
 int
-rvaultfs_run(rvault_t *vault, const char *mountpoint, bool fg, bool debug)
+rvaultfs_run(rvault_t *vault, const char *mountpoint, unsigned flags)
 {
 	struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+	rvaultfs_ctx_t ctx = { .vault = vault, .flags = flags };
+	const bool fg = (flags & RVAULTFS_FOREGROUND) != 0;
 	struct fuse *fuse;
 	int ret;
 
@@ -492,15 +990,46 @@ rvaultfs_run(rvault_t *vault, const char *mountpoint, bool fg, bool debug)
 	fuse_opt_add_arg(&args, "-odefault_permissions");
 #ifdef __APPLE__
 	fuse_opt_add_arg(&args, "-oiosize=16777216"); // 16 MB
-	fuse_opt_add_arg(&args, "-onoubc");
+	if ((flags & RVAULTFS_KERNEL_CACHE) == 0) {
+		fuse_opt_add_arg(&args, "-onoubc");
+	}
 	// fuse_opt_add_arg(&args, "-oauto_xattr");
+#endif
+	if (vault->read_only) {
+		fuse_opt_add_arg(&args, "-oro");
+	}
+#if !defined(__NetBSD__)
+	if (flags & RVAULTFS_KERNEL_CACHE) {
+		fuse_opt_add_arg(&args, "-oauto_cache");
+	}
+	if (vault->read_only) {
+		/* Nothing changes through the mount: cache for longer. */
+		fuse_opt_add_arg(&args, "-oentry_timeout=60");
+		fuse_opt_add_arg(&args, "-oattr_timeout=60");
+	}
+#endif
+#if defined(__linux__) && FUSE_VERSION >= 28
+	/*
+	 * Allow the writes larger than a page and splice the written
+	 * data from the kernel (see rvaultfs_write_buf()).
+	 */
+	fuse_opt_add_arg(&args, "-obig_writes");
+	fuse_opt_add_arg(&args, "-omax_write=1048576"); // 1 MB
+#if FUSE_VERSION >= 29
+	fuse_opt_add_arg(&args, "-osplice_read");
+#endif
 #endif
 	// fuse_opt_add_arg(&args, "-oauto_unmount");
-	if (debug) {
+	if (flags & RVAULTFS_DEBUG) {
 		fuse_opt_add_arg(&args, "-odebug");
 	}
+	if (flags & RVAULTFS_WATCH) {
+		/* Requires the notifications of the low-level API. */
+		app_log(LOG_WARNING, "watching is not supported by this "
+		    "build (see USE_FUSE3)");
+	}
 #if defined(__NetBSD__)
-	fuse = fuse_new(&args, &rvaultfs_ops, sizeof(rvaultfs_ops), vault);
+	fuse = fuse_new(&args, &rvaultfs_ops, sizeof(rvaultfs_ops), &ctx);
 	if (fuse == NULL) {
 		return -1;
 	}
@@ -521,7 +1050,7 @@ rvaultfs_run(rvault_t *vault, const char *mountpoint, bool fg, bool debug)
 		return -1;
 	}
 	if ((fuse = fuse_new(chan, &args, &rvaultfs_ops,
-	    sizeof(rvaultfs_ops), vault)) == NULL) {
+	    sizeof(rvaultfs_ops), &ctx)) == NULL) {
 		fuse_unmount(mountpoint, chan);
 		return -1;
 	}
@@ -532,5 +1061,9 @@ rvaultfs_run(rvault_t *vault, const char *mountpoint, bool fg, bool debug)
 #endif
 	fuse_destroy(fuse);
 	fuse_opt_free_args(&args);
+
+	rvault_stats_stop();
+	rvault_stats_log(vault);
+	app_log_stop();
 	return ret;
 }
@@ -8,6 +8,18 @@
 #ifndef	_RVAULTFS_H_
 #define	_RVAULTFS_H_
 
-int	rvaultfs_run(rvault_t *, const char *, bool, bool);
+#define	RVAULTFS_FOREGROUND	0x01	// do not daemonize
+#define	RVAULTFS_DEBUG		0x02	// FUSE-level debug logging
+#define	RVAULTFS_KERNEL_CACHE	0x04	// use the kernel page cache
+#define	RVAULTFS_WATCH		0x08	// watch for the external changes
+
+/*
+ * Control directory of the mount, with the statistics files.
+ */
+#define	RVAULTFS_CTL_DIR	".rvault"
+#define	RVAULTFS_CTL_STATS	"stats"		// JSON
+#define	RVAULTFS_CTL_STATS_PROM	"stats.prom"	// Prometheus text format
+
+int	rvaultfs_run(rvault_t *, const char *, unsigned);
 
 #endif
@@ -0,0 +1,2306 @@
+/*
+ * Copyright (c) 2019-2020 Mindaugas Rasiukevicius <rmind at noxt eu>
+ * All rights reserved.
+ *
+ * Use is subject to license terms, as specified in the LICENSE file.
+ */
+
+/*
+ * rvault FUSE operations: the low-level (inode-based) FUSE 3 API.
+ *
+ * Each looked up file or directory is represented by a node, which is
+ * identified by its inode number (the node address) and which caches
+ * the plain and the encrypted name of the path component.  Therefore,
+ * the vault path of an object is composed of the cached names, instead
+ * of resolving (i.e. encrypting) the whole path in every operation; a
+ * new name is encrypted only once, on the lookup.
+ *
+ * The nodes are kept in a hash table, keyed by the parent node and the
+ * name.  A node is referenced by the kernel lookups (see the forget
+ * operation) and by its child nodes.
+ *
+ * => If the vault is being re-keyed, the path components might still
+ *    be encrypted with the previous keys; in such case, fall back to the
+ *    full path resolution (see put_path_component() in resolve.c).
+ *
+ * => The session is single-threaded, therefore the nodes need no locking.
+ *    However, the re-keying sweeper renames the objects holding the vault
+ *    lock, therefore it is held from the path resolution until the system
+ *    call on the path returns (see vault_path_lock()).
+ *
+ * => Optionally, the vault directories of the nodes are watched for the
+ *    external changes (e.g. by the file synchronization tools), in which
+ *    case the affected nodes are re-validated and the kernel caches are
+ *    invalidated (see the "External changes" section below).
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <sys/queue.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+
+#if defined(__linux__)
+#include <sys/inotify.h>
+#include <poll.h>
+#endif
+
+#define	FUSE_USE_VERSION	31
+#include <fuse_lowlevel.h>
+
+#include "rvault.h"
+#include "rvaultfs.h"
+#include "fileobj.h"
+#include "storage.h"
+#include "utils.h"
+
+#define	RVFS_TIMEOUT		1.0	// entry and attribute timeout
+#define	RVFS_RO_TIMEOUT		60.0	// .. if mounted read-only
+#define	RVFS_HASH_MINSIZE	1024
+#define	RVFS_MAX_IOSIZE		(1024U * 1024) // 1 MB
+#define	RVFS_WATCH_HSIZE	256
+
+/* The inode number of the entries which are not looked up (see readdir). */
+#ifndef FUSE_UNKNOWN_INO
+#define	FUSE_UNKNOWN_INO	0xffffffff
+#endif
+
+typedef struct rvfs_node {
+	struct rvfs_node *	parent;
+	char *			name;
+	char *			vname;
+	uint64_t		nlookup;
+	unsigned		nchildren;
+	bool			hashed;
+	LIST_ENTRY(rvfs_node)	hentry;
+
+	/*
+	 * Inode number of the file object and the watch of the vault
+	 * directory (zero if none).
+	 */
+	ino_t			vino;
+	int			wd;
+	LIST_ENTRY(rvfs_node)	wentry;
+
+	/*
+	 * Open file object (the last one, if opened multiple times) and
+	 * the attributes of the file object on the last release, which
+	 * determine whether the cached pages are still valid.
+	 */
+	fileobj_t *		fobj;
+	unsigned		nopen;
+	bool			cached;
+	struct timespec		cmtime;
+	off_t			csize;
+
+	/* Control directory or file (see the "Control directory" below). */
+	unsigned		ctl;
+} rvfs_node_t;
+
+typedef LIST_HEAD(, rvfs_node) rvfs_bucket_t;
+
+struct rvfs_watch;
+
+typedef struct {
+	rvault_t *		vault;
+	unsigned		flags;
+	double			timeout;
+	rvfs_node_t		root;
+	rvfs_bucket_t *		htable;
+	unsigned		hsize;
+	unsigned		nnodes;
+	struct fuse_session *	se;
+	struct rvfs_watch *	watch;
+} rvfs_t;
+
+///////////////////////////////////////////////////////////////////////////
+
+static inline rvfs_t *
+get_fs(fuse_req_t req)
+{
+	rvfs_t *fs = fuse_req_userdata(req);
+	ASSERT(fs != NULL);
+
+	/* Every operation is a foreground request for the preloader. */
+	rvault_preload_touch(fs->vault);
+	return fs;
+}
+
+/*
+ * OP_STATS: record the latency of the operation (see RVAULT_OP_SCOPE).
+ */
+#define	OP_STATS(op)	RVAULT_OP_SCOPE(((rvfs_t *)			\
+    fuse_req_userdata(req))->vault, RVAULT_OP_ ## op)
+
+/*
+ * OP_TRACE: set the arguments of the operation, if tracing; the object
+ * is given by the inode and, optionally, the name in it (see trace_args()).
+ */
+#define	OP_TRACE(ino, name, arg, off, len)				\
+    do {								\
+	if (__hist_scope.trec) {					\
+		trace_args(req, __hist_scope.trec, (ino), (name),	\
+		    (arg), (off), (len));				\
+	}								\
+    } while (0)
+
+#define	OP_TRACE2(ino, name)						\
+    do {								\
+	if (__hist_scope.trec) {					\
+		trace_path2(req, __hist_scope.trec, (ino), (name));	\
+	}								\
+    } while (0)
+
+static inline rvfs_node_t *
+get_node(rvfs_t *fs, fuse_ino_t ino)
+{
+	return ino == FUSE_ROOT_ID ? &fs->root : (void *)(uintptr_t)ino;
+}
+
+static inline fuse_ino_t
+get_ino(rvfs_t *fs, rvfs_node_t *node)
+{
+	return node == &fs->root ? FUSE_ROOT_ID : (uintptr_t)node;
+}
+
+static inline fileobj_t *
+get_fobj(struct fuse_file_info *fi)
+{
+	fileobj_t *fobj = (void *)(uintptr_t)fi->fh;
+	ASSERT(fobj != NULL);
+	return fobj;
+}
+
+/*
+ * Node hash table.
+ */
+
+static unsigned
+node_hash(const rvfs_node_t *parent, const char *name)
+{
+	uintptr_t p = (uintptr_t)parent;
+	uint32_t h = 2166136261U;	// FNV-1a
+
+	for (unsigned i = 0; i < sizeof(p); i++, p >>= 8) {
+		h = (h ^ (p & 0xff)) * 16777619U;
+	}
+	while (*name) {
+		h = (h ^ (unsigned char)*name++) * 16777619U;
+	}
+	return h;
+}
+
+static rvfs_bucket_t *
+node_bucket(rvfs_t *fs, const rvfs_node_t *parent, const char *name)
+{
+	return &fs->htable[node_hash(parent, name) & (fs->hsize - 1)];
+}
+
+static void
+node_hash_grow(rvfs_t *fs)
+{
+	const unsigned hsize = fs->hsize;
+	rvfs_bucket_t *htable = fs->htable;
+
+	fs->htable = calloc(hsize * 2, sizeof(rvfs_bucket_t));
+	if (fs->htable == NULL) {
+		/* Not critical: just keep the current table. */
+		fs->htable = htable;
+		return;
+	}
+	fs->hsize = hsize * 2;
+
+	for (unsigned i = 0; i < hsize; i++) {
+		rvfs_node_t *node;
+
+		while ((node = LIST_FIRST(&htable[i])) != NULL) {
+			LIST_REMOVE(node, hentry);
+			LIST_INSERT_HEAD(node_bucket(fs, node->parent,
+			    node->name), node, hentry);
+		}
+	}
+	free(htable);
+}
+
+static rvfs_node_t *
+node_find(rvfs_t *fs, rvfs_node_t *parent, const char *name)
+{
+	rvfs_node_t *node;
+
+	LIST_FOREACH(node, node_bucket(fs, parent, name), hentry) {
+		if (node->parent == parent && strcmp(node->name, name) == 0) {
+			return node;
+		}
+	}
+	return NULL;
+}
+
+static void
+node_insert(rvfs_t *fs, rvfs_node_t *node)
+{
+	ASSERT(!node->hashed);
+	LIST_INSERT_HEAD(node_bucket(fs, node->parent, node->name),
+	    node, hentry);
+	node->hashed = true;
+}
+
+static void
+node_unhash(rvfs_node_t *node)
+{
+	if (node->hashed) {
+		LIST_REMOVE(node, hentry);
+		node->hashed = false;
+	}
+}
+
+/*
+ * node_get: get the node of the name in the given directory, creating
+ * it if necessary, and acquire a lookup reference.
+ *
+ * => Takes the ownership of the encrypted name.
+ */
+static void	watch_del(rvfs_t *, rvfs_node_t *);
+
+static rvfs_node_t *
+node_get(rvfs_t *fs, rvfs_node_t *parent, const char *name, char *vname)
+{
+	rvfs_node_t *node;
+
+	if ((node = node_find(fs, parent, name)) != NULL) {
+		free(vname);
+		node->nlookup++;
+		return node;
+	}
+	if ((node = calloc(1, sizeof(rvfs_node_t))) == NULL) {
+		free(vname);
+		return NULL;
+	}
+	if ((node->name = strdup(name)) == NULL) {
+		free(vname);
+		free(node);
+		return NULL;
+	}
+	node->vname = vname;
+	node->parent = parent;
+	node->nlookup = 1;
+	parent->nchildren++;
+	node_insert(fs, node);
+
+	if (++fs->nnodes > fs->hsize * 2) {
+		node_hash_grow(fs);
+	}
+	return node;
+}
+
+/*
+ * node_put: release the lookup references and destroy the node, as
+ * well as its parents, once there are no references left.
+ */
+static void
+node_put(rvfs_t *fs, rvfs_node_t *node, uint64_t nlookup)
+{
+	ASSERT(node->nlookup >= nlookup);
+	node->nlookup -= nlookup;
+
+	while (node != &fs->root && node->nlookup == 0 &&
+	    node->nchildren == 0) {
+		rvfs_node_t *parent = node->parent;
+
+		node_unhash(node);
+		watch_del(fs, node);
+		free(node->name);
+		free(node->vname);
+		free(node);
+		fs->nnodes--;
+
+		ASSERT(parent->nchildren > 0);
+		parent->nchildren--;
+		node = parent;
+	}
+}
+
+/*
+ * Path construction.
+ */
+
+static bool
+read_only_p(fuse_req_t req, rvfs_t *fs)
+{
+	if (fs->vault->read_only) {
+		fuse_reply_err(req, EROFS);
+		return true;
+	}
+	return false;
+}
+
+static int
+path_prepend(char *buf, size_t *off, const char *pc)
+{
+	const size_t len = strlen(pc);
+
+	if (len + 1 > *off) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	*off -= len;
+	memcpy(&buf[*off], pc, len);
+	buf[--(*off)] = '/';
+	return 0;
+}
+
+/*
+ * node_mkpath: construct the path of the node, optionally with the
+ * name appended, using either the plain or the encrypted names.
+ */
+static int
+node_mkpath(rvfs_t *fs, const rvfs_node_t *node, const char *name,
+    bool vnames, char *buf, size_t len)
+{
+	char tmp[PATH_MAX];
+	size_t off = sizeof(tmp);
+	const char *base = "";
+	int ret;
+
+	tmp[--off] = '\0';
+	if (name && path_prepend(tmp, &off, name) == -1) {
+		return -1;
+	}
+	for (; node != &fs->root; node = node->parent) {
+		if (path_prepend(tmp, &off, vnames ?
+		    node->vname : node->name) == -1) {
+			return -1;
+		}
+	}
+	if (vnames) {
+		base = fs->vault->base_path ? fs->vault->base_path : "";
+	}
+	ret = snprintf(buf, len, "%s%s", base, tmp[off] ? &tmp[off] : "/");
+	if (ret < 0 || (size_t)ret >= len) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	return 0;
+}
+
+static int
+get_path(rvfs_t *fs, const rvfs_node_t *node, const char *name,
+    char *buf, size_t len)
+{
+	return node_mkpath(fs, node, name, false, buf, len);
+}
+
+/*
+ * get_vault_path: get the path to the file object of the node or of
+ * the name (given in the encrypted form) in the node directory.
+ */
+static int
+get_vault_path(rvfs_t *fs, const rvfs_node_t *node, const char *name,
+    const char *vname, char *buf, size_t len)
+{
+	rvault_t *vault = fs->vault;
+	char path[PATH_MAX], *vpath;
+	int ret;
+
+	if (vault->prev_key_count == 0) {
+		return node_mkpath(fs, node, vname, true, buf, len);
+	}
+
+	/* Re-keying: the components might be using the previous keys. */
+	if (get_path(fs, node, name, path, sizeof(path)) == -1) {
+		return -1;
+	}
+	if ((vpath = rvault_resolve_path(vault, path, NULL)) == NULL) {
+		return -1;
+	}
+	ret = snprintf(buf, len, "%s", vpath);
+	free(vpath);
+
+	if (ret < 0 || (size_t)ret >= len) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * vault_path_lock: hold the vault lock across the resolution of a path
+ * and the operation on the resolved path.
+ *
+ * => Only while re-keying: otherwise, the names do not change.
+ * => Must not be held when calling the fileobj routines which take it.
+ */
+static void
+vault_path_lock(rvfs_t *fs)
+{
+	if (fs->vault->prev_key_count) {
+		pthread_mutex_lock(&fs->vault->lock);
+	}
+}
+
+static void
+vault_path_unlock(rvfs_t *fs)
+{
+	if (fs->vault->prev_key_count) {
+		pthread_mutex_unlock(&fs->vault->lock);
+	}
+}
+
+static char *
+get_vname(rvfs_t *fs, const char *name)
+{
+	return rvault_encrypt_vname(fs->vault, name, strlen(name));
+}
+
+/*
+ * trace_args: set the arguments of the operation for the trace; the
+ * paths are constructed from the plain names (see OP_TRACE).
+ */
+static void
+trace_args(fuse_req_t req, rvault_trace_rec_t *trec, fuse_ino_t ino,
+    const char *name, int64_t arg, int64_t off, uint64_t len)
+{
+	rvfs_t *fs = fuse_req_userdata(req);
+	char path[PATH_MAX];
+
+	if (get_path(fs, get_node(fs, ino), name, path, sizeof(path)) == -1) {
+		rvault_trace_args(trec, NULL, arg, off, len);
+		return;
+	}
+	rvault_trace_args(trec, path, arg, off, len);
+}
+
+static void
+trace_path2(fuse_req_t req, rvault_trace_rec_t *trec, fuse_ino_t ino,
+    const char *name)
+{
+	rvfs_t *fs = fuse_req_userdata(req);
+	char path[PATH_MAX];
+
+	if (get_path(fs, get_node(fs, ino), name, path, sizeof(path)) == 0) {
+		rvault_trace_path2(trec, path);
+	}
+}
+
+/*
+ * External changes.
+ *
+ * The vault directories of the directory nodes are watched (inotify);
+ * an event on a name only tells which node to re-validate: a node whose
+ * file object was removed or replaced (i.e. a different inode) is taken
+ * out of the hash table, so that the next lookup creates a new node, and
+ * a node whose file object was modified gets its kernel caches dropped,
+ * unless the file is open through the mount.  Note: the changes made
+ * through the mount itself are recognised as such, i.e. the same file
+ * object, with the attributes recorded on release.
+ *
+ * => The kernel is notified by a separate thread, since a notification
+ *    may block on the directory lock held by an operation which is still
+ *    waiting for the single-threaded session.
+ */
+
+#if defined(__linux__)
+
+#define	RVFS_WATCH_MASK		(IN_CREATE | IN_DELETE | IN_MOVED_FROM | \
+				IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB)
+
+enum { RVFS_INVAL_ENTRY, RVFS_INVAL_DELETE, RVFS_INVAL_INODE };
+
+typedef struct rvfs_inval {
+	unsigned		type;
+	fuse_ino_t		parent;
+	fuse_ino_t		ino;
+	char *			name;
+	STAILQ_ENTRY(rvfs_inval) entry;
+} rvfs_inval_t;
+
+struct rvfs_watch {
+	int			fd;
+	rvfs_bucket_t		whtable[RVFS_WATCH_HSIZE];
+
+	/* Queue of the kernel notifications and the notifier thread. */
+	pthread_t		thread;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cv;
+	STAILQ_HEAD(, rvfs_inval) queue;
+	bool			stop;
+};
+
+static rvfs_bucket_t *
+watch_bucket(struct rvfs_watch *w, int wd)
+{
+	return &w->whtable[(unsigned)wd % RVFS_WATCH_HSIZE];
+}
+
+static rvfs_node_t *
+watch_find(struct rvfs_watch *w, int wd)
+{
+	rvfs_node_t *node;
+
+	LIST_FOREACH(node, watch_bucket(w, wd), wentry) {
+		if (node->wd == wd) {
+			return node;
+		}
+	}
+	return NULL;
+}
+
+static void
+watch_add(rvfs_t *fs, rvfs_node_t *node, const char *vpath)
+{
+	struct rvfs_watch *w = fs->watch;
+	int wd;
+
+	if (w == NULL || node->wd) {
+		return;
+	}
+	wd = inotify_add_watch(w->fd, vpath, RVFS_WATCH_MASK | IN_ONLYDIR);
+	if (wd == -1) {
+		app_elog(LOG_DEBUG, "%s: inotify_add_watch `%s' failed",
+		    __func__, vpath);
+		return;
+	}
+	if (watch_find(w, wd) == NULL) {
+		/* Note: the same directory may have a stale node. */
+		LIST_INSERT_HEAD(watch_bucket(w, wd), node, wentry);
+		node->wd = wd;
+	}
+}
+
+static void
+watch_del(rvfs_t *fs, rvfs_node_t *node)
+{
+	struct rvfs_watch *w = fs->watch;
+
+	if (node->wd == 0) {
+		return;
+	}
+	if (w) {
+		LIST_REMOVE(node, wentry);
+		(void)inotify_rm_watch(w->fd, node->wd);
+	}
+	node->wd = 0;
+}
+
+static void
+watch_queue(rvfs_t *fs, unsigned type, rvfs_node_t *parent,
+    rvfs_node_t *node, const char *name)
+{
+	struct rvfs_watch *w = fs->watch;
+	rvfs_inval_t *inval;
+
+	if ((inval = calloc(1, sizeof(rvfs_inval_t))) == NULL) {
+		return;
+	}
+	if (name && (inval->name = strdup(name)) == NULL) {
+		free(inval);
+		return;
+	}
+	inval->type = type;
+	inval->parent = get_ino(fs, parent);
+	inval->ino = get_ino(fs, node);
+
+	pthread_mutex_lock(&w->lock);
+	STAILQ_INSERT_TAIL(&w->queue, inval, entry);
+	pthread_cond_signal(&w->cv);
+	pthread_mutex_unlock(&w->lock);
+}
+
+/*
+ * watch_revalidate: re-validate the node of the name in the directory.
+ */
+static void
+watch_revalidate(rvfs_t *fs, rvfs_node_t *dnode, const char *name)
+{
+	rvfs_node_t *node = node_find(fs, dnode, name);
+	char vpath[PATH_MAX], *vname;
+	struct stat st;
+	bool exists;
+
+	if (node == NULL) {
+		/* Not known to the kernel: nothing is cached. */
+		return;
+	}
+	if ((vname = get_vname(fs, name)) == NULL) {
+		return;
+	}
+	vault_path_lock(fs);
+	if (get_vault_path(fs, dnode, name, vname,
+	    vpath, sizeof(vpath)) == -1) {
+		vault_path_unlock(fs);
+		free(vname);
+		return;
+	}
+	free(vname);
+	exists = fileobj_vstat(fs->vault, vpath, &st) == 0;
+	vault_path_unlock(fs);
+
+	if (!exists || st.st_ino != node->vino) {
+		app_log(LOG_DEBUG, "%s: `%s' %s", __func__, name,
+		    exists ? "replaced" : "removed");
+		node_unhash(node);
+		watch_queue(fs, exists ? RVFS_INVAL_ENTRY : RVFS_INVAL_DELETE,
+		    dnode, node, name);
+		return;
+	}
+	if (node->nopen) {
+		return;
+	}
+	if (!node->cached || st.st_size != node->csize ||
+	    st.st_mtim.tv_sec != node->cmtime.tv_sec ||
+	    st.st_mtim.tv_nsec != node->cmtime.tv_nsec) {
+		node->cached = false;
+		watch_queue(fs, RVFS_INVAL_INODE, dnode, node, NULL);
+	}
+}
+
+/*
+ * watch_revalidate_all: re-validate all nodes (the events were lost).
+ */
+static void
+watch_revalidate_all(rvfs_t *fs)
+{
+	for (unsigned i = 0; i < fs->hsize; i++) {
+		rvfs_node_t *node = LIST_FIRST(&fs->htable[i]), *next;
+
+		while (node) {
+			/* Note: the node might get unhashed. */
+			next = LIST_NEXT(node, hentry);
+			watch_revalidate(fs, node->parent, node->name);
+			node = next;
+		}
+	}
+}
+
+/*
+ * watch_process: process the pending events (in the session thread).
+ */
+static void
+watch_process(rvfs_t *fs)
+{
+	struct rvfs_watch *w = fs->watch;
+	char buf[4096] __aligned(__alignof__(struct inotify_event));
+	const struct inotify_event *ev;
+	ssize_t len;
+
+	while ((len = read(w->fd, buf, sizeof(buf))) > 0) {
+		for (char *p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+			rvfs_node_t *dnode;
+			size_t nlen;
+			char *name;
+
+			ev = (const void *)p;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				app_log(LOG_WARNING, "%s: event queue "
+				    "overflow", __func__);
+				watch_revalidate_all(fs);
+				continue;
+			}
+			if ((dnode = watch_find(w, ev->wd)) == NULL) {
+				continue;
+			}
+			if (ev->mask & IN_IGNORED) {
+				/* The directory was removed. */
+				LIST_REMOVE(dnode, wentry);
+				dnode->wd = 0;
+				continue;
+			}
+			if (ev->len == 0 || strncmp(ev->name,
+			    RVAULT_FOBJ_PREF, RVAULT_FOBJ_PREFLEN)) {
+				continue;
+			}
+			name = rvault_resolve_vname(fs->vault, ev->name, &nlen);
+			if (name == NULL) {
+				continue;
+			}
+			watch_revalidate(fs, dnode, name);
+			crypto_memzero(name, nlen);
+			free(name);
+		}
+	}
+}
+
+static void *
+watch_notifier(void *arg)
+{
+	rvfs_t *fs = arg;
+	struct rvfs_watch *w = fs->watch;
+
+	pthread_mutex_lock(&w->lock);
+	for (;;) {
+		rvfs_inval_t *inval;
+		int ret = 0;
+
+		while (!w->stop && STAILQ_EMPTY(&w->queue)) {
+			pthread_cond_wait(&w->cv, &w->lock);
+		}
+		if (w->stop) {
+			break;
+		}
+		inval = STAILQ_FIRST(&w->queue);
+		STAILQ_REMOVE_HEAD(&w->queue, entry);
+		pthread_mutex_unlock(&w->lock);
+
+		switch (inval->type) {
+		case RVFS_INVAL_ENTRY:
+			ret = fuse_lowlevel_notify_inval_entry(fs->se,
+			    inval->parent, inval->name, strlen(inval->name));
+			break;
+		case RVFS_INVAL_DELETE:
+			ret = fuse_lowlevel_notify_delete(fs->se,
+			    inval->parent, inval->ino, inval->name,
+			    strlen(inval->name));
+			break;
+		case RVFS_INVAL_INODE:
+			ret = fuse_lowlevel_notify_inval_inode(fs->se,
+			    inval->ino, 0, 0);
+			break;
+		}
+		if (ret && ret != -ENOENT) {
+			app_log(LOG_DEBUG, "%s: notification %u failed: %d",
+			    __func__, inval->type, ret);
+		}
+		free(inval->name);
+		free(inval);
+
+		pthread_mutex_lock(&w->lock);
+	}
+	pthread_mutex_unlock(&w->lock);
+	return NULL;
+}
+
+/*
+ * watch_start: start watching the vault, beginning with the root.
+ */
+static int
+watch_start(rvfs_t *fs)
+{
+	struct rvfs_watch *w;
+	int ret;
+
+	if ((w = calloc(1, sizeof(struct rvfs_watch))) == NULL) {
+		return -1;
+	}
+	if ((w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) {
+		free(w);
+		return -1;
+	}
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->cv, NULL);
+	STAILQ_INIT(&w->queue);
+
+	if ((ret = pthread_create(&w->thread, NULL, watch_notifier, fs)) != 0) {
+		errno = ret;
+		pthread_cond_destroy(&w->cv);
+		pthread_mutex_destroy(&w->lock);
+		close(w->fd);
+		free(w);
+		return -1;
+	}
+	fs->watch = w;
+	watch_add(fs, &fs->root, fs->vault->base_path);
+	return 0;
+}
+
+static void
+watch_stop(rvfs_t *fs)
+{
+	struct rvfs_watch *w = fs->watch;
+	rvfs_inval_t *inval;
+
+	if (w == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&w->lock);
+	w->stop = true;
+	pthread_cond_signal(&w->cv);
+	pthread_mutex_unlock(&w->lock);
+	pthread_join(w->thread, NULL);
+
+	while ((inval = STAILQ_FIRST(&w->queue)) != NULL) {
+		STAILQ_REMOVE_HEAD(&w->queue, entry);
+		free(inval->name);
+		free(inval);
+	}
+	pthread_cond_destroy(&w->cv);
+	pthread_mutex_destroy(&w->lock);
+	close(w->fd);
+	fs->watch = NULL;
+	free(w);
+}
+
+/*
+ * rvaultfs_loop: the session loop, also processing the watch events.
+ */
+static int
+rvaultfs_loop(rvfs_t *fs, struct fuse_session *se)
+{
+	struct fuse_buf fbuf;
+	int ret = 0;
+
+	memset(&fbuf, 0, sizeof(fbuf));
+	while (!fuse_session_exited(se)) {
+		struct pollfd pfd[2];
+
+		/* Note: the watch is started by the init operation. */
+		pfd[0].fd = fuse_session_fd(se);
+		pfd[0].events = POLLIN;
+		pfd[1].fd = fs->watch ? fs->watch->fd : -1;
+		pfd[1].events = POLLIN;
+
+		if (poll(pfd, 2, -1) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			ret = -errno;
+			break;
+		}
+		if (pfd[1].revents & POLLIN) {
+			watch_process(fs);
+		}
+		if (pfd[0].revents == 0) {
+			continue;
+		}
+		if ((ret = fuse_session_receive_buf(se, &fbuf)) == -EINTR) {
+			continue;
+		}
+		if (ret <= 0) {
+			break;
+		}
+		fuse_session_process_buf(se, &fbuf);
+	}
+	free(fbuf.mem);
+	fuse_session_reset(se);
+	return ret < 0 ? -1 : 0;
+}
+
+#else
+
+static void
+watch_add(rvfs_t *fs __unused, rvfs_node_t *node __unused,
+    const char *vpath __unused)
+{
+	/* Not supported. */
+}
+
+static void
+watch_del(rvfs_t *fs __unused, rvfs_node_t *node __unused)
+{
+	/* Not supported. */
+}
+
+#endif
+
+/*
+ * node_seen: record the file object of the node, as just looked up.
+ */
+static void
+node_seen(rvfs_t *fs, rvfs_node_t *node, const struct stat *st)
+{
+	char vpath[PATH_MAX];
+
+	node->vino = st->st_ino;
+	if (fs->watch && S_ISDIR(st->st_mode) && node->wd == 0 &&
+	    get_vault_path(fs, node, NULL, NULL, vpath, sizeof(vpath)) == 0) {
+		watch_add(fs, node, vpath);
+	}
+}
+
+/*
+ * reply_entry: reply with the entry, given the attributes if they are
+ * already known (e.g. preloaded).
+ */
+static rvfs_node_t *
+reply_entry(fuse_req_t req, rvfs_node_t *parent, const char *name,
+    char *vname, const char *vpath, const struct stat *st,
+    struct fuse_file_info *fi)
+{
+	rvfs_t *fs = get_fs(req);
+	struct fuse_entry_param e;
+	rvfs_node_t *node;
+
+	memset(&e, 0, sizeof(e));
+	if (st) {
+		memcpy(&e.attr, st, sizeof(struct stat));
+	} else if (fileobj_vstat(fs->vault, vpath, &e.attr) == -1) {
+		free(vname);
+		return NULL;
+	}
+	if ((node = node_get(fs, parent, name, vname)) == NULL) {
+		return NULL;
+	}
+	node_seen(fs, node, &e.attr);
+	e.ino = get_ino(fs, node);
+	e.attr.st_ino = e.ino;
+	e.attr_timeout = fs->timeout;
+	e.entry_timeout = fs->timeout;
+
+	if (fi) {
+		fuse_reply_create(req, &e, fi);
+	} else {
+		fuse_reply_entry(req, &e);
+	}
+	return node;
+}
+
+/*
+ * Control directory: the statistics files, rendered on open.
+ *
+ * => The nodes are not backed by the vault: their encrypted names are
+ *    the plain ones, which do not exist in the vault, therefore the
+ *    operations on them, other than reading, fail (e.g. with ENOENT).
+ */
+
+#define	RVFS_CTL_DIR		1
+#define	RVFS_CTL_STATS		2
+#define	RVFS_CTL_STATS_PROM	3
+
+static void
+ctl_stat(rvfs_t *fs, rvfs_node_t *node, struct stat *st)
+{
+	const bool dir = node->ctl == RVFS_CTL_DIR;
+
+	memset(st, 0, sizeof(struct stat));
+	st->st_ino = get_ino(fs, node);
+	st->st_mode = dir ? (S_IFDIR | 0111) : (S_IFREG | 0444);
+	st->st_nlink = dir ? 2 : 1;
+	st->st_uid = getuid();
+	st->st_gid = getgid();
+	st->st_mtime = st->st_ctime = st->st_atime = time(NULL);
+}
+
+/*
+ * ctl_lookup: look up the control directory or its file, if the name
+ * refers to them; returns true if so (i.e. the request is replied).
+ */
+static bool
+ctl_lookup(fuse_req_t req, rvfs_node_t *dnode, const char *name)
+{
+	rvfs_t *fs = get_fs(req);
+	struct fuse_entry_param e;
+	rvfs_node_t *node;
+	unsigned ctl;
+	char *vname;
+
+	if (dnode == &fs->root && strcmp(name, RVAULTFS_CTL_DIR) == 0) {
+		ctl = RVFS_CTL_DIR;
+	} else if (dnode->ctl != RVFS_CTL_DIR) {
+		return false;
+	} else if (strcmp(name, RVAULTFS_CTL_STATS) == 0) {
+		ctl = RVFS_CTL_STATS;
+	} else if (strcmp(name, RVAULTFS_CTL_STATS_PROM) == 0) {
+		ctl = RVFS_CTL_STATS_PROM;
+	} else {
+		fuse_reply_err(req, ENOENT);
+		return true;
+	}
+	if ((vname = strdup(name)) == NULL ||
+	    (node = node_get(fs, dnode, name, vname)) == NULL) {
+		fuse_reply_err(req, errno);
+		return true;
+	}
+	node->ctl = ctl;
+
+	memset(&e, 0, sizeof(e));
+	ctl_stat(fs, node, &e.attr);
+	e.ino = e.attr.st_ino;
+	e.attr_timeout = fs->timeout;
+	e.entry_timeout = fs->timeout;
+	fuse_reply_entry(req, &e);
+	return true;
+}
+
+static void
+ctl_open(fuse_req_t req, rvfs_node_t *node, struct fuse_file_info *fi)
+{
+	rvfs_t *fs = get_fs(req);
+	char *buf;
+
+	if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+		fuse_reply_err(req, EACCES);
+		return;
+	}
+	if ((buf = rvault_stats_render(fs->vault,
+	    node->ctl == RVFS_CTL_STATS_PROM ?
+	    RVAULT_STATS_PROM : RVAULT_STATS_JSON)) == NULL) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+	fi->fh = (uintptr_t)buf;
+	fi->direct_io = true;
+	fuse_reply_open(req, fi);
+}
+
+static void
+ctl_read(fuse_req_t req, size_t len, off_t offset, struct fuse_file_info *fi)
+{
+	const char *data = (const char *)(uintptr_t)fi->fh;
+	const size_t dlen = strlen(data);
+
+	if ((size_t)offset >= dlen) {
+		fuse_reply_buf(req, NULL, 0);
+		return;
+	}
+	fuse_reply_buf(req, data + offset, MIN(len, dlen - (size_t)offset));
+}
+
+///////////////////////////////////////////////////////////////////////////
+
+static void
+rvaultfs_init(void *arg, struct fuse_conn_info *conn)
+{
+	rvfs_t *fs = arg;
+
+	/*
+	 * Use larger requests (the kernel caps them to its limit) and
+	 * splice the data between the kernel and the file buffers.
+	 */
+	conn->max_write = RVFS_MAX_IOSIZE;
+	conn->max_readahead = RVFS_MAX_IOSIZE;
+	conn->want |= conn->capable &
+	    (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE);
+
+	if (app_log_start() == -1) {
+		app_elog(LOG_ERR, "failed to start the logger");
+	}
+
+	/*
+	 * Start the re-keying sweeper, if needed.  Note: it has to be
+	 * started after daemonizing, as the threads do not survive fork.
+	 */
+	if (rvault_rekey_start(fs->vault) == -1) {
+		app_log(LOG_ERR, "failed to start the re-keying sweeper");
+	}
+	if (rvault_preload_start(fs->vault) == -1) {
+		app_log(LOG_ERR, "failed to start the preloader");
+	}
+	if (rvault_stats_start(fs->vault) == -1) {
+		app_elog(LOG_ERR, "failed to set up the statistics logging");
+	}
+	if (fs->flags & RVAULTFS_WATCH) {
+#if defined(__linux__)
+		if (watch_start(fs) == -1) {
+			app_elog(LOG_ERR, "failed to watch the vault");
+		}
+#else
+		app_log(LOG_WARNING, "watching is not supported");
+#endif
+	}
+}
+
+static void
+rvaultfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	rvfs_t *fs = get_fs(req);
+	rvfs_node_t *dnode = get_node(fs, parent);
+	char path[PATH_MAX], vpath[PATH_MAX], *vname;
+	struct stat st, *stp = NULL;
+	OP_STATS(LOOKUP);
+
+	OP_TRACE(parent, name, 0, 0, 0);
+	if (ctl_lookup(req, dnode, name)) {
+		return;
+	}
+	app_log(LOG_DEBUG, "%s: parent %p, name `%s'", __func__, dnode, name);
+
+	/* Use the encrypted name and the attributes, if preloaded. */
+	if (fs->vault->preload &&
+	    get_path(fs, dnode, name, path, sizeof(path)) == 0 &&
+	    rvault_preload_lookup(fs->vault, path, &vname, &st) == 0) {
+		stp = &st;
+	} else if ((vname = get_vname(fs, name)) == NULL) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+	vault_path_lock(fs);
+	if (get_vault_path(fs, dnode, name, vname,
+	    vpath, sizeof(vpath)) == -1 ||
+	    (stp == NULL && fileobj_vstat(fs->vault, vpath, &st) == -1)) {
+		vault_path_unlock(fs);
+		fuse_reply_err(req, errno);
+		free(vname);
+		return;
+	}
+	vault_path_unlock(fs);
+	if (reply_entry(req, dnode, name, vname, vpath, &st, NULL) == NULL) {
+		fuse_reply_err(req, errno);
+	}
+}
+
+static void
+rvaultfs_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+	rvfs_t *fs = get_fs(req);
+	OP_STATS(FORGET);
+
+	OP_TRACE(ino, NULL, 0, 0, 0);
+	node_put(fs, get_node(fs, ino), nlookup);
+	fuse_reply_none(req);
+}
+
+static void
+rvaultfs_forget_multi(fuse_req_t req, size_t count,
+    struct fuse_forget_data *forgets)
+{
+	rvfs_t *fs = get_fs(req);
+	OP_STATS(FORGET);
+
+	for (size_t i = 0; i < count; i++) {
+		node_put(fs, get_node(fs, forgets[i].ino), forgets[i].nlookup);
+	}
+	fuse_reply_none(req);
+}
+
+static void
+rvaultfs_getattr(fuse_req_t req, fuse_ino_t ino,
+    struct fuse_file_info *fi __unused)
+{
+	rvfs_t *fs = get_fs(req);
+	char vpath[PATH_MAX];
+	struct stat st;
+
+	rvfs_node_t *node = get_node(fs, ino);
+	OP_STATS(GETATTR);
+
+	OP_TRACE(ino, NULL, 0, 0, 0);
+	if (node->ctl) {
+		ctl_stat(fs, node, &st);
+		fuse_reply_attr(req, &st, fs->timeout);
+		return;
+	}
+
+	/*
+	 * The data of an open file might not be written back yet: use
+	 * its in-memory length, if loaded; the data is not loaded here.
+	 */
+	if (node->fobj) {
+		if (fileobj_fstat(node->fobj, &st) == -1) {
+			fuse_reply_err(req, errno);
+			return;
+		}
+		goto out;
+	}
+	vault_path_lock(fs);
+	if (get_vault_path(fs, node, NULL, NULL, vpath, sizeof(vpath)) == -1 ||
+	    fileobj_vstat(fs->vault, vpath, &st) == -1) {
+		vault_path_unlock(fs);
+		fuse_reply_err(req, errno);
+		return;
+	}
+	vault_path_unlock(fs);
+out:
+	st.st_ino = ino;
+	fuse_reply_attr(req, &st, fs->timeout);
+}
+
+static void
+rvaultfs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+    int to_set, struct fuse_file_info *fi)
+{
+	rvfs_t *fs = get_fs(req);
+	rvfs_node_t *node = get_node(fs, ino);
+	char vpath[PATH_MAX];
+	OP_STATS(SETATTR);
+
+	OP_TRACE(ino, NULL, (to_set & FUSE_SET_ATTR_SIZE) != 0, 0,
+	    attr->st_size);
+	app_log(LOG_DEBUG, "%s: node %p, to_set 0x%x", __func__, node, to_set);
+	if (read_only_p(req, fs)) {
+		return;
+	}
+
+	/*
+	 * Note: the size is changed first, as the fileobj routines take
+	 * the vault lock themselves.
+	 */
+	if ((to_set & FUSE_SET_ATTR_SIZE) != 0) {
+		char path[PATH_MAX];
+
+		if (attr->st_size < 0) {
+			errno = EINVAL;
+			goto err;
+		}
+		if (fi) {
+			fileobj_t *fobj = get_fobj(fi);
+
+			if (fileobj_setsize(fobj, attr->st_size) == -1) {
+				goto err;
+			}
+		} else if (get_path(fs, node, NULL, path, sizeof(path)) == -1 ||
+		    fileobj_truncate(fs->vault, path, attr->st_size) == -1) {
+			goto err;
+		}
+	}
+	vault_path_lock(fs);
+	if (get_vault_path(fs, node, NULL, NULL, vpath, sizeof(vpath)) == -1) {
+		goto err_unlock;
+	}
+	if ((to_set & FUSE_SET_ATTR_MODE) != 0 &&
+	    chmod(vpath, attr->st_mode) == -1) {
+		goto err_unlock;
+	}
+	if ((to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) != 0) {
+		const uid_t uid = (to_set & FUSE_SET_ATTR_UID) ?
+		    attr->st_uid : (uid_t)-1;
+		const gid_t gid = (to_set & FUSE_SET_ATTR_GID) ?
+		    attr->st_gid : (gid_t)-1;
+
+		if (chown(vpath, uid, gid) == -1) {
+			goto err_unlock;
+		}
+	}
+	if ((to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)) != 0) {
+		struct timespec ts[2];
+
+		ts[0].tv_sec = 0;
+		ts[0].tv_nsec = UTIME_OMIT;
+		ts[1] = ts[0];
+
+		if (to_set & FUSE_SET_ATTR_ATIME_NOW) {
+			ts[0].tv_nsec = UTIME_NOW;
+		} else if (to_set & FUSE_SET_ATTR_ATIME) {
+			ts[0] = attr->st_atim;
+		}
+		if (to_set & FUSE_SET_ATTR_MTIME_NOW) {
+			ts[1].tv_nsec = UTIME_NOW;
+		} else if (to_set & FUSE_SET_ATTR_MTIME) {
+			ts[1] = attr->st_mtim;
+		}
+		if (utimensat(AT_FDCWD, vpath, ts, AT_SYMLINK_NOFOLLOW) == -1) {
+			goto err_unlock;
+		}
+	}
+	vault_path_unlock(fs);
+	rvaultfs_getattr(req, ino, fi);
+	return;
+err_unlock:
+	vault_path_unlock(fs);
+err:
+	fuse_reply_err(req, errno);
+}
+
+static void
+rvaultfs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+    mode_t mode)
+{
+	rvfs_t *fs = get_fs(req);
+	rvfs_node_t *dnode = get_node(fs, parent);
+	char path[PATH_MAX], vpath[PATH_MAX], *vname;
+	OP_STATS(MKDIR);
+
+	OP_TRACE(parent, name, 0, 0, 0);
+	if (read_only_p(req, fs)) {
+		return;
+	}
+	if ((vname = get_vname(fs, name)) == NULL) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+	vault_path_lock(fs);
+	if (get_path(fs, dnode, name, path, sizeof(path)) == -1 ||
+	    get_vault_path(fs, dnode, name, vname,
+	    vpath, sizeof(vpath)) == -1 ||
+	    mkdir(vpath, mode) == -1) {
+		vault_path_unlock(fs);
+		free(vname);
+		fuse_reply_err(req, errno);
+		return;
+	}
+	vault_path_unlock(fs);
+	rvault_index_add(fs->vault, path, true);
+
+	if (reply_entry(req, dnode, name, vname, vpath, NULL, NULL) == NULL) {
+		fuse_reply_err(req, errno);
+	}
+}
+
+static void
+rvaultfs_remove(fuse_req_t req, fuse_ino_t parent, const char *name,
+    bool dir)
+{
+	rvfs_t *fs = get_fs(req);
+	rvfs_node_t *dnode = get_node(fs, parent), *node;
+	char path[PATH_MAX], vpath[PATH_MAX], *vname;
+	int ret;
+
+	if (read_only_p(req, fs)) {
+		return;
+	}
+	vault_path_lock(fs);
+	if ((node = node_find(fs, dnode, name)) != NULL) {
+		vname = NULL;
+		ret = get_vault_path(fs, node, NULL, NULL,
+		    vpath, sizeof(vpath));
+	} else if ((vname = get_vname(fs, name)) != NULL) {
+		ret = get_vault_path(fs, dnode, name, vname,
+		    vpath, sizeof(vpath));
+	} else {
+		ret = -1;
+	}
+	free(vname);
+
+	if (ret == -1 || get_path(fs, dnode, name, path, sizeof(path)) == -1 ||
+	    (dir ? rmdir(vpath) : unlink(vpath)) == -1) {
+		vault_path_unlock(fs);
+		fuse_reply_err(req, errno);
+		return;
+	}
+	vault_path_unlock(fs);
+	rvault_index_remove(fs->vault, path);
+
+	/* The node stays until forgotten, but it cannot be looked up. */
+	if (node) {
+		node_unhash(node);
+	}
+	fuse_reply_err(req, 0);
+}
+
+static void
+rvaultfs_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	OP_STATS(UNLINK);
+
+	OP_TRACE(parent, name, 0, 0, 0);
+	rvaultfs_remove(req, parent, name, false);
+}
+
+static void
+rvaultfs_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	OP_STATS(RMDIR);
+
+	OP_TRACE(parent, name, 0, 0, 0);
+	rvaultfs_remove(req, parent, name, true);
+}
+
+static void
+rvaultfs_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+    fuse_ino_t newparent, const char *newname, unsigned int flags)
+{
+	rvfs_t *fs = get_fs(req);
+	rvfs_node_t *dnode = get_node(fs, parent);
+	rvfs_node_t *ndnode = get_node(fs, newparent);
+	rvfs_node_t *node, *tnode;
+	char path_from[PATH_MAX], vpath_from[PATH_MAX];
+	char path_to[PATH_MAX], vpath_to[PATH_MAX];
+	char *vname = NULL, *nvname = NULL, *nname = NULL;
+	OP_STATS(RENAME);
+
+	OP_TRACE(parent, name, 0, 0, 0);
+	OP_TRACE2(newparent, newname);
+	app_log(LOG_DEBUG, "%s: from `%s' to `%s'", __func__, name, newname);
+
+	if (read_only_p(req, fs)) {
+		return;
+	}
+	if (flags) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+	if ((vname = get_vname(fs, name)) == NULL ||
+	    (nvname = get_vname(fs, newname)) == NULL ||
+	    (nname = strdup(newname)) == NULL) {
+		goto err;
+	}
+	vault_path_lock(fs);
+	if (get_path(fs, dnode, name, path_from, sizeof(path_from)) == -1 ||
+	    get_path(fs, ndnode, newname, path_to, sizeof(path_to)) == -1 ||
+	    get_vault_path(fs, dnode, name, vname,
+	    vpath_from, sizeof(vpath_from)) == -1 ||
+	    get_vault_path(fs, ndnode, newname, nvname,
+	    vpath_to, sizeof(vpath_to)) == -1 ||
+	    rename(vpath_from, vpath_to) == -1) {
+		vault_path_unlock(fs);
+		goto err;
+	}
+	vault_path_unlock(fs);
+	rvault_index_rename(fs->vault, path_from, path_to);
+
+	/*
+	 * Update the nodes: the target, if any, is replaced; the source
+	 * node moves to the new directory under the new name.
+	 */
+	node = node_find(fs, dnode, name);
+	tnode = node_find(fs, ndnode, newname);
+	if (tnode && tnode != node) {
+		node_unhash(tnode);
+	}
+	if (node && node != tnode) {
+		node_unhash(node);
+		free(node->name);
+		free(node->vname);
+		node->name = nname;
+		node->vname = nvname;
+		nname = nvname = NULL;
+
+		if (dnode != ndnode) {
+			/* Move the reference; the old parent may go away. */
+			ndnode->nchildren++;
+			node->parent = ndnode;
+			ASSERT(dnode->nchildren > 0);
+			dnode->nchildren--;
+			node_put(fs, dnode, 0);
+		}
+		node_insert(fs, node);
+	}
+	free(vname);
+	free(nvname);
+	free(nname);
+	fuse_reply_err(req, 0);
+	return;
+err:
+	fuse_reply_err(req, errno);
+	free(vname);
+	free(nvname);
+	free(nname);
+}
+
+/*
+ * cache_valid_p: determine whether the pages of the file, cached by
+ * the kernel, are still valid, i.e. the file object has not changed
+ * since it was last released (or it is still open through the mount).
+ */
+static bool
+cache_valid_p(rvfs_t *fs, const rvfs_node_t *node, const char *vpath)
+{
+	struct stat st;
+
+	if (node->nopen) {
+		return true;
+	}
+	if (!node->cached || fileobj_vstat(fs->vault, vpath, &st) == -1) {
+		return false;
+	}
+	return st.st_mtim.tv_sec == node->cmtime.tv_sec &&
+	    st.st_mtim.tv_nsec == node->cmtime.tv_nsec &&
+	    st.st_size == node->csize;
+}
+
+static void
+rvaultfs_open_raw(fuse_req_t req, rvfs_node_t *dnode, const char *name,
+    mode_t mode, struct fuse_file_info *fi)
+{
+	rvfs_t *fs = get_fs(req);
+	char path[PATH_MAX], vpath[PATH_MAX], *vname = NULL;
+	rvfs_node_t *node = dnode;
+	fileobj_t *fobj;
+
+	/*
+	 * On a read-only mount, the file object (and its decrypted data)
+	 * is shared by all the handles of the file.
+	 */
+	if (fs->vault->read_only && !name && node->fobj) {
+		fobj = node->fobj;
+		fi->keep_cache = (fs->flags & RVAULTFS_KERNEL_CACHE) != 0;
+		fi->direct_io = !fi->keep_cache;
+		goto out;
+	}
+
+	/* Note: the node is the file itself, if there is no name. */
+	if (name && (vname = get_vname(fs, name)) == NULL) {
+		goto err;
+	}
+	if (get_path(fs, dnode, name, path, sizeof(path)) == -1 ||
+	    get_vault_path(fs, dnode, name, vname,
+	    vpath, sizeof(vpath)) == -1) {
+		goto err;
+	}
+	/* Note: while re-keying, fileobj_vopen() resolves under the lock. */
+	fobj = name ? NULL : rvault_preload_open(fs->vault, path, fi->flags);
+	if (fobj == NULL && (fobj = fileobj_vopen(fs->vault, path,
+	    fs->vault->prev_key_count ? NULL : vpath,
+	    fi->flags, mode)) == NULL) {
+		goto err;
+	}
+
+	/*
+	 * Use direct I/O i.e. bypass the page cache for extra security,
+	 * unless the kernel cache is enabled; in such case, keep the cached
+	 * pages if they are still valid.
+	 */
+	if (fs->flags & RVAULTFS_KERNEL_CACHE) {
+		fi->keep_cache = !name && cache_valid_p(fs, node, vpath);
+	} else {
+		fi->direct_io = true;
+	}
+
+	app_log(LOG_DEBUG, "%s: `%s' -> %p", __func__, path, fobj);
+out:
+	/* Associate the file object with the FUSE file handle. */
+	static_assert(sizeof(fi->fh) >= sizeof(uintptr_t),
+	    "fuse_file_info::fh is too small to fit a pointer value");
+	fi->fh = (uintptr_t)fobj;
+
+	if (name == NULL) {
+		fuse_reply_open(req, fi);
+	} else if ((node = reply_entry(req, dnode, name,
+	    vname, vpath, NULL, fi)) == NULL) {
+		const int error = errno;
+
+		fileobj_close(fobj);
+		errno = error;
+		vname = NULL;
+		goto err;
+	}
+	node->fobj = fobj;
+	node->nopen++;
+	return;
+err:
+	fuse_reply_err(req, errno);
+	free(vname);
+}
+
+static void
+rvaultfs_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+    mode_t mode, struct fuse_file_info *fi)
+{
+	rvfs_t *fs = get_fs(req);
+	OP_STATS(CREATE);
+
+	OP_TRACE(parent, name, fi->flags, 0, 0);
+	rvaultfs_open_raw(req, get_node(fs, parent), name, mode, fi);
+}
+
+static void
+rvaultfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	rvfs_t *fs = get_fs(req);
+	rvfs_node_t *node = get_node(fs, ino);
+	OP_STATS(OPEN);
+
+	OP_TRACE(ino, NULL, fi->flags, 0, 0);
+	if (node->ctl) {
+		ctl_open(req, node, fi);
+		return;
+	}
+	rvaultfs_open_raw(req, node, NULL, FOBJ_OMASK, fi);
+}
+
+/*
+ * rvaultfs_read: reply with the data directly from the file buffer.
+ */
+static void
+rvaultfs_read(fuse_req_t req, fuse_ino_t ino, size_t len,
+    off_t offset, struct fuse_file_info *fi)
+{
+	fileobj_t *fobj = get_fobj(fi);
+	struct fuse_bufvec bufv;
+	const void *data;
+	ssize_t ret;
+	OP_STATS(READ);
+
+	OP_TRACE(ino, NULL, 0, offset, len);
+	if (get_node(get_fs(req), ino)->ctl) {
+		ctl_read(req, len, offset, fi);
+		return;
+	}
+	app_log(LOG_DEBUG, "%s: vnode %p, len %zu, offset %jd",
+	    __func__, fobj, len, (intmax_t)offset);
+
+	if ((ret = fileobj_pread_buf(fobj, &data, len, offset)) <= 0) {
+		if (ret == -1) {
+			fuse_reply_err(req, errno);
+		} else {
+			fuse_reply_buf(req, NULL, 0);
+		}
+		return;
+	}
+	bufv = FUSE_BUFVEC_INIT(ret);
+	bufv.buf[0].mem = (void *)(uintptr_t)data;
+	fuse_reply_data(req, &bufv, 0);
+}
+
+static ssize_t
+rvaultfs_copy_buf(void *arg, void *buf, size_t len)
+{
+	struct fuse_bufvec *src = arg;
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(len);
+	ssize_t ret;
+
+	dst.buf[0].mem = buf;
+	if ((ret = fuse_buf_copy(&dst, src, 0)) < 0) {
+		errno = -ret;
+		return -1;
+	}
+	return ret;
+}
+
+/*
+ * rvaultfs_write_buf: copy the data directly into the file buffer (the
+ * source may be a pipe, if the data is spliced).
+ */
+static void
+rvaultfs_write_buf(fuse_req_t req, fuse_ino_t ino,
+    struct fuse_bufvec *bufv, off_t offset, struct fuse_file_info *fi)
+{
+	fileobj_t *fobj = get_fobj(fi);
+	const size_t len = fuse_buf_size(bufv);
+	ssize_t ret = 0;
+	OP_STATS(WRITE);
+
+	OP_TRACE(ino, NULL, 0, offset, len);
+	app_log(LOG_DEBUG, "%s: vnode %p, len %zu, offset %jd",
+	    __func__, fobj, len, (intmax_t)offset);
+
+	if (len && (ret = fileobj_pwrite_copy(fobj, rvaultfs_copy_buf,
+	    bufv, len, offset)) == -1) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+	fuse_reply_write(req, ret);
+}
+
+static void
+rvaultfs_sync(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	fileobj_t *fobj = get_fobj(fi);
+
+	if (get_node(get_fs(req), ino)->ctl) {
+		fuse_reply_err(req, 0);
+		return;
+	}
+	app_log(LOG_DEBUG, "%s: vnode %p", __func__, fobj);
+	fuse_reply_err(req,
+	    fileobj_sync(fobj, FOBJ_FULLSYNC) == -1 ? errno : 0);
+}
+
+static void
+rvaultfs_fsync(fuse_req_t req, fuse_ino_t ino,
+    int isdatasync __unused, struct fuse_file_info *fi)
+{
+	OP_STATS(FSYNC);
+
+	OP_TRACE(ino, NULL, 0, 0, 0);
+
+	/* Note: the index is written back only on sync and on close. */
+	(void)rvault_index_sync(get_fs(req)->vault);
+	rvaultfs_sync(req, ino, fi);
+}
+
+static void
+rvaultfs_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	OP_STATS(FLUSH);
+
+	OP_TRACE(ino, NULL, 0, 0, 0);
+	rvaultfs_sync(req, ino, fi);
+}
+
+static void
+rvaultfs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	rvfs_t *fs = get_fs(req);
+	rvfs_node_t *node = get_node(fs, ino);
+	fileobj_t *fobj = get_fobj(fi);
+	char vpath[PATH_MAX];
+	struct stat st;
+	OP_STATS(RELEASE);
+
+	OP_TRACE(ino, NULL, 0, 0, 0);
+	if (node->ctl) {
+		free((void *)(uintptr_t)fi->fh);
+		fuse_reply_err(req, 0);
+		return;
+	}
+	app_log(LOG_DEBUG, "%s: vnode %p", __func__, fobj);
+	ASSERT(node->nopen > 0);
+	node->nopen--;
+
+	/* Note: on a read-only mount, the file object is shared. */
+	if (fs->vault->read_only && node->nopen) {
+		ASSERT(node->fobj == fobj);
+		fuse_reply_err(req, 0);
+		return;
+	}
+	fileobj_close(fobj);
+	if (node->fobj == fobj) {
+		node->fobj = NULL;
+	}
+
+	/*
+	 * Record the attributes of the (written back) file object: the
+	 * cached pages are valid as long as they do not change.
+	 */
+	vault_path_lock(fs);
+	node->cached = (fs->flags & RVAULTFS_KERNEL_CACHE) != 0 &&
+	    get_vault_path(fs, node, NULL, NULL, vpath, sizeof(vpath)) == 0 &&
+	    fileobj_vstat(fs->vault, vpath, &st) == 0;
+	vault_path_unlock(fs);
+	if (node->cached) {
+		node->cmtime = st.st_mtim;
+		node->csize = st.st_size;
+	}
+	fuse_reply_err(req, 0);
+}
+
+#if FUSE_VERSION >= 29
+/*
+ * rvaultfs_fallocate: pre-allocate the file buffer (see fileobj_allocate());
+ * only the plain allocation, optionally keeping the size, is supported.
+ */
+static void
+rvaultfs_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
+    off_t off, off_t len, struct fuse_file_info *fi)
+{
+	fileobj_t *fobj = get_fobj(fi);
+	unsigned flags = 0;
+	OP_STATS(FALLOCATE);
+
+	OP_TRACE(ino, NULL, mode, off, len);
+	app_log(LOG_DEBUG, "%s: vnode %p, mode %d, offset %jd, len %jd",
+	    __func__, fobj, mode, (intmax_t)off, (intmax_t)len);
+
+#if defined(FALLOC_FL_KEEP_SIZE)
+	if ((mode & FALLOC_FL_KEEP_SIZE) != 0) {
+		flags |= FOBJ_ALLOC_KEEP_SIZE;
+		mode &= ~FALLOC_FL_KEEP_SIZE;
+	}
+#endif
+	if (mode != 0) {
+		fuse_reply_err(req, EOPNOTSUPP);
+		return;
+	}
+	if (len <= 0) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+	fuse_reply_err(req,
+	    fileobj_allocate(fobj, off, len, flags) == -1 ? errno : 0);
+}
+#endif
+
+#if FUSE_VERSION >= 34
+/*
+ * rvaultfs_copy_file_range: copy the whole file by cloning the encrypted
+ * object (see fileobj_clone()), without decrypting it.
+ *
+ * => A partial range cannot be cloned: let the kernel fall back to the
+ *    read and write.
+ */
+static void
+rvaultfs_copy_file_range(fuse_req_t req, fuse_ino_t ino_in, off_t off_in,
+    struct fuse_file_info *fi_in, fuse_ino_t ino_out, off_t off_out,
+    struct fuse_file_info *fi_out, size_t len, int flags)
+{
+	rvfs_t *fs = get_fs(req);
+	rvfs_node_t *node_in = get_node(fs, ino_in);
+	rvfs_node_t *node_out = get_node(fs, ino_out);
+	char path_in[PATH_MAX], vpath_in[PATH_MAX];
+	char path_out[PATH_MAX], vpath_out[PATH_MAX];
+	struct stat st_in, st_out;
+	OP_STATS(COPY_FILE_RANGE);
+
+	OP_TRACE(ino_in, NULL, off_out, off_in, len);
+	OP_TRACE2(ino_out, NULL);
+	if (node_in->ctl || node_out->ctl) {
+		fuse_reply_err(req, EOPNOTSUPP);
+		return;
+	}
+	app_log(LOG_DEBUG, "%s: %p -> %p, len %zu",
+	    __func__, node_in, node_out, len);
+
+	/* Note: the lengths are in the object headers. */
+	if (fileobj_sync(get_fobj(fi_in), FOBJ_WRITEBACK) == -1 ||
+	    fileobj_sync(get_fobj(fi_out), FOBJ_WRITEBACK) == -1 ||
+	    get_path(fs, node_in, NULL, path_in, sizeof(path_in)) == -1 ||
+	    get_path(fs, node_out, NULL, path_out, sizeof(path_out)) == -1) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+	vault_path_lock(fs);
+	if (get_vault_path(fs, node_in, NULL, NULL,
+	    vpath_in, sizeof(vpath_in)) == -1 ||
+	    get_vault_path(fs, node_out, NULL, NULL,
+	    vpath_out, sizeof(vpath_out)) == -1 ||
+	    fileobj_vstat(fs->vault, vpath_in, &st_in) == -1 ||
+	    fileobj_vstat(fs->vault, vpath_out, &st_out) == -1) {
+		vault_path_unlock(fs);
+		fuse_reply_err(req, errno);
+		return;
+	}
+	vault_path_unlock(fs);
+	if (flags || off_in || off_out || len < (size_t)st_in.st_size ||
+	    st_out.st_size > st_in.st_size) {
+		fuse_reply_err(req, EOPNOTSUPP);
+		return;
+	}
+	if (fileobj_clone(fs->vault, path_in, path_out) == -1) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+	fuse_reply_write(req, st_in.st_size);
+}
+#endif
+
+#if FUSE_VERSION >= 38 && defined(SEEK_DATA)
+/*
+ * rvaultfs_lseek: SEEK_DATA and SEEK_HOLE support for the sparse files.
+ */
+static void
+rvaultfs_lseek(fuse_req_t req, fuse_ino_t ino, off_t off,
+    int whence, struct fuse_file_info *fi)
+{
+	fileobj_t *fobj = get_fobj(fi);
+	off_t ret;
+	OP_STATS(LSEEK);
+
+	OP_TRACE(ino, NULL, whence, off, 0);
+	if (get_node(get_fs(req), ino)->ctl) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+	app_log(LOG_DEBUG, "%s: vnode %p, offset %jd, whence %d",
+	    __func__, fobj, (intmax_t)off, whence);
+
+	if (whence != SEEK_DATA && whence != SEEK_HOLE) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+	if ((ret = fileobj_seek_data(fobj, off, whence == SEEK_HOLE)) == -1) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+	fuse_reply_lseek(req, ret);
+}
+#endif
+
+/*
+ * Directory operations: a snapshot of the entries is taken on opendir
+ * and their names are decrypted as the entries are returned, i.e. in the
+ * batches of the readdir buffer size, keeping the position as an offset.
+ * The attributes are obtained, relative to the directory descriptor,
+ * only for readdirplus.
+ */
+
+static void
+rvaultfs_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	rvfs_t *fs = get_fs(req);
+	char vpath[PATH_MAX];
+	rvault_dir_t *dir;
+	OP_STATS(OPENDIR);
+
+	OP_TRACE(ino, NULL, 0, 0, 0);
+	if (get_node(fs, ino)->ctl) {
+		/* Note: the control directory is not listed. */
+		fuse_reply_err(req, EACCES);
+		return;
+	}
+	vault_path_lock(fs);
+	if (get_vault_path(fs, get_node(fs, ino), NULL, NULL,
+	    vpath, sizeof(vpath)) == -1 ||
+	    (dir = rvault_opendir(fs->vault, vpath)) == NULL) {
+		vault_path_unlock(fs);
+		fuse_reply_err(req, errno);
+		return;
+	}
+	vault_path_unlock(fs);
+	fi->fh = (uintptr_t)dir;
+	fuse_reply_open(req, fi);
+}
+
+static void
+rvaultfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+    off_t off, struct fuse_file_info *fi)
+{
+	rvault_dir_t *dir = (void *)(uintptr_t)fi->fh;
+	rvfs_t *fs = get_fs(req);
+	rvfs_node_t *dnode = get_node(fs, ino);
+	const rvault_dirent_t *ent;
+	size_t len = 0;
+	char *buf;
+	OP_STATS(READDIR);
+
+	OP_TRACE(ino, NULL, 0, off, 0);
+	if ((buf = malloc(size)) == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	for (unsigned i = (unsigned)off;
+	    (ent = rvault_readdir(dir, &i)) != NULL; i++) {
+		struct stat st = { .st_ino = FUSE_UNKNOWN_INO,
+		    .st_mode = ent->type };
+		rvfs_node_t *node;
+		size_t elen;
+
+		/*
+		 * Use the inode number of the node, if the entry has been
+		 * looked up; otherwise, it is not known yet.
+		 */
+		if (strcmp(ent->name, ".") == 0) {
+			st.st_ino = ino;
+		} else if (strcmp(ent->name, "..") == 0) {
+			if (dnode->parent) {
+				st.st_ino = get_ino(fs, dnode->parent);
+			}
+		} else if ((node = node_find(fs, dnode, ent->name)) != NULL) {
+			st.st_ino = get_ino(fs, node);
+		}
+
+		/* Note: the offset is of the next entry. */
+		elen = fuse_add_direntry(req, buf + len, size - len,
+		    ent->name, &st, i + 1);
+		if (elen > size - len) {
+			break;
+		}
+		len += elen;
+	}
+	fuse_reply_buf(req, buf, len);
+	free(buf);
+}
+
+/*
+ * rvaultfs_readdirplus: return the entries together with their attributes,
+ * so that the kernel does not need to look up each of them.
+ *
+ * => Each returned entry (except "." and "..") is a lookup reference.
+ */
+static void
+rvaultfs_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size,
+    off_t off, struct fuse_file_info *fi)
+{
+	rvault_dir_t *dir = (void *)(uintptr_t)fi->fh;
+	rvfs_t *fs = get_fs(req);
+	rvfs_node_t *dnode = get_node(fs, ino);
+	const rvault_dirent_t *ent;
+	size_t len = 0;
+	char *buf;
+	OP_STATS(READDIRPLUS);
+
+	OP_TRACE(ino, NULL, 0, off, 0);
+	if ((buf = malloc(size)) == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	for (unsigned i = (unsigned)off;
+	    (ent = rvault_readdir(dir, &i)) != NULL; i++) {
+		struct fuse_entry_param e;
+		rvfs_node_t *node = NULL;
+		char *vname;
+		size_t elen;
+
+		memset(&e, 0, sizeof(e));
+		if (strcmp(ent->name, ".") == 0 ||
+		    strcmp(ent->name, "..") == 0) {
+			e.attr.st_mode = ent->type;
+			goto add;
+		}
+		if (fileobj_statat(fs->vault, dir->fd,
+		    ent->vname, &e.attr) == -1) {
+			/* Removed in the meantime. */
+			continue;
+		}
+
+		/*
+		 * Note: while re-keying, the name on disk might be using
+		 * a previous key, but the node caches the current one.
+		 */
+		vname = fs->vault->prev_key_count ?
+		    get_vname(fs, ent->name) : strdup(ent->vname);
+		if (vname == NULL ||
+		    (node = node_get(fs, dnode, ent->name, vname)) == NULL) {
+			break;
+		}
+		node_seen(fs, node, &e.attr);
+		e.ino = get_ino(fs, node);
+		e.attr.st_ino = e.ino;
+		e.attr_timeout = fs->timeout;
+		e.entry_timeout = fs->timeout;
+add:
+		/* Note: the offset is of the next entry. */
+		elen = fuse_add_direntry_plus(req, buf + len, size - len,
+		    ent->name, &e, i + 1);
+		if (elen > size - len) {
+			if (node) {
+				node_put(fs, node, 1);
+			}
+			break;
+		}
+		len += elen;
+	}
+	fuse_reply_buf(req, buf, len);
+	free(buf);
+}
+
+static void
+rvaultfs_releasedir(fuse_req_t req, fuse_ino_t ino,
+    struct fuse_file_info *fi)
+{
+	OP_STATS(RELEASEDIR);
+
+	OP_TRACE(ino, NULL, 0, 0, 0);
+	rvault_closedir((void *)(uintptr_t)fi->fh);
+	fuse_reply_err(req, 0);
+}
+
+static void
+rvaultfs_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	rvfs_t *fs = get_fs(req);
+	char vpath[PATH_MAX];
+	struct statvfs stbuf;
+	OP_STATS(STATFS);
+
+	OP_TRACE(ino, NULL, 0, 0, 0);
+	vault_path_lock(fs);
+	if (get_vault_path(fs, get_node(fs, ino), NULL, NULL,
+	    vpath, sizeof(vpath)) == -1 || statvfs(vpath, &stbuf) == -1) {
+		vault_path_unlock(fs);
+		fuse_reply_err(req, errno);
+		return;
+	}
+	vault_path_unlock(fs);
+	fuse_reply_statfs(req, &stbuf);
+}
+
+/*
+ * Extended attributes.
+ */
+
+static void
+reply_xattr(fuse_req_t req, void *buf, size_t size, ssize_t ret)
+{
+	if (ret == -1) {
+		fuse_reply_err(req, errno);
+	} else if (size == 0) {
+		fuse_reply_xattr(req, ret);
+	} else {
+		fuse_reply_buf(req, buf, ret);
+	}
+	free(buf);
+}
+
+static void
+rvaultfs_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+    size_t size)
+{
+	rvfs_t *fs = get_fs(req);
+	char vpath[PATH_MAX];
+	void *buf = NULL;
+	ssize_t ret = -1;
+	OP_STATS(GETXATTR);
+
+	OP_TRACE(ino, NULL, 0, 0, size);
+	if (get_node(fs, ino)->ctl) {
+		fuse_reply_err(req, ENOTSUP);
+		return;
+	}
+	vault_path_lock(fs);
+	if (get_vault_path(fs, get_node(fs, ino), NULL, NULL,
+	    vpath, sizeof(vpath)) == 0 &&
+	    (size == 0 || (buf = malloc(size)) != NULL)) {
+		ret = getxattr(vpath, name, buf, size);
+	}
+	vault_path_unlock(fs);
+	reply_xattr(req, buf, size, ret);
+}
+
+static void
+rvaultfs_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
+{
+	rvfs_t *fs = get_fs(req);
+	char vpath[PATH_MAX];
+	void *buf = NULL;
+	ssize_t ret = -1;
+	OP_STATS(LISTXATTR);
+
+	OP_TRACE(ino, NULL, 0, 0, size);
+	if (get_node(fs, ino)->ctl) {
+		fuse_reply_err(req, ENOTSUP);
+		return;
+	}
+	vault_path_lock(fs);
+	if (get_vault_path(fs, get_node(fs, ino), NULL, NULL,
+	    vpath, sizeof(vpath)) == 0 &&
+	    (size == 0 || (buf = malloc(size)) != NULL)) {
+		ret = listxattr(vpath, buf, size);
+	}
+	vault_path_unlock(fs);
+	reply_xattr(req, buf, size, ret);
+}
+
+static void
+rvaultfs_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+    const char *val, size_t size, int flags)
+{
+	rvfs_t *fs = get_fs(req);
+	char vpath[PATH_MAX];
+	OP_STATS(SETXATTR);
+
+	OP_TRACE(ino, NULL, 0, 0, size);
+	if (get_node(fs, ino)->ctl) {
+		fuse_reply_err(req, ENOTSUP);
+		return;
+	}
+	if (read_only_p(req, fs)) {
+		return;
+	}
+	vault_path_lock(fs);
+	if (get_vault_path(fs, get_node(fs, ino), NULL, NULL,
+	    vpath, sizeof(vpath)) == -1 ||
+	    lsetxattr(vpath, name, val, size, flags) == -1) {
+		vault_path_unlock(fs);
+		fuse_reply_err(req, errno);
+		return;
+	}
+	vault_path_unlock(fs);
+	fuse_reply_err(req, 0);
+}
+
+static void
+rvaultfs_removexattr(fuse_req_t req, fuse_ino_t ino, const char *name)
+{
+	rvfs_t *fs = get_fs(req);
+	char vpath[PATH_MAX];
+	OP_STATS(REMOVEXATTR);
+
+	OP_TRACE(ino, NULL, 0, 0, 0);
+	if (get_node(fs, ino)->ctl) {
+		fuse_reply_err(req, ENOTSUP);
+		return;
+	}
+	if (read_only_p(req, fs)) {
+		return;
+	}
+	vault_path_lock(fs);
+	if (get_vault_path(fs, get_node(fs, ino), NULL, NULL,
+	    vpath, sizeof(vpath)) == -1 || removexattr(vpath, name) == -1) {
+		vault_path_unlock(fs);
+		fuse_reply_err(req, errno);
+		return;
+	}
+	vault_path_unlock(fs);
+	fuse_reply_err(req, 0);
+}
+
+static const struct fuse_lowlevel_ops rvaultfs_ops = {
+	.init		= rvaultfs_init,
+	.lookup		= rvaultfs_lookup,
+	.forget		= rvaultfs_forget,
+	.forget_multi	= rvaultfs_forget_multi,
+	.getattr	= rvaultfs_getattr,
+	.setattr	= rvaultfs_setattr,
+	.mkdir		= rvaultfs_mkdir,
+	.unlink		= rvaultfs_unlink,
+	.rmdir		= rvaultfs_rmdir,
+	.rename		= rvaultfs_rename,
+	.create		= rvaultfs_create,
+	.open		= rvaultfs_open,
+	.read		= rvaultfs_read,
+	.write_buf	= rvaultfs_write_buf,
+	.flush		= rvaultfs_flush,
+	.fsync		= rvaultfs_fsync,
+	.release	= rvaultfs_release,
+	.opendir	= rvaultfs_opendir,
+	.readdir	= rvaultfs_readdir,
+	.readdirplus	= rvaultfs_readdirplus,
+	.releasedir	= rvaultfs_releasedir,
+	.statfs		= rvaultfs_statfs,
+#if FUSE_VERSION >= 29
+	.fallocate	= rvaultfs_fallocate,
+#endif
+#if FUSE_VERSION >= 34
+	.copy_file_range = rvaultfs_copy_file_range,
+#endif
+#if FUSE_VERSION >= 38 && defined(SEEK_DATA)
+	.lseek		= rvaultfs_lseek,
+#endif
+
+	.listxattr	= rvaultfs_listxattr,
+	.getxattr	= rvaultfs_getxattr,
+	.setxattr	= rvaultfs_setxattr,
+	.removexattr	= rvaultfs_removexattr,
+};
+
+static void
+rvaultfs_fini(rvfs_t *fs)
+{
+	/* Destroy the nodes which were not forgotten (if still hashed). */
+	for (unsigned i = 0; i < fs->hsize; i++) {
+		rvfs_node_t *node;
+
+		while ((node = LIST_FIRST(&fs->htable[i])) != NULL) {
+			LIST_REMOVE(node, hentry);
+			free(node->name);
+			free(node->vname);
+			free(node);
+		}
+	}
+	free(fs->htable);
+}
+
+int
+rvaultfs_run(rvault_t *vault, const char *mountpoint, unsigned flags)
+{
+	struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+	struct fuse_session *se;
+	rvfs_t fs;
+	int ret = -1;
+
+	memset(&fs, 0, sizeof(fs));
+	fs.vault = vault;
+	fs.flags = flags;
+	fs.timeout = vault->read_only ? RVFS_RO_TIMEOUT : RVFS_TIMEOUT;
+	fs.hsize = RVFS_HASH_MINSIZE;
+	if ((fs.htable = calloc(fs.hsize, sizeof(rvfs_bucket_t))) == NULL) {
+		return -1;
+	}
+
+	/*
+	 * Note: force 'default_permissions' option.  No need to check the
+	 * permissions in readdir(); access() operation will not be called
+	 * by FUSE either.
+	 */
+	fuse_opt_add_arg(&args, APP_NAME);
+	fuse_opt_add_arg(&args, "-ofsname="APP_NAME);
+	fuse_opt_add_arg(&args, "-odefault_permissions");
+	if (vault->read_only) {
+		fuse_opt_add_arg(&args, "-oro");
+	}
+	if (flags & RVAULTFS_DEBUG) {
+		fuse_opt_add_arg(&args, "-odebug");
+	}
+	se = fuse_session_new(&args, &rvaultfs_ops, sizeof(rvaultfs_ops), &fs);
+	if (se == NULL) {
+		goto out;
+	}
+	if (fuse_set_signal_handlers(se) == -1) {
+		goto err;
+	}
+	if (fuse_session_mount(se, mountpoint) == -1) {
+		fuse_remove_signal_handlers(se);
+		goto err;
+	}
+	(void)fuse_daemonize((flags & RVAULTFS_FOREGROUND) != 0);
+	fs.se = se;
+#if defined(__linux__)
+	ret = (flags & RVAULTFS_WATCH) ?
+	    rvaultfs_loop(&fs, se) : fuse_session_loop(se);
+	watch_stop(&fs);
+#else
+	ret = fuse_session_loop(se);
+#endif
+	app_log(LOG_DEBUG, "%s: exited fuse_session_loop() with %d",
+	    __func__, ret);
+	fuse_session_unmount(se);
+	fuse_remove_signal_handlers(se);
+err:
+	fuse_session_destroy(se);
+out:
+	fuse_opt_free_args(&args);
+	rvaultfs_fini(&fs);
+
+	rvault_stats_stop();
+	rvault_stats_log(vault);
+	app_log_stop();
+	return ret;
+}
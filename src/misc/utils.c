@@ -10,7 +10,7 @@
  *
  * - Hex string encoding/decoding.
  * - PID file setup and mutual exclusion using a lock.
- * - Application logging facility.
+ * - Application logging facility (asynchronous, rate limited).
  * - Misc.
  */
 
@@ -27,6 +27,7 @@
 #include <libgen.h>
 #include <errno.h>
 #include <err.h>
+#include <pthread.h>
 
 #include "sys.h"
 #include "utils.h"
@@ -293,13 +294,92 @@ str_tokenize(char *line, char **tokens, unsigned n)
 	return i;
 }
 
+/*
+ * str_pathcmp: compare the paths such that a directory always sorts
+ * right before its descendants (i.e. '/' is the lowest character).
+ */
+int
+str_pathcmp(const char *p, const char *q)
+{
+	while (*p && *p == *q) {
+		p++, q++;
+	}
+	return (*p == '/' ? 1 : (unsigned char)*p) -
+	    (*q == '/' ? 1 : (unsigned char)*q);
+}
+
+/*
+ * str_to_uint: parse the decimal unsigned integer in the given range.
+ * The whole string must be consumed; returns -1 if it is not valid.
+ */
+int
+str_to_uint(const char *arg, unsigned min, unsigned max, unsigned *val)
+{
+	unsigned long v;
+	char *end;
+
+	errno = 0;
+	v = strtoul(arg, &end, 10);
+	if (errno || !isdigit((unsigned char)*arg) || *end != '\0' ||
+	    v < min || v > max) {
+		return -1;
+	}
+	*val = (unsigned)v;
+	return 0;
+}
+
 /*
  * Logging facility.
+ *
+ * The messages are formatted in the per-thread buffer.  Once started
+ * with app_log_start(), they are queued in a bounded MPSC ring (the
+ * slot sequence numbers are used to claim and publish the slots) and
+ * written out by the background flusher thread, so the callers never
+ * block on the I/O.  If the ring is full, then the message is dropped
+ * and the drops are reported by the flusher.  Otherwise (e.g. for the
+ * CLI commands), the messages are written synchronously.
+ *
+ * The errors are rate limited per call site (see the APP_LOG() macro):
+ * at most APP_LOG_BURST messages per second, with the number of the
+ * suppressed messages noted in the next one.
  */
 
-static int		app_log_level = LOG_WARNING;
+#define	APP_LOG_MSGLEN		(2048)
+#define	APP_LOG_NSLOTS		(256)	// must be a power of 2
+#define	APP_LOG_BURST		(10)
+
+typedef struct {
+	atomic_uint_fast64_t	seq;
+	int			level;
+	time_t			time;
+	char			msg[APP_LOG_MSGLEN];
+} app_log_slot_t;
+
+typedef struct {
+	app_log_slot_t		slots[APP_LOG_NSLOTS];
+	atomic_uint_fast64_t	head;
+	uint64_t		tail;
+	atomic_uint_fast64_t	ndropped;
+
+	atomic_bool		async;
+	atomic_bool		stop;
+	atomic_bool		sleeping;
+	pthread_t		thread;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cv;
+
+	/* The flusher's cached time string. */
+	time_t			last_time;
+	char			time_str[64];
+} app_log_ring_t;
+
+int			app_log_level = LOG_WARNING;
 static FILE *		app_log_errfh = NULL;
-static __thread char	app_log_buf[64 * 1024];
+static __thread char	app_log_buf[APP_LOG_MSGLEN];
+static app_log_ring_t	app_log_ring = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cv = PTHREAD_COND_INITIALIZER,
+};
 
 void
 app_setlog(int level)
@@ -325,55 +405,289 @@ app_set_errorfile(const char *fmt, ...)
 }
 
 static void
-app_log_fwrite(int level, const char *msg)
+app_log_fwrite(int level, time_t now, const char *msg)
 {
+	app_log_ring_t *ring = &app_log_ring;
 	FILE *fp = (level <= LOG_ERR) ? stderr : stdout;
 
 	fprintf(fp, "%s\n", msg);
 	if (level <= LOG_ERR && app_log_errfh) {
-		const time_t now = time(NULL);
+		char time_buf[64], *time_str = time_buf;
 		struct tm tm;
-		char time[64];
 
-		localtime_r(&now, &tm);
-		strftime(time, sizeof(time), "%d/%b/%Y:%H:%M:%S %z", &tm);
-		fprintf(app_log_errfh, "[%s] %s\n", time, msg);
+		/*
+		 * The flusher formats the time only once per second.
+		 */
+		if (atomic_load(&ring->async)) {
+			time_str = ring->time_str;
+		}
+		if (time_str != ring->time_str || ring->last_time != now) {
+			localtime_r(&now, &tm);
+			strftime(time_str, sizeof(time_buf),
+			    "%d/%b/%Y:%H:%M:%S %z", &tm);
+			if (time_str == ring->time_str) {
+				ring->last_time = now;
+			}
+		}
+		fprintf(app_log_errfh, "[%s] %s\n", time_str, msg);
+	}
+}
+
+/*
+ * app_log_enqueue: claim the next slot in the ring, copy the message
+ * and publish it to the flusher.
+ *
+ * => Returns false if the ring is full.
+ */
+static bool
+app_log_enqueue(int level, time_t now, const char *msg)
+{
+	app_log_ring_t *ring = &app_log_ring;
+	uint64_t pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	app_log_slot_t *slot;
+
+	for (;;) {
+		int64_t diff;
+
+		slot = &ring->slots[pos & (APP_LOG_NSLOTS - 1)];
+		diff = (int64_t)atomic_load_explicit(&slot->seq,
+		    memory_order_acquire) - (int64_t)pos;
+		if (diff == 0) {
+			/* Free slot: claim it (updates the pos on failure). */
+			if (atomic_compare_exchange_weak_explicit(&ring->head,
+			    &pos, pos + 1, memory_order_relaxed,
+			    memory_order_relaxed)) {
+				break;
+			}
+		} else if (diff < 0) {
+			/* Not yet consumed: full. */
+			return false;
+		} else {
+			pos = atomic_load_explicit(&ring->head,
+			    memory_order_relaxed);
+		}
+	}
+	slot->level = level;
+	slot->time = now;
+	memcpy(slot->msg, msg, MIN(strlen(msg) + 1, sizeof(slot->msg)));
+	slot->msg[sizeof(slot->msg) - 1] = '\0';
+	atomic_store(&slot->seq, pos + 1);
+
+	/*
+	 * Wake up the flusher, if it is sleeping.  Note: both the slot
+	 * publishing and the flag are sequentially consistent, so either
+	 * we see the flusher sleeping or it sees the message.
+	 */
+	if (atomic_load(&ring->sleeping)) {
+		pthread_mutex_lock(&ring->lock);
+		pthread_cond_signal(&ring->cv);
+		pthread_mutex_unlock(&ring->lock);
+	}
+	return true;
+}
+
+/*
+ * app_log_drain: write out the queued messages (single consumer).
+ *
+ * => Returns the number of the messages written.
+ */
+static unsigned
+app_log_drain(void)
+{
+	app_log_ring_t *ring = &app_log_ring;
+	uint64_t ndropped;
+	unsigned n = 0;
+
+	for (;;) {
+		app_log_slot_t *slot;
+
+		slot = &ring->slots[ring->tail & (APP_LOG_NSLOTS - 1)];
+		if (atomic_load(&slot->seq) != ring->tail + 1) {
+			break;
+		}
+		app_log_fwrite(slot->level, slot->time, slot->msg);
+		atomic_store_explicit(&slot->seq,
+		    ring->tail + APP_LOG_NSLOTS, memory_order_release);
+		ring->tail++;
+		n++;
+	}
+	if ((ndropped = atomic_exchange(&ring->ndropped, 0)) != 0) {
+		char msg[64];
+
+		snprintf(msg, sizeof(msg), "log: %" PRIu64
+		    " messages dropped", ndropped);
+		app_log_fwrite(LOG_WARNING, time(NULL), msg);
+		n++;
+	}
+	if (n) {
+		fflush(stdout);
+		if (app_log_errfh) {
+			fflush(app_log_errfh);
+		}
+	}
+	return n;
+}
+
+static void *
+app_log_flusher(void *arg __unused)
+{
+	app_log_ring_t *ring = &app_log_ring;
+
+	for (;;) {
+		struct timespec ts;
+
+		if (app_log_drain()) {
+			continue;
+		}
+		if (atomic_load(&ring->stop)) {
+			break;
+		}
+
+		/*
+		 * Nothing to write: sleep, re-checking after announcing
+		 * it (see app_log_enqueue()).  The timeout is a backstop.
+		 */
+		pthread_mutex_lock(&ring->lock);
+		atomic_store(&ring->sleeping, true);
+		if (atomic_load(&ring->slots[ring->tail &
+		    (APP_LOG_NSLOTS - 1)].seq) != ring->tail + 1 &&
+		    !atomic_load(&ring->stop)) {
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec++;
+			(void)pthread_cond_timedwait(&ring->cv,
+			    &ring->lock, &ts);
+		}
+		atomic_store(&ring->sleeping, false);
+		pthread_mutex_unlock(&ring->lock);
+	}
+	return NULL;
+}
+
+/*
+ * app_log_start: start the background flusher and the asynchronous
+ * logging.
+ *
+ * => Must be called after daemonizing, since the thread would not
+ *    survive the fork.
+ */
+int
+app_log_start(void)
+{
+	app_log_ring_t *ring = &app_log_ring;
+
+	if (atomic_load(&ring->async)) {
+		return 0;
+	}
+	for (unsigned i = 0; i < APP_LOG_NSLOTS; i++) {
+		const uint64_t seq = ring->tail + i;
+		atomic_store(&ring->slots[seq & (APP_LOG_NSLOTS - 1)].seq, seq);
+	}
+	atomic_store(&ring->head, ring->tail);
+	atomic_store(&ring->stop, false);
+
+	if ((errno = pthread_create(&ring->thread, NULL,
+	    app_log_flusher, NULL)) != 0) {
+		return -1;
 	}
+	atomic_store(&ring->async, true);
+	return 0;
 }
 
+/*
+ * app_log_stop: write out the queued messages, stop the flusher and
+ * switch back to the synchronous logging.
+ */
 void
-app_log(int level, const char *fmt, ...)
+app_log_stop(void)
 {
-	va_list ap;
+	app_log_ring_t *ring = &app_log_ring;
 
-	if (level > app_log_level) {
+	if (!atomic_load(&ring->async)) {
 		return;
 	}
+	pthread_mutex_lock(&ring->lock);
+	atomic_store(&ring->stop, true);
+	pthread_cond_signal(&ring->cv);
+	pthread_mutex_unlock(&ring->lock);
+	pthread_join(ring->thread, NULL);
+
+	/* Switch back and pick up the messages which raced the stop. */
+	atomic_store(&ring->async, false);
+	app_log_drain();
+}
+
+/*
+ * app_log_ratelimit: check the call site's error rate limit.
+ *
+ * => Returns the number of the suppressed messages since the last
+ *    allowed one or -1 if this message must be suppressed.
+ */
+static int
+app_log_ratelimit(app_log_rl_t *rl, time_t now)
+{
+	uint64_t window = atomic_load(&rl->window);
+
+	if (window != (uint64_t)now &&
+	    atomic_compare_exchange_strong(&rl->window, &window, now)) {
+		atomic_store(&rl->count, 0);
+	}
+	if (atomic_fetch_add(&rl->count, 1) >= APP_LOG_BURST) {
+		atomic_fetch_add(&rl->suppressed, 1);
+		return -1;
+	}
+	return atomic_exchange(&rl->suppressed, 0);
+}
+
+static void
+app_log_vwrite(app_log_rl_t *rl, int level, int errnum,
+    const char *fmt, va_list ap)
+{
+	const time_t now = time(NULL);
+	size_t len = sizeof(app_log_buf);
+	char *buf = app_log_buf;
+	int ret, nsuppressed = 0;
+
+	if (level <= LOG_ERR && (nsuppressed =
+	    app_log_ratelimit(rl, now)) == -1) {
+		return;
+	}
+	if ((ret = vsnprintf(buf, len, fmt, ap)) < 0) {
+		return;
+	}
+	if ((size_t)ret < len && errnum) {
+		ret += snprintf(buf + ret, len - ret, ": %s",
+		    strerror(errnum));
+	}
+	if ((size_t)ret < len && nsuppressed) {
+		snprintf(buf + ret, len - ret, " (%d similar messages "
+		    "suppressed)", nsuppressed);
+	}
+
+	if (!atomic_load(&app_log_ring.async)) {
+		app_log_fwrite(level, now, buf);
+	} else if (!app_log_enqueue(level, now, buf)) {
+		atomic_fetch_add(&app_log_ring.ndropped, 1);
+	}
+}
+
+void
+_app_log(app_log_rl_t *rl, int level, const char *fmt, ...)
+{
+	va_list ap;
+
 	va_start(ap, fmt);
-	vsnprintf(app_log_buf, sizeof(app_log_buf), fmt, ap);
+	app_log_vwrite(rl, level, 0, fmt, ap);
 	va_end(ap);
-
-	app_log_fwrite(level, app_log_buf);
 }
 
 void
-app_elog(int level, const char *fmt, ...)
+_app_elog(app_log_rl_t *rl, int level, const char *fmt, ...)
 {
 	const int errno_saved = errno;
-	ssize_t ret;
 	va_list ap;
 
-	if (level > app_log_level) {
-		return;
-	}
 	va_start(ap, fmt);
-	ret = vsnprintf(app_log_buf, sizeof(app_log_buf), fmt, ap);
+	app_log_vwrite(rl, level, errno_saved, fmt, ap);
 	va_end(ap);
-
-	if (ret < 0 || (size_t)ret >= sizeof(app_log_buf) ||
-	    snprintf(app_log_buf + ret, sizeof(app_log_buf) - ret,
-	    ": %s\n", strerror(errno_saved)) == -1) {
-		return; // error;
-	}
-	app_log_fwrite(level, app_log_buf);
+	errno = errno_saved;
 }
@@ -11,6 +11,7 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <inttypes.h>
+#include <stdatomic.h>
 #include <limits.h>
 #include <syslog.h>
 #include <assert.h>
@@ -182,10 +183,40 @@ void *		hex_read_arbitrary_buf(const void *, size_t, size_t *);
 void		setup_pid(const char *, ...);
 char *		tmpfile_get_name(const char *);
 unsigned	str_tokenize(char *, char **, unsigned);
+int		str_pathcmp(const char *, const char *);
+int		str_to_uint(const char *, unsigned, unsigned, unsigned *);
+
+/*
+ * Logging facility.
+ *
+ * - The arguments are not evaluated if the level is disabled.
+ * - The errors (LOG_ERR and more severe) are rate limited per call site.
+ */
+
+typedef struct {
+	atomic_uint_fast64_t	window;
+	atomic_uint		count;
+	atomic_uint		suppressed;
+} app_log_rl_t;
+
+extern int	app_log_level;
+
+#define	APP_LOG(f, level, ...)						\
+    do {								\
+	static app_log_rl_t __app_log_rl;				\
+	if (__predict_false((level) <= app_log_level)) {		\
+		f(&__app_log_rl, (level), __VA_ARGS__);			\
+	}								\
+    } while (0)
+
+#define	app_log(level, ...)	APP_LOG(_app_log, (level), __VA_ARGS__)
+#define	app_elog(level, ...)	APP_LOG(_app_elog, (level), __VA_ARGS__)
 
 void		app_setlog(int);
 int		app_set_errorfile(const char *, ...);
-void		app_log(int, const char *, ...);
-void		app_elog(int, const char *, ...);
+int		app_log_start(void);
+void		app_log_stop(void);
+void		_app_log(app_log_rl_t *, int, const char *, ...);
+void		_app_elog(app_log_rl_t *, int, const char *, ...);
 
 #endif
@@ -12,6 +12,10 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/statvfs.h>
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
 
 #include <stdlib.h>
 #include <inttypes.h>
@@ -149,3 +153,58 @@ fs_sync(int fd, const char *path)
 	}
 	return ret;
 }
+
+/*
+ * fs_copy_file: copy the data of the given length from the source file
+ * descriptor to the destination, starting at the current offsets.
+ *
+ * => Tries the cheapest method first: clone the extents (reflink), if
+ *    supported by the file system, then in-kernel copy and only then
+ *    fall back to read/write.
+ * => The clone and in-kernel copy operate on the whole file, therefore
+ *    the offsets are expected to be at zero.
+ */
+int
+fs_copy_file(int sfd, int dfd, size_t len)
+{
+	unsigned char *buf;
+	ssize_t nbytes;
+
+#if defined(FICLONE)
+	if (ioctl(dfd, FICLONE, sfd) == 0) {
+		return 0;
+	}
+#endif
+#if defined(__linux__)
+	while (len) {
+		nbytes = copy_file_range(sfd, NULL, dfd, NULL, len, 0);
+		if (nbytes <= 0) {
+			if (nbytes == -1 && errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		len -= nbytes;
+	}
+	if (len == 0) {
+		return 0;
+	}
+#endif
+	if ((buf = malloc(FS_COPY_BUFSIZE)) == NULL) {
+		return -1;
+	}
+	while (len) {
+		const size_t target = MIN(len, FS_COPY_BUFSIZE);
+
+		if ((nbytes = fs_read(sfd, buf, target)) == 0) {
+			errno = EIO; // unexpected EOF
+		}
+		if (nbytes <= 0 || fs_write(dfd, buf, nbytes) != nbytes) {
+			free(buf);
+			return -1;
+		}
+		len -= nbytes;
+	}
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,460 @@
+/*
+ * Copyright (c) 2020 Mindaugas Rasiukevicius <rmind at noxt eu>
+ * All rights reserved.
+ *
+ * Use is subject to license terms, as specified in the LICENSE file.
+ */
+
+/*
+ * Batched and linked I/O.
+ *
+ * If built with USE_URING=1 (Linux), the I/O is submitted through the
+ * io_uring: the queued reads are submitted together, with a single
+ * system call, and the dependent operations (write -> fsync -> rename)
+ * are linked, so they are executed by the kernel in order without the
+ * round trips.  Otherwise, or if the io_uring is not available (e.g. an
+ * older kernel or disabled by the system policy), the operations fall
+ * back to the regular system calls.
+ *
+ * => The I/O context (fs_io_t) is not thread-safe; the linked helpers
+ *    use a per-thread context.
+ * => The completion callback gets the result of the operation: the
+ *    number of bytes or a negative errno.  In the fallback mode, it is
+ *    invoked before fs_io_pread() returns.
+ */
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <errno.h>
+
+#if defined(USE_URING)
+#include <liburing.h>
+#endif
+
+#include "sys.h"
+#include "utils.h"
+
+#define	FS_IO_THREAD_DEPTH	4
+
+struct fs_io {
+	fs_io_done_t		done;
+	unsigned		depth;
+	unsigned		inflight;
+#if defined(USE_URING)
+	bool			uring;
+	struct io_uring		ring;
+#endif
+};
+
+/*
+ * fs_io_create: create the I/O context for up to 'depth' operations
+ * in flight, falling back to the regular system calls if the io_uring
+ * cannot be set up.
+ */
+fs_io_t *
+fs_io_create(unsigned depth, fs_io_done_t done)
+{
+	fs_io_t *io;
+#if defined(USE_URING)
+	int ret;
+#endif
+
+	if ((io = calloc(1, sizeof(fs_io_t))) == NULL) {
+		return NULL;
+	}
+	io->done = done;
+	io->depth = MAX(depth, 1);
+#if defined(USE_URING)
+	if ((ret = io_uring_queue_init(io->depth, &io->ring, 0)) == 0) {
+		io->uring = true;
+	} else {
+		app_log(LOG_DEBUG, "%s: io_uring not available: %s",
+		    __func__, strerror(-ret));
+	}
+#endif
+	return io;
+}
+
+void
+fs_io_destroy(fs_io_t *io)
+{
+#if defined(USE_URING)
+	if (io->uring) {
+		(void)fs_io_wait(io, true);
+		io_uring_queue_exit(&io->ring);
+	}
+#endif
+	free(io);
+}
+
+/*
+ * fs_io_async_p: return true if the operations are asynchronous.
+ */
+bool
+fs_io_async_p(const fs_io_t *io)
+{
+#if defined(USE_URING)
+	return io->uring;
+#else
+	(void)io;
+	return false;
+#endif
+}
+
+#if defined(USE_URING)
+
+/*
+ * fs_io_get_sqe: get a submission queue entry, submitting the queued
+ * ones if the queue is full.
+ */
+static struct io_uring_sqe *
+fs_io_get_sqe(fs_io_t *io)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = io_uring_get_sqe(&io->ring)) == NULL) {
+		(void)io_uring_submit(&io->ring);
+		sqe = io_uring_get_sqe(&io->ring);
+	}
+	return sqe;
+}
+
+/*
+ * fs_io_reap: submit the queued operations, wait for at least 'nwait'
+ * completions and process all the available ones.
+ *
+ * => The completions of the internal operations (without the argument)
+ *    are only counted.
+ */
+static int
+fs_io_reap(fs_io_t *io, unsigned nwait)
+{
+	unsigned n = 0;
+	int ret;
+
+	nwait = MIN(nwait, io->inflight);
+	while ((ret = io_uring_submit_and_wait(&io->ring, nwait)) == -EINTR)
+		;
+	if (ret < 0) {
+		errno = -ret;
+		return -1;
+	}
+	while (io->inflight) {
+		struct io_uring_cqe *cqe;
+		void *arg;
+		int res;
+
+		ret = (n < nwait) ? io_uring_wait_cqe(&io->ring, &cqe) :
+		    io_uring_peek_cqe(&io->ring, &cqe);
+		if (ret == -EINTR) {
+			continue;
+		}
+		if (ret == -EAGAIN) {
+			break;
+		}
+		if (ret < 0) {
+			errno = -ret;
+			return -1;
+		}
+		arg = io_uring_cqe_get_data(cqe);
+		res = cqe->res;
+		io_uring_cqe_seen(&io->ring, cqe);
+		io->inflight--;
+		n++;
+
+		if (arg) {
+			io->done(arg, res);
+		}
+	}
+	return 0;
+}
+
+#endif
+
+/*
+ * fs_io_pread: queue a read of the given length at the offset.
+ *
+ * => The operation is submitted on the next fs_io_wait() or once the
+ *    queue depth is reached.
+ */
+int
+fs_io_pread(fs_io_t *io, int fd, void *buf, size_t len, off_t off,
+    void *arg)
+{
+	ssize_t ret;
+
+	ASSERT(arg != NULL);
+#if defined(USE_URING)
+	if (io->uring) {
+		struct io_uring_sqe *sqe;
+
+		if (io->inflight == io->depth && fs_io_reap(io, 1) == -1) {
+			return -1;
+		}
+		if ((sqe = fs_io_get_sqe(io)) == NULL) {
+			errno = EBUSY;
+			return -1;
+		}
+		io_uring_prep_read(sqe, fd, buf, len, off);
+		io_uring_sqe_set_data(sqe, arg);
+		io->inflight++;
+		return 0;
+	}
+#endif
+	while ((ret = pread(fd, buf, len, off)) == -1 && errno == EINTR)
+		;
+	io->done(arg, ret == -1 ? -errno : ret);
+	return 0;
+}
+
+/*
+ * fs_io_wait: submit the queued operations and wait for one (or all)
+ * of them to complete, invoking the callback.
+ */
+int
+fs_io_wait(fs_io_t *io, bool all)
+{
+#if defined(USE_URING)
+	if (io->uring) {
+		while (io->inflight) {
+			if (fs_io_reap(io, all ? io->inflight : 1) == -1) {
+				return -1;
+			}
+			if (!all) {
+				break;
+			}
+		}
+	}
+#else
+	(void)io; (void)all;
+#endif
+	return 0;
+}
+
+#if defined(USE_URING)
+
+static pthread_key_t		fs_io_key;
+static pthread_once_t		fs_io_once = PTHREAD_ONCE_INIT;
+
+static void
+fs_io_thread_dtor(void *arg)
+{
+	fs_io_destroy(arg);
+}
+
+static void
+fs_io_thread_init(void)
+{
+	(void)pthread_key_create(&fs_io_key, fs_io_thread_dtor);
+}
+
+static void
+fs_io_nodone(void *arg __unused, ssize_t res __unused)
+{
+	/* Nothing: the linked operations have no arguments. */
+}
+
+/*
+ * fs_io_thread: get the I/O context of the current thread.
+ */
+static fs_io_t *
+fs_io_thread(void)
+{
+	fs_io_t *io;
+
+	(void)pthread_once(&fs_io_once, fs_io_thread_init);
+	if ((io = pthread_getspecific(fs_io_key)) == NULL &&
+	    (io = fs_io_create(FS_IO_THREAD_DEPTH, fs_io_nodone)) != NULL) {
+		(void)pthread_setspecific(fs_io_key, io);
+	}
+	return io;
+}
+
+/*
+ * fs_io_thread_reset: discard the I/O context of the current thread,
+ * e.g. with the operations which could not be submitted or completed;
+ * the next operation creates a new one.
+ */
+static void
+fs_io_thread_reset(fs_io_t *io)
+{
+	(void)pthread_setspecific(fs_io_key, NULL);
+	io_uring_queue_exit(&io->ring);
+	free(io);
+}
+
+/*
+ * fs_io_link_wait: submit the linked operations and collect their
+ * results, in the order of submission.
+ *
+ * => Returns -1 if none of the operations was submitted: the caller
+ *    may perform them using the regular system calls.
+ * => Otherwise, the operations which were not submitted get -ECANCELED
+ *    and the ones which could not be waited for get -EIO.
+ * => On failure, the context of the thread is discarded, therefore it
+ *    must not be used after the call.
+ */
+static int
+fs_io_link_wait(fs_io_t *io, int *res, unsigned n)
+{
+	unsigned nsub;
+	int ret;
+
+	while ((ret = io_uring_submit_and_wait(&io->ring, n)) == -EINTR)
+		;
+	if (ret <= 0) {
+		fs_io_thread_reset(io);
+		errno = ret ? -ret : EAGAIN;
+		return -1;
+	}
+	nsub = MIN((unsigned)ret, n);
+	for (unsigned i = 0; i < n; i++) {
+		res[i] = (i < nsub) ? -EIO : -ECANCELED;
+	}
+	io->inflight += nsub;
+
+	while (io->inflight) {
+		struct io_uring_cqe *cqe;
+		uintptr_t idx;
+
+		while ((ret = io_uring_wait_cqe(&io->ring, &cqe)) == -EINTR)
+			;
+		if (ret < 0) {
+			break;
+		}
+		idx = (uintptr_t)io_uring_cqe_get_data(cqe);
+		ASSERT(idx > 0 && idx <= nsub);
+		res[idx - 1] = cqe->res;
+		io_uring_cqe_seen(&io->ring, cqe);
+		io->inflight--;
+	}
+	if (io->inflight || nsub < n) {
+		app_log(LOG_WARNING, "%s: io_uring failure, %u of %u linked "
+		    "operations submitted", __func__, nsub, n);
+		fs_io_thread_reset(io);
+	}
+	return 0;
+}
+
+#endif
+
+/*
+ * fs_write_sync: write the buffer at the current offset of the file
+ * and perform fsync(), as fs_write() and fs_sync().
+ *
+ * => Returns the number of bytes written or -1 on failure.  As with
+ *    fs_sync(), the fsync() failure is only logged.
+ */
+ssize_t
+fs_write_sync(int fd, const void *buf, size_t len)
+{
+	size_t done = 0;
+	ssize_t nbytes;
+#if defined(USE_URING)
+	fs_io_t *io = fs_io_thread();
+
+	if (io && io->uring && io->inflight == 0 && len <= UINT_MAX &&
+	    (io->ring.features & IORING_FEAT_RW_CUR_POS) != 0) {
+		struct io_uring_sqe *sqe;
+		int res[2];
+
+		/* Write at the current position (-1), then fsync. */
+		sqe = io_uring_get_sqe(&io->ring);
+		io_uring_prep_write(sqe, fd, buf, len, -1);
+		io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+		io_uring_sqe_set_data(sqe, (void *)(uintptr_t)1);
+
+		sqe = io_uring_get_sqe(&io->ring);
+		io_uring_prep_fsync(sqe, fd, 0);
+		io_uring_sqe_set_data(sqe, (void *)(uintptr_t)2);
+
+		/*
+		 * Note: if nothing was submitted, just fall back to the
+		 * system calls.
+		 */
+		if (fs_io_link_wait(io, res, 2) == 0) {
+			if (res[0] < 0 && res[0] != -EINTR &&
+			    res[0] != -EAGAIN) {
+				errno = -res[0];
+				return -1;
+			}
+			if ((size_t)res[0] == len && res[1] == 0) {
+				return len;
+			}
+			if ((size_t)res[0] == len && res[1] != -ECANCELED) {
+				errno = -res[1];
+				app_elog(LOG_WARNING, "%s() failed", __func__);
+				return len;
+			}
+
+			/* Short write: the fsync was cancelled; finish it. */
+			done = MAX(res[0], 0);
+		}
+	}
+#endif
+	nbytes = fs_write(fd, (const uint8_t *)buf + done, len - done);
+	if (nbytes == -1) {
+		return -1;
+	}
+	fs_sync(fd, NULL);
+	return done + nbytes;
+}
+
+/*
+ * fs_sync_rename: perform fsync() on the file and then rename it,
+ * i.e. make the file contents durable before it replaces the target.
+ *
+ * => Returns 0 on success and -1 on failure (with errno set); the file
+ *    is not renamed if the fsync() fails.
+ */
+int
+fs_sync_rename(int fd, const char *from, const char *to)
+{
+#if defined(USE_URING)
+	fs_io_t *io = fs_io_thread();
+
+	if (io && io->uring && io->inflight == 0) {
+		struct io_uring_sqe *sqe;
+		int res[2];
+
+		sqe = io_uring_get_sqe(&io->ring);
+		io_uring_prep_fsync(sqe, fd, 0);
+		io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+		io_uring_sqe_set_data(sqe, (void *)(uintptr_t)1);
+
+		sqe = io_uring_get_sqe(&io->ring);
+		io_uring_prep_renameat(sqe, AT_FDCWD, from, AT_FDCWD, to, 0);
+		io_uring_sqe_set_data(sqe, (void *)(uintptr_t)2);
+
+		/*
+		 * Note: the kernels without the rename support fail it
+		 * with EINVAL; just fall back to rename(2) then, as well
+		 * as if it was not submitted.
+		 */
+		if (fs_io_link_wait(io, res, 2) == 0) {
+			if (res[0] < 0) {
+				errno = -res[0];
+				return -1;
+			}
+			if (res[1] == 0) {
+				return 0;
+			}
+			if (res[1] != -EINVAL && res[1] != -ECANCELED) {
+				errno = -res[1];
+				return -1;
+			}
+			return rename(from, to);
+		}
+	}
+#endif
+	if (fs_sync(fd, NULL) == -1) {
+		return -1;
+	}
+	return rename(from, to);
+}
@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) 2020 Mindaugas Rasiukevicius <rmind at noxt eu>
+ * All rights reserved.
+ *
+ * Use is subject to license terms, as specified in the LICENSE file.
+ */
+
+/*
+ * Static tracing probes (USDT).
+ *
+ * If built with USE_USDT=1, the probes are placed using the SystemTap
+ * SDT header, i.e. each probe is a single no-op instruction, with the
+ * arguments described in the ELF notes; the tracers (e.g. bpftrace or
+ * perf) attach to them as "usdt:<binary>:rvault:<name>".  Otherwise,
+ * the probes are compiled out; the arguments are not evaluated.
+ */
+
+#ifndef	_PROBES_H_
+#define	_PROBES_H_
+
+#if defined(USE_USDT)
+
+#include <sys/sdt.h>
+
+#define	RVAULT_PROBE1(n, a)		DTRACE_PROBE1(rvault, n, a)
+#define	RVAULT_PROBE2(n, a, b)		DTRACE_PROBE2(rvault, n, a, b)
+#define	RVAULT_PROBE3(n, a, b, c)	DTRACE_PROBE3(rvault, n, a, b, c)
+
+#else
+
+#define	RVAULT_PROBE1(n, a)		((void)sizeof(a))
+#define	RVAULT_PROBE2(n, a, b)		((void)sizeof(a), (void)sizeof(b))
+#define	RVAULT_PROBE3(n, a, b, c)	\
+    ((void)sizeof(a), (void)sizeof(b), (void)sizeof(c))
+
+#endif
+
+#endif
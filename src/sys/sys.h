@@ -8,6 +8,8 @@
 #ifndef	_SYS_H_
 #define	_SYS_H_
 
+#include <stdbool.h>
+
 #ifndef O_SYNC
 #define	O_SYNC		0	// Darwin
 #endif
@@ -22,6 +24,24 @@ ssize_t		fs_read(int, void *, size_t);
 ssize_t		fs_write(int, const void *, size_t);
 int		fs_sync(int, const char *);
 
+#define	FS_COPY_BUFSIZE	(64 * 1024)
+int		fs_copy_file(int, int, size_t);
+
+/*
+ * Batched and linked I/O, using the io_uring if available (see io.c).
+ */
+typedef struct fs_io fs_io_t;
+typedef void (*fs_io_done_t)(void *, ssize_t);
+
+fs_io_t *	fs_io_create(unsigned, fs_io_done_t);
+void		fs_io_destroy(fs_io_t *);
+bool		fs_io_async_p(const fs_io_t *);
+int		fs_io_pread(fs_io_t *, int, void *, size_t, off_t, void *);
+int		fs_io_wait(fs_io_t *, bool);
+
+ssize_t		fs_write_sync(int, const void *, size_t);
+int		fs_sync_rename(int, const char *, const char *);
+
 typedef enum {
 	MMAP_WRITEABLE	= 0x1,
 	MMAP_ERASE	= 0x2,
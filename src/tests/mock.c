@@ -120,7 +120,7 @@ mock_get_vault(const char *cipher, char **path)
 	int ret;
 
 	ret = rvault_init(base_path, NULL, passphrase, TEST_UUID,
-	    cipher, NULL, RVAULT_FLAG_NOAUTH);
+	    cipher, NULL, RVAULT_FLAG_NOAUTH, 0);
 	assert(ret == 0);
 
 	vault = rvault_open(base_path, NULL, passphrase);
@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2020 Mindaugas Rasiukevicius <rmind at noxt eu>
+ * All rights reserved.
+ *
+ * Use is subject to license terms, as specified in the LICENSE file.
+ */
+
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <assert.h>
+
+#include "rvault.h"
+#include "storage.h"
+#include "fileobj.h"
+#include "utils.h"
+#include "mock.h"
+
+#define	TEST_TEXT2	"THE QUICK BROWN FOX JUMPED OVER THE LAZY DOG"
+
+static void
+run_backup(const char *base_path, const char *dest, unsigned flags,
+    unsigned ncopied, unsigned ndeleted)
+{
+	rvault_backup_stats_t stats;
+	char *ckpt;
+	int ret;
+
+	ret = asprintf(&ckpt, "%s/%s", dest, RVAULT_CHECKPOINT_FILE);
+	assert(ret > 0);
+	ret = rvault_backup(base_path, dest, ckpt, 2, flags, &stats);
+	assert(ret == 0);
+	assert(stats.ncopied == ncopied);
+	assert(stats.ndeleted == ndeleted);
+	assert(stats.nerrors == 0);
+	free(ckpt);
+}
+
+static bool
+dest_exists_p(rvault_t *vault, const char *dest, const char *path)
+{
+	const size_t blen = strlen(vault->base_path);
+	char *vpath, *dpath;
+	bool exists;
+	int ret;
+
+	vpath = rvault_resolve_path(vault, path, NULL);
+	assert(vpath && strncmp(vpath, vault->base_path, blen) == 0);
+	ret = asprintf(&dpath, "%s%s", dest, vpath + blen);
+	assert(ret > 0);
+	exists = access(dpath, F_OK) == 0;
+	free(dpath);
+	free(vpath);
+	return exists;
+}
+
+static void
+test_backup(const char *cipher)
+{
+	char *base_path, *dest, *vpath;
+	rvault_t *vault, *bvault;
+	int ret;
+
+	vault = mock_get_vault(cipher, &base_path);
+	dest = mock_get_vault_dir();
+
+	vpath = rvault_resolve_path(vault, "/dir", NULL);
+	ret = mkdir(vpath, 0700);
+	assert(ret == 0);
+	free(vpath);
+
+	mock_vault_fwrite(vault, "/a", TEST_TEXT);
+	mock_vault_fwrite(vault, "/dir/b", TEST_TEXT);
+	mock_vault_fwrite(vault, "/dir/c", TEST_TEXT);
+
+	/*
+	 * Full backup: the metadata and the three objects.
+	 * No changes: nothing to copy.
+	 */
+	run_backup(base_path, dest, 0, 4, 0);
+	run_backup(base_path, dest, 0, 0, 0);
+
+	/*
+	 * Changed content of the same length; only the file metadata
+	 * changed (the header fingerprint is the same).
+	 */
+	mock_vault_fwrite(vault, "/dir/b", TEST_TEXT2);
+	vpath = rvault_resolve_path(vault, "/a", NULL);
+	ret = utimensat(AT_FDCWD, vpath, NULL, 0);
+	assert(ret == 0);
+	free(vpath);
+	run_backup(base_path, dest, 0, 1, 0);
+
+	/*
+	 * Deletion: a tombstone; the object is deleted only if requested.
+	 */
+	vpath = rvault_resolve_path(vault, "/dir/c", NULL);
+	ret = unlink(vpath);
+	assert(ret == 0);
+	free(vpath);
+	run_backup(base_path, dest, 0, 0, 1);
+	assert(dest_exists_p(vault, dest, "/dir/c"));
+
+	mock_vault_fwrite(vault, "/d", TEST_TEXT);
+	vpath = rvault_resolve_path(vault, "/a", NULL);
+	ret = unlink(vpath);
+	assert(ret == 0);
+	free(vpath);
+	run_backup(base_path, dest, RVAULT_BACKUP_DELETE, 1, 1);
+	assert(!dest_exists_p(vault, dest, "/a"));
+
+	/*
+	 * The backup is a valid vault.
+	 */
+	bvault = rvault_open(dest, NULL, "test");
+	assert(bvault != NULL);
+	mock_vault_fcheck(bvault, "/dir/b", TEST_TEXT2);
+	mock_vault_fcheck(bvault, "/d", TEST_TEXT);
+	mock_cleanup_vault(bvault, dest);
+
+	mock_cleanup_vault(vault, base_path);
+}
+
+int
+main(void)
+{
+	const char **ciphers;
+	unsigned nitems = 0;
+
+	app_setlog(0);
+
+	ciphers = crypto_cipher_list(&nitems);
+	for (unsigned i = 0; i < nitems; i++) {
+		test_backup(ciphers[i]);
+	}
+	puts("ok");
+	return 0;
+}
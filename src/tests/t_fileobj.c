@@ -152,6 +152,380 @@ test_file_zero(rvault_t *vault)
 	fileobj_close(fobj);
 }
 
+static void
+test_file_clone(rvault_t *vault)
+{
+	fileobj_t *src, *dst;
+	char buf[64];
+	ssize_t nbytes;
+	int ret;
+
+	/*
+	 * The source is dirty (not yet synced); the target is open and
+	 * has some different data, which must be replaced.
+	 */
+	mock_vault_fwrite(vault, "/clone-dst", "old data");
+	src = fileobj_open(vault, "/clone-src", O_CREAT | O_RDWR, FOBJ_OMASK);
+	assert(src != NULL);
+	nbytes = fileobj_pwrite(src, TEST_TEXT, TEST_TEXT_LEN, 0);
+	assert(nbytes == TEST_TEXT_LEN);
+
+	dst = fileobj_open(vault, "/clone-dst", O_RDWR, FOBJ_OMASK);
+	assert(dst != NULL);
+	nbytes = fileobj_pread(dst, buf, sizeof(buf), 0);
+	assert(nbytes == 8);
+
+	ret = fileobj_clone(vault, "/clone-src", "/clone-dst");
+	assert(ret == 0);
+	nbytes = fileobj_pread(dst, buf, sizeof(buf), 0);
+	assert(nbytes == TEST_TEXT_LEN);
+	assert(memcmp(buf, TEST_TEXT, TEST_TEXT_LEN) == 0);
+	fileobj_close(dst);
+	fileobj_close(src);
+
+	/* New target; a directory cannot be cloned. */
+	ret = fileobj_clone(vault, "/clone-src", "/clone-new");
+	assert(ret == 0);
+	mock_vault_fcheck(vault, "/clone-new", TEST_TEXT);
+	ret = fileobj_clone(vault, "/", "/clone-dir");
+	assert(ret == -1);
+}
+
+static void
+test_file_rewrite(rvault_t *vault)
+{
+	static const char other[] = "THE QUICK BROWN FOX";
+	uint_fast64_t nsyncs, nskipped;
+	char buf[TEST_TEXT_LEN];
+	fileobj_t *fobj;
+	ssize_t nbytes;
+	int ret;
+
+	mock_vault_fwrite(vault, "/rewrite", TEST_TEXT);
+	nsyncs = vault->stats.nsyncs;
+	nskipped = vault->stats.nsyncs_skipped;
+
+	/*
+	 * Rewrite with the identical content: no write-back.
+	 */
+	fobj = fileobj_open(vault, "/rewrite", O_RDWR, FOBJ_OMASK);
+	assert(fobj != NULL);
+	nbytes = fileobj_pwrite(fobj, TEST_TEXT, TEST_TEXT_LEN, 0);
+	assert(nbytes == TEST_TEXT_LEN);
+	ret = fileobj_sync(fobj, FOBJ_FULLSYNC);
+	assert(ret == 0);
+	assert(vault->stats.nsyncs == nsyncs);
+	assert(vault->stats.nsyncs_skipped == nskipped + 1);
+
+	/*
+	 * Different content of the same length must be persisted;
+	 * then the identical one must be detected again.
+	 */
+	nbytes = fileobj_pwrite(fobj, other, sizeof(other) - 1, 0);
+	assert(nbytes == sizeof(other) - 1);
+	ret = fileobj_sync(fobj, FOBJ_FULLSYNC);
+	assert(ret == 0);
+	assert(vault->stats.nsyncs == nsyncs + 1);
+
+	nbytes = fileobj_pwrite(fobj, other, sizeof(other) - 1, 0);
+	assert(nbytes == sizeof(other) - 1);
+	ret = fileobj_sync(fobj, FOBJ_FULLSYNC);
+	assert(ret == 0);
+	assert(vault->stats.nsyncs == nsyncs + 1);
+	assert(vault->stats.nsyncs_skipped == nskipped + 2);
+	fileobj_close(fobj);
+
+	fobj = fileobj_open(vault, "/rewrite", O_RDONLY, FOBJ_OMASK);
+	assert(fobj != NULL);
+	nbytes = fileobj_pread(fobj, buf, sizeof(buf), 0);
+	assert(nbytes == TEST_TEXT_LEN);
+	assert(memcmp(buf, other, sizeof(other) - 1) == 0);
+	assert(memcmp(buf + sizeof(other) - 1, TEST_TEXT + sizeof(other) - 1,
+	    TEST_TEXT_LEN - (sizeof(other) - 1)) == 0);
+	fileobj_close(fobj);
+}
+
+/*
+ * Note: FUSE passes O_TRUNC as the truncation of the open file.
+ */
+static void
+test_file_trunc_rewrite(rvault_t *vault)
+{
+	static const char other[] = "THE QUICK BROWN FOX";
+	uint_fast64_t nsyncs, nskipped;
+	char buf[TEST_TEXT_LEN];
+	fileobj_t *fobj;
+	struct stat st;
+	ssize_t nbytes;
+	int ret;
+
+	mock_vault_fwrite(vault, "/trunc-rewrite", TEST_TEXT);
+	nsyncs = vault->stats.nsyncs;
+	nskipped = vault->stats.nsyncs_skipped;
+
+	/*
+	 * Truncate and rewrite with the identical content: no write-back.
+	 */
+	fobj = fileobj_open(vault, "/trunc-rewrite", O_RDWR, FOBJ_OMASK);
+	assert(fobj != NULL);
+	ret = fileobj_setsize(fobj, 0);
+	assert(ret == 0);
+	ret = fileobj_fstat(fobj, &st);
+	assert(ret == 0 && st.st_size == 0);
+	nbytes = fileobj_pwrite(fobj, TEST_TEXT, TEST_TEXT_LEN, 0);
+	assert(nbytes == TEST_TEXT_LEN);
+	fileobj_close(fobj);
+	assert(vault->stats.nsyncs == nsyncs);
+	assert(vault->stats.nsyncs_skipped == nskipped + 1);
+
+	/*
+	 * Different content must be persisted.
+	 */
+	fobj = fileobj_open(vault, "/trunc-rewrite", O_RDWR, FOBJ_OMASK);
+	assert(fobj != NULL);
+	ret = fileobj_setsize(fobj, 0);
+	assert(ret == 0);
+	nbytes = fileobj_pwrite(fobj, other, sizeof(other) - 1, 0);
+	assert(nbytes == sizeof(other) - 1);
+	fileobj_close(fobj);
+	assert(vault->stats.nsyncs == nsyncs + 1);
+
+	fobj = fileobj_open(vault, "/trunc-rewrite", O_RDONLY, FOBJ_OMASK);
+	assert(fobj != NULL);
+	nbytes = fileobj_pread(fobj, buf, sizeof(buf), 0);
+	assert(nbytes == sizeof(other) - 1);
+	assert(memcmp(buf, other, sizeof(other) - 1) == 0);
+	fileobj_close(fobj);
+
+	/*
+	 * Truncation without a rewrite is persisted on close.
+	 */
+	fobj = fileobj_open(vault, "/trunc-rewrite", O_RDWR, FOBJ_OMASK);
+	assert(fobj != NULL);
+	ret = fileobj_setsize(fobj, 0);
+	assert(ret == 0);
+	fileobj_close(fobj);
+	ret = fileobj_stat(vault, "/trunc-rewrite", &st);
+	assert(ret == 0 && st.st_size == 0);
+}
+
+#define	TEST_SPARSE_SIZE	(256U * 1024 * 1024) // 256 MB
+
+static void
+test_file_sparse(rvault_t *vault)
+{
+	const off_t off = TEST_SPARSE_SIZE / 2 + 1;
+	fileobj_t *fobj;
+	char buf[64];
+	ssize_t nbytes;
+	struct stat st;
+	char *vpath;
+	int ret;
+
+	/*
+	 * Extend the file and write into the middle: the holes must be
+	 * neither stored nor encrypted.
+	 */
+	fobj = fileobj_open(vault, "/sparse", O_CREAT | O_RDWR, FOBJ_OMASK);
+	assert(fobj != NULL);
+	ret = fileobj_setsize(fobj, TEST_SPARSE_SIZE);
+	assert(ret == 0);
+	nbytes = fileobj_pwrite(fobj, TEST_TEXT, TEST_TEXT_LEN, off);
+	assert(nbytes == TEST_TEXT_LEN);
+	fileobj_close(fobj);
+
+	vpath = rvault_resolve_path(vault, "/sparse", NULL);
+	assert(vpath != NULL);
+	ret = stat(vpath, &st);
+	assert(ret == 0 && st.st_size < 256 * 1024);
+	free(vpath);
+
+	ret = fileobj_stat(vault, "/sparse", &st);
+	assert(ret == 0 && st.st_size == TEST_SPARSE_SIZE);
+
+	/*
+	 * Re-open: check the data and the holes.
+	 */
+	fobj = fileobj_open(vault, "/sparse", O_RDWR, FOBJ_OMASK);
+	assert(fobj != NULL);
+	nbytes = fileobj_pread(fobj, buf, TEST_TEXT_LEN, off);
+	assert(nbytes == TEST_TEXT_LEN);
+	assert(memcmp(buf, TEST_TEXT, TEST_TEXT_LEN) == 0);
+	nbytes = fileobj_pread(fobj, buf, sizeof(buf), off - sizeof(buf));
+	assert(nbytes == sizeof(buf) && buf[0] == 0 && buf[63] == 0);
+
+	assert(fileobj_seek_data(fobj, 0, false) == TEST_SPARSE_SIZE / 2);
+	assert(fileobj_seek_data(fobj, 0, true) == 0);
+	assert(fileobj_seek_data(fobj, off, false) == off);
+	assert(fileobj_seek_data(fobj, off, true) > off);
+	assert(fileobj_seek_data(fobj, TEST_SPARSE_SIZE - 1, false) == -1);
+	assert(fileobj_seek_data(fobj, TEST_SPARSE_SIZE, true) == -1);
+
+	/*
+	 * Overwriting with zeros makes the range a hole again.
+	 */
+	memset(buf, 0, sizeof(buf));
+	nbytes = fileobj_pwrite(fobj, buf, TEST_TEXT_LEN, off);
+	assert(nbytes == TEST_TEXT_LEN);
+	ret = fileobj_sync(fobj, FOBJ_FULLSYNC);
+	assert(ret == 0);
+	assert(fileobj_seek_data(fobj, 0, false) == -1);
+	fileobj_close(fobj);
+}
+
+static void
+test_file_allocate(rvault_t *vault)
+{
+	const size_t len = TEST_BLOCK_COUNT * TEST_BLOCK_SIZE;
+	unsigned char buf[TEST_BLOCK_SIZE];
+	fileobj_t *fobj;
+	ssize_t nbytes;
+	struct stat st;
+	int ret;
+
+	fobj = fileobj_open(vault, "/alloc", O_CREAT | O_RDWR, FOBJ_OMASK);
+	assert(fobj != NULL);
+
+	/*
+	 * Pre-allocate keeping the size; then write sequentially.
+	 */
+	ret = fileobj_allocate(fobj, 0, len, FOBJ_ALLOC_KEEP_SIZE);
+	assert(ret == 0);
+	assert(fileobj_getsize(fobj) == 0);
+
+	for (unsigned i = 0; i < TEST_BLOCK_COUNT; i++) {
+		const off_t off = i * sizeof(buf);
+
+		memset(buf, i + 1, sizeof(buf));
+		nbytes = fileobj_pwrite(fobj, buf, sizeof(buf), off);
+		assert(nbytes == sizeof(buf));
+	}
+	assert(fileobj_getsize(fobj) == len);
+
+	/*
+	 * Extend the file: the new range reads as zeros.
+	 */
+	ret = fileobj_allocate(fobj, len, len, 0);
+	assert(ret == 0);
+	assert(fileobj_getsize(fobj) == 2 * len);
+	ret = fileobj_stat(vault, "/alloc", &st);
+	assert(ret == 0 && (size_t)st.st_size == 2 * len);
+
+	nbytes = fileobj_pread(fobj, buf, sizeof(buf), len - sizeof(buf));
+	assert(nbytes == sizeof(buf) && buf[0] == TEST_BLOCK_COUNT);
+	nbytes = fileobj_pread(fobj, buf, sizeof(buf), len);
+	assert(nbytes == sizeof(buf) && buf[0] == 0);
+
+	ret = fileobj_allocate(fobj, -1, len, 0);
+	assert(ret == -1);
+	fileobj_close(fobj);
+}
+
+static void
+test_file_truncate(rvault_t *vault)
+{
+	fileobj_t *fobj;
+	ssize_t nbytes;
+	struct stat st;
+	char buf[64];
+	int ret;
+
+	/*
+	 * Truncating to zero: the open file object is reloaded.
+	 */
+	mock_vault_fwrite(vault, "/trunc", TEST_TEXT);
+	fobj = fileobj_open(vault, "/trunc", O_RDWR, FOBJ_OMASK);
+	assert(fobj != NULL);
+	assert(fileobj_getsize(fobj) == TEST_TEXT_LEN);
+
+	ret = fileobj_truncate(vault, "/trunc", 0);
+	assert(ret == 0);
+	assert(fileobj_getsize(fobj) == 0);
+	ret = fileobj_stat(vault, "/trunc", &st);
+	assert(ret == 0 && st.st_size == 0);
+
+	/*
+	 * Truncating an open file uses its file object.
+	 */
+	nbytes = fileobj_pwrite(fobj, TEST_TEXT, TEST_TEXT_LEN, 0);
+	assert(nbytes == TEST_TEXT_LEN);
+	ret = fileobj_truncate(vault, "/trunc", 9);
+	assert(ret == 0);
+	assert(fileobj_getsize(fobj) == 9);
+	fileobj_close(fobj);
+
+	fobj = fileobj_open(vault, "/trunc", O_RDONLY, FOBJ_OMASK);
+	assert(fobj != NULL);
+	nbytes = fileobj_pread(fobj, buf, sizeof(buf), 0);
+	assert(nbytes == 9 && memcmp(buf, TEST_TEXT, 9) == 0);
+	fileobj_close(fobj);
+
+	ret = fileobj_truncate(vault, "/trunc-none", 0);
+	assert(ret == -1);
+}
+
+static void
+test_file_statat(rvault_t *vault)
+{
+	char *vpath, *vname;
+	struct stat st;
+	int dirfd, ret;
+
+	mock_vault_fwrite(vault, "/statat", TEST_TEXT);
+	vpath = rvault_resolve_path(vault, "/statat", NULL);
+	assert(vpath != NULL);
+	vname = strrchr(vpath, '/') + 1;
+
+	dirfd = open(vault->base_path, O_RDONLY | O_DIRECTORY);
+	assert(dirfd != -1);
+	ret = fileobj_statat(vault, dirfd, vname, &st);
+	assert(ret == 0 && S_ISREG(st.st_mode));
+	assert(st.st_size == TEST_TEXT_LEN);
+
+	ret = fileobj_statat(vault, dirfd, "RV:none", &st);
+	assert(ret == -1);
+	close(dirfd);
+	free(vpath);
+}
+
+static ssize_t
+copy_half(void *arg, void *buf, size_t len)
+{
+	memcpy(buf, arg, len / 2);
+	return len / 2;
+}
+
+static void
+test_file_copy(rvault_t *vault)
+{
+	fileobj_t *fobj;
+	const void *data;
+	ssize_t nbytes;
+
+	fobj = fileobj_open(vault, "/copy", O_CREAT | O_RDWR, FOBJ_OMASK);
+	assert(fobj != NULL);
+
+	/* Short copy: only the copied part is written. */
+	nbytes = fileobj_pwrite_copy(fobj, copy_half,
+	    (void *)(uintptr_t)TEST_TEXT, TEST_TEXT_LEN, 0);
+	assert(nbytes == TEST_TEXT_LEN / 2);
+	assert(fileobj_getsize(fobj) == TEST_TEXT_LEN / 2);
+
+	nbytes = fileobj_pread_buf(fobj, &data, TEST_TEXT_LEN, 0);
+	assert(nbytes == TEST_TEXT_LEN / 2);
+	assert(memcmp(data, TEST_TEXT, nbytes) == 0);
+
+	nbytes = fileobj_pread_buf(fobj, &data, 1, TEST_TEXT_LEN);
+	assert(nbytes == 0);
+
+	/* The trimmed part must read back as zeros once extended. */
+	nbytes = fileobj_pwrite(fobj, "x", 1, TEST_TEXT_LEN);
+	assert(nbytes == 1);
+	nbytes = fileobj_pread_buf(fobj, &data, 1, TEST_TEXT_LEN - 1);
+	assert(nbytes == 1 && *(const char *)data == '\0');
+	fileobj_close(fobj);
+}
+
 static void
 run_tests(const char *cipher)
 {
@@ -160,6 +534,14 @@ run_tests(const char *cipher)
 	test_file_expand(vault);
 	test_file_onebyte(vault);
 	test_file_zero(vault);
+	test_file_clone(vault);
+	test_file_rewrite(vault);
+	test_file_trunc_rewrite(vault);
+	test_file_sparse(vault);
+	test_file_allocate(vault);
+	test_file_truncate(vault);
+	test_file_statat(vault);
+	test_file_copy(vault);
 	mock_cleanup_vault(vault, base_path);
 }
 
@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2020 Mindaugas Rasiukevicius <rmind at noxt eu>
+ * All rights reserved.
+ *
+ * Use is subject to license terms, as specified in the LICENSE file.
+ */
+
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include "rvault.h"
+#include "storage.h"
+#include "fileobj.h"
+#include "utils.h"
+#include "mock.h"
+
+static const char *test_dirs[] = {
+	"/a", "/a/b", "/ab",
+};
+
+static const char *test_files[] = {
+	"/f.txt", "/a/f.txt", "/a/b/g.txt", "/ab/f.c",
+};
+
+static void
+find_iter(void *arg, const char *path, bool isdir)
+{
+	char *buf = arg;
+	strcat(buf, path);
+	strcat(buf, isdir ? "/ " : " ");
+}
+
+static void
+check_find(rvault_t *vault, const char *pattern, const char *expected)
+{
+	char buf[1024];
+	int ret;
+
+	buf[0] = '\0';
+	ret = rvault_index_find(vault, pattern, buf, find_iter);
+	assert(ret == 0);
+	if (strcmp(buf, expected) != 0) {
+		printf("`%s': got `%s', expected `%s'\n",
+		    pattern, buf, expected);
+		abort();
+	}
+}
+
+static void
+test_index(const char *cipher)
+{
+	char *base_path, *ipath;
+	rvault_t *vault;
+	struct stat st;
+	ino_t ino;
+	int ret;
+
+	vault = mock_get_vault(cipher, &base_path);
+	for (unsigned i = 0; i < __arraycount(test_dirs); i++) {
+		char *vpath = rvault_resolve_path(vault, test_dirs[i], NULL);
+		ret = mkdir(vpath, 0700);
+		assert(ret == 0);
+		free(vpath);
+	}
+	for (unsigned i = 0; i < __arraycount(test_files); i++) {
+		mock_vault_fwrite(vault, test_files[i], TEST_TEXT);
+	}
+
+	/*
+	 * No index until it is created.
+	 */
+	ret = rvault_index_open(vault);
+	assert(ret == 0 && vault->index == NULL);
+	ret = rvault_index_find(vault, "*", NULL, find_iter);
+	assert(ret == -1);
+
+	ret = rvault_index_rebuild(vault, 2);
+	assert(ret == 0 && vault->index != NULL);
+	ret = asprintf(&ipath, "%s/%s", base_path, RVAULT_INDEX_FILE);
+	assert(ret > 0);
+	ret = stat(ipath, &st);
+	assert(ret == 0);
+	ino = st.st_ino;
+
+	check_find(vault, "*.txt", "/a/b/g.txt /a/f.txt /f.txt ");
+	check_find(vault, "/a/*", "/a/b/ /a/b/g.txt /a/f.txt ");
+	check_find(vault, "/a*", "/a/ /a/b/ /a/b/g.txt /a/f.txt "
+	    "/ab/ /ab/f.c ");
+	check_find(vault, "/ab/f.?", "/ab/f.c ");
+	check_find(vault, "none", "");
+
+	/*
+	 * Maintenance: add, rename (including the sub-tree) and remove.
+	 */
+	mock_vault_fwrite(vault, "/a/new.txt", TEST_TEXT);
+	check_find(vault, "new.txt", "/a/new.txt ");
+
+	ret = rvault_index_rename(vault, "/a", "/z");
+	assert(ret == 0);
+	check_find(vault, "/a/*", "");
+	check_find(vault, "*.txt", "/f.txt /z/b/g.txt /z/f.txt /z/new.txt ");
+
+	ret = rvault_index_remove(vault, "/z/b");
+	assert(ret == 0);
+	check_find(vault, "/z*", "/z/ /z/f.txt /z/new.txt ");
+
+	/* Into the middle, over an existing entry. */
+	ret = rvault_index_rename(vault, "/z", "/ab");
+	assert(ret == 0);
+	check_find(vault, "*", "/ab/ /ab/f.txt /ab/new.txt /f.txt ");
+	ret = rvault_index_rename(vault, "/ab", "/a");
+	assert(ret == 0);
+	check_find(vault, "*", "/a/ /a/f.txt /a/new.txt /f.txt ");
+	ret = rvault_index_rename(vault, "/f.txt", "/0.txt");
+	assert(ret == 0);
+	check_find(vault, "*", "/0.txt /a/ /a/f.txt /a/new.txt ");
+
+	/*
+	 * The changes are written back only on sync.
+	 */
+	ret = stat(ipath, &st);
+	assert(ret == 0 && st.st_ino == ino);
+	ret = rvault_index_sync(vault);
+	assert(ret == 0);
+	ret = stat(ipath, &st);
+	assert(ret == 0 && st.st_ino != ino);
+
+	/*
+	 * Persistence.
+	 */
+	ret = rvault_index_rename(vault, "/a", "/z");
+	assert(ret == 0);
+	rvault_index_close(vault);
+	assert(vault->index == NULL);
+	ret = rvault_index_open(vault);
+	assert(ret == 0 && vault->index != NULL);
+	check_find(vault, "/z*", "/z/ /z/f.txt /z/new.txt ");
+
+	free(ipath);
+	mock_cleanup_vault(vault, base_path);
+}
+
+int
+main(void)
+{
+	const char **ciphers;
+	unsigned nitems = 0;
+
+	app_setlog(0);
+
+	ciphers = crypto_cipher_list(&nitems);
+	for (unsigned i = 0; i < nitems; i++) {
+		test_index(ciphers[i]);
+	}
+	puts("ok");
+	return 0;
+}
@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2020 Mindaugas Rasiukevicius <rmind at noxt eu>
+ * All rights reserved.
+ *
+ * Use is subject to license terms, as specified in the LICENSE file.
+ */
+
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "rvault.h"
+#include "sys.h"
+#include "utils.h"
+#include "mock.h"
+
+#define	NREADS		64
+#define	IO_DEPTH	8
+
+typedef struct {
+	ssize_t		res;
+	bool		done;
+	uint32_t	val;
+} read_t;
+
+static void
+read_done(void *arg, ssize_t res)
+{
+	read_t *r = arg;
+
+	assert(!r->done);
+	r->res = res;
+	r->done = true;
+}
+
+static void
+test_pread(void)
+{
+	read_t reads[NREADS];
+	fs_io_t *io;
+	int fd;
+
+	fd = mock_get_tmpfile(NULL);
+	for (uint32_t i = 0; i < NREADS; i++) {
+		assert(write(fd, &i, sizeof(i)) == sizeof(i));
+	}
+
+	/* More reads than the depth. */
+	io = fs_io_create(IO_DEPTH, read_done);
+	assert(io != NULL);
+	memset(reads, 0, sizeof(reads));
+	for (unsigned i = 0; i < NREADS; i++) {
+		assert(fs_io_pread(io, fd, &reads[i].val, sizeof(uint32_t),
+		    i * sizeof(uint32_t), &reads[i]) == 0);
+	}
+	assert(fs_io_wait(io, true) == 0);
+	for (unsigned i = 0; i < NREADS; i++) {
+		assert(reads[i].done);
+		assert(reads[i].res == (ssize_t)sizeof(uint32_t));
+		assert(reads[i].val == i);
+	}
+
+	/* Past the end: short read. */
+	memset(reads, 0, sizeof(reads));
+	assert(fs_io_pread(io, fd, &reads[0].val, sizeof(uint32_t),
+	    NREADS * sizeof(uint32_t), &reads[0]) == 0);
+	assert(fs_io_wait(io, true) == 0);
+	assert(reads[0].done && reads[0].res == 0);
+
+	/* Bad descriptor: the error is passed to the callback. */
+	memset(reads, 0, sizeof(reads));
+	assert(fs_io_pread(io, -1, &reads[0].val, sizeof(uint32_t),
+	    0, &reads[0]) == 0);
+	assert(fs_io_wait(io, false) == 0);
+	assert(reads[0].done && reads[0].res == -EBADF);
+
+	fs_io_destroy(io);
+	close(fd);
+}
+
+static void
+test_write_sync_rename(void)
+{
+	char *fpath, tpath[PATH_MAX], buf[64];
+	struct stat st;
+	int fd;
+
+	fd = mock_get_tmpfile(&fpath);
+	assert(fs_write_sync(fd, TEST_TEXT, TEST_TEXT_LEN) ==
+	    (ssize_t)TEST_TEXT_LEN);
+
+	/* At the current offset, as write(2). */
+	assert(lseek(fd, 0, SEEK_CUR) == (off_t)TEST_TEXT_LEN);
+	assert(fs_write_sync(fd, TEST_TEXT, TEST_TEXT_LEN) ==
+	    (ssize_t)TEST_TEXT_LEN);
+	assert(fstat(fd, &st) == 0 && st.st_size == 2 * (off_t)TEST_TEXT_LEN);
+
+	snprintf(tpath, sizeof(tpath), "%s.renamed", fpath);
+	assert(fs_sync_rename(fd, fpath, tpath) == 0);
+	assert(access(fpath, F_OK) == -1);
+	assert(pread(fd, buf, TEST_TEXT_LEN, 0) == (ssize_t)TEST_TEXT_LEN);
+	assert(memcmp(buf, TEST_TEXT, TEST_TEXT_LEN) == 0);
+	close(fd);
+
+	/* The rename failure is reported. */
+	fd = open(tpath, O_RDONLY);
+	assert(fd != -1);
+	assert(fs_sync_rename(fd, fpath, tpath) == -1 && errno == ENOENT);
+	close(fd);
+
+	unlink(tpath);
+	free(fpath);
+}
+
+int
+main(void)
+{
+	app_setlog(0);
+	test_pread();
+	test_write_sync_rename();
+	puts("ok");
+	return 0;
+}
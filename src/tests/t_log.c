@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2020 Mindaugas Rasiukevicius <rmind at noxt eu>
+ * All rights reserved.
+ *
+ * Use is subject to license terms, as specified in the LICENSE file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "rvault.h"
+#include "utils.h"
+#include "mock.h"
+
+#define	NTHREADS	4
+#define	NMSGS		1000
+
+static unsigned		nargs_evaluated = 0;
+
+static unsigned
+eval_arg(void)
+{
+	return ++nargs_evaluated;
+}
+
+static void *
+log_worker(void *arg)
+{
+	const uintptr_t id = (uintptr_t)arg;
+
+	for (unsigned i = 0; i < NMSGS; i++) {
+		app_log(LOG_WARNING, "worker %ju message %u", (uintmax_t)id, i);
+	}
+	return NULL;
+}
+
+/*
+ * redirect_fd: redirect the given descriptor to the temporary file.
+ */
+static int
+redirect_fd(int fd, char **fpath)
+{
+	int tmpfd, saved;
+
+	tmpfd = mock_get_tmpfile(fpath);
+	saved = dup(fd);
+	assert(saved != -1);
+	assert(dup2(tmpfd, fd) != -1);
+	close(tmpfd);
+	return saved;
+}
+
+static void
+restore_fd(int fd, int saved)
+{
+	assert(dup2(saved, fd) != -1);
+	close(saved);
+}
+
+/*
+ * count_lines: count the lines in the file, adding the reported drops.
+ */
+static unsigned
+count_lines(const char *fpath, const char *match)
+{
+	char line[256];
+	unsigned n = 0;
+	FILE *fp;
+
+	fp = fopen(fpath, "r");
+	assert(fp != NULL);
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		uint64_t ndropped;
+
+		if (sscanf(line, "log: %" SCNu64 " messages dropped",
+		    &ndropped) == 1) {
+			n += ndropped;
+			continue;
+		}
+		n += (strstr(line, match) != NULL);
+	}
+	fclose(fp);
+	return n;
+}
+
+static void
+test_lazy(void)
+{
+	app_setlog(LOG_WARNING);
+	app_log(LOG_DEBUG, "%u", eval_arg());
+	assert(nargs_evaluated == 0);
+}
+
+static void
+test_async(void)
+{
+	pthread_t thr[NTHREADS];
+	char *fpath;
+	int saved;
+
+	fflush(stdout);
+	saved = redirect_fd(STDOUT_FILENO, &fpath);
+
+	app_setlog(LOG_WARNING);
+	assert(app_log_start() == 0);
+	for (uintptr_t i = 0; i < NTHREADS; i++) {
+		int ret;
+
+		ret = pthread_create(&thr[i], NULL, log_worker, (void *)i);
+		assert(ret == 0);
+	}
+	for (unsigned i = 0; i < NTHREADS; i++) {
+		pthread_join(thr[i], NULL);
+	}
+	app_log_stop();
+	fflush(stdout);
+	restore_fd(STDOUT_FILENO, saved);
+
+	/* Every message is either written or counted as dropped. */
+	assert(count_lines(fpath, "message") == NTHREADS * NMSGS);
+	unlink(fpath);
+	free(fpath);
+}
+
+static void
+test_ratelimit(void)
+{
+	unsigned n;
+	char *fpath;
+	int saved;
+
+	saved = redirect_fd(STDERR_FILENO, &fpath);
+	app_setlog(LOG_WARNING);
+	for (unsigned i = 0; i < NMSGS; i++) {
+		errno = EIO;
+		app_elog(LOG_ERR, "repeated error");
+		assert(errno == EIO);
+	}
+	restore_fd(STDERR_FILENO, saved);
+
+	/* Up to two one-second windows. */
+	n = count_lines(fpath, "repeated error: ");
+	assert(n >= 1 && n <= 20);
+	unlink(fpath);
+	free(fpath);
+}
+
+int
+main(void)
+{
+	test_lazy();
+	test_async();
+	test_ratelimit();
+	puts("ok");
+	return 0;
+}
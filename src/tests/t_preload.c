@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2020 Mindaugas Rasiukevicius <rmind at noxt eu>
+ * All rights reserved.
+ *
+ * Use is subject to license terms, as specified in the LICENSE file.
+ */
+
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "rvault.h"
+#include "fileobj.h"
+#include "utils.h"
+#include "mock.h"
+
+#define	TEST_WAIT_US	(10 * 1000 * 1000)
+#define	TEST_PAUSE_US	(1000)
+
+/*
+ * wait_preloaded: wait for the path to be preloaded and get it.
+ */
+static char *
+wait_preloaded(rvault_t *vault, const char *path, struct stat *st)
+{
+	char *vname = NULL;
+	unsigned waited = 0;
+
+	while (rvault_preload_lookup(vault, path, &vname, st) == -1) {
+		assert(waited < TEST_WAIT_US);
+		usleep(TEST_PAUSE_US);
+		waited += TEST_PAUSE_US;
+	}
+	return vname;
+}
+
+static void
+test_preload(const char *cipher)
+{
+	char *base_path, *vpath, *vname;
+	rvault_t *vault;
+	fileobj_t *fobj;
+	struct timespec ts[2];
+	char buf[64];
+	struct stat st;
+	ssize_t nbytes;
+	int ret;
+
+	vault = mock_get_vault(cipher, &base_path);
+	vpath = rvault_resolve_path(vault, "/a", NULL);
+	ret = mkdir(vpath, 0700);
+	assert(ret == 0);
+	free(vpath);
+	mock_vault_fwrite(vault, "/a/f1", TEST_TEXT);
+	mock_vault_fwrite(vault, "/f2", TEST_TEXT);
+	mock_vault_fwrite(vault, "/f3", TEST_TEXT);
+
+	ret = rvault_preload_setup(vault, "/", 1024 * 1024);
+	assert(ret == 0);
+	ret = rvault_preload_start(vault);
+	assert(ret == 0);
+
+	/*
+	 * Directory: the encrypted name and the attributes only.
+	 */
+	vname = wait_preloaded(vault, "/a", &st);
+	assert(S_ISDIR(st.st_mode));
+	vpath = rvault_resolve_path(vault, "/a", NULL);
+	assert(strcmp(strrchr(vpath, '/') + 1, vname) == 0);
+	free(vpath);
+	free(vname);
+	ret = rvault_preload_lookup(vault, "/a", NULL, &st);
+	assert(ret == -1);
+
+	/*
+	 * File with the data: the entry is kept until the open.
+	 */
+	vname = wait_preloaded(vault, "/a/f1", &st);
+	assert(S_ISREG(st.st_mode) && st.st_size == TEST_TEXT_LEN);
+	free(vname);
+
+	fobj = rvault_preload_open(vault, "/a/f1", O_RDWR);
+	assert(fobj != NULL);
+	nbytes = fileobj_pread(fobj, buf, sizeof(buf), 0);
+	assert(nbytes == TEST_TEXT_LEN);
+	assert(memcmp(buf, TEST_TEXT, TEST_TEXT_LEN) == 0);
+	fileobj_close(fobj);
+
+	fobj = rvault_preload_open(vault, "/a/f1", O_RDWR);
+	assert(fobj == NULL);
+
+	/*
+	 * Changed file: discarded.
+	 */
+	free(wait_preloaded(vault, "/f2", &st));
+	mock_vault_fwrite(vault, "/f2", TEST_TEXT TEST_TEXT);
+	fobj = rvault_preload_open(vault, "/f2", O_RDWR);
+	assert(fobj == NULL);
+
+	/*
+	 * Modified within the same second: discarded too.
+	 */
+	free(wait_preloaded(vault, "/f3", &st));
+	ts[0] = ts[1] = st.st_mtim;
+	ts[1].tv_nsec = (ts[1].tv_nsec + 1) % 1000000000;
+	vpath = rvault_resolve_path(vault, "/f3", NULL);
+	ret = utimensat(AT_FDCWD, vpath, ts, 0);
+	assert(ret == 0);
+	free(vpath);
+	fobj = rvault_preload_open(vault, "/f3", O_RDWR);
+	assert(fobj == NULL);
+
+	mock_cleanup_vault(vault, base_path);
+}
+
+int
+main(void)
+{
+	const char **ciphers;
+	unsigned nitems = 0;
+
+	app_setlog(0);
+
+	ciphers = crypto_cipher_list(&nitems);
+	for (unsigned i = 0; i < nitems; i++) {
+		test_preload(ciphers[i]);
+	}
+	puts("ok");
+	return 0;
+}
@@ -5,15 +5,18 @@
  * Use is subject to license terms, as specified in the LICENSE file.
  */
 
+#include <sys/stat.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <inttypes.h>
 #include <string.h>
 #include <unistd.h>
 #include <limits.h>
+#include <fcntl.h>
 #include <assert.h>
 
 #include "rvault.h"
+#include "fileobj.h"
 #include "storage.h"
 #include "recovery.h"
 #include "utils.h"
@@ -29,7 +32,7 @@ test_basic(const char *cipher)
 	int ret;
 
 	ret = rvault_init(base_path, NULL, passphrase, TEST_UUID,
-	    cipher, NULL, RVAULT_FLAG_NOAUTH);
+	    cipher, NULL, RVAULT_FLAG_NOAUTH, 0);
 	assert(ret == 0);
 
 	vault = rvault_open(base_path, NULL, passphrase);
@@ -49,7 +52,7 @@ test_invalid_passphrase(const char *cipher)
 	int ret;
 
 	ret = rvault_init(base_path, NULL, "not-test", TEST_UUID,
-	    cipher, NULL, RVAULT_FLAG_NOAUTH);
+	    cipher, NULL, RVAULT_FLAG_NOAUTH, 0);
 	assert(ret == 0);
 
 	vault = rvault_open(base_path, NULL, passphrase);
@@ -94,6 +97,116 @@ test_recovery(const char *cipher)
 	free(recovery);
 }
 
+/*
+ * rekey_meta_write: store the secrets database (just the data).
+ */
+static void
+rekey_meta_write(rvault_t *vault)
+{
+	char *fpath;
+	ssize_t nbytes;
+	int fd;
+
+	assert(asprintf(&fpath, "%s/%s", vault->base_path,
+	    RVAULT_SDB_FILE) > 0);
+	fd = open(fpath, O_CREAT | O_RDWR, 0600);
+	assert(fd != -1);
+	nbytes = storage_write_data(vault, fd, TEST_TEXT, TEST_TEXT_LEN);
+	assert(nbytes > 0);
+	close(fd);
+	free(fpath);
+}
+
+static void
+rekey_meta_check(rvault_t *vault)
+{
+	sbuffer_t sbuf;
+	char *fpath;
+	ssize_t nbytes;
+	int fd;
+
+	assert(asprintf(&fpath, "%s/%s", vault->base_path,
+	    RVAULT_SDB_FILE) > 0);
+	fd = open(fpath, O_RDONLY);
+	assert(fd != -1);
+	memset(&sbuf, 0, sizeof(sbuffer_t));
+	nbytes = storage_read_data(vault, fd, fs_file_size(fd), &sbuf);
+	assert(nbytes == (ssize_t)TEST_TEXT_LEN);
+	assert(memcmp(sbuf.buf, TEST_TEXT, TEST_TEXT_LEN) == 0);
+	sbuffer_free(&sbuf);
+	close(fd);
+	free(fpath);
+}
+
+static void
+test_rekey(const char *cipher)
+{
+	char *base_path = NULL, *buf = NULL, *recovery = NULL, *mpath = NULL;
+	char *vpath;
+	rvault_t *vault;
+	size_t len = 0;
+	FILE *fp;
+	int fd, ret;
+
+	/* Create a vault with some files and export the key. */
+	fp = open_memstream(&buf, &len);
+	vault = mock_get_vault(cipher, &base_path);
+	vpath = rvault_resolve_path(vault, "/dir", NULL);
+	ret = mkdir(vpath, 0700);
+	assert(ret == 0);
+	free(vpath);
+	mock_vault_fwrite(vault, "/hot-file", "hot data");
+	mock_vault_fwrite(vault, "/dir/cold-file", "cold data");
+	rekey_meta_write(vault);
+	ret = rvault_index_rebuild(vault, 1);
+	assert(ret == 0);
+	rvault_recovery_export(vault, fp);
+	rvault_close(vault);
+	fclose(fp);
+
+	fd = mock_get_tmpfile(&recovery);
+	fs_write(fd, buf, len);
+	close(fd);
+	free(buf);
+
+	/* Replace the key: new metadata with the next key epoch. */
+	ret = asprintf(&mpath, "%s/%s", base_path, RVAULT_META_FILE);
+	assert(ret > 0);
+	unlink(mpath);
+	free(mpath);
+	ret = rvault_init(base_path, NULL, "test-new", TEST_UUID,
+	    cipher, NULL, RVAULT_FLAG_NOAUTH, 1);
+	assert(ret == 0);
+
+	/* Without the previous key, the files are not accessible. */
+	vault = rvault_open(base_path, NULL, "test-new");
+	assert(vault != NULL && vault->key_epoch == 1);
+	assert(fileobj_open(vault, "/hot-file", O_RDONLY, 0) == NULL);
+
+	/* With the previous key: access re-encrypts it lazily. */
+	ret = rvault_add_prev_key(vault, recovery);
+	assert(ret == 0);
+	mock_vault_fcheck(vault, "/hot-file", "hot data");
+
+	/* The sweeper converts the rest, including the names. */
+	ret = rvault_rekey_sweep(vault);
+	assert(ret == 0);
+	rvault_close(vault);
+
+	/* Everything must be accessible with the current key only. */
+	vault = rvault_open(base_path, NULL, "test-new");
+	assert(vault != NULL);
+	mock_vault_fcheck(vault, "/hot-file", "hot data");
+	mock_vault_fcheck(vault, "/dir/cold-file", "cold data");
+	rekey_meta_check(vault);
+	ret = rvault_index_open(vault);
+	assert(ret == 0 && vault->index != NULL);
+	mock_cleanup_vault(vault, base_path);
+
+	unlink(recovery);
+	free(recovery);
+}
+
 static void
 test_paths(void)
 {
@@ -166,6 +279,7 @@ main(void)
 		test_basic(cipher);
 		test_invalid_passphrase(cipher);
 		test_recovery(cipher);
+		test_rekey(cipher);
 	}
 	test_paths();
 	puts("ok");
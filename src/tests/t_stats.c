@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2020 Mindaugas Rasiukevicius <rmind at noxt eu>
+ * All rights reserved.
+ *
+ * Use is subject to license terms, as specified in the LICENSE file.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include "rvault.h"
+#include "fileobj.h"
+#include "utils.h"
+#include "mock.h"
+
+static void
+test_hist(void)
+{
+	rvault_hist_t hist;
+	uint64_t n = 0;
+
+	memset(&hist, 0, sizeof(hist));
+	for (unsigned i = 0; i < 3; i++) {
+		RVAULT_HIST_SCOPE(&hist);
+		usleep(100);
+	}
+	assert(hist.count == 3);
+	assert(hist.total_us >= 300);
+
+	/* At least 100 us: not in the buckets with the lower bounds. */
+	for (unsigned i = 0; i < RVAULT_HIST_NBUCKETS; i++) {
+		assert((UINT64_C(1) << i) > 100 || hist.buckets[i] == 0);
+		n += hist.buckets[i];
+	}
+	assert(n == hist.count);
+}
+
+static void
+test_stats(const char *cipher)
+{
+	const crypto_cipher_t c = crypto_cipher_id(cipher);
+	rvault_t *vault;
+	char *base_path, *buf;
+
+	vault = mock_get_vault(cipher, &base_path);
+	mock_vault_fwrite(vault, "/f", TEST_TEXT);
+	mock_vault_fcheck(vault, "/f", TEST_TEXT);
+
+	assert(vault->stats.storage_write.count == 1);
+	assert(vault->stats.storage_read.count == 1);
+	assert(vault->stats.write_bytes == TEST_TEXT_LEN);
+	assert(vault->stats.read_bytes == TEST_TEXT_LEN);
+	assert(vault->stats.enc_bytes[c] >= TEST_TEXT_LEN);
+	assert(vault->stats.dec_bytes[c] >= TEST_TEXT_LEN);
+	assert(vault->stats.nsyncs == 1);
+
+	buf = rvault_stats_render(vault, RVAULT_STATS_JSON);
+	assert(buf != NULL);
+	assert(strstr(buf, "\"writebacks\": 1,") != NULL);
+	assert(strstr(buf, cipher) != NULL);
+	free(buf);
+
+	buf = rvault_stats_render(vault, RVAULT_STATS_PROM);
+	assert(buf != NULL);
+	assert(strstr(buf, "rvault_syncs_total{type=\"writeback\"} 1\n"));
+	assert(strstr(buf, "rvault_storage_duration_seconds_count"
+	    "{op=\"read\"} 1\n"));
+	free(buf);
+
+	mock_cleanup_vault(vault, base_path);
+}
+
+int
+main(void)
+{
+	const char **ciphers;
+	unsigned nitems = 0;
+
+	app_setlog(0);
+	test_hist();
+
+	ciphers = crypto_cipher_list(&nitems);
+	for (unsigned i = 0; i < nitems; i++) {
+		test_stats(ciphers[i]);
+	}
+	puts("ok");
+	return 0;
+}
@@ -5,9 +5,13 @@
  * Use is subject to license terms, as specified in the LICENSE file.
  */
 
+#include <sys/resource.h>
+#include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <inttypes.h>
 #include <unistd.h>
+#include <errno.h>
 #include <assert.h>
 
 #include "rvault.h"
@@ -79,6 +83,173 @@ test_corrupted_aetag(rvault_t *vault)
 	close(fd);
 }
 
+#define	TEST_SPARSE_LEN		(1024U * 1024) // 1 MB
+
+static int
+sparse_iter(void *arg, uint64_t off, uint64_t len)
+{
+	unsigned *n = arg;
+
+	assert(off == (*n ? TEST_SPARSE_LEN / 2 : 0));
+	assert(len == TEST_TEXT_LEN);
+	(*n)++;
+	return 0;
+}
+
+static void
+test_sparse(rvault_t *vault)
+{
+	const int fd = mock_get_tmpfile(NULL);
+	const storage_extent_t exts[] = {
+		{ 0, TEST_TEXT_LEN },
+		{ TEST_SPARSE_LEN / 2, TEST_TEXT_LEN },
+	};
+	ssize_t nbytes, file_len, len;
+	sbuffer_t buf, sbuf;
+	unsigned n = 0;
+	uint8_t *p;
+
+	p = sbuffer_alloc(&buf, TEST_SPARSE_LEN);
+	assert(p != NULL);
+	memcpy(p, TEST_TEXT, TEST_TEXT_LEN);
+	memcpy(p + TEST_SPARSE_LEN / 2, TEST_TEXT, TEST_TEXT_LEN);
+
+	/*
+	 * Only the extents are stored.
+	 */
+	nbytes = storage_write_sparse(vault, fd, p, TEST_SPARSE_LEN, exts, 2);
+	assert(nbytes > 0 && nbytes < 1024);
+	file_len = fs_file_size(fd);
+	assert(file_len == nbytes);
+
+	memset(&sbuf, 0, sizeof(sbuffer_t));
+	len = storage_read_extents(vault, fd, file_len, &sbuf, sparse_iter, &n);
+	assert(len == TEST_SPARSE_LEN);
+	assert(n == 2);
+	assert(memcmp(sbuf.buf, p, TEST_SPARSE_LEN) == 0);
+	assert(storage_read_length(vault, fd) == TEST_SPARSE_LEN);
+	sbuffer_free(&sbuf);
+	sbuffer_free(&buf);
+
+	/*
+	 * Corrupted object.
+	 */
+	mock_corrupt_byte_at(fd, file_len - 1, NULL);
+	memset(&sbuf, 0, sizeof(sbuffer_t));
+	len = storage_read_data(vault, fd, file_len, &sbuf);
+	assert(len == -1);
+	close(fd);
+}
+
+#define	TEST_SPARSE_BIGLEN	(64U * 1024 * 1024) // 64 MB
+
+static long
+minflt(void)
+{
+	struct rusage ru;
+
+	assert(getrusage(RUSAGE_SELF, &ru) == 0);
+	return ru.ru_minflt;
+}
+
+static void
+test_sparse_free(rvault_t *vault)
+{
+	const int fd = mock_get_tmpfile(NULL);
+	const storage_extent_t exts[] = {
+		{ TEST_SPARSE_BIGLEN - TEST_TEXT_LEN, TEST_TEXT_LEN },
+	};
+	storage_extents_t se = { NULL, 0, 0 };
+	sbuffer_t buf, sbuf;
+	ssize_t nbytes, len;
+	long nflt;
+	uint8_t *p;
+
+	p = sbuffer_alloc(&buf, TEST_SPARSE_BIGLEN);
+	assert(p != NULL);
+	memcpy(p + exts[0].off, TEST_TEXT, TEST_TEXT_LEN);
+	nbytes = storage_write_sparse(vault, fd, p, TEST_SPARSE_BIGLEN,
+	    exts, 1);
+	assert(nbytes > 0);
+	sbuffer_release(&buf);
+
+	/*
+	 * Only the extents are erased: the holes are not touched.
+	 */
+	memset(&sbuf, 0, sizeof(sbuffer_t));
+	len = storage_read_extents(vault, fd, nbytes, &sbuf,
+	    storage_extents_add, &se);
+	assert(len == TEST_SPARSE_BIGLEN);
+	assert(se.n == 1 && se.exts[0].off == exts[0].off);
+	nflt = minflt();
+	storage_extents_free(&se, &sbuf);
+	assert(minflt() - nflt < 64);
+	assert(sbuf.buf == NULL && se.exts == NULL);
+	close(fd);
+}
+
+static void
+test_sparse_compat(rvault_t *vault)
+{
+	const int fd = mock_get_tmpfile(NULL);
+	const storage_extent_t exts[] = { { 0, TEST_TEXT_LEN } };
+	unsigned char buf[FILEOBJ_HDR_LEN];
+	fileobj_hdr_t *hdr = (void *)buf;
+	const unsigned abi_ver = vault->abi_ver;
+	ssize_t nbytes, file_len, len;
+	sbuffer_t sbuf;
+	uint32_t epoch;
+	uint8_t flags;
+	uint8_t *p;
+
+	p = calloc(1, TEST_SPARSE_LEN);
+	assert(p != NULL);
+	memcpy(p, TEST_TEXT, TEST_TEXT_LEN);
+
+	/*
+	 * The older vaults get a regular object.
+	 */
+	vault->abi_ver = RVAULT_ABI_VER_MIN;
+	nbytes = storage_write_sparse(vault, fd, p, TEST_SPARSE_LEN, exts, 1);
+	vault->abi_ver = abi_ver;
+	assert(nbytes > 0);
+	assert(storage_read_hdr(fd, hdr) == 0);
+	assert(hdr->ver == RVAULT_ABI_VER_MIN && !FILEOBJ_SPARSE_P(hdr));
+
+	file_len = fs_file_size(fd);
+	memset(&sbuf, 0, sizeof(sbuffer_t));
+	len = storage_read_data(vault, fd, file_len, &sbuf);
+	assert(len == TEST_SPARSE_LEN);
+	assert(memcmp(sbuf.buf, p, TEST_SPARSE_LEN) == 0);
+	sbuffer_free(&sbuf);
+
+	/*
+	 * The version 3 objects cannot have a key epoch.
+	 */
+	epoch = htobe32(1);
+	assert(pwrite(fd, &epoch, sizeof(epoch),
+	    offsetof(fileobj_hdr_t, key_epoch)) == sizeof(epoch));
+	assert(storage_read_hdr(fd, hdr) == -1 && errno == EIO);
+	memset(&sbuf, 0, sizeof(sbuffer_t));
+	len = storage_read_data(vault, fd, file_len, &sbuf);
+	assert(len == -1 && errno == EIO);
+	epoch = 0;
+	assert(pwrite(fd, &epoch, sizeof(epoch),
+	    offsetof(fileobj_hdr_t, key_epoch)) == sizeof(epoch));
+
+	/*
+	 * Unknown flags: not supported, rather than corrupted.
+	 */
+	flags = hdr->flags | (1U << 7);
+	assert(pwrite(fd, &flags, 1, offsetof(fileobj_hdr_t, flags)) == 1);
+	memset(&sbuf, 0, sizeof(sbuffer_t));
+	len = storage_read_data(vault, fd, file_len, &sbuf);
+	assert(len == -1 && errno == ENOTSUP);
+
+	free(p);
+	close(fd);
+}
+
 #if defined(USE_LZ4)
 
 #define	TEST_CTEXT	"test test test test test ...................."
@@ -111,6 +282,42 @@ test_compression(rvault_t *vault)
 #define	test_compression(v)
 #endif
 
+static void
+test_direct_io(rvault_t *vault)
+{
+	const size_t tlen = 3 * 4096 + 1;
+	ssize_t nbytes, file_len, len;
+	sbuffer_t sbuf;
+	char *tbuf;
+
+	vault->direct_io = true;
+	tbuf = malloc(tlen);
+	assert(tbuf != NULL);
+	memset(tbuf, 0x5a, tlen);
+
+	/* Below and above the alignment: the padding is truncated. */
+	for (unsigned i = 0; i < 2; i++) {
+		const void *buf = i ? tbuf : TEST_TEXT;
+		const size_t blen = i ? tlen : TEST_TEXT_LEN;
+		const int fd = mock_get_tmpfile(NULL);
+
+		nbytes = storage_write_data(vault, fd, buf, blen);
+		assert(nbytes > 0);
+
+		file_len = fs_file_size(fd);
+		assert(file_len == nbytes);
+
+		memset(&sbuf, 0, sizeof(sbuffer_t));
+		len = storage_read_data(vault, fd, file_len, &sbuf);
+		assert(len == (ssize_t)blen);
+		assert(memcmp(sbuf.buf, buf, blen) == 0);
+		sbuffer_free(&sbuf);
+		close(fd);
+	}
+	free(tbuf);
+	vault->direct_io = false;
+}
+
 static void
 run_tests(const char *cipher)
 {
@@ -119,7 +326,11 @@ run_tests(const char *cipher)
 	test_basic(vault);
 	test_corrupted_data(vault);
 	test_corrupted_aetag(vault);
+	test_sparse(vault);
+	test_sparse_compat(vault);
+	test_sparse_free(vault);
 	test_compression(vault);
+	test_direct_io(vault);
 	mock_cleanup_vault(vault, base_path);
 }
 
@@ -0,0 +1,210 @@
+/*
+ * Copyright (c) 2020 Mindaugas Rasiukevicius <rmind at noxt eu>
+ * All rights reserved.
+ *
+ * Use is subject to license terms, as specified in the LICENSE file.
+ */
+
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <limits.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <assert.h>
+
+#include "rvault.h"
+#include "cli.h"
+#include "utils.h"
+#include "mock.h"
+
+#define	TEST_LEN	100
+
+static void
+trace_op(rvault_t *vault, unsigned op, const char *path, const char *path2,
+    int64_t arg, uint64_t len)
+{
+	RVAULT_OP_SCOPE(vault, op);
+
+	RVAULT_OP_TRACE(path, arg, 0, len);
+	RVAULT_OP_TRACE2(path2);
+}
+
+/*
+ * read_trace: get the paths of the records (skipping the comments).
+ */
+static unsigned
+read_trace(const char *fpath, char paths[][2][64], unsigned n)
+{
+	char line[512], op[32];
+	unsigned i = 0;
+	FILE *fp;
+
+	fp = fopen(fpath, "r");
+	assert(fp != NULL);
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		uint64_t t, us, len;
+		int64_t arg, off;
+		int ret;
+
+		if (line[0] == '#') {
+			continue;
+		}
+		assert(i < n);
+		paths[i][1][0] = '\0';
+		ret = sscanf(line, "%" SCNu64 " %" SCNu64 " %31s %63s %"
+		    SCNd64 " %" SCNd64 " %" SCNu64 " %63s", &t, &us, op,
+		    paths[i][0], &arg, &off, &len, paths[i][1]);
+		assert(ret >= 7);
+
+		/* Nothing in plain. */
+		for (unsigned j = 0; j < 2; j++) {
+			assert(strstr(paths[i][j], "secret") == NULL);
+			assert(strstr(paths[i][j], "name") == NULL);
+		}
+		i++;
+	}
+	fclose(fp);
+	return i;
+}
+
+/*
+ * check_report: verify the replay report, i.e. every operation accounted
+ * for (replayed without errors or skipped) and the rename replayed.
+ */
+static void
+check_report(const char *fpath, unsigned nops)
+{
+	char line[512], op[32];
+	uint64_t count, total = 0, nrenames = 0;
+	size_t nrecs = 0;
+	FILE *fp;
+
+	fp = fopen(fpath, "r");
+	assert(fp != NULL);
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		uint64_t v[6], nerrors;
+		int ret;
+
+		if (sscanf(line, "%zu operations in", &nrecs) == 1) {
+			continue;
+		}
+		ret = sscanf(line, "%31s %" SCNu64 " %" SCNu64 " %" SCNu64
+		    " %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64
+		    " %" SCNu64, op, &count, &v[0], &v[1], &v[2], &v[3],
+		    &v[4], &v[5], &nerrors);
+		if (ret == 9) {
+			assert(nerrors == 0);
+		} else if (ret != 2 || strstr(line, "(not replayed)") == NULL) {
+			continue;
+		}
+		if (strcmp(op, "rename") == 0) {
+			nrenames = count;
+		}
+		total += count;
+	}
+	fclose(fp);
+
+	assert(nrecs == nops);
+	assert(total == nops);
+	assert(nrenames == 1);
+}
+
+static void
+test_trace(const char *cipher)
+{
+	char paths[5][2][64], fpath_buf[PATH_MAX];
+	char *base_path, *fpath, *rpath, *dir, *argv[4];
+	rvault_t *vault;
+	struct stat st;
+	size_t plen;
+	unsigned n;
+	int fd, saved;
+
+	close(mock_get_tmpfile(&fpath));
+	vault = mock_get_vault(cipher, &base_path);
+	assert(rvault_trace_open(vault, fpath) == 0);
+
+	trace_op(vault, RVAULT_OP_MKDIR, "/secret", NULL, 0, 0);
+	trace_op(vault, RVAULT_OP_CREATE, "/secret/name", NULL, O_RDWR, 0);
+	trace_op(vault, RVAULT_OP_WRITE, "/secret/name", NULL, 0, TEST_LEN);
+	trace_op(vault, RVAULT_OP_RELEASE, "/secret/name", NULL, 0, 0);
+	trace_op(vault, RVAULT_OP_RENAME, "/secret/name", "/secret/name2",
+	    0, 0);
+	rvault_trace_close(vault);
+	assert(vault->trace == NULL);
+
+	/*
+	 * The same names have the same identifiers; the structure is
+	 * preserved.
+	 */
+	n = read_trace(fpath, paths, __arraycount(paths));
+	assert(n == 5);
+	plen = strlen(paths[0][0]);
+	assert(plen > 1 && paths[0][0][0] == '/');
+	assert(strncmp(paths[1][0], paths[0][0], plen) == 0);
+	assert(paths[1][0][plen] == '/');
+	assert(strcmp(paths[1][0], paths[2][0]) == 0);
+	assert(strcmp(paths[1][0], paths[4][0]) == 0);
+	assert(strncmp(paths[4][1], paths[0][0], plen) == 0);
+	assert(strcmp(paths[4][1], paths[4][0]) != 0);
+
+	/*
+	 * Replay in a directory: the renamed file must have the data.
+	 */
+	dir = mock_get_vault_dir();
+	argv[0] = strdup("replay");
+	argv[1] = fpath;
+	argv[2] = dir;
+	argv[3] = NULL;
+	optind = 1;
+
+	/* Note: capture the report rather than print it. */
+	fflush(stdout);
+	fd = mock_get_tmpfile(&rpath);
+	saved = dup(STDOUT_FILENO);
+	assert(saved != -1);
+	assert(dup2(fd, STDOUT_FILENO) != -1);
+	close(fd);
+	assert(replay_cmd(NULL, NULL, 3, argv) == 0);
+	fflush(stdout);
+	assert(dup2(saved, STDOUT_FILENO) != -1);
+	close(saved);
+	free(argv[0]);
+
+	check_report(rpath, n);
+	unlink(rpath);
+	free(rpath);
+
+	snprintf(fpath_buf, sizeof(fpath_buf), "%s%s", dir, paths[4][1]);
+	assert(stat(fpath_buf, &st) == 0);
+	assert(st.st_size == TEST_LEN);
+	snprintf(fpath_buf, sizeof(fpath_buf), "%s%s", dir, paths[4][0]);
+	assert(stat(fpath_buf, &st) == -1);
+
+	assert(chdir("/") == 0);
+	mock_cleanup_vault_dir(dir);
+	mock_cleanup_vault(vault, base_path);
+	unlink(fpath);
+	free(fpath);
+}
+
+int
+main(void)
+{
+	const char **ciphers;
+	unsigned nitems = 0;
+
+	app_setlog(0);
+	ciphers = crypto_cipher_list(&nitems);
+	for (unsigned i = 0; i < nitems; i++) {
+		test_trace(ciphers[i]);
+	}
+	puts("ok");
+	return 0;
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2020 Mindaugas Rasiukevicius <rmind at noxt eu>
+ * All rights reserved.
+ *
+ * Use is subject to license terms, as specified in the LICENSE file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <assert.h>
+
+#include "utils.h"
+
+static void
+test_str_to_uint(void)
+{
+	unsigned val = 0;
+
+	assert(str_to_uint("4", 1, UINT_MAX, &val) == 0 && val == 4);
+	assert(str_to_uint("0", 0, 255, &val) == 0 && val == 0);
+	assert(str_to_uint("255", 0, 255, &val) == 0 && val == 255);
+
+	/* Out of range, e.g. zero jobs. */
+	assert(str_to_uint("0", 1, UINT_MAX, &val) == -1);
+	assert(str_to_uint("256", 0, 255, &val) == -1);
+	assert(str_to_uint("4294967296", 0, UINT_MAX, &val) == -1);
+	assert(str_to_uint("99999999999999999999", 0, UINT_MAX, &val) == -1);
+
+	/* Not a number. */
+	assert(str_to_uint("", 0, UINT_MAX, &val) == -1);
+	assert(str_to_uint("x", 0, UINT_MAX, &val) == -1);
+	assert(str_to_uint("4x", 0, UINT_MAX, &val) == -1);
+	assert(str_to_uint("-1", 0, UINT_MAX, &val) == -1);
+	assert(str_to_uint(" 1", 0, UINT_MAX, &val) == -1);
+	assert(str_to_uint("+1", 0, UINT_MAX, &val) == -1);
+	assert(val == 255);
+}
+
+int
+main(void)
+{
+	test_str_to_uint();
+	puts("ok");
+	return 0;
+}
@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) 2020 Mindaugas Rasiukevicius <rmind at noxt eu>
+ * All rights reserved.
+ *
+ * Use is subject to license terms, as specified in the LICENSE file.
+ */
+
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "rvault.h"
+#include "fileobj.h"
+#include "utils.h"
+#include "mock.h"
+
+static const char *test_paths[] = {
+	"/a", "/a/b", "/a/b/c", "/d", "/f1", "/a/f2", "/a/b/f3", "/a/b/c/f4",
+};
+
+#define	TEST_NDIRS	4
+
+typedef struct {
+	pthread_mutex_t	lock;
+	unsigned	seen[__arraycount(test_paths)];
+	const char *	prune;
+} walk_test_t;
+
+static int
+walk_test_entry(void *arg, const rvault_walk_ent_t *ent)
+{
+	walk_test_t *wt = arg;
+	unsigned i;
+
+	for (i = 0; i < __arraycount(test_paths); i++) {
+		if (strcmp(test_paths[i], ent->path) == 0)
+			break;
+	}
+	assert(i < __arraycount(test_paths));
+	assert(strcmp(strrchr(test_paths[i], '/') + 1, ent->name) == 0);
+	assert(S_ISDIR(ent->st->st_mode) == (i < TEST_NDIRS));
+
+	pthread_mutex_lock(&wt->lock);
+	wt->seen[i]++;
+	pthread_mutex_unlock(&wt->lock);
+
+	if (wt->prune && strcmp(wt->prune, ent->path) == 0) {
+		return RVAULT_WALK_PRUNE;
+	}
+	return 0;
+}
+
+static void
+test_walk(const char *cipher, unsigned nworkers)
+{
+	walk_test_t wt;
+	rvault_t *vault;
+	char *base_path;
+	int ret;
+
+	vault = mock_get_vault(cipher, &base_path);
+	for (unsigned i = 0; i < __arraycount(test_paths); i++) {
+		const char *path = test_paths[i];
+
+		if (i < TEST_NDIRS) {
+			char *vpath = rvault_resolve_path(vault, path, NULL);
+			ret = mkdir(vpath, 0700);
+			assert(ret == 0);
+			free(vpath);
+		} else {
+			mock_vault_fwrite(vault, path, TEST_TEXT);
+		}
+	}
+
+	/*
+	 * Full walk: every entry exactly once.
+	 */
+	memset(&wt, 0, sizeof(wt));
+	pthread_mutex_init(&wt.lock, NULL);
+	ret = rvault_walk(vault, "/", nworkers, &wt, walk_test_entry);
+	assert(ret == 0);
+	for (unsigned i = 0; i < __arraycount(test_paths); i++) {
+		assert(wt.seen[i] == 1);
+	}
+
+	/*
+	 * Sub-directory with pruning.
+	 */
+	memset(wt.seen, 0, sizeof(wt.seen));
+	wt.prune = "/a/b/c";
+	ret = rvault_walk(vault, "/a/", nworkers, &wt, walk_test_entry);
+	assert(ret == 0);
+	for (unsigned i = 0; i < __arraycount(test_paths); i++) {
+		const char *path = test_paths[i];
+		const bool in_a = strncmp(path, "/a/", 3) == 0;
+		const bool pruned = strncmp(path, "/a/b/c/", 7) == 0;
+		assert(wt.seen[i] == (in_a && !pruned));
+	}
+
+	/*
+	 * Not a directory.
+	 */
+	ret = rvault_walk(vault, "/f1", nworkers, &wt, walk_test_entry);
+	assert(ret == -1 && errno == ENOTDIR);
+
+	pthread_mutex_destroy(&wt.lock);
+	mock_cleanup_vault(vault, base_path);
+}
+
+int
+main(void)
+{
+	const char **ciphers;
+	unsigned nitems = 0;
+
+	app_setlog(0);
+
+	ciphers = crypto_cipher_list(&nitems);
+	for (unsigned i = 0; i < nitems; i++) {
+		test_walk(ciphers[i], 1);
+		test_walk(ciphers[i], 4);
+	}
+	puts("ok");
+	return 0;
+}